@@ -0,0 +1,253 @@
+/**
+ * @file ble_tx_test.c
+ * @brief Host test of the BLE TX ring's space accounting.
+ *
+ * Compiles main/ble_tx.c itself, against the stand-ins in host/stubs, and
+ * drives it without its task: messages are queued with the real producer
+ * calls and drained record by record with the sender's send_oldest(). The
+ * notifications land in a capture buffer, so every message can be compared
+ * with what was queued. The ring is filled to every distance from full up
+ * to a little more than a header, and neither a refused message nor its
+ * header may overwrite anything still unsent. Build it from the
+ * repository root:
+ *
+ *     cc -I host/stubs -I main host/ble_tx_test.c -o ble_tx_test
+ *     ./ble_tx_test
+ */
+
+#include "ble_tx.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CLIENT 1
+#define MTU 247
+
+static uint16_t attr_handle = 42;
+static int failures;
+
+#define CHECK(cond, ...)                                                                                   \
+    do                                                                                                     \
+    {                                                                                                      \
+        if (!(cond))                                                                                       \
+        {                                                                                                  \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                    \
+            printf(__VA_ARGS__);                                                                           \
+            printf("\n");                                                                                  \
+            failures++;                                                                                    \
+        }                                                                                                  \
+    } while (0)
+
+// --- Stand-ins for the session table, the framing and NimBLE ---
+
+static ble_session_t client = {.conn_handle = CLIENT, .mtu = MTU, .subscribed = true};
+static int32_t pending;
+
+bool ble_session_get(uint16_t conn_handle, ble_session_t *out)
+{
+    if (conn_handle != CLIENT)
+    {
+        return false;
+    }
+    *out = client;
+    return true;
+}
+
+size_t ble_session_list(ble_session_t *out, size_t max, bool subscribed_only)
+{
+    (void)subscribed_only;
+    if (max == 0)
+    {
+        return 0;
+    }
+    out[0] = client;
+    return 1;
+}
+
+void ble_session_add_pending(uint16_t conn_handle, int32_t delta)
+{
+    (void)conn_handle;
+    pending += delta;
+}
+
+void ble_session_set_framing(uint16_t conn_handle, ble_framing_t framing)
+{
+    (void)conn_handle;
+    client.framing = framing;
+}
+
+void ble_frame_encode(const ble_frame_hdr_t *hdr, uint8_t *out)
+{
+    (void)hdr;
+    memset(out, 0, BLE_FRAME_HDR_LEN);
+}
+
+// Everything notified, in order
+static uint8_t captured[2 * BLE_TX_RING_SIZE];
+static size_t captured_len;
+static struct os_mbuf mbuf;
+
+int os_msys_num_free(void)
+{
+    return BLE_TX_MSYS_RESERVE + 8;
+}
+
+struct os_mbuf *ble_hs_mbuf_att_pkt(void)
+{
+    mbuf.len = 0;
+    return &mbuf;
+}
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    if (om->len + len > sizeof(om->data))
+    {
+        return -1;
+    }
+    memcpy(&om->data[om->len], data, len);
+    om->len += len;
+    return 0;
+}
+
+void os_mbuf_free_chain(struct os_mbuf *om)
+{
+    (void)om;
+}
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t handle, struct os_mbuf *om)
+{
+    (void)conn_handle, (void)handle;
+    if (captured_len + om->len > sizeof(captured))
+    {
+        return BLE_HS_ENOMEM + 1; // Dropped by the sender; the checks report it
+    }
+    memcpy(&captured[captured_len], om->data, om->len);
+    captured_len += om->len;
+    return 0;
+}
+
+// --- Helpers ---
+
+static void reset(uint32_t at)
+{
+    // Start anywhere: positions are free-running counters
+    atomic_store(&ring_head, at);
+    atomic_store(&ring_tail, at);
+    memset(ring, 0xEE, sizeof(ring));
+    memset(&stats, 0, sizeof(stats));
+    captured_len = 0;
+    pending = 0;
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t)(seed + i * 7);
+    }
+}
+
+static size_t drain(void)
+{
+    // A corrupted header could make the ring look endless
+    size_t records = 0;
+    while (records < 1000 && send_oldest())
+    {
+        records++;
+    }
+    CHECK(records < 1000, "the ring does not drain");
+    return records;
+}
+
+// Fills the ring so that exactly `room` bytes are left, then tries to queue
+// a message of `len` bytes. Whatever happens, the filler must come out
+// intact, followed by the message if and only if it was accepted.
+static void fill_and_send(uint32_t start, size_t room, size_t len)
+{
+    static uint8_t filler[BLE_TX_RING_SIZE];
+    static uint8_t extra[BLE_TX_RING_SIZE];
+    size_t filler_len = BLE_TX_RING_SIZE - sizeof(ble_tx_hdr_t) - room;
+    fill_pattern(filler, filler_len, 1);
+    fill_pattern(extra, len, 99);
+
+    reset(start);
+    CHECK(ble_tx_send(CLIENT, filler, filler_len, 0), "start %lu: filler refused", (unsigned long)start);
+    ble_tx_stats_t s;
+    ble_tx_get_stats(&s);
+    CHECK(s.queued_bytes == BLE_TX_RING_SIZE - room, "room %zu: %u bytes queued", room, (unsigned)s.queued_bytes);
+
+    bool fits = room >= sizeof(ble_tx_hdr_t) + len;
+    bool accepted = ble_tx_send(CLIENT, extra, len, 0);
+    CHECK(accepted == fits, "room %zu, message %zu: %s", room, len, accepted ? "accepted" : "refused");
+    ble_tx_get_stats(&s);
+    CHECK(s.queued_bytes <= BLE_TX_RING_SIZE, "room %zu: %u bytes queued", room, (unsigned)s.queued_bytes);
+    CHECK(s.queued_msgs == (accepted ? 2u : 1u), "room %zu: %u messages queued", room, (unsigned)s.queued_msgs);
+
+    size_t records = drain();
+    CHECK(records == (accepted ? 2u : 1u), "room %zu: %zu records drained", room, records);
+    CHECK(captured_len == filler_len + (accepted ? len : 0), "room %zu: %zu bytes notified", room, captured_len);
+    CHECK(memcmp(captured, filler, filler_len) == 0, "room %zu, message %zu: unsent filler overwritten", room, len);
+    if (accepted)
+    {
+        CHECK(memcmp(&captured[filler_len], extra, len) == 0, "room %zu: message corrupted", room);
+    }
+    CHECK(pending == 0, "room %zu: %ld bytes still pending", room, (long)pending);
+}
+
+// Many messages of varying sizes around the ring, each compared on the way out
+static void wrap_around(void)
+{
+    reset(UINT32_MAX - 100); // The counters wrap too
+    static uint8_t sent[BLE_TX_RING_SIZE];
+    size_t total = 0, messages = 0;
+    srand(7);
+    for (int round = 0; round < 200; round++)
+    {
+        size_t len = 1 + (size_t)rand() % 900;
+        uint8_t msg[900];
+        fill_pattern(msg, len, (uint8_t)round);
+        if (!ble_tx_send(CLIENT, msg, len, 0))
+        {
+            // Full: everything queued so far must come out as it went in
+            captured_len = 0;
+            drain();
+            CHECK(captured_len == total, "round %d: %zu of %zu bytes notified", round, captured_len, total);
+            CHECK(memcmp(captured, sent, total) == 0, "round %d: messages corrupted", round);
+            total = 0;
+            CHECK(ble_tx_send(CLIENT, msg, len, 0), "round %d: refused by an empty ring", round);
+        }
+        memcpy(&sent[total], msg, len);
+        total += len;
+        messages++;
+    }
+    captured_len = 0;
+    drain();
+    CHECK(captured_len == total && memcmp(captured, sent, total) == 0, "last messages corrupted");
+    printf("wrap-around: %zu messages\n", messages);
+}
+
+int main(void)
+{
+    ble_tx_init(&attr_handle);
+
+    // Up to a header and a byte more than a header from full, at both ends
+    // of the ring and across the counters' wrap
+    const uint32_t starts[] = {0, 1000, BLE_TX_RING_SIZE - 3, UINT32_MAX - 2};
+    int cases = 0;
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++)
+    {
+        for (size_t room = 0; room <= 2 * sizeof(ble_tx_hdr_t) + 1; room++)
+        {
+            for (size_t len = 0; len <= sizeof(ble_tx_hdr_t) + 1; len++)
+            {
+                fill_and_send(starts[s], room, len);
+                cases++;
+            }
+        }
+    }
+    printf("near full: %d cases\n", cases);
+
+    wrap_around();
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file dispatch_bench.c
+ * @brief Host benchmark of the command registry against the former strcmp chain.
+ *
+ * Registers 10, 50 and 200 synthetic commands and looks every one up three
+ * ways: by walking the names in order with strcmp, as the if/else chain in
+ * the command handler used to, by name through the registry hash index, and
+ * by id as the binary protocol does. Before timing, the program checks that
+ * every lookup finds the right descriptor, that prefixes and extensions of
+ * registered names and unused ids find nothing, and that duplicate names
+ * and ids are rejected; then it reports the time per lookup. bench("dispatch")
+ * measures the same on the device in cycles. Build it from the repository
+ * root:
+ *
+ *     cc -O2 -I host/stubs -I main host/dispatch_bench.c main/command_registry.c -o dispatch_bench
+ *     ./dispatch_bench
+ */
+
+#include "command_registry.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_CMDS 200
+#define SLOTS 512
+#define NAME_LEN 8
+#define REPEAT 20000
+
+#define CHECK(cond, ...)                                                                                   \
+    do                                                                                                     \
+    {                                                                                                      \
+        if (!(cond))                                                                                       \
+        {                                                                                                  \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                    \
+            printf(__VA_ARGS__);                                                                           \
+            printf("\n");                                                                                  \
+            failures++;                                                                                    \
+        }                                                                                                  \
+    } while (0)
+
+static int failures;
+
+static char names[MAX_CMDS][NAME_LEN];
+static command_desc_t descs[MAX_CMDS];
+static command_slot_t slots[SLOTS];
+
+static void nop(const command_args_t *args)
+{
+    (void)args;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void check(const command_registry_t *reg, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t len = strlen(names[i]);
+        CHECK(command_registry_find(reg, names[i], len) == &descs[i], "n=%zu: %s not found by name", n, names[i]);
+        CHECK(command_registry_get(reg, descs[i].id) == &descs[i], "n=%zu: %s not found by id", n, names[i]);
+        // Names are matched whole, also when not null-terminated
+        CHECK(command_registry_find(reg, names[i], len - 1) == NULL, "n=%zu: prefix of %s found", n, names[i]);
+        char longer[NAME_LEN + 1];
+        snprintf(longer, sizeof(longer), "%sx", names[i]);
+        CHECK(command_registry_find(reg, longer, len + 1) == NULL, "n=%zu: %s found", n, longer);
+        CHECK(command_registry_find(reg, longer, len) == &descs[i], "n=%zu: %.*s not found", n, (int)len, longer);
+    }
+    if (n < MAX_CMDS)
+    {
+        CHECK(command_registry_find(reg, names[n], strlen(names[n])) == NULL, "n=%zu: unregistered %s found", n,
+              names[n]);
+        CHECK(command_registry_get(reg, descs[n].id) == NULL, "n=%zu: unregistered id %u found", n,
+              (unsigned)descs[n].id);
+    }
+
+    // A table repeating a name or an id is refused and leaves the registry alone
+    command_registry_t copy = *reg;
+    static command_slot_t copy_slots[SLOTS];
+    memcpy(copy_slots, slots, sizeof(copy_slots));
+    copy.slots = copy_slots;
+    command_desc_t dup_name = descs[n - 1];
+    dup_name.id = MAX_CMDS;
+    command_desc_t dup_id = {.id = descs[0].id, .name = "unique", .args = "", .usage = "unique", .fn = nop};
+    CHECK(command_registry_add_table(&copy, &dup_name, 1) == ESP_ERR_INVALID_STATE, "n=%zu: duplicate name taken",
+          n);
+    CHECK(command_registry_add_table(&copy, &dup_id, 1) == ESP_ERR_INVALID_STATE, "n=%zu: duplicate id taken", n);
+    CHECK(copy.count == n, "n=%zu: %zu commands after refused tables", n, copy.count);
+}
+
+static void bench(size_t n)
+{
+    command_registry_t reg;
+    command_registry_init(&reg, slots, SLOTS);
+    CHECK(command_registry_add_table(&reg, descs, n) == ESP_OK, "n=%zu: table refused", n);
+    check(&reg, n);
+
+    volatile uintptr_t sink = 0;
+    double start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t j = 0;
+            while (j < n && strcmp(names[j], names[i]) != 0) j++;
+            sink += j;
+        }
+    }
+    double chain_ns = (now_ns() - start) / ((double)REPEAT * n);
+
+    start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            sink += (uintptr_t)command_registry_find(&reg, names[i], NAME_LEN - 2);
+        }
+    }
+    double find_ns = (now_ns() - start) / ((double)REPEAT * n);
+
+    start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            sink += (uintptr_t)command_registry_get(&reg, descs[i].id);
+        }
+    }
+    double get_ns = (now_ns() - start) / ((double)REPEAT * n);
+
+    printf("%3zu commands  strcmp chain %7.1f ns  registry by name %6.1f ns (%.1fx)  by id %7.1f ns\n", n, chain_ns,
+           find_ns, chain_ns / find_ns, get_ns);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {10, 50, 200};
+
+    // The names and ids bench("dispatch") uses on the device
+    for (size_t i = 0; i < MAX_CMDS; i++)
+    {
+        snprintf(names[i], NAME_LEN, "cmd%03u", (unsigned)i);
+        descs[i].id = (uint16_t)i;
+        descs[i].name = names[i];
+        descs[i].args = "";
+        descs[i].usage = names[i];
+        descs[i].fn = nop;
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        bench(sizes[s]);
+    }
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
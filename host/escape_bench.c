@@ -0,0 +1,234 @@
+/**
+ * @file escape_bench.c
+ * @brief Host benchmark of json_escape() against the former per-byte escaper.
+ *
+ * Escapes the corpus of bench("escape"), each string on its own and
+ * repeated to fill 1 KB, with both escapers and reports the time per
+ * string and the throughput. Before timing anything it checks that both
+ * give the same output for the corpus and for random strings of ASCII,
+ * control characters and valid UTF-8, that invalid UTF-8 becomes \ufffd,
+ * and that a short buffer gets a prefix and the length that was needed.
+ * Build it from the repository root:
+ *
+ *     cc -O2 -I main host/escape_bench.c main/utils.c -o escape_bench
+ *     ./escape_bench
+ */
+
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_LEN 2048
+#define TIME_NS 200000000.0 // Spent on each measurement
+
+static int failures;
+
+// The corpus of bench("escape")
+static const struct
+{
+    const char *name;
+    const char *text;
+} corpus[] = {
+    {"ssid", "office-network-5g"},
+    {"log", "I (12345) WIFI_MANAGER: Connecting to SSID: office-network-5g, "
+            "auth mode WPA2-PSK, channel 11, rssi -61 dBm, retry 0 of 5, "
+            "bssid 24:0a:c4:12:34:56, listen interval 3, power save min modem"},
+    {"quoted", "{\"cmd\":\"connect\",\"args\":[\"C:\\\\net\\\\cfg\",\"a\\tb\"]}\r\n"},
+    {"utf8", "Caf\xc3\xa9 \xe2\x80\x94 Stra\xc3\x9f""e 12, M\xc3\xbcnchen \xe2\x82\xac \xf0\x9f\x93\xb6 guest-wifi"},
+};
+
+// The per-byte escaper json_escape() replaced. The byte is taken unsigned,
+// as on the ESP32; with a signed char UTF-8 would come out as \uffxx.
+static void escape_legacy(const char *str, char *out, size_t out_size)
+{
+    size_t j = 0;
+    for (size_t i = 0; str[i] && j < out_size - 6; i++)
+    {
+        unsigned char c = (unsigned char)str[i];
+        switch (c)
+        {
+        case '"': out[j++] = '\\'; out[j++] = '"'; break;
+        case '\\': out[j++] = '\\'; out[j++] = '\\'; break;
+        case '\b': out[j++] = '\\'; out[j++] = 'b'; break;
+        case '\f': out[j++] = '\\'; out[j++] = 'f'; break;
+        case '\n': out[j++] = '\\'; out[j++] = 'n'; break;
+        case '\r': out[j++] = '\\'; out[j++] = 'r'; break;
+        case '\t': out[j++] = '\\'; out[j++] = 't'; break;
+        default:
+            if (c < 32)
+            {
+                j += snprintf(&out[j], out_size - j, "\\u%04x", (unsigned int)c);
+            }
+            else
+            {
+                out[j++] = (char)c;
+            }
+        }
+    }
+    out[j] = '\0';
+}
+
+static void check_same(const char *what, const char *text)
+{
+    static char legacy[BUF_LEN], swar[BUF_LEN];
+    escape_legacy(text, legacy, sizeof(legacy));
+    size_t needed = json_escape(text, swar, sizeof(swar));
+    if (strcmp(legacy, swar) != 0 || needed != strlen(swar))
+    {
+        printf("FAIL %s: outputs differ\n  legacy: %s\n  swar:   %s\n", what, legacy, swar);
+        failures++;
+    }
+}
+
+// Random text of plain ASCII, characters to escape and valid UTF-8
+static size_t random_text(char *out, size_t max)
+{
+    static const char *const pieces[] = {"a", "Z", "0", " ", "\"", "\\", "\n", "\t", "\x01", "\x1f", "\x7f",
+                                         "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x93\xb6", "plain-run-of-text"};
+    size_t len = 0;
+    size_t count = (size_t)rand() % 40;
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *p = pieces[(size_t)rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+        size_t n = strlen(p);
+        if (len + n >= max)
+        {
+            break;
+        }
+        memcpy(out + len, p, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static void check(void)
+{
+    for (size_t c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++)
+    {
+        check_same(corpus[c].name, corpus[c].text);
+    }
+
+    srand(1);
+    char text[256];
+    for (int i = 0; i < 100000; i++)
+    {
+        // Every alignment of the word-at-a-time scan
+        size_t shift = (size_t)i % 4;
+        random_text(text + shift, sizeof(text) - shift);
+        check_same("random", text + shift);
+    }
+
+    // Invalid UTF-8 is replaced, byte by byte
+    static const struct
+    {
+        const char *in, *out;
+    } invalid[] = {
+        {"a\xff" "b", "a\\ufffdb"},
+        {"\xc3", "\\ufffd"},
+        {"\xc0\xaf", "\\ufffd\\ufffd"},
+        {"\xed\xa0\x80", "\\ufffd\\ufffd\\ufffd"},
+        {"\xf4\x90\x80\x80", "\\ufffd\\ufffd\\ufffd\\ufffd"},
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        char out[64];
+        json_escape(invalid[i].in, out, sizeof(out));
+        if (strcmp(out, invalid[i].out) != 0)
+        {
+            printf("FAIL invalid %zu: got %s\n", i, out);
+            failures++;
+        }
+    }
+
+    // A short buffer gets a prefix that ends before a cut escape
+    static char full[BUF_LEN];
+    const char *text_q = corpus[2].text;
+    size_t needed = json_escape(text_q, full, sizeof(full));
+    for (size_t size = 1; size <= needed + 1; size++)
+    {
+        char out[BUF_LEN];
+        size_t got = json_escape(text_q, out, size);
+        size_t kept = strlen(out);
+        if (got != needed || kept >= size || memcmp(out, full, kept) != 0 ||
+            (size > needed && kept != needed))
+        {
+            printf("FAIL truncation to %zu bytes: %s\n", size, out);
+            failures++;
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time per call, repeating the call for about TIME_NS
+static double measure(const char *text, bool swar)
+{
+    static char out[BUF_LEN];
+    volatile size_t sink = 0;
+    long runs = 0;
+    double start = now_ns(), elapsed;
+    do
+    {
+        for (int r = 0; r < 1000; r++)
+        {
+            if (swar)
+            {
+                sink += json_escape(text, out, sizeof(out));
+            }
+            else
+            {
+                escape_legacy(text, out, sizeof(out));
+                sink += (unsigned char)out[0];
+            }
+        }
+        runs += 1000;
+        elapsed = now_ns() - start;
+    } while (elapsed < TIME_NS);
+    return elapsed / runs;
+}
+
+int main(void)
+{
+    check();
+
+    static char large[BUF_LEN / 2];
+    for (size_t c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++)
+    {
+        for (int big = 0; big < 2; big++)
+        {
+            const char *text = corpus[c].text;
+            size_t len = strlen(text);
+            if (big)
+            {
+                // Repeated to fill half the output buffer, like a log dump
+                size_t n = 0;
+                while (n + len < sizeof(large))
+                {
+                    memcpy(large + n, text, len);
+                    n += len;
+                }
+                large[n] = '\0';
+                text = large;
+                len = n;
+            }
+            double legacy_ns = measure(text, false);
+            double swar_ns = measure(text, true);
+            printf("%-6s %4zu bytes  legacy %8.1f ns (%5.0f MB/s)  swar %8.1f ns (%5.0f MB/s)  %.2fx\n",
+                   corpus[c].name, len, legacy_ns, len * 1e3 / legacy_ns, swar_ns, len * 1e3 / swar_ns,
+                   legacy_ns / swar_ns);
+        }
+    }
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
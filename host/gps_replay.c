@@ -0,0 +1,124 @@
+/**
+ * @file gps_replay.c
+ * @brief Replays recorded NMEA streams through the GPS pipeline.
+ *
+ * Feeds each file through gps_stream exactly as the UART task does:
+ * bytes are read straight into the ring's free space and committed in
+ * chunks, of a fixed size or, by default, of random sizes from 1 to 256
+ * bytes, so line ends fall anywhere in a read and lines wrap around the
+ * ring. It prints every line (-v) or fix update (-f) on request, then the
+ * counters, the final fix and the time spent per byte. Results must not
+ * depend on the chunk size. Build it from the repository root:
+ *
+ *     cc -O2 -I main host/gps_replay.c main/gps_stream.c main/minmea.c -o gps_replay
+ *     ./gps_replay host/gps_sample.nmea
+ */
+
+#include "gps_stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void print_line(void *ctx, const gps_line_t *line)
+{
+    (void)ctx;
+    printf("  %3zu %s\n", line->len, line->text);
+}
+
+static void print_fix(const gps_fix_t *fix)
+{
+    printf("fix: %s lat %.7f lon %.7f kph %.2f course %.2f utc %ld ms date %lu quality %u sats %u hdop %.2f alt %.1f m\n",
+           fix->valid ? "valid" : "none", fix->lat_e7 / 1e7, fix->lon_e7 / 1e7, fix->speed_kmh_e2 / 100.0,
+           fix->course_e2 / 100.0, (long)fix->utc_ms, (unsigned long)fix->date, fix->quality, fix->satellites,
+           fix->hdop_e2 / 100.0, fix->alt_dm / 10.0);
+}
+
+static int replay(const char *path, size_t chunk, bool verbose, bool fixes)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    static gps_stream_t stream;
+    gps_stream_init(&stream, verbose ? print_line : NULL, NULL);
+    srand(1);
+
+    double busy = 0;
+    for (;;)
+    {
+        char *dst;
+        size_t space = gps_stream_write_space(&stream, &dst);
+        size_t want = chunk != 0 ? chunk : 1 + (size_t)rand() % 256;
+        size_t got = fread(dst, 1, want < space ? want : space, file);
+        if (got == 0)
+        {
+            break;
+        }
+        clock_t start = clock();
+        uint32_t updates = gps_stream_commit(&stream, got);
+        busy += (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (fixes && updates > 0)
+        {
+            gps_fix_t fix;
+            gps_stream_get_fix(&stream, &fix);
+            print_fix(&fix);
+        }
+    }
+    fclose(file);
+
+    gps_stream_stats_t stats;
+    gps_stream_get_stats(&stream, &stats);
+    gps_fix_t fix;
+    gps_stream_get_fix(&stream, &fix);
+    printf("%s: %lu bytes, %lu lines, rmc %lu, gga %lu, other %lu, invalid %lu, too long %lu\n", path,
+           (unsigned long)stats.bytes, (unsigned long)stats.lines, (unsigned long)stats.rmc, (unsigned long)stats.gga,
+           (unsigned long)stats.other, (unsigned long)stats.invalid, (unsigned long)stats.too_long);
+    print_fix(&fix);
+    if (stats.bytes > 0)
+    {
+        printf("%.1f ns per byte\n", busy * 1e9 / stats.bytes);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunk = 0;
+    bool verbose = false, fixes = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            chunk = (size_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            fixes = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (i == argc)
+    {
+        fprintf(stderr, "usage: %s [-c chunk] [-v] [-f] file.nmea...\n", argv[0]);
+        return 2;
+    }
+
+    int status = 0;
+    for (; i < argc; i++)
+    {
+        status |= replay(argv[i], chunk, verbose, fixes);
+    }
+    return status;
+}
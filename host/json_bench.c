@@ -0,0 +1,230 @@
+/**
+ * @file json_bench.c
+ * @brief Host benchmark of the JSON writer against the former snprintf path.
+ *
+ * Builds two typical responses, a 10-network scan result and a status
+ * report, three ways: with snprintf and json_escape() into temporary
+ * buffers as the handlers used to, with the writer into a flat buffer,
+ * and with the writer streaming through a 64-byte staging buffer into a
+ * sink, as it does into the TX ring. All three must produce the same
+ * bytes, and the writer must truncate cleanly into any smaller buffer;
+ * the program checks that first, then reports the size and the time per
+ * document. bench("json") measures the same on the device in
+ * cycles. Build it from the repository root:
+ *
+ *     cc -O2 -I main host/json_bench.c main/json_writer.c main/utils.c -o json_bench
+ *     ./json_bench
+ */
+
+#include "json_writer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define NETWORKS 10
+#define BUF_LEN 1024
+#define CHUNK_LEN 64
+#define REPEAT 200000
+
+static int failures;
+
+// SSIDs as they come from a scan; some need escaping
+static const char *const ssids[NETWORKS] = {
+    "office-network-5g", "office-network", "guest", "FRITZ!Box 7590 XY", "Caf\xc3\xa9 \"Central\"",
+    "HP-Print-42-LaserJet", "iPhone von Anna", "eduroam", "tab\there", "C:\\net",
+};
+
+static const char *const status_ssid = "office-network-5g";
+
+// --- The former snprintf path ---
+
+static size_t scan_snprintf(char *out, size_t size)
+{
+    size_t offset = snprintf(out, size, "{\"available_networks\":[");
+    for (int i = 0; i < NETWORKS && offset < size - 128; i++)
+    {
+        char ssid_escaped[65];
+        json_escape(ssids[i], ssid_escaped, sizeof(ssid_escaped));
+        offset += snprintf(out + offset, size - offset, "%s{\"ssid\":\"%s\",\"rssi\":%d,\"encryption\":%d}",
+                           i > 0 ? "," : "", ssid_escaped, -40 - 3 * i, i % 3 != 0);
+    }
+    offset += snprintf(out + offset, size - offset, "]}");
+    return offset;
+}
+
+static size_t status_snprintf(char *out, size_t size)
+{
+    char ssid_escaped[65];
+    json_escape(status_ssid, ssid_escaped, sizeof(ssid_escaped));
+    return snprintf(out, size,
+                    "{\"wifi\":\"connected\",\"ssid\":\"%s\",\"ip\":\"%s\",\"rssi\":%d,\"autoconnect\":%s,"
+                    "\"devname\":\"%s\",\"uptime_s\":%lu,\"heap\":%lu,\"min_heap\":%lu,\"ble_clients\":%u,"
+                    "\"version\":\"%s\"}",
+                    ssid_escaped, "192.168.178.42", -61, "true", "ESP32-BLE", 123456ul, 187432ul, 151208ul, 2u,
+                    "1.4.0");
+}
+
+// --- The writer ---
+
+static size_t scan_writer(json_writer_t *w)
+{
+    json_begin_object(w);
+    json_put_key(w, "available_networks");
+    json_begin_array(w);
+    for (int i = 0; i < NETWORKS; i++)
+    {
+        json_begin_object(w);
+        json_put_key_string(w, "ssid", ssids[i]);
+        json_put_key_int(w, "rssi", -40 - 3 * i);
+        json_put_key_int(w, "encryption", i % 3 != 0);
+        json_end_object(w);
+    }
+    json_end_array(w);
+    json_end_object(w);
+    return json_writer_finish(w);
+}
+
+static size_t status_writer(json_writer_t *w)
+{
+    json_begin_object(w);
+    json_put_key_string(w, "wifi", "connected");
+    json_put_key_string(w, "ssid", status_ssid);
+    json_put_key_string(w, "ip", "192.168.178.42");
+    json_put_key_int(w, "rssi", -61);
+    json_put_key_bool(w, "autoconnect", true);
+    json_put_key_string(w, "devname", "ESP32-BLE");
+    json_put_key_int(w, "uptime_s", 123456);
+    json_put_key_int(w, "heap", 187432);
+    json_put_key_int(w, "min_heap", 151208);
+    json_put_key_int(w, "ble_clients", 2);
+    json_put_key_string(w, "version", "1.4.0");
+    json_end_object(w);
+    return json_writer_finish(w);
+}
+
+// --- Sinks ---
+
+typedef struct
+{
+    char data[BUF_LEN];
+    size_t len;
+} collected_t;
+
+static bool collect_sink(void *ctx, const char *data, size_t len)
+{
+    collected_t *c = ctx;
+    if (c->len + len > sizeof(c->data))
+    {
+        return false;
+    }
+    memcpy(&c->data[c->len], data, len);
+    c->len += len;
+    return true;
+}
+
+// Stands in for the TX ring: takes every chunk and only counts it
+static bool count_sink(void *ctx, const char *data, size_t len)
+{
+    (void)data;
+    *(volatile size_t *)ctx += len;
+    return true;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct
+{
+    const char *name;
+    size_t (*legacy)(char *out, size_t size);
+    size_t (*writer)(json_writer_t *w);
+} document_t;
+
+static void bench(const document_t *doc)
+{
+    static char legacy[BUF_LEN], flat[BUF_LEN];
+    static collected_t streamed;
+
+    // Same bytes three ways
+    size_t legacy_len = doc->legacy(legacy, sizeof(legacy));
+    json_writer_t w;
+    json_writer_init(&w, flat, sizeof(flat));
+    size_t flat_len = doc->writer(&w);
+    char chunk[CHUNK_LEN];
+    streamed.len = 0;
+    json_writer_init_sink(&w, chunk, sizeof(chunk), collect_sink, &streamed);
+    size_t stream_len = doc->writer(&w);
+    if (legacy_len != flat_len || memcmp(legacy, flat, flat_len) != 0)
+    {
+        printf("FAIL %s: writer output differs\n  snprintf: %s\n  writer:   %s\n", doc->name, legacy, flat);
+        failures++;
+    }
+    if (w.overflow || stream_len != flat_len || streamed.len != flat_len ||
+        memcmp(streamed.data, flat, flat_len) != 0)
+    {
+        printf("FAIL %s: streamed output differs\n", doc->name);
+        failures++;
+    }
+
+    // Any smaller buffer holds a terminated prefix and reports the overflow
+    for (size_t size = 1; size <= flat_len + 1; size++)
+    {
+        static char small[BUF_LEN];
+        json_writer_init(&w, small, size);
+        size_t len = doc->writer(&w);
+        size_t kept = size - 1 < flat_len ? size - 1 : flat_len;
+        if (len != flat_len || w.overflow != (size <= flat_len) || strlen(small) != kept ||
+            memcmp(small, flat, kept) != 0)
+        {
+            printf("FAIL %s: wrong truncation to %zu bytes\n", doc->name, size);
+            failures++;
+        }
+    }
+
+    volatile size_t sink = 0;
+    double start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        sink += doc->legacy(legacy, sizeof(legacy));
+    }
+    double legacy_ns = (now_ns() - start) / REPEAT;
+
+    start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        json_writer_init(&w, flat, sizeof(flat));
+        sink += doc->writer(&w);
+    }
+    double writer_ns = (now_ns() - start) / REPEAT;
+
+    volatile size_t sunk = 0;
+    start = now_ns();
+    for (int r = 0; r < REPEAT; r++)
+    {
+        json_writer_init_sink(&w, chunk, sizeof(chunk), count_sink, (void *)&sunk);
+        sink += doc->writer(&w);
+    }
+    double stream_ns = (now_ns() - start) / REPEAT;
+
+    printf("%-6s %4zu bytes  snprintf %7.1f ns  writer %7.1f ns (%.2fx)  stream %7.1f ns (%.2fx)\n", doc->name,
+           flat_len, legacy_ns, writer_ns, legacy_ns / writer_ns, stream_ns, legacy_ns / stream_ns);
+}
+
+int main(void)
+{
+    static const document_t documents[] = {
+        {"scan", scan_snprintf, scan_writer},
+        {"status", status_snprintf, status_writer},
+    };
+    for (size_t i = 0; i < sizeof(documents) / sizeof(documents[0]); i++)
+    {
+        bench(&documents[i]);
+    }
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#pragma once
+// Host stand-in
+#include "esp_err.h"
+#define ESP_RETURN_ON_ERROR(x, tag, ...)                                                                   \
+    do                                                                                                     \
+    {                                                                                                      \
+        esp_err_t err_rc_ = (x);                                                                           \
+        if (err_rc_ != ESP_OK)                                                                             \
+        {                                                                                                  \
+            return err_rc_;                                                                                \
+        }                                                                                                  \
+    } while (0)
@@ -0,0 +1,4 @@
+#pragma once
+// Host stand-in
+#include <stdint.h>
+static inline uint32_t esp_get_free_heap_size(void) { return 200000; }
@@ -0,0 +1,3 @@
+#pragma once
+// Host stand-in
+#include "freertos/FreeRTOS.h"
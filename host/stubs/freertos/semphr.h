@@ -0,0 +1,23 @@
+#pragma once
+// Host stand-in: locks are always free
+#include "freertos/FreeRTOS.h"
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    static int dummy;
+    return &dummy;
+}
+#define xSemaphoreCreateRecursiveMutex xSemaphoreCreateMutex
+#define xSemaphoreCreateBinary xSemaphoreCreateMutex
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+    (void)sem, (void)wait;
+    return pdTRUE;
+}
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    (void)sem;
+    return pdTRUE;
+}
+#define xSemaphoreTakeRecursive xSemaphoreTake
+#define xSemaphoreGiveRecursive xSemaphoreGive
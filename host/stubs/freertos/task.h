@@ -0,0 +1,23 @@
+#pragma once
+// Host stand-in: tasks are created but never run
+#include "freertos/FreeRTOS.h"
+
+static inline BaseType_t xTaskCreate(void (*fn)(void *), const char *name, uint32_t stack, void *arg,
+                                     UBaseType_t prio, TaskHandle_t *handle)
+{
+    (void)fn, (void)name, (void)stack, (void)arg, (void)prio;
+    static int dummy;
+    if (handle != NULL)
+    {
+        *handle = &dummy;
+    }
+    return pdPASS;
+}
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    (void)clear, (void)wait;
+    return 0;
+}
+static inline void vTaskDelay(TickType_t ticks) { (void)ticks; }
+static inline TickType_t xTaskGetTickCount(void) { return 0; }
+#define xTaskNotifyGive(task) ((void)(task))
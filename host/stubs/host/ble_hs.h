@@ -0,0 +1,18 @@
+#pragma once
+// Host stand-in: just the mbuf and notify calls; the test program defines them
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLE_HS_ENOMEM 6
+
+struct os_mbuf
+{
+    uint8_t data[512];
+    uint16_t len;
+};
+
+int os_msys_num_free(void);
+struct os_mbuf *ble_hs_mbuf_att_pkt(void);
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+void os_mbuf_free_chain(struct os_mbuf *om);
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om);
@@ -0,0 +1,3 @@
+#pragma once
+// Host stand-in: the values of the project's sdkconfig that headers use
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
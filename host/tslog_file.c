@@ -0,0 +1,127 @@
+/**
+ * @file tslog_file.c
+ * @brief Implementation of the file-backed log partition.
+ */
+
+#include "tslog_file.h"
+#include <string.h>
+
+// Counts an operation; false once the stand-in is set to fail
+static bool may_proceed(tslog_file_t *f)
+{
+    if (f->fail_after == 0)
+    {
+        return true;
+    }
+    if (f->fail_after == 1)
+    {
+        return false;
+    }
+    f->fail_after--;
+    return true;
+}
+
+static bool in_area(const tslog_file_t *f, uint32_t offset, size_t len)
+{
+    return offset <= f->flash.size && len <= f->flash.size - offset;
+}
+
+static bool file_read(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    tslog_file_t *f = ctx;
+    return may_proceed(f) && in_area(f, offset, len) && fseek(f->file, offset, SEEK_SET) == 0 &&
+           fread(buf, 1, len, f->file) == len;
+}
+
+// Like NOR flash, a write can only clear bits
+static bool file_write(void *ctx, uint32_t offset, const void *buf, size_t len)
+{
+    tslog_file_t *f = ctx;
+    if (!may_proceed(f) || !in_area(f, offset, len))
+    {
+        return false;
+    }
+    const uint8_t *src = buf;
+    uint8_t block[256];
+    while (len > 0)
+    {
+        size_t n = len < sizeof(block) ? len : sizeof(block);
+        if (fseek(f->file, offset, SEEK_SET) != 0 || fread(block, 1, n, f->file) != n)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            block[i] &= src[i];
+        }
+        if (fseek(f->file, offset, SEEK_SET) != 0 || fwrite(block, 1, n, f->file) != n)
+        {
+            return false;
+        }
+        offset += n;
+        src += n;
+        len -= n;
+    }
+    return fflush(f->file) == 0;
+}
+
+static bool file_erase(void *ctx, uint32_t offset, size_t len)
+{
+    tslog_file_t *f = ctx;
+    if (!may_proceed(f) || !in_area(f, offset, len) || offset % TSLOG_SECTOR_SIZE != 0 ||
+        len % TSLOG_SECTOR_SIZE != 0)
+    {
+        return false;
+    }
+    uint8_t erased[TSLOG_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    for (size_t done = 0; done < len; done += sizeof(erased))
+    {
+        if (fseek(f->file, offset + done, SEEK_SET) != 0 || fwrite(erased, 1, sizeof(erased), f->file) != sizeof(erased))
+        {
+            return false;
+        }
+    }
+    return fflush(f->file) == 0;
+}
+
+bool tslog_file_open(tslog_file_t *f, const char *path, uint32_t size)
+{
+    memset(f, 0, sizeof(*f));
+    f->file = fopen(path, "r+b");
+    if (f->file == NULL)
+    {
+        // A new partition comes erased
+        f->file = fopen(path, "w+b");
+        uint8_t erased[TSLOG_SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        for (uint32_t done = 0; f->file != NULL && done < size; done += sizeof(erased))
+        {
+            fwrite(erased, 1, sizeof(erased), f->file);
+        }
+    }
+    if (f->file == NULL || size % TSLOG_SECTOR_SIZE != 0 || fseek(f->file, 0, SEEK_END) != 0 ||
+        ftell(f->file) != (long)size)
+    {
+        tslog_file_close(f);
+        return false;
+    }
+
+    f->flash = (tslog_flash_t){
+        .ctx = f,
+        .size = size,
+        .read = file_read,
+        .write = file_write,
+        .erase = file_erase,
+    };
+    return true;
+}
+
+void tslog_file_close(tslog_file_t *f)
+{
+    if (f->file != NULL)
+    {
+        fclose(f->file);
+        f->file = NULL;
+    }
+}
@@ -0,0 +1,43 @@
+/**
+ * @file tslog_file.h
+ * @brief File-backed stand-in for the time-series log partition.
+ *
+ * Lets tslog run on a development machine: the flash area is a file of
+ * the partition's size, and the file behaves like NOR flash, so writes
+ * can only clear bits and erases are whole sectors that fill them with
+ * 0xFF again. A file left by an earlier run is mounted as it is, which
+ * makes resets easy to replay. Build it together with main/tslog.c:
+ *
+ *     cc -I main host/tslog_file.c main/tslog.c your_program.c
+ */
+
+#ifndef TSLOG_FILE_H
+#define TSLOG_FILE_H
+
+#include "tslog.h"
+#include <stdio.h>
+
+/**
+ * @brief An open stand-in.
+ */
+typedef struct
+{
+    FILE *file;
+    tslog_flash_t flash; // Pass this to tslog_mount()
+    unsigned fail_after; // Flash operations left before they start to fail; 0 never fails
+} tslog_file_t;
+
+/**
+ * @brief Opens the file, creating it erased if it does not exist.
+ *
+ * @param size The size of the area, a multiple of TSLOG_SECTOR_SIZE.
+ * @return False if the file cannot be opened or has another size.
+ */
+bool tslog_file_open(tslog_file_t *f, const char *path, uint32_t size);
+
+/**
+ * @brief Closes the file.
+ */
+void tslog_file_close(tslog_file_t *f);
+
+#endif // TSLOG_FILE_H
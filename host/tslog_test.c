@@ -0,0 +1,363 @@
+/**
+ * @file tslog_test.c
+ * @brief Host test of the time-series ring log.
+ *
+ * Runs main/tslog.c over the file-backed flash of host/tslog_file.c and
+ * keeps every record it appends, so that what the log returns can be
+ * compared with what went in. It fills a small area until the ring has
+ * wrapped around several times, remounts it as after a reset, compares
+ * random range queries with the same ranges filtered from the reference,
+ * tears the last chunk at every length as a reset during the write would,
+ * and lets the ring overtake a query in progress. Build it from the
+ * repository root:
+ *
+ *     cc -I main host/tslog_test.c host/tslog_file.c main/tslog.c -o tslog_test
+ *     ./tslog_test
+ */
+
+#include "tslog_file.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH "tslog_test.bin"
+#define SECTORS 8
+#define MAX_RECORDS 40000
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                   \
+    do                                                                                                     \
+    {                                                                                                      \
+        if (!(cond))                                                                                       \
+        {                                                                                                  \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                    \
+            printf(__VA_ARGS__);                                                                           \
+            printf("\n");                                                                                  \
+            failures++;                                                                                    \
+        }                                                                                                  \
+    } while (0)
+
+static tslog_file_t file;
+static tslog_t tl;
+
+// Everything appended, in order
+static tslog_record_t appended[MAX_RECORDS];
+static size_t appended_count;
+
+static tslog_record_t got[MAX_RECORDS];
+
+// --- Helpers ---
+
+static void mount(bool fresh)
+{
+    tslog_file_close(&file);
+    if (fresh)
+    {
+        remove(PATH);
+    }
+    bool ok = tslog_file_open(&file, PATH, SECTORS * TSLOG_SECTOR_SIZE) && tslog_mount(&tl, &file.flash);
+    CHECK(ok, "cannot mount %s", PATH);
+    if (fresh)
+    {
+        appended_count = 0;
+    }
+}
+
+// Samples like the telemetry task's: a steady interval with the odd gap,
+// values that mostly hold still or drift, and now and then jump
+static void append(size_t n)
+{
+    static uint32_t t = 1000;
+    static int32_t v[TSLOG_FIELDS] = {-60, 180000, 1, 1};
+    for (size_t i = 0; i < n && appended_count < MAX_RECORDS; i++)
+    {
+        t += rand() % 50 == 0 ? 10 + (uint32_t)rand() % 5000 : 10;
+        v[0] += rand() % 4 == 0 ? rand() % 7 - 3 : 0;
+        v[1] += rand() % 3 == 0 ? rand() % 2001 - 1000 : 0;
+        v[2] = rand() % 40 == 0 ? rand() % 4 : v[2];
+        v[3] = rand() % 100 == 0 ? !v[3] : v[3];
+        if (rand() % 500 == 0)
+        {
+            v[1] = rand() - RAND_MAX / 2; // Far outside the small deltas
+        }
+        tslog_record_t rec = {.t = t};
+        memcpy(rec.v, v, sizeof(v));
+        CHECK(tslog_append(&tl, &rec), "append of record %zu failed", appended_count);
+        appended[appended_count++] = rec;
+    }
+}
+
+static size_t query(uint32_t from, uint32_t to)
+{
+    tslog_iter_t it;
+    tslog_iter_begin(&tl, &it, from, to);
+    size_t n = 0;
+    while (n < MAX_RECORDS && tslog_iter_next(&it, &got[n]))
+    {
+        n++;
+    }
+    CHECK(tslog_iter_lost(&it) == 0, "query %u..%u lost %u sectors", from, to, tslog_iter_lost(&it));
+    return n;
+}
+
+static bool same(const tslog_record_t *a, const tslog_record_t *b)
+{
+    return a->t == b->t && memcmp(a->v, b->v, sizeof(a->v)) == 0;
+}
+
+// The whole log must be the newest records appended, in order; returns
+// how many of them it kept
+static size_t check_log(const char *what)
+{
+    size_t n = query(0, UINT32_MAX);
+    CHECK(n > 0 && n <= appended_count, "%s: %zu records of %zu", what, n, appended_count);
+    size_t first = appended_count - n;
+    for (size_t i = 0; i < n && n <= appended_count; i++)
+    {
+        if (!same(&got[i], &appended[first + i]))
+        {
+            CHECK(false, "%s: record %zu of %zu differs", what, i, n);
+            break;
+        }
+    }
+    tslog_stats_t stats;
+    tslog_get_stats(&tl, &stats);
+    CHECK(n == 0 || stats.oldest_t == got[0].t, "%s: oldest %u, first record %u", what, stats.oldest_t,
+          n > 0 ? got[0].t : 0);
+    return n;
+}
+
+// --- Scenarios ---
+
+static void wrap_around(void)
+{
+    mount(true);
+    size_t kept = 0;
+    for (int round = 0; round < 40; round++)
+    {
+        append(500 + (size_t)rand() % 500);
+        kept = check_log("wrap-around");
+    }
+    tslog_stats_t stats;
+    tslog_get_stats(&tl, &stats);
+    CHECK(stats.used == SECTORS, "%u of %u sectors used", stats.used, SECTORS);
+    CHECK(stats.erases >= 3 * SECTORS, "the ring wrapped only %u sectors", stats.erases);
+    CHECK(stats.failures == 0 && stats.rejected == 0, "%u failures, %u rejected", stats.failures, stats.rejected);
+    printf("wrap-around: %zu records appended, %zu kept, %u erases, %.1f bytes per record\n", appended_count, kept,
+           stats.erases, (double)stats.bytes / (stats.records - stats.pending));
+}
+
+static void remount(void)
+{
+    // Flushed records survive a reset, pending ones do not
+    tslog_flush(&tl);
+    size_t before = check_log("before remount");
+    append(TSLOG_CHUNK_RECORDS / 2);
+    appended_count -= TSLOG_CHUNK_RECORDS / 2;
+    mount(false);
+    size_t after = check_log("remount");
+    CHECK(after == before, "%zu records before, %zu after remount", before, after);
+    uint32_t last;
+    CHECK(tslog_last_time(&tl, &last) && last == appended[appended_count - 1].t, "last time %u, expected %u", last,
+          appended[appended_count - 1].t);
+
+    // Appending goes on where it stopped
+    append(3000);
+    check_log("after remount");
+    tslog_flush(&tl);
+    mount(false);
+    check_log("second remount");
+    printf("remount: %zu records recovered\n", after);
+}
+
+static void range_queries(void)
+{
+    // Some of the newest records are still in RAM
+    append(TSLOG_CHUNK_RECORDS / 3);
+    size_t n = check_log("ranges");
+    static tslog_record_t all[MAX_RECORDS];
+    memcpy(all, got, n * sizeof(all[0]));
+
+    uint32_t lo = all[0].t, hi = all[n - 1].t;
+    int queries = 0;
+    for (int q = 0; q < 2000; q++)
+    {
+        // Inside the log, around its ends, and at the records' own times
+        uint32_t span = hi - lo + 2000;
+        uint32_t from = lo - 1000 + (uint32_t)rand() % span;
+        uint32_t to = from + (uint32_t)rand() % (q % 4 == 0 ? span : 200);
+        if (q % 3 == 0)
+        {
+            from = all[(size_t)rand() % n].t;
+        }
+        if (q % 5 == 0)
+        {
+            to = from;
+        }
+
+        size_t count = query(from, to);
+        size_t expected = 0;
+        bool match = true;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (all[i].t >= from && all[i].t <= to)
+            {
+                match = match && expected < count && same(&got[expected], &all[i]);
+                expected++;
+            }
+        }
+        CHECK(match && count == expected, "query %u..%u: %zu records, expected %zu", from, to, count, expected);
+        queries++;
+    }
+
+    CHECK(query(hi + 1, UINT32_MAX) == 0, "records after the newest");
+    CHECK(query(0, lo - 1) == 0, "records before the oldest");
+    CHECK(query(hi, lo) == 0, "records in an empty range");
+    printf("range queries: %d over %zu records\n", queries, n);
+}
+
+// Overwrites part of the area as erased flash; only a test may do this
+static void erase_bytes(uint32_t offset, uint32_t len)
+{
+    uint8_t erased[TSLOG_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    fseek(file.file, offset, SEEK_SET);
+    fwrite(erased, 1, len, file.file);
+    fflush(file.file);
+}
+
+static void flip_bit(uint32_t offset)
+{
+    uint8_t byte;
+    fseek(file.file, offset, SEEK_SET);
+    fread(&byte, 1, 1, file.file);
+    byte ^= 0x10;
+    fseek(file.file, offset, SEEK_SET);
+    fwrite(&byte, 1, 1, file.file);
+    fflush(file.file);
+}
+
+// A reset during the write leaves only the first bytes of the last chunk.
+// At every length, the records before it must come back, none of its own,
+// and appending must go on after it
+static void torn_chunks(void)
+{
+    int cases = 0;
+    for (uint32_t kept = 0;; kept++)
+    {
+        mount(true);
+        append(2000);
+        tslog_flush(&tl);
+        if (tl.head_off > TSLOG_SECTOR_SIZE - TSLOG_CHUNK_MAX_SIZE)
+        {
+            append(TSLOG_CHUNK_RECORDS); // Keep the last chunk inside the sector
+            append(TSLOG_CHUNK_RECORDS);
+        }
+        uint32_t sector = tl.head, start = tl.head_off;
+        append(TSLOG_CHUNK_RECORDS);
+        CHECK(tl.head == sector, "the chunk went to another sector");
+        uint32_t size = tl.head_off - start;
+        if (kept >= size)
+        {
+            break;
+        }
+
+        erase_bytes(sector * TSLOG_SECTOR_SIZE + start + kept, size - kept);
+        appended_count -= TSLOG_CHUNK_RECORDS;
+        mount(false);
+        check_log("torn chunk");
+        append(100);
+        tslog_flush(&tl);
+        check_log("after a torn chunk");
+        if (kept > 0)
+        {
+            CHECK(tl.head != sector, "appending went on in the torn sector");
+        }
+        mount(false);
+        check_log("remount after a torn chunk");
+        cases++;
+    }
+
+    // A flipped bit anywhere in the last chunk drops it
+    for (uint32_t at = 0; at < TSLOG_CHUNK_HDR_SIZE + 8; at++)
+    {
+        mount(true);
+        append(1000);
+        tslog_flush(&tl);
+        uint32_t sector = tl.head, start = tl.head_off;
+        append(TSLOG_CHUNK_RECORDS);
+        if (tl.head != sector)
+        {
+            continue;
+        }
+        flip_bit(sector * TSLOG_SECTOR_SIZE + start + at);
+        appended_count -= TSLOG_CHUNK_RECORDS;
+        mount(false);
+        check_log("damaged chunk");
+        cases++;
+    }
+    printf("torn chunks: %d cases\n", cases);
+}
+
+// The ring overtakes a query that reads slowly: after the records of the
+// chunk it had loaded, the query must go on at the oldest sector left,
+// without repeating or reordering records
+static void overtaken_query(void)
+{
+    mount(true);
+    append(8000);
+    size_t n = check_log("overtaken");
+    size_t first = appended_count - n;
+
+    tslog_iter_t it;
+    tslog_iter_begin(&tl, &it, 0, UINT32_MAX);
+    size_t read = 0;
+    for (; read < 50; read++)
+    {
+        CHECK(tslog_iter_next(&it, &got[read]), "query ended early");
+    }
+    append(6000); // Erases the sectors the query has not read yet
+    while (read < MAX_RECORDS && tslog_iter_next(&it, &got[read]))
+    {
+        read++;
+    }
+    CHECK(tslog_iter_lost(&it) > 0, "no sectors lost");
+
+    // Timestamps are unique here, so the jump is where they stop matching
+    size_t jump = 0;
+    while (jump < read && same(&got[jump], &appended[first + jump]))
+    {
+        jump++;
+    }
+    CHECK(jump >= 50 && jump < 50 + TSLOG_CHUNK_RECORDS, "jumped after %zu records", jump);
+    tslog_stats_t stats;
+    tslog_get_stats(&tl, &stats);
+    CHECK(jump < read && got[jump].t == stats.oldest_t, "resumed at %u, oldest is %u",
+          jump < read ? got[jump].t : 0, stats.oldest_t);
+
+    // From there on, the rest of the log
+    size_t resume = appended_count - (read - jump);
+    bool match = read - jump <= appended_count;
+    for (size_t i = jump; i < read && match; i++)
+    {
+        match = same(&got[i], &appended[resume + i - jump]);
+    }
+    CHECK(match, "the records after the wrap are not the rest of the log");
+    printf("overtaken query: %u sectors lost after %zu records, resumed at t %u\n", tslog_iter_lost(&it), jump,
+           jump < read ? got[jump].t : 0);
+}
+
+int main(void)
+{
+    srand(24);
+    wrap_around();
+    remount();
+    range_queries();
+    torn_chunks();
+    overtaken_query();
+
+    tslog_file_close(&file);
+    remove(PATH);
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,495 @@
+/**
+ * @file wifi_sm_sim.c
+ * @brief Drives the WiFi state machine through a simulated driver.
+ *
+ * main/wifi_sm.c runs unchanged against a discrete-time simulation: a fake
+ * driver answers connect() after a delay with an association, an address,
+ * a rejection or nothing at all, and the one-shot timer is modelled the
+ * way wifi_manager.c implements it. An expiry is posted to the event loop
+ * with the timer's generation and arrives a little later; by then the timer
+ * may have been re-armed or cancelled, and the generation check must drop
+ * it. The scenarios cover a normal connection, association failures with
+ * a backoff that grows, is jittered and is capped at WIFI_SM_BACKOFF_MAX_MS,
+ * the immediate first retry after losing a working link, a disconnect
+ * during the backoff, phase timeouts and stale timeouts. Build it from the
+ * repository root:
+ *
+ *     cc -I main host/wifi_sm_sim.c main/wifi_sm.c -o wifi_sm_sim
+ *     ./wifi_sm_sim
+ */
+
+#include "wifi_sm.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_PENDING 16
+#define MAX_TRANSITIONS 256
+
+// Disconnect reason of a rejected association (WIFI_REASON_AUTH_FAIL)
+#define REASON_REJECTED 202
+#define REASON_BEACON_TIMEOUT 200
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                   \
+    do                                                                                                     \
+    {                                                                                                      \
+        if (!(cond))                                                                                       \
+        {                                                                                                  \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                    \
+            printf(__VA_ARGS__);                                                                           \
+            printf("\n");                                                                                  \
+            failures++;                                                                                    \
+        }                                                                                                  \
+    } while (0)
+
+// How the simulated AP answers an association attempt
+typedef enum
+{
+    AP_ACCEPT,  // Associates after 300 ms, address after 800 ms
+    AP_REJECT,  // Rejects after 200 ms
+    AP_SILENT,  // Never answers
+    AP_NO_DHCP, // Associates, but no address ever comes
+} ap_mode_t;
+
+// An event on its way to the state machine
+typedef struct
+{
+    uint32_t at;
+    bool timer;       // A timer expiry, carrying its generation
+    uint32_t gen;
+    wifi_sm_event_t event;
+    int arg;
+} pending_t;
+
+typedef struct
+{
+    wifi_sm_state_t from, to;
+    int reason;
+    uint32_t at;
+    uint32_t backoff_ms;
+} transition_t;
+
+typedef struct
+{
+    wifi_sm_t sm;
+    uint32_t now;
+    ap_mode_t ap;
+    uint32_t loop_latency_ms; // From a timer's expiry to its event being handled
+    bool filter_stale;
+
+    // The one-shot timer, as wifi_manager.c runs it
+    bool timer_armed;
+    uint32_t timer_at;
+    uint32_t timer_gen;
+
+    pending_t pending[MAX_PENDING];
+    size_t pending_count;
+
+    uint32_t rng;
+    uint32_t connects, disconnects, stale_dropped;
+    transition_t log[MAX_TRANSITIONS];
+    size_t log_count;
+} sim_t;
+
+static void post(sim_t *s, uint32_t delay, bool timer, uint32_t gen, wifi_sm_event_t event, int arg)
+{
+    if (s->pending_count == MAX_PENDING)
+    {
+        CHECK(false, "too many pending events");
+        return;
+    }
+    s->pending[s->pending_count++] = (pending_t){s->now + delay, timer, gen, event, arg};
+}
+
+// Driver events still in flight belong to the attempt being dropped
+static void drop_driver_events(sim_t *s)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < s->pending_count; i++)
+    {
+        if (s->pending[i].timer)
+        {
+            s->pending[kept++] = s->pending[i];
+        }
+    }
+    s->pending_count = kept;
+}
+
+// --- Operations of the state machine ---
+
+static bool op_connect(void *ctx)
+{
+    sim_t *s = ctx;
+    s->connects++;
+    switch (s->ap)
+    {
+    case AP_ACCEPT:
+        post(s, 300, false, 0, WIFI_SM_EV_ASSOCIATED, 0);
+        post(s, 800, false, 0, WIFI_SM_EV_GOT_IP, 0);
+        break;
+    case AP_REJECT:
+        post(s, 200, false, 0, WIFI_SM_EV_LINK_LOST, REASON_REJECTED);
+        break;
+    case AP_SILENT:
+        break;
+    case AP_NO_DHCP:
+        post(s, 300, false, 0, WIFI_SM_EV_ASSOCIATED, 0);
+        break;
+    }
+    return true;
+}
+
+static void op_disconnect(void *ctx)
+{
+    sim_t *s = ctx;
+    s->disconnects++;
+    drop_driver_events(s);
+}
+
+static void op_set_timer(void *ctx, uint32_t ms)
+{
+    sim_t *s = ctx;
+    s->timer_gen++;
+    s->timer_armed = ms > 0;
+    s->timer_at = s->now + ms;
+}
+
+static uint32_t op_random(void *ctx)
+{
+    // xorshift32
+    sim_t *s = ctx;
+    s->rng ^= s->rng << 13;
+    s->rng ^= s->rng >> 17;
+    s->rng ^= s->rng << 5;
+    return s->rng;
+}
+
+static void op_on_transition(void *ctx, wifi_sm_state_t from, wifi_sm_state_t to, int reason)
+{
+    sim_t *s = ctx;
+    if (s->log_count < MAX_TRANSITIONS)
+    {
+        s->log[s->log_count++] = (transition_t){from, to, reason, s->now, s->sm.stats.backoff_ms};
+    }
+}
+
+static const wifi_sm_ops_t ops = {
+    .connect = op_connect,
+    .disconnect = op_disconnect,
+    .set_timer = op_set_timer,
+    .random = op_random,
+    .on_transition = op_on_transition,
+};
+
+// --- Simulation ---
+
+static void sim_init(sim_t *s, ap_mode_t ap, uint32_t seed)
+{
+    memset(s, 0, sizeof(*s));
+    s->ap = ap;
+    s->rng = seed != 0 ? seed : 1;
+    s->loop_latency_ms = 5;
+    s->filter_stale = true;
+    s->now = 1000;
+    wifi_sm_init(&s->sm, &ops, s, s->now);
+}
+
+static void feed(sim_t *s, wifi_sm_event_t event, int arg)
+{
+    wifi_sm_handle(&s->sm, event, arg, s->now);
+}
+
+// Runs everything due up to the given time, in time order
+static void run_until(sim_t *s, uint32_t until)
+{
+    for (;;)
+    {
+        size_t next = s->pending_count;
+        uint32_t at = until;
+        for (size_t i = 0; i < s->pending_count; i++)
+        {
+            if (s->pending[i].at <= at)
+            {
+                at = s->pending[i].at;
+                next = i;
+            }
+        }
+        if (s->timer_armed && s->timer_at <= at)
+        {
+            // The timer task posts the expiry with the generation it saw
+            s->now = s->timer_at;
+            s->timer_armed = false;
+            post(s, s->loop_latency_ms, true, s->timer_gen, WIFI_SM_EV_TIMEOUT, 0);
+            continue;
+        }
+        if (next == s->pending_count)
+        {
+            s->now = until;
+            return;
+        }
+
+        pending_t p = s->pending[next];
+        s->pending[next] = s->pending[--s->pending_count];
+        s->now = p.at;
+        if (p.timer && s->filter_stale && p.gen != s->timer_gen)
+        {
+            s->stale_dropped++;
+            continue;
+        }
+        feed(s, p.event, p.arg);
+    }
+}
+
+static wifi_sm_state_t state(const sim_t *s)
+{
+    return s->sm.state;
+}
+
+// --- Scenarios ---
+
+static void connect_normally(void)
+{
+    sim_t s;
+    sim_init(&s, AP_ACCEPT, 1);
+    feed(&s, WIFI_SM_EV_CONNECT, 1);
+    CHECK(state(&s) == WIFI_SM_ASSOCIATING, "not associating: %s", wifi_sm_state_name(state(&s)));
+    run_until(&s, s.now + 500);
+    CHECK(state(&s) == WIFI_SM_DHCP, "not in DHCP: %s", wifi_sm_state_name(state(&s)));
+    run_until(&s, s.now + 60000);
+    CHECK(state(&s) == WIFI_SM_CONNECTED, "not connected: %s", wifi_sm_state_name(state(&s)));
+    CHECK(!s.timer_armed, "timer still armed when connected");
+    CHECK(s.connects == 1 && s.disconnects == 0, "%u connects, %u disconnects", s.connects, s.disconnects);
+
+    static const wifi_sm_state_t expected[] = {WIFI_SM_ASSOCIATING, WIFI_SM_DHCP, WIFI_SM_CONNECTED};
+    CHECK(s.log_count == 3, "%zu transitions", s.log_count);
+    for (size_t i = 0; i < s.log_count && i < 3; i++)
+    {
+        CHECK(s.log[i].to == expected[i], "transition %zu to %s", i, wifi_sm_state_name(s.log[i].to));
+    }
+
+    wifi_sm_stats_t stats;
+    wifi_sm_get_stats(&s.sm, &stats, s.now);
+    CHECK(stats.attempts == 1 && stats.failures == 0 && stats.retry == 0, "attempts %u failures %u retry %u",
+          stats.attempts, stats.failures, stats.retry);
+    CHECK(stats.phases[WIFI_SM_ASSOCIATING].last_ms == 300, "associating took %u ms",
+          stats.phases[WIFI_SM_ASSOCIATING].last_ms);
+    CHECK(stats.phases[WIFI_SM_DHCP].last_ms == 500, "DHCP took %u ms", stats.phases[WIFI_SM_DHCP].last_ms);
+    printf("connect: associated, address after %u ms\n", s.log[2].at - s.log[0].at);
+}
+
+// Nominal ceiling of the n-th backoff after failed attempts
+static uint32_t ceiling(uint32_t n)
+{
+    uint32_t delay = WIFI_SM_BACKOFF_BASE_MS;
+    for (uint32_t i = 1; i < n && delay < WIFI_SM_BACKOFF_MAX_MS; i++)
+    {
+        delay *= 2;
+    }
+    return delay < WIFI_SM_BACKOFF_MAX_MS ? delay : WIFI_SM_BACKOFF_MAX_MS;
+}
+
+#define BACKOFFS 10
+#define SEEDS 8
+
+// Returns the delays of the first BACKOFFS backoffs against a rejecting AP
+static void collect_backoffs(uint32_t seed, uint32_t delays[BACKOFFS])
+{
+    sim_t s;
+    sim_init(&s, AP_REJECT, seed);
+    feed(&s, WIFI_SM_EV_CONNECT, 1);
+    size_t n = 0;
+    size_t seen = 0;
+    while (n < BACKOFFS)
+    {
+        run_until(&s, s.now + 1000);
+        for (; seen < s.log_count && n < BACKOFFS; seen++)
+        {
+            if (s.log[seen].to == WIFI_SM_BACKOFF)
+            {
+                CHECK(s.log[seen].reason == REASON_REJECTED, "backoff reason %d", s.log[seen].reason);
+                delays[n++] = s.log[seen].backoff_ms;
+            }
+        }
+        if (s.log_count == MAX_TRANSITIONS)
+        {
+            break;
+        }
+    }
+    CHECK(n == BACKOFFS, "only %zu backoffs", n);
+
+    // Every backoff was waited out in full before the next attempt
+    for (size_t i = 0; i + 1 < s.log_count; i++)
+    {
+        if (s.log[i].to == WIFI_SM_BACKOFF)
+        {
+            CHECK(s.log[i + 1].to == WIFI_SM_ASSOCIATING &&
+                      s.log[i + 1].at - s.log[i].at == s.log[i].backoff_ms + s.loop_latency_ms,
+                  "backoff of %u ms ended after %u ms", s.log[i].backoff_ms, s.log[i + 1].at - s.log[i].at);
+        }
+    }
+}
+
+static void backoff_after_failures(void)
+{
+    uint32_t delays[SEEDS][BACKOFFS];
+    for (uint32_t seed = 0; seed < SEEDS; seed++)
+    {
+        collect_backoffs(seed + 1, delays[seed]);
+    }
+
+    for (size_t n = 0; n < BACKOFFS; n++)
+    {
+        // Within the upper half of a ceiling that doubles up to the cap
+        uint32_t ceil = ceiling(n + 1);
+        uint32_t lo = UINT32_MAX, hi = 0;
+        for (size_t seed = 0; seed < SEEDS; seed++)
+        {
+            uint32_t d = delays[seed][n];
+            CHECK(d >= ceil / 2 && d <= ceil, "backoff %zu: %u ms outside %u..%u", n + 1, d, ceil / 2, ceil);
+            CHECK(d <= WIFI_SM_BACKOFF_MAX_MS, "backoff %zu: %u ms above the cap", n + 1, d);
+            lo = d < lo ? d : lo;
+            hi = d > hi ? d : hi;
+        }
+        // Jittered: clients failing together do not retry together
+        CHECK(hi > lo, "backoff %zu: %u ms for every seed", n + 1, lo);
+        printf("backoff %2zu: %5u..%5u ms (ceiling %5u)\n", n + 1, lo, hi, ceil);
+    }
+    CHECK(ceiling(BACKOFFS) == WIFI_SM_BACKOFF_MAX_MS, "the cap is never reached");
+}
+
+static void fast_reconnect_after_link_loss(void)
+{
+    sim_t s;
+    sim_init(&s, AP_ACCEPT, 3);
+    feed(&s, WIFI_SM_EV_CONNECT, 1);
+    run_until(&s, s.now + 2000);
+    CHECK(state(&s) == WIFI_SM_CONNECTED, "not connected: %s", wifi_sm_state_name(state(&s)));
+
+    // The AP goes away: the first retry is immediate, then the backoff starts over
+    s.ap = AP_REJECT;
+    size_t from = s.log_count;
+    uint32_t lost_at = s.now;
+    feed(&s, WIFI_SM_EV_LINK_LOST, REASON_BEACON_TIMEOUT);
+    CHECK(state(&s) == WIFI_SM_ASSOCIATING, "no immediate retry: %s", wifi_sm_state_name(state(&s)));
+    CHECK(s.log[from].to == WIFI_SM_BACKOFF && s.log[from].backoff_ms == 0, "first retry waits %u ms",
+          s.log[from].backoff_ms);
+    run_until(&s, s.now + 250);
+    CHECK(state(&s) == WIFI_SM_BACKOFF && s.sm.stats.backoff_ms >= WIFI_SM_BACKOFF_BASE_MS / 2 &&
+              s.sm.stats.backoff_ms <= WIFI_SM_BACKOFF_BASE_MS,
+          "second retry waits %u ms", s.sm.stats.backoff_ms);
+
+    // It comes back: the time to reconnect counts from the loss
+    s.ap = AP_ACCEPT;
+    run_until(&s, s.now + 5000);
+    CHECK(state(&s) == WIFI_SM_CONNECTED, "not reconnected: %s", wifi_sm_state_name(state(&s)));
+    wifi_sm_stats_t stats;
+    wifi_sm_get_stats(&s.sm, &stats, s.now);
+    uint32_t took = s.log[s.log_count - 1].at - lost_at;
+    CHECK(stats.reconnects == 1 && stats.last_reconnect_ms == took, "reconnects %u in %u ms, expected %u ms",
+          stats.reconnects, stats.last_reconnect_ms, took);
+    CHECK(stats.retry == 0, "retry %u after reconnecting", stats.retry);
+    printf("link loss: reconnected after %u ms\n", took);
+}
+
+static void disconnect_during_backoff(void)
+{
+    sim_t s;
+    sim_init(&s, AP_REJECT, 4);
+    feed(&s, WIFI_SM_EV_CONNECT, 1);
+    run_until(&s, s.now + 250);
+    CHECK(state(&s) == WIFI_SM_BACKOFF, "not backing off: %s", wifi_sm_state_name(state(&s)));
+    CHECK(s.timer_armed, "backoff without a timer");
+
+    feed(&s, WIFI_SM_EV_DISCONNECT, 0);
+    CHECK(state(&s) == WIFI_SM_IDLE, "not idle: %s", wifi_sm_state_name(state(&s)));
+    CHECK(!s.timer_armed, "backoff timer still armed");
+    uint32_t connects = s.connects;
+    run_until(&s, s.now + 10 * WIFI_SM_BACKOFF_MAX_MS);
+    CHECK(state(&s) == WIFI_SM_IDLE && s.connects == connects, "retried after a disconnect: %s, %u connects",
+          wifi_sm_state_name(state(&s)), s.connects - connects);
+
+    // Its expiry was already on its way: it is stale and dropped
+    sim_init(&s, AP_REJECT, 4);
+    feed(&s, WIFI_SM_EV_CONNECT, 1);
+    run_until(&s, s.now + 250);
+    run_until(&s, s.timer_at); // Fired, not handled yet
+    feed(&s, WIFI_SM_EV_DISCONNECT, 0);
+    connects = s.connects;
+    run_until(&s, s.now + 1000);
+    CHECK(s.stale_dropped == 1, "%u stale timeouts dropped", s.stale_dropped);
+    CHECK(state(&s) == WIFI_SM_IDLE && s.connects == connects, "a stale expiry restarted: %s",
+          wifi_sm_state_name(state(&s)));
+
+    // Even if one got through, it would not start an attempt from idle
+    feed(&s, WIFI_SM_EV_TIMEOUT, 0);
+    CHECK(state(&s) == WIFI_SM_IDLE && s.connects == connects, "a timeout restarted from idle");
+    printf("disconnect during backoff: stays idle\n");
+}
+
+static void phase_timeouts(void)
+{
+    sim_t s;
+    sim_init(&s, AP_SILENT, 5);
+    feed(&s, WIFI_SM_EV_CONNECT, 0);
+    uint32_t started = s.now;
+    run_until(&s, s.now + WIFI_SM_ASSOC_TIMEOUT_MS + 1000);
+    CHECK(state(&s) == WIFI_SM_IDLE && s.sm.stats.last_reason == WIFI_SM_REASON_TIMEOUT,
+          "association: %s, reason %d", wifi_sm_state_name(state(&s)), s.sm.stats.last_reason);
+    CHECK(s.log[s.log_count - 1].at - started == WIFI_SM_ASSOC_TIMEOUT_MS + s.loop_latency_ms,
+          "association gave up after %u ms", s.log[s.log_count - 1].at - started);
+    CHECK(s.disconnects == 1, "%u disconnects", s.disconnects);
+
+    sim_init(&s, AP_NO_DHCP, 5);
+    feed(&s, WIFI_SM_EV_CONNECT, 0);
+    run_until(&s, s.now + 300);
+    uint32_t associated = s.now;
+    run_until(&s, s.now + WIFI_SM_DHCP_TIMEOUT_MS + 1000);
+    CHECK(state(&s) == WIFI_SM_IDLE && s.sm.stats.last_reason == WIFI_SM_REASON_TIMEOUT,
+          "DHCP: %s, reason %d", wifi_sm_state_name(state(&s)), s.sm.stats.last_reason);
+    CHECK(s.log[s.log_count - 1].at - associated == WIFI_SM_DHCP_TIMEOUT_MS + s.loop_latency_ms,
+          "DHCP gave up after %u ms", s.log[s.log_count - 1].at - associated);
+    printf("timeouts: association %u ms, DHCP %u ms\n", WIFI_SM_ASSOC_TIMEOUT_MS, WIFI_SM_DHCP_TIMEOUT_MS);
+}
+
+// The association timer fires just as the AP accepts: its expiry is queued
+// behind the association, which re-arms the timer for DHCP
+static void stale_timeout(bool filter)
+{
+    sim_t s;
+    sim_init(&s, AP_NO_DHCP, 6);
+    s.filter_stale = filter;
+    s.loop_latency_ms = 20;
+    feed(&s, WIFI_SM_EV_CONNECT, 0);
+    drop_driver_events(&s);
+    post(&s, WIFI_SM_ASSOC_TIMEOUT_MS + 10, false, 0, WIFI_SM_EV_ASSOCIATED, 0);
+    run_until(&s, s.now + WIFI_SM_ASSOC_TIMEOUT_MS + 100);
+
+    if (filter)
+    {
+        CHECK(s.stale_dropped == 1, "%u stale timeouts dropped", s.stale_dropped);
+        CHECK(state(&s) == WIFI_SM_DHCP, "stale association timeout taken: %s", wifi_sm_state_name(state(&s)));
+        CHECK(s.timer_armed, "DHCP timer lost");
+        printf("stale timeout: dropped, still in DHCP\n");
+    }
+    else
+    {
+        // Why the filter is needed: the machine cannot tell the expiries apart
+        CHECK(state(&s) == WIFI_SM_IDLE && s.sm.stats.last_reason == WIFI_SM_REASON_TIMEOUT,
+              "unfiltered: %s", wifi_sm_state_name(state(&s)));
+    }
+}
+
+int main(void)
+{
+    connect_normally();
+    backoff_after_failures();
+    fast_reconnect_after_link_loss();
+    disconnect_during_backoff();
+    phase_timeouts();
+    stale_timeout(true);
+    stale_timeout(false);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -11,12 +11,110 @@
 #include "wifi_manager.h"
 
 #include "freertos/semphr.h"
+#include <string.h>
 
 static const char *TAG = "APP_TASK";
 
-// The queue handle for commands
+// The queue handle for commands; carries app_cmd_buf_t pointers
 static QueueHandle_t app_task_queue;
 
+// Pool of command buffers and the queue of free buffer pointers
+static app_cmd_buf_t cmd_pool[APP_CMD_POOL_SIZE];
+static QueueHandle_t cmd_free_queue;
+
+// Admission statistics, updated by producers on any task
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static app_task_queue_stats_t queue_stats = {.capacity = APP_TASK_QUEUE_SIZE};
+
+// Coalesced status publication. Requests set these under status_lock;
+// only the application task publishes and clears them.
+static TaskHandle_t app_task_handle;
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool status_broadcast;
+static uint16_t status_targets[APP_TASK_STATUS_MAX_TARGETS];
+static size_t status_target_count;
+static uint32_t status_interval_ms = APP_TASK_STATUS_INTERVAL_MS;
+static int64_t last_status_us = INT64_MIN / 2;
+
+// Set by event handlers once a deferred command can be answered
+static atomic_bool deferred_pending;
+
+static void count_rejected(void)
+{
+    portENTER_CRITICAL(&stats_lock);
+    queue_stats.rejected++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * @brief Publishes the status if it is dirty and the interval has passed.
+ *
+ * @return How long to wait until a pending publication is due, or
+ *         portMAX_DELAY if nothing is pending.
+ */
+static TickType_t publish_status_if_due(void)
+{
+    portENTER_CRITICAL(&status_lock);
+    bool pending = status_broadcast || status_target_count > 0;
+    portEXIT_CRITICAL(&status_lock);
+    if (!pending)
+    {
+        return portMAX_DELAY;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t due = last_status_us + (int64_t)status_interval_ms * 1000;
+    if (now < due)
+    {
+        TickType_t wait = pdMS_TO_TICKS((due - now + 999) / 1000);
+        return wait > 0 ? wait : 1;
+    }
+
+    uint16_t targets[APP_TASK_STATUS_MAX_TARGETS];
+    portENTER_CRITICAL(&status_lock);
+    bool broadcast = status_broadcast;
+    size_t count = status_target_count;
+    memcpy(targets, status_targets, count * sizeof(targets[0]));
+    status_broadcast = false;
+    status_target_count = 0;
+    portEXIT_CRITICAL(&status_lock);
+
+    portENTER_CRITICAL(&stats_lock);
+    queue_stats.status_published++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    // A broadcast reaches the clients waiting for their own copy as well
+    if (broadcast)
+    {
+        command_handler_publish_status(APP_CMD_ORIGIN_INTERNAL);
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            command_handler_publish_status(targets[i]);
+        }
+    }
+    last_status_us = now;
+    return portMAX_DELAY;
+}
+
+static void run_command(app_cmd_buf_t *cmd)
+{
+    ESP_LOGI(TAG, "Dequeued command: %s", cmd->data);
+    int64_t start = esp_timer_get_time();
+    command_handler_process(cmd->data, cmd->len, cmd->origin);
+    app_task_cmd_release(cmd);
+
+    // Moving average of the execution time, used for retry-after hints
+    uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start);
+    portENTER_CRITICAL(&stats_lock);
+    queue_stats.avg_exec_us = queue_stats.avg_exec_us == 0
+                                  ? elapsed_us
+                                  : (queue_stats.avg_exec_us * 7 + elapsed_us) / 8;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
 // The main application task function
 static void app_task(void *pvParameters)
 {
@@ -31,10 +129,9 @@ static void app_task(void *pvParameters)
     ESP_LOGI(TAG, "Application task started.");
 
     // Perform initial actions based on stored preferences
-    if (nvs_storage_get_auto_connect() && nvs_storage_get_ssid()[0] != '\0')
+    if (nvs_storage_get_bool(CONFIG_AUTOCONNECT) && wifi_manager_connect_known() == ESP_OK)
     {
-        ESP_LOGI(TAG, "Auto-connecting to: %s", nvs_storage_get_ssid());
-        wifi_manager_connect(nvs_storage_get_ssid(), nvs_storage_get_password());
+        ESP_LOGI(TAG, "Auto-connecting to the best known network.");
     }
     else
     {
@@ -42,28 +139,48 @@ static void app_task(void *pvParameters)
         wifi_manager_start_scan();
     }
 
-    app_cmd_t received_cmd;
+    app_cmd_buf_t *received_cmd;
     while (1)
     {
-        // Wait indefinitely for a command to arrive in the queue
-        if (xQueueReceive(app_task_queue, &received_cmd, portMAX_DELAY) == pdPASS)
+        // A due status goes first, but at most once per interval, so a
+        // busy command queue can neither starve it nor be starved by it
+        TickType_t status_wait = publish_status_if_due();
+
+        if (atomic_exchange(&deferred_pending, false))
+        {
+            command_handler_finish_deferred();
+        }
+
+        if (xQueueReceive(app_task_queue, &received_cmd, 0) == pdPASS)
         {
-            ESP_LOGI(TAG, "Dequeued command: %s", received_cmd.cmd);
-            command_handler_process(received_cmd.cmd);
+            run_command(received_cmd);
+            continue;
         }
+
+        // Sleep until a command is submitted, a status or a completion is
+        // requested, or a pending status becomes due
+        ulTaskNotifyTake(pdTRUE, status_wait);
     }
 }
 
 esp_err_t app_task_start(void *init_done_sem)
 {
-    app_task_queue = xQueueCreate(APP_TASK_QUEUE_SIZE, sizeof(app_cmd_t));
-    if (app_task_queue == NULL)
+    app_task_queue = xQueueCreate(APP_TASK_QUEUE_SIZE, sizeof(app_cmd_buf_t *));
+    cmd_free_queue = xQueueCreate(APP_CMD_POOL_SIZE, sizeof(app_cmd_buf_t *));
+    if (app_task_queue == NULL || cmd_free_queue == NULL)
     {
         ESP_LOGE(TAG, "Failed to create application task queue.");
         return ESP_FAIL;
     }
 
-    BaseType_t result = xTaskCreate(app_task, "app_task", 4096, init_done_sem, 5, NULL);
+    for (int i = 0; i < APP_CMD_POOL_SIZE; i++)
+    {
+        app_cmd_buf_t *buf = &cmd_pool[i];
+        atomic_init(&buf->refs, 0);
+        xQueueSend(cmd_free_queue, &buf, 0);
+    }
+
+    BaseType_t result = xTaskCreate(app_task, "app_task", 4096, init_done_sem, 5, &app_task_handle);
     if (result != pdPASS)
     {
         ESP_LOGE(TAG, "Failed to create application task.");
@@ -73,7 +190,111 @@ esp_err_t app_task_start(void *init_done_sem)
     return ESP_OK;
 }
 
+app_cmd_buf_t *app_task_cmd_alloc(uint16_t origin)
+{
+    app_cmd_buf_t *buf;
+    if (cmd_free_queue == NULL || xQueueReceive(cmd_free_queue, &buf, 0) != pdPASS)
+    {
+        count_rejected();
+        return NULL;
+    }
+    atomic_store(&buf->refs, 1);
+    buf->len = 0;
+    buf->origin = origin;
+    return buf;
+}
+
+void app_task_cmd_ref(app_cmd_buf_t *buf)
+{
+    atomic_fetch_add(&buf->refs, 1);
+}
+
+void app_task_cmd_release(app_cmd_buf_t *buf)
+{
+    if (atomic_fetch_sub(&buf->refs, 1) == 1)
+    {
+        xQueueSend(cmd_free_queue, &buf, 0);
+    }
+}
+
+BaseType_t app_task_cmd_submit(app_cmd_buf_t *buf)
+{
+    // Never wait: producers include the NimBLE host task and the event loop
+    if (xQueueSend(app_task_queue, &buf, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Queue full, rejecting command '%s'", buf->data);
+        app_task_cmd_release(buf);
+        count_rejected();
+        return pdFAIL;
+    }
+
+    uint32_t depth = uxQueueMessagesWaiting(app_task_queue);
+    portENTER_CRITICAL(&stats_lock);
+    queue_stats.accepted++;
+    if (depth > queue_stats.high_water)
+    {
+        queue_stats.high_water = depth;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+    xTaskNotifyGive(app_task_handle);
+    return pdTRUE;
+}
+
+void app_task_request_status(uint16_t target)
+{
+    portENTER_CRITICAL(&stats_lock);
+    queue_stats.status_requests++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    portENTER_CRITICAL(&status_lock);
+    if (target == APP_CMD_ORIGIN_INTERNAL)
+    {
+        status_broadcast = true;
+    }
+    else if (!status_broadcast)
+    {
+        size_t i = 0;
+        while (i < status_target_count && status_targets[i] != target) i++;
+        if (i == status_target_count)
+        {
+            if (status_target_count < APP_TASK_STATUS_MAX_TARGETS)
+            {
+                status_targets[status_target_count++] = target;
+            }
+            else
+            {
+                status_broadcast = true;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&status_lock);
+
+    if (app_task_handle != NULL)
+    {
+        xTaskNotifyGive(app_task_handle);
+    }
+}
+
+void app_task_request_deferred(void)
+{
+    atomic_store(&deferred_pending, true);
+    if (app_task_handle != NULL)
+    {
+        xTaskNotifyGive(app_task_handle);
+    }
+}
+
+void app_task_set_status_interval(uint32_t interval_ms)
+{
+    status_interval_ms = interval_ms;
+}
+
 BaseType_t app_task_queue_post(const char *cmd)
+{
+    return app_task_queue_post_from(APP_CMD_ORIGIN_INTERNAL, cmd);
+}
+
+BaseType_t app_task_queue_post_from(uint16_t origin, const char *cmd)
 {
     if (app_task_queue == NULL)
     {
@@ -81,14 +302,37 @@ BaseType_t app_task_queue_post(const char *cmd)
         return pdFAIL;
     }
 
-    app_cmd_t cmd_to_queue;
-    strncpy(cmd_to_queue.cmd, cmd, APP_CMD_MAX_LEN - 1);
-    cmd_to_queue.cmd[APP_CMD_MAX_LEN - 1] = '\0';
-
-    if (xQueueSend(app_task_queue, &cmd_to_queue, pdMS_TO_TICKS(100)) != pdTRUE)
+    app_cmd_buf_t *buf = app_task_cmd_alloc(origin);
+    if (buf == NULL)
     {
-        ESP_LOGE(TAG, "Failed to queue command '%s', queue might be full.", cmd);
+        ESP_LOGW(TAG, "No free command buffers, rejecting command '%s'", cmd);
         return pdFAIL;
     }
-    return pdTRUE;
+
+    size_t len = strnlen(cmd, APP_CMD_MAX_LEN - 1);
+    memcpy(buf->data, cmd, len);
+    buf->data[len] = '\0';
+    buf->len = len;
+
+    return app_task_cmd_submit(buf);
+}
+
+void app_task_get_queue_stats(app_task_queue_stats_t *stats)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *stats = queue_stats;
+    portEXIT_CRITICAL(&stats_lock);
+    stats->depth = app_task_queue ? uxQueueMessagesWaiting(app_task_queue) : 0;
+}
+
+uint32_t app_task_retry_after_ms(void)
+{
+    app_task_queue_stats_t stats;
+    app_task_get_queue_stats(&stats);
+
+    // Time to work off the current backlog, with a sane floor and ceiling
+    uint32_t ms = (stats.depth * stats.avg_exec_us) / 1000;
+    if (ms < APP_TASK_RETRY_MIN_MS) ms = APP_TASK_RETRY_MIN_MS;
+    if (ms > APP_TASK_RETRY_MAX_MS) ms = APP_TASK_RETRY_MAX_MS;
+    return ms;
 }
@@ -11,21 +11,63 @@
 #define APP_TASK_H
 
 #include "app_includes.h"
+#include <stdatomic.h>
 
-// The maximum length of a command string that can be queued.
-#define APP_CMD_MAX_LEN 128
+// The maximum length of a command string that can be queued. Enough for a
+// config() call that sets every setting and a network at its longest; a
+// command longer than one write has to use the framed transport.
+#define APP_CMD_MAX_LEN 320
 
 // The maximum number of commands that can be held in the queue.
 #define APP_TASK_QUEUE_SIZE 10
 
+// The number of pooled command buffers. One more than the queue depth for the
+// command being executed, and one for a buffer being filled by a producer.
+#define APP_CMD_POOL_SIZE (APP_TASK_QUEUE_SIZE + 2)
+
+// Origin of commands raised inside the firmware; their responses are
+// broadcast to every subscribed client.
+#define APP_CMD_ORIGIN_INTERNAL 0xFFFF
+
+// Default minimum time between two coalesced status publications.
+#define APP_TASK_STATUS_INTERVAL_MS 500
+
+// Clients that can wait for a unicast status at once; more fall back to a broadcast.
+#define APP_TASK_STATUS_MAX_TARGETS 4
+
+// Bounds of the retry-after hint sent to clients when a command is rejected.
+#define APP_TASK_RETRY_MIN_MS 50
+#define APP_TASK_RETRY_MAX_MS 2000
+
 /**
- * @brief Structure for commands passed into the application task queue.
+ * @brief Admission statistics of the command queue.
  */
 typedef struct
 {
-    char cmd[APP_CMD_MAX_LEN];
-} app_cmd_t;
+    uint32_t depth;       // Commands currently waiting
+    uint32_t capacity;    // Maximum number of waiting commands
+    uint32_t high_water;  // Highest depth observed
+    uint32_t accepted;    // Commands admitted to the queue
+    uint32_t rejected;    // Commands rejected because the queue or pool was full
+    uint32_t avg_exec_us; // Moving average of the command execution time
+    uint32_t status_requests;  // Status publications requested by events
+    uint32_t status_published; // Status publications actually sent
+} app_task_queue_stats_t;
 
+/**
+ * @brief A pooled, reference-counted command buffer.
+ *
+ * Producers (e.g. the NimBLE host task) write the command text directly into
+ * a buffer obtained from app_task_cmd_alloc() and submit it; only the buffer
+ * handle crosses the queue. The command handler tokenizes the text in place.
+ */
+typedef struct
+{
+    char data[APP_CMD_MAX_LEN]; // Null-terminated command text
+    uint16_t len;               // Length of the command text
+    uint16_t origin;            // Connection that issued the command, or APP_CMD_ORIGIN_INTERNAL
+    atomic_uint refs;           // Owners of the buffer; returned to the pool at zero
+} app_cmd_buf_t;
 /**
  * @brief Starts the main application task.
  *
@@ -35,15 +77,112 @@ typedef struct
  */
 esp_err_t app_task_start(void *init_done_sem);
 
+/**
+ * @brief Takes a free command buffer from the pool.
+ *
+ * Never blocks, so it is safe to call from the NimBLE host task. A failed
+ * allocation is counted as a rejected command. The returned
+ * buffer holds one reference that is handed over by app_task_cmd_submit().
+ *
+ * @param origin The connection issuing the command, or APP_CMD_ORIGIN_INTERNAL.
+ * @return A command buffer, or NULL if the pool is exhausted.
+ */
+app_cmd_buf_t *app_task_cmd_alloc(uint16_t origin);
+
+/**
+ * @brief Queues a filled command buffer for execution.
+ *
+ * Ownership of the caller's reference passes to the application task. Never
+ * blocks: if the queue is full, the buffer is released, the rejection is
+ * counted and pdFAIL is returned so the caller can signal backpressure.
+ *
+ * @param buf The command buffer, with data and len filled in.
+ * @return pdTRUE if the command was queued, pdFAIL otherwise.
+ */
+BaseType_t app_task_cmd_submit(app_cmd_buf_t *buf);
+
+/**
+ * @brief Takes an additional reference on a command buffer.
+ *
+ * @param buf The command buffer.
+ */
+void app_task_cmd_ref(app_cmd_buf_t *buf);
+
+/**
+ * @brief Drops a reference on a command buffer, returning it to the pool
+ *        when the last reference is released.
+ *
+ * @param buf The command buffer.
+ */
+void app_task_cmd_release(app_cmd_buf_t *buf);
+
 /**
  * @brief Posts a command string to the application task queue.
  *
  * This is a thread-safe way to send a command to be processed by the main
- * application task.
+ * application task. The string is copied into a pooled command buffer.
+ * Responses are broadcast to every subscribed client.
  *
  * @param cmd The null-terminated command string to post.
  * @return pdTRUE if the command was successfully posted, pdFALSE otherwise.
  */
 BaseType_t app_task_queue_post(const char *cmd);
 
+/**
+ * @brief Posts a command string on behalf of a client.
+ *
+ * Like app_task_queue_post(), but responses are sent to the given client only.
+ *
+ * @param origin The connection handle of the client.
+ * @param cmd The null-terminated command string to post.
+ * @return pdTRUE if the command was successfully posted, pdFALSE otherwise.
+ */
+BaseType_t app_task_queue_post_from(uint16_t origin, const char *cmd);
+
+/**
+ * @brief Marks the device status dirty so that it gets published.
+ *
+ * Event handlers call this instead of posting "status()". Requests are
+ * coalesced: however many arrive, the application task builds and sends
+ * the status at most once per status interval, and never takes a slot of
+ * the command queue, so client commands are not crowded out. Never blocks.
+ *
+ * @param target The client that should receive the status, or
+ *               APP_CMD_ORIGIN_INTERNAL for every subscribed client.
+ */
+void app_task_request_status(uint16_t target);
+
+/**
+ * @brief Asks the application task to finish the deferred commands.
+ *
+ * Event handlers that learn the outcome of a slow operation record it and
+ * call this instead of answering the waiting clients themselves, since
+ * sending may block until there is room to transmit. The application task
+ * then calls command_handler_finish_deferred() before running the next
+ * queued command. Requests are coalesced and never fail. Never blocks.
+ */
+void app_task_request_deferred(void);
+
+/**
+ * @brief Sets the minimum time between two status publications.
+ *
+ * @param interval_ms The interval in milliseconds.
+ */
+void app_task_set_status_interval(uint32_t interval_ms);
+
+/**
+ * @brief Gets the admission statistics of the command queue.
+ *
+ * @param[out] stats The statistics.
+ */
+void app_task_get_queue_stats(app_task_queue_stats_t *stats);
+
+/**
+ * @brief Estimates how long a client should wait before retrying a rejected
+ *        command, based on the current backlog.
+ *
+ * @return The suggested delay in milliseconds.
+ */
+uint32_t app_task_retry_after_ms(void);
+
 #endif // APP_TASK_H
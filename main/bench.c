@@ -0,0 +1,713 @@
+/**
+ * @file bench.c
+ * @brief Implementation of the on-device micro-benchmarks.
+ */
+
+#include "bench.h"
+#include "app_includes.h"
+#include "esp_cpu.h"
+#include "command_handler.h"
+#include "app_task.h"
+#include "ble_manager.h"
+#include "cbor.h"
+#include "json_writer.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "BENCH";
+
+// Number of passes over all names per measurement
+#define BENCH_DISPATCH_REPEAT 10
+#define BENCH_DISPATCH_MAX_CMDS 200
+#define BENCH_DISPATCH_SLOTS 512
+#define BENCH_NAME_LEN 8
+
+#define BENCH_INGRESS_REPEAT 100
+
+// Command size of the former copy-based ingress path
+#define BENCH_LEGACY_CMD_LEN 128
+
+// Codec benchmark: passes per measurement and synthetic scan size
+#define BENCH_CODEC_REPEAT 20
+#define BENCH_CODEC_NETWORKS 10
+#define BENCH_CODEC_BUF_LEN 1024
+
+// JSON writer benchmark: passes per measurement and staging buffer of the
+// streaming variant
+#define BENCH_JSON_REPEAT 20
+#define BENCH_JSON_CHUNK_LEN 64
+
+// Escape benchmark: passes per measurement and output buffer
+#define BENCH_ESCAPE_REPEAT 20
+#define BENCH_ESCAPE_BUF_LEN 2048
+
+// Notify benchmark: default and maximum payload, message size, and how long
+// to wait for the client to drain before giving up
+#define BENCH_NOTIFY_DEFAULT_BYTES 16384
+#define BENCH_NOTIFY_MAX_BYTES (256 * 1024)
+#define BENCH_NOTIFY_MSG_LEN 512
+#define BENCH_NOTIFY_TIMEOUT_MS 30000
+
+// Representative command used for the ingress benchmark
+static const char bench_ingress_cmd[] = "connect(\"office-network-5g\",\"correct horse battery\")";
+
+// Queue item of the former copy-based ingress path
+typedef struct
+{
+    char cmd[BENCH_LEGACY_CMD_LEN];
+} bench_legacy_cmd_t;
+
+// Strings escaped by the escape benchmark, typical of what goes into responses
+static const struct
+{
+    const char *name;
+    const char *text;
+} bench_escape_corpus[] = {
+    {"ssid", "office-network-5g"},
+    {"log", "I (12345) WIFI_MANAGER: Connecting to SSID: office-network-5g, "
+            "auth mode WPA2-PSK, channel 11, rssi -61 dBm, retry 0 of 5, "
+            "bssid 24:0a:c4:12:34:56, listen interval 3, power save min modem"},
+    {"quoted", "{\"cmd\":\"connect\",\"args\":[\"C:\\\\net\\\\cfg\",\"a\\tb\"]}\r\n"},
+    {"utf8", "Caf\xc3\xa9 \xe2\x80\x94 Stra\xc3\x9f""e 12, M\xc3\xbcnchen \xe2\x82\xac \xf0\x9f\x93\xb6 guest-wifi"},
+};
+
+// Per-byte escaper that json_escape() replaced, kept as the baseline
+static void bench_escape_legacy(const char *str, char *out, size_t out_size)
+{
+    size_t j = 0;
+    for (size_t i = 0; str[i] && j < out_size - 6; i++)
+    {
+        char c = str[i];
+        switch (c)
+        {
+        case '"': out[j++] = '\\'; out[j++] = '"'; break;
+        case '\\': out[j++] = '\\'; out[j++] = '\\'; break;
+        case '\b': out[j++] = '\\'; out[j++] = 'b'; break;
+        case '\f': out[j++] = '\\'; out[j++] = 'f'; break;
+        case '\n': out[j++] = '\\'; out[j++] = 'n'; break;
+        case '\r': out[j++] = '\\'; out[j++] = 'r'; break;
+        case '\t': out[j++] = '\\'; out[j++] = 't'; break;
+        default:
+            if (c < 32)
+            {
+                j += snprintf(&out[j], out_size - j, "\\u%04x", (unsigned int)c);
+            }
+            else
+            {
+                out[j++] = c;
+            }
+        }
+    }
+    out[j < out_size ? j : out_size - 1] = '\0';
+}
+
+static void bench_nop(const command_args_t *args)
+{
+}
+
+/**
+ * @brief Compares registry lookup against the former strcmp chain.
+ *
+ * For 10, 50 and 200 synthetic commands, every name is looked up once per
+ * pass, both by walking the names in order (what the if/else chain did) and
+ * through the registry hash index. Reports the average cycles per lookup.
+ */
+static void bench_dispatch(void)
+{
+    static const size_t sizes[] = {10, 50, 200};
+
+    char (*names)[BENCH_NAME_LEN] = malloc(BENCH_DISPATCH_MAX_CMDS * BENCH_NAME_LEN);
+    command_desc_t *descs = calloc(BENCH_DISPATCH_MAX_CMDS, sizeof(command_desc_t));
+    command_slot_t *slots = malloc(BENCH_DISPATCH_SLOTS * sizeof(command_slot_t));
+    if (!names || !descs || !slots)
+    {
+        free(names);
+        free(descs);
+        free(slots);
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+
+    for (size_t i = 0; i < BENCH_DISPATCH_MAX_CMDS; i++)
+    {
+        snprintf(names[i], BENCH_NAME_LEN, "cmd%03u", (unsigned)i);
+        descs[i].id = (uint16_t)i;
+        descs[i].name = names[i];
+        descs[i].args = "";
+        descs[i].usage = names[i];
+        descs[i].fn = bench_nop;
+    }
+
+    char resp[256];
+    size_t offset = snprintf(resp, sizeof(resp), "{\"bench\":\"dispatch\",\"results\":[");
+    volatile uintptr_t sink = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t n = sizes[s];
+        command_registry_t reg;
+        command_registry_init(&reg, slots, BENCH_DISPATCH_SLOTS);
+        command_registry_add_table(&reg, descs, n);
+
+        uint32_t start = esp_cpu_get_cycle_count();
+        for (int r = 0; r < BENCH_DISPATCH_REPEAT; r++)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                size_t j = 0;
+                while (j < n && strcmp(names[j], names[i]) != 0) j++;
+                sink += j;
+            }
+        }
+        uint32_t chain_cycles = esp_cpu_get_cycle_count() - start;
+
+        start = esp_cpu_get_cycle_count();
+        for (int r = 0; r < BENCH_DISPATCH_REPEAT; r++)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                sink += (uintptr_t)command_registry_find(&reg, names[i], BENCH_NAME_LEN - 2);
+            }
+        }
+        uint32_t hash_cycles = esp_cpu_get_cycle_count() - start;
+
+        uint32_t lookups = n * BENCH_DISPATCH_REPEAT;
+        offset += snprintf(resp + offset, sizeof(resp) - offset,
+                           "%s{\"n\":%u,\"chain_cycles\":%lu,\"registry_cycles\":%lu}",
+                           s > 0 ? "," : "", (unsigned)n,
+                           (unsigned long)(chain_cycles / lookups), (unsigned long)(hash_cycles / lookups));
+    }
+    snprintf(resp + offset, sizeof(resp) - offset, "]}");
+
+    free(names);
+    free(descs);
+    free(slots);
+
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+/**
+ * @brief Compares the copy-based command ingress path with the pooled one.
+ *
+ * The legacy path flattens the payload into a stack buffer, copies it into a
+ * 128-byte queue item, lets the queue copy the item in and out, and copies it
+ * once more before parsing. The pooled path writes the payload into a pooled
+ * buffer once and only passes the pointer through a queue. Both variants run
+ * on private queues and split the command name from its arguments, so only
+ * the ingress overhead differs.
+ */
+static void bench_ingress(void)
+{
+    QueueHandle_t legacy_queue = xQueueCreate(1, sizeof(bench_legacy_cmd_t));
+    QueueHandle_t pooled_queue = xQueueCreate(1, sizeof(app_cmd_buf_t *));
+    bench_legacy_cmd_t *items = malloc(2 * sizeof(bench_legacy_cmd_t));
+    if (!legacy_queue || !pooled_queue || !items)
+    {
+        if (legacy_queue) vQueueDelete(legacy_queue);
+        if (pooled_queue) vQueueDelete(pooled_queue);
+        free(items);
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+
+    size_t len = sizeof(bench_ingress_cmd) - 1;
+    volatile uintptr_t sink = 0;
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_INGRESS_REPEAT; r++)
+    {
+        char flat[BENCH_LEGACY_CMD_LEN];
+        memcpy(flat, bench_ingress_cmd, len);
+        flat[len] = '\0';
+        strncpy(items[0].cmd, flat, BENCH_LEGACY_CMD_LEN - 1);
+        items[0].cmd[BENCH_LEGACY_CMD_LEN - 1] = '\0';
+        xQueueSend(legacy_queue, &items[0], 0);
+        xQueueReceive(legacy_queue, &items[1], 0);
+        char buf[BENCH_LEGACY_CMD_LEN];
+        strncpy(buf, items[1].cmd, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+        sink += (uintptr_t)strchr(buf, '(');
+    }
+    uint32_t legacy_cycles = esp_cpu_get_cycle_count() - start;
+
+    int pooled_runs = 0;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_INGRESS_REPEAT; r++)
+    {
+        app_cmd_buf_t *cmd = app_task_cmd_alloc(APP_CMD_ORIGIN_INTERNAL);
+        if (cmd == NULL)
+        {
+            break;
+        }
+        memcpy(cmd->data, bench_ingress_cmd, len);
+        cmd->data[len] = '\0';
+        cmd->len = len;
+        xQueueSend(pooled_queue, &cmd, 0);
+        app_cmd_buf_t *received;
+        xQueueReceive(pooled_queue, &received, 0);
+        sink += (uintptr_t)memchr(received->data, '(', received->len);
+        app_task_cmd_release(received);
+        pooled_runs++;
+    }
+    uint32_t pooled_cycles = esp_cpu_get_cycle_count() - start;
+
+    vQueueDelete(legacy_queue);
+    vQueueDelete(pooled_queue);
+    free(items);
+
+    char resp[128];
+    snprintf(resp, sizeof(resp), "{\"bench\":\"ingress\",\"bytes\":%u,\"copy_cycles\":%lu,\"pooled_cycles\":%lu}",
+             (unsigned)len, (unsigned long)(legacy_cycles / BENCH_INGRESS_REPEAT),
+             (unsigned long)(pooled_runs > 0 ? pooled_cycles / pooled_runs : 0));
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+/**
+ * @brief Measures notification throughput to the calling client.
+ *
+ * Streams filler messages of BENCH_NOTIFY_MSG_LEN bytes through the TX ring
+ * to the client that issued the command and times how long it takes until
+ * all of them left the device. Running it after each blelink() profile shows
+ * what the negotiated link parameters are worth in practice. The filler
+ * messages are {"fill":"..."} objects so clients can simply ignore them.
+ */
+static void bench_notify(int32_t bytes)
+{
+    uint16_t conn_handle = command_handler_origin();
+    ble_session_t session;
+    if (conn_handle == BLE_MANAGER_BROADCAST || !ble_manager_get_session(conn_handle, &session))
+    {
+        command_handler_reply("{\"error\":\"bench(\\\"notify\\\") needs a BLE client\"}");
+        return;
+    }
+    if (bytes <= 0) bytes = BENCH_NOTIFY_DEFAULT_BYTES;
+    if (bytes > BENCH_NOTIFY_MAX_BYTES) bytes = BENCH_NOTIFY_MAX_BYTES;
+
+    char *msg = malloc(BENCH_NOTIFY_MSG_LEN);
+    if (msg == NULL)
+    {
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+    memset(msg, '.', BENCH_NOTIFY_MSG_LEN);
+    memcpy(msg, "{\"fill\":\"", 9);
+    memcpy(msg + BENCH_NOTIFY_MSG_LEN - 2, "\"}", 2);
+
+    ble_tx_stats_t before;
+    ble_manager_get_tx_stats(&before);
+
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)BENCH_NOTIFY_TIMEOUT_MS * 1000;
+    int32_t queued = 0;
+    bool connected = true;
+
+    while (connected && esp_timer_get_time() < deadline)
+    {
+        connected = ble_manager_get_session(conn_handle, &session);
+        if (queued >= bytes && session.tx_pending == 0)
+        {
+            break;
+        }
+        // Keep the ring about half full: enough to never starve the sender,
+        // without crowding out other clients' responses
+        if (queued < bytes && session.tx_pending + BENCH_NOTIFY_MSG_LEN <= BLE_TX_RING_SIZE / 2 &&
+            ble_tx_send(conn_handle, msg, BENCH_NOTIFY_MSG_LEN, pdMS_TO_TICKS(100)))
+        {
+            queued += BENCH_NOTIFY_MSG_LEN;
+            continue;
+        }
+        // Waiting for our messages to leave, or for room: the ring is shared,
+        // and other clients' messages may fill it. A refused send fails at
+        // once, so retrying without a delay would spin on this task
+        vTaskDelay(1);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    free(msg);
+
+    ble_tx_stats_t after;
+    ble_manager_get_tx_stats(&after);
+
+    char link[160];
+    ble_manager_format_link(&session, link, sizeof(link));
+
+    char resp[320];
+    snprintf(resp, sizeof(resp),
+             "{\"bench\":\"notify\",\"bytes\":%ld,\"ms\":%lu,\"bytes_per_sec\":%lu,\"notifications\":%lu,"
+             "\"stalls\":%lu,\"dropped\":%lu,\"complete\":%s,\"link\":%s}",
+             (long)queued, (unsigned long)(elapsed_us / 1000),
+             (unsigned long)(elapsed_us > 0 ? (int64_t)queued * 1000000 / elapsed_us : 0),
+             (unsigned long)(after.notifications - before.notifications),
+             (unsigned long)(after.stalls - before.stalls),
+             (unsigned long)(after.dropped_msgs - before.dropped_msgs),
+             (connected && queued >= bytes && session.tx_pending == 0) ? "true" : "false", link);
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+/**
+ * @brief Builds a scan result like the Wi-Fi manager does, as JSON text.
+ */
+static size_t bench_scan_json(char *out, size_t size)
+{
+    size_t offset = snprintf(out, size, "{\"available_networks\":[");
+    for (int i = 0; i < BENCH_CODEC_NETWORKS && offset < size - 128; i++)
+    {
+        char ssid[33];
+        char ssid_escaped[65];
+        snprintf(ssid, sizeof(ssid), "bench-network-%02d", i);
+        json_escape(ssid, ssid_escaped, sizeof(ssid_escaped));
+        offset += snprintf(out + offset, size - offset, "%s{\"ssid\":\"%s\",\"rssi\":%d,\"encryption\":%d}",
+                           i > 0 ? "," : "", ssid_escaped, -40 - 3 * i, i % 3 != 0);
+    }
+    offset += snprintf(out + offset, size - offset, "]}");
+    return offset;
+}
+
+/**
+ * @brief Builds the same scan result directly as CBOR, without going
+ *        through JSON.
+ */
+static size_t bench_scan_cbor(uint8_t *out, size_t size)
+{
+    cbor_writer_t w;
+    cbor_writer_init(&w, out, size);
+    cbor_put_map(&w, 1);
+    cbor_put_uint(&w, cbor_key_id("available_networks", 18));
+    cbor_put_array(&w, BENCH_CODEC_NETWORKS);
+    for (int i = 0; i < BENCH_CODEC_NETWORKS; i++)
+    {
+        char ssid[33];
+        int len = snprintf(ssid, sizeof(ssid), "bench-network-%02d", i);
+        cbor_put_map(&w, 3);
+        cbor_put_uint(&w, cbor_key_id("ssid", 4));
+        cbor_put_text(&w, ssid, len);
+        cbor_put_uint(&w, cbor_key_id("rssi", 4));
+        cbor_put_int(&w, -40 - 3 * i);
+        cbor_put_uint(&w, cbor_key_id("encryption", 10));
+        cbor_put_int(&w, i % 3 != 0);
+    }
+    return w.overflow ? 0 : w.len;
+}
+
+/**
+ * @brief Builds the same scan result with the JSON writer.
+ */
+static size_t bench_scan_writer(json_writer_t *w)
+{
+    json_begin_object(w);
+    json_put_key(w, "available_networks");
+    json_begin_array(w);
+    for (int i = 0; i < BENCH_CODEC_NETWORKS; i++)
+    {
+        char ssid[33];
+        snprintf(ssid, sizeof(ssid), "bench-network-%02d", i);
+        json_begin_object(w);
+        json_put_key_string(w, "ssid", ssid);
+        json_put_key_int(w, "rssi", -40 - 3 * i);
+        json_put_key_int(w, "encryption", i % 3 != 0);
+        json_end_object(w);
+    }
+    json_end_array(w);
+    json_end_object(w);
+    return json_writer_finish(w);
+}
+
+// Stands in for the TX ring: takes every chunk and only counts it
+static bool bench_count_sink(void *ctx, const char *data, size_t len)
+{
+    *(volatile size_t *)ctx += len;
+    return true;
+}
+
+/**
+ * @brief Compares the JSON writer with the former snprintf path.
+ *
+ * Builds a 10-network scan result three ways: with snprintf and
+ * json_escape into temporary buffers, with the writer into a flat buffer,
+ * and with the writer streaming through a 64-byte staging buffer into a
+ * sink, as it would into the TX ring. Reports bytes and average cycles.
+ */
+static void bench_json(void)
+{
+    char *json = malloc(BENCH_CODEC_BUF_LEN);
+    if (!json)
+    {
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+
+    size_t snprintf_len = 0, writer_len = 0, stream_len = 0;
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_JSON_REPEAT; r++)
+    {
+        snprintf_len = bench_scan_json(json, BENCH_CODEC_BUF_LEN);
+    }
+    uint32_t snprintf_cycles = esp_cpu_get_cycle_count() - start;
+
+    json_writer_t w;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_JSON_REPEAT; r++)
+    {
+        json_writer_init(&w, json, BENCH_CODEC_BUF_LEN);
+        writer_len = bench_scan_writer(&w);
+    }
+    uint32_t writer_cycles = esp_cpu_get_cycle_count() - start;
+
+    char chunk[BENCH_JSON_CHUNK_LEN];
+    volatile size_t sunk = 0;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_JSON_REPEAT; r++)
+    {
+        json_writer_init_sink(&w, chunk, sizeof(chunk), bench_count_sink, (void *)&sunk);
+        stream_len = bench_scan_writer(&w);
+    }
+    uint32_t stream_cycles = esp_cpu_get_cycle_count() - start;
+
+    free(json);
+
+    char resp[256];
+    snprintf(resp, sizeof(resp),
+             "{\"bench\":\"json\",\"snprintf\":{\"bytes\":%u,\"cycles\":%lu},"
+             "\"writer\":{\"bytes\":%u,\"cycles\":%lu},\"stream\":{\"bytes\":%u,\"cycles\":%lu}}",
+             (unsigned)snprintf_len, (unsigned long)(snprintf_cycles / BENCH_JSON_REPEAT),
+             (unsigned)writer_len, (unsigned long)(writer_cycles / BENCH_JSON_REPEAT),
+             (unsigned)stream_len, (unsigned long)(stream_cycles / BENCH_JSON_REPEAT));
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+/**
+ * @brief Compares json_escape() with the former per-byte escaper.
+ *
+ * Escapes every corpus string, and each of them repeated to fill half the
+ * output buffer (like a log dump or a scan result), with both escapers.
+ * Reports input bytes and average cycles per string.
+ */
+static void bench_escape(void)
+{
+    char *in = malloc(BENCH_ESCAPE_BUF_LEN / 2);
+    char *out = malloc(BENCH_ESCAPE_BUF_LEN);
+    if (!in || !out)
+    {
+        free(in);
+        free(out);
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+
+    static char resp[768];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key_string(&w, "bench", "escape");
+    json_put_key(&w, "results");
+    json_begin_array(&w);
+
+    volatile size_t sink = 0;
+    for (size_t c = 0; c < sizeof(bench_escape_corpus) / sizeof(bench_escape_corpus[0]); c++)
+    {
+        for (int large = 0; large < 2; large++)
+        {
+            const char *text = bench_escape_corpus[c].text;
+            size_t len = strlen(text);
+            if (large)
+            {
+                size_t n = 0;
+                while (n + len < BENCH_ESCAPE_BUF_LEN / 2)
+                {
+                    memcpy(in + n, text, len);
+                    n += len;
+                }
+                in[n] = '\0';
+                text = in;
+                len = n;
+            }
+
+            uint32_t start = esp_cpu_get_cycle_count();
+            for (int r = 0; r < BENCH_ESCAPE_REPEAT; r++)
+            {
+                bench_escape_legacy(text, out, BENCH_ESCAPE_BUF_LEN);
+                sink += out[0];
+            }
+            uint32_t legacy_cycles = esp_cpu_get_cycle_count() - start;
+
+            start = esp_cpu_get_cycle_count();
+            for (int r = 0; r < BENCH_ESCAPE_REPEAT; r++)
+            {
+                sink += json_escape(text, out, BENCH_ESCAPE_BUF_LEN);
+            }
+            uint32_t swar_cycles = esp_cpu_get_cycle_count() - start;
+
+            json_begin_object(&w);
+            json_put_key_string(&w, "text", bench_escape_corpus[c].name);
+            json_put_key_int(&w, "bytes", len);
+            json_put_key_int(&w, "legacy_cycles", legacy_cycles / BENCH_ESCAPE_REPEAT);
+            json_put_key_int(&w, "swar_cycles", swar_cycles / BENCH_ESCAPE_REPEAT);
+            json_end_object(&w);
+        }
+    }
+    json_end_array(&w);
+    json_end_object(&w);
+
+    free(in);
+    free(out);
+
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+/**
+ * @brief Compares the text and binary encodings.
+ *
+ * For status() and a 10-network scan result it reports the size of the JSON
+ * and CBOR documents, the cycles to build the JSON and the extra cycles to
+ * transcode it to CBOR. For the scan result it also reports encoding
+ * straight to CBOR. Finally it compares parsing connect() in both forms.
+ */
+static void bench_codec(void)
+{
+    char *json = malloc(BENCH_CODEC_BUF_LEN);
+    uint8_t *cbor = malloc(BENCH_CODEC_BUF_LEN);
+    if (!json || !cbor)
+    {
+        free(json);
+        free(cbor);
+        command_handler_reply("{\"error\":\"no memory\"}");
+        return;
+    }
+
+    // status()
+    size_t status_json_len = 0, status_cbor_len = 0;
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        status_json_len = command_handler_build_status(json, BENCH_CODEC_BUF_LEN);
+    }
+    uint32_t status_json_cycles = esp_cpu_get_cycle_count() - start;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        status_cbor_len = cbor_from_json(json, cbor, BENCH_CODEC_BUF_LEN, NULL);
+    }
+    uint32_t status_transcode_cycles = esp_cpu_get_cycle_count() - start;
+
+    // Scan results
+    size_t scan_json_len = 0, scan_cbor_len = 0, scan_direct_len = 0;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        scan_json_len = bench_scan_json(json, BENCH_CODEC_BUF_LEN);
+    }
+    uint32_t scan_json_cycles = esp_cpu_get_cycle_count() - start;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        scan_cbor_len = cbor_from_json(json, cbor, BENCH_CODEC_BUF_LEN, NULL);
+    }
+    uint32_t scan_transcode_cycles = esp_cpu_get_cycle_count() - start;
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        scan_direct_len = bench_scan_cbor(cbor, BENCH_CODEC_BUF_LEN);
+    }
+    uint32_t scan_direct_cycles = esp_cpu_get_cycle_count() - start;
+
+    // Request parsing; both forms are tokenized in place, so parse copies
+    const command_desc_t *desc;
+    command_args_t args;
+    uint32_t rid;
+    static char text_req[APP_CMD_MAX_LEN];
+    static uint8_t cbor_req[APP_CMD_MAX_LEN];
+    cbor_writer_t w;
+    cbor_writer_init(&w, cbor_req, sizeof(cbor_req));
+    cbor_put_array(&w, 3);
+    cbor_put_text(&w, "connect", 7);
+    cbor_put_text(&w, "office-network-5g", 17);
+    cbor_put_text(&w, "correct horse battery", 21);
+    size_t text_len = sizeof(bench_ingress_cmd) - 1;
+
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        memcpy(text_req, bench_ingress_cmd, text_len + 1);
+        command_handler_parse(text_req, text_len, &desc, &args, &rid);
+    }
+    uint32_t parse_text_cycles = esp_cpu_get_cycle_count() - start;
+    static uint8_t scratch[APP_CMD_MAX_LEN];
+    start = esp_cpu_get_cycle_count();
+    for (int r = 0; r < BENCH_CODEC_REPEAT; r++)
+    {
+        memcpy(scratch, cbor_req, w.len);
+        command_handler_parse((char *)scratch, w.len, &desc, &args, &rid);
+    }
+    uint32_t parse_cbor_cycles = esp_cpu_get_cycle_count() - start;
+
+    free(json);
+    free(cbor);
+
+    char resp[384];
+    snprintf(resp, sizeof(resp),
+             "{\"bench\":\"codec\","
+             "\"status\":{\"json_bytes\":%u,\"cbor_bytes\":%u,\"json_cycles\":%lu,\"transcode_cycles\":%lu},"
+             "\"scan\":{\"json_bytes\":%u,\"cbor_bytes\":%u,\"direct_bytes\":%u,\"json_cycles\":%lu,"
+             "\"transcode_cycles\":%lu,\"direct_cycles\":%lu},"
+             "\"parse\":{\"text_bytes\":%u,\"cbor_bytes\":%u,\"text_cycles\":%lu,\"cbor_cycles\":%lu}}",
+             (unsigned)status_json_len, (unsigned)status_cbor_len,
+             (unsigned long)(status_json_cycles / BENCH_CODEC_REPEAT),
+             (unsigned long)(status_transcode_cycles / BENCH_CODEC_REPEAT),
+             (unsigned)scan_json_len, (unsigned)scan_cbor_len, (unsigned)scan_direct_len,
+             (unsigned long)(scan_json_cycles / BENCH_CODEC_REPEAT),
+             (unsigned long)(scan_transcode_cycles / BENCH_CODEC_REPEAT),
+             (unsigned long)(scan_direct_cycles / BENCH_CODEC_REPEAT),
+             (unsigned)text_len, (unsigned)w.len,
+             (unsigned long)(parse_text_cycles / BENCH_CODEC_REPEAT),
+             (unsigned long)(parse_cbor_cycles / BENCH_CODEC_REPEAT));
+    ESP_LOGI(TAG, "%s", resp);
+    command_handler_reply(resp);
+}
+
+static void cmd_bench(const command_args_t *args)
+{
+    const char *name = args->argv[0].str;
+
+    if (strcmp(name, "dispatch") == 0)
+    {
+        bench_dispatch();
+    }
+    else if (strcmp(name, "ingress") == 0)
+    {
+        bench_ingress();
+    }
+    else if (strcmp(name, "codec") == 0)
+    {
+        bench_codec();
+    }
+    else if (strcmp(name, "json") == 0)
+    {
+        bench_json();
+    }
+    else if (strcmp(name, "escape") == 0)
+    {
+        bench_escape();
+    }
+    else if (strcmp(name, "notify") == 0)
+    {
+        bench_notify(args->argc > 1 ? args->argv[1].num : 0);
+    }
+    else
+    {
+        command_handler_reply("{\"error\":\"usage: bench(\\\"dispatch|ingress|codec|json|escape|notify\\\",bytes)\"}");
+    }
+}
+
+static const command_desc_t bench_commands[] = {
+    {COMMAND_ID_BENCH, "bench", "s|i", "bench(\"dispatch|ingress|codec|json|escape|notify\",bytes)", cmd_bench},
+};
+
+esp_err_t bench_init(void)
+{
+    return command_handler_register(bench_commands, sizeof(bench_commands) / sizeof(bench_commands[0]));
+}
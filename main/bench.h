@@ -0,0 +1,22 @@
+/**
+ * @file bench.h
+ * @brief On-device micro-benchmarks for the hot paths of the firmware.
+ *
+ * The benchmarks are exposed as the bench("name") command and report their
+ * results as JSON over BLE. They measure CPU cycles with the CCOUNT register,
+ * so the numbers are directly comparable between firmware builds.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "esp_err.h"
+
+/**
+ * @brief Registers the bench command with the command handler.
+ *
+ * @return ESP_OK on success, or an error code on failure.
+ */
+esp_err_t bench_init(void);
+
+#endif // BENCH_H
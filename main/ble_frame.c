@@ -0,0 +1,102 @@
+/**
+ * @file ble_frame.c
+ * @brief Implementation of the BLE message framing.
+ */
+
+#include "ble_frame.h"
+
+static const char *TAG = "BLE_FRAME";
+
+void ble_frame_encode(const ble_frame_hdr_t *hdr, uint8_t *out)
+{
+    out[0] = hdr->flags;
+    out[1] = hdr->msg_id;
+    out[2] = hdr->seq & 0xFF;
+    out[3] = hdr->seq >> 8;
+    out[4] = hdr->len & 0xFF;
+    out[5] = hdr->len >> 8;
+}
+
+bool ble_frame_is_framed(const struct os_mbuf *om)
+{
+    uint8_t first;
+    return os_mbuf_copydata(om, 0, 1, &first) == 0 && first < BLE_FRAME_MARKER_LIMIT;
+}
+
+void ble_frame_rx_reset(ble_frame_rx_t *rx)
+{
+    if (rx->buf != NULL)
+    {
+        app_task_cmd_release(rx->buf);
+        rx->buf = NULL;
+    }
+    rx->next_seq = 0;
+}
+
+ble_frame_rx_result_t ble_frame_rx_feed(ble_frame_rx_t *rx, const struct os_mbuf *om, app_cmd_buf_t **done)
+{
+    uint16_t om_len = OS_MBUF_PKTLEN(om);
+    uint8_t raw[BLE_FRAME_HDR_LEN];
+    if (om_len < BLE_FRAME_HDR_LEN || os_mbuf_copydata(om, 0, BLE_FRAME_HDR_LEN, raw) != 0)
+    {
+        ble_frame_rx_reset(rx);
+        return BLE_FRAME_RX_ERROR;
+    }
+
+    ble_frame_hdr_t hdr = {
+        .flags = raw[0],
+        .msg_id = raw[1],
+        .seq = raw[2] | (raw[3] << 8),
+        .len = raw[4] | (raw[5] << 8),
+    };
+    uint16_t frag_len = om_len - BLE_FRAME_HDR_LEN;
+
+    if (hdr.flags & BLE_FRAME_FLAG_FIRST)
+    {
+        // A new message implicitly abandons an unfinished one
+        ble_frame_rx_reset(rx);
+        if (hdr.seq != 0 || hdr.len == 0 || hdr.len >= APP_CMD_MAX_LEN)
+        {
+            return BLE_FRAME_RX_ERROR;
+        }
+        rx->buf = app_task_cmd_alloc(rx->conn_handle);
+        if (rx->buf == NULL)
+        {
+            return BLE_FRAME_RX_NOMEM;
+        }
+        rx->buf->len = 0;
+        rx->msg_id = hdr.msg_id;
+    }
+    else if (rx->buf == NULL || hdr.msg_id != rx->msg_id || hdr.seq != rx->next_seq)
+    {
+        ESP_LOGW(TAG, "Unexpected fragment %u of message %u from %u", hdr.seq, hdr.msg_id, rx->conn_handle);
+        ble_frame_rx_reset(rx);
+        return BLE_FRAME_RX_ERROR;
+    }
+
+    app_cmd_buf_t *buf = rx->buf;
+    if (buf->len + frag_len > hdr.len || hdr.len >= APP_CMD_MAX_LEN)
+    {
+        ble_frame_rx_reset(rx);
+        return BLE_FRAME_RX_ERROR;
+    }
+    os_mbuf_copydata(om, BLE_FRAME_HDR_LEN, frag_len, buf->data + buf->len);
+    buf->len += frag_len;
+    rx->next_seq = hdr.seq + 1;
+
+    if (!(hdr.flags & BLE_FRAME_FLAG_LAST))
+    {
+        return BLE_FRAME_RX_MORE;
+    }
+    if (buf->len != hdr.len)
+    {
+        ble_frame_rx_reset(rx);
+        return BLE_FRAME_RX_ERROR;
+    }
+
+    buf->data[buf->len] = '\0';
+    *done = buf;
+    rx->buf = NULL;
+    rx->next_seq = 0;
+    return BLE_FRAME_RX_DONE;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file ble_frame.h
+ * @brief Framing of messages carried over the TX and RX characteristics.
+ *
+ * In framed mode every notification (TX) and every write (RX) starts with a
+ * small header that tells the peer which message the fragment belongs to,
+ * where it goes and whether it is the first and/or last one:
+ *
+ *     byte 0     flags    BLE_FRAME_FLAG_FIRST | BLE_FRAME_FLAG_LAST
+ *     byte 1     msg_id   Identifies the message, wraps around at 255
+ *     bytes 2-3  seq      Fragment index within the message, little endian
+ *     bytes 4-5  len      Total message length, little endian
+ *
+ * The payload follows directly. The first byte of a frame is always below
+ * 0x20, which never starts a text command or JSON response, so raw and
+ * framed writes can be told apart without any state.
+ *
+ * A client switches its notifications to framed mode with hello("framed");
+ * clients that never send it keep the raw mode.
+ */
+
+#ifndef BLE_FRAME_H
+#define BLE_FRAME_H
+
+#include "app_task.h"
+#include "host/ble_hs.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Size of the frame header in bytes.
+#define BLE_FRAME_HDR_LEN 6
+
+// Fragment flags.
+#define BLE_FRAME_FLAG_FIRST 0x01
+#define BLE_FRAME_FLAG_LAST 0x02
+
+// Any leading byte below this value marks a framed write.
+#define BLE_FRAME_MARKER_LIMIT 0x20
+
+/**
+ * @brief A decoded frame header.
+ */
+typedef struct
+{
+    uint8_t flags;
+    uint8_t msg_id;
+    uint16_t seq;
+    uint16_t len; // Total length of the message, not of the fragment
+} ble_frame_hdr_t;
+
+/**
+ * @brief Reassembly state of the framed writes of one client.
+ */
+typedef struct
+{
+    uint16_t conn_handle;
+    uint8_t msg_id;
+    uint16_t next_seq;
+    app_cmd_buf_t *buf; // Command being reassembled, or NULL
+} ble_frame_rx_t;
+
+/**
+ * @brief Outcome of feeding a write to the reassembler.
+ */
+typedef enum
+{
+    BLE_FRAME_RX_MORE,  // Fragment accepted, more are expected
+    BLE_FRAME_RX_DONE,  // The command is complete
+    BLE_FRAME_RX_NOMEM, // No free command buffer, the message was dropped
+    BLE_FRAME_RX_ERROR, // Malformed or out-of-order fragment, the message was dropped
+} ble_frame_rx_result_t;
+
+/**
+ * @brief Serializes a frame header.
+ *
+ * @param hdr The header.
+ * @param[out] out Receives BLE_FRAME_HDR_LEN bytes.
+ */
+void ble_frame_encode(const ble_frame_hdr_t *hdr, uint8_t *out);
+
+/**
+ * @brief Checks whether a write carries a frame header.
+ */
+bool ble_frame_is_framed(const struct os_mbuf *om);
+
+/**
+ * @brief Feeds one framed write to a client's reassembler.
+ *
+ * The fragment payload is copied out of the mbuf chain straight into the
+ * pooled command buffer. When the last fragment arrives, ownership of that
+ * buffer passes to the caller through @p done.
+ *
+ * @param rx The client's reassembly state.
+ * @param om The write, including the frame header.
+ * @param[out] done The completed command on BLE_FRAME_RX_DONE.
+ * @return The outcome, see ble_frame_rx_result_t.
+ */
+ble_frame_rx_result_t ble_frame_rx_feed(ble_frame_rx_t *rx, const struct os_mbuf *om, app_cmd_buf_t **done);
+
+/**
+ * @brief Drops any partially reassembled message.
+ */
+void ble_frame_rx_reset(ble_frame_rx_t *rx);
+
+#endif // BLE_FRAME_H
@@ -7,6 +7,12 @@
 #include "esp_log.h"
 #include "nvs_storage.h" // For getting the device name
 #include "app_task.h"    // For posting commands to the app task
+#include "ble_tx.h"
+#include "ble_session.h"
+#include "ble_frame.h"
+#include "cbor.h"
+#include "device_state.h"
+#include "freertos/semphr.h"
 
 // NimBLE host and controller includes
 #include "host/ble_hs.h"
@@ -19,17 +25,60 @@
 
 static const char *TAG = "BLE_MANAGER";
 
+// How long a producer waits for another one to finish writing into the TX ring
+#define TX_PRODUCER_WAIT_MS 100
+
+// Largest response after CBOR encoding
+#define CBOR_RESPONSE_MAX 1024
+
+// LE Data Length Extension limits (Core spec Vol 6, Part B, 4.5.10)
+#define LINK_DATA_LEN_MAX_OCTETS 251
+#define LINK_DATA_LEN_MAX_TIME 2120 // us for 251 octets on the 1M PHY
+#define LINK_DATA_LEN_MIN_OCTETS 27
+#define LINK_DATA_LEN_MIN_TIME 328
+
+/**
+ * @brief Link parameters requested for each profile.
+ *
+ * Intervals are in 1.25 ms units, supervision timeouts in 10 ms units.
+ */
+typedef struct
+{
+    const char *name;
+    struct ble_gap_upd_params params;
+    uint16_t tx_octets;
+    uint16_t tx_time;
+    uint8_t phy_mask;
+} link_profile_def_t;
+
+static const link_profile_def_t link_profiles[] = {
+    [BLE_LINK_PROFILE_DEFAULT] = {"default", {0}, LINK_DATA_LEN_MIN_OCTETS, LINK_DATA_LEN_MIN_TIME, BLE_GAP_LE_PHY_1M_MASK},
+    // 7.5-15 ms: several connection events per phone scheduling slot
+    [BLE_LINK_PROFILE_THROUGHPUT] = {"throughput", {.itvl_min = 6, .itvl_max = 12, .latency = 0, .supervision_timeout = 400},
+                                     LINK_DATA_LEN_MAX_OCTETS, LINK_DATA_LEN_MAX_TIME, BLE_GAP_LE_PHY_2M_MASK},
+    [BLE_LINK_PROFILE_BALANCED] = {"balanced", {.itvl_min = 24, .itvl_max = 40, .latency = 0, .supervision_timeout = 500},
+                                   LINK_DATA_LEN_MAX_OCTETS, LINK_DATA_LEN_MAX_TIME, BLE_GAP_LE_PHY_1M_MASK},
+    // 100-200 ms and skip up to 4 idle events
+    [BLE_LINK_PROFILE_LOWPOWER] = {"lowpower", {.itvl_min = 80, .itvl_max = 160, .latency = 4, .supervision_timeout = 600},
+                                   LINK_DATA_LEN_MIN_OCTETS, LINK_DATA_LEN_MIN_TIME, BLE_GAP_LE_PHY_1M_MASK},
+};
+
 // UUIDs for the custom service and characteristics (reversed for NimBLE)
 #define SERVICE_UUID_BASE 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e
 #define CHAR_UUID_RX_BASE 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x02, 0x00, 0x40, 0x6e
 #define CHAR_UUID_TX_BASE 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x03, 0x00, 0x40, 0x6e
 
-// Module-level static variables for BLE state
-static bool device_connected = false;
-static uint16_t conn_handle = BLE_HS_CONN_HANDLE_NONE;
+// Module-level static variables for BLE state. Per-client state (handle,
+// MTU, subscription) lives in the session table.
 static uint16_t tx_char_handle = 0;
 static uint8_t own_addr_type;
-static uint16_t negotiated_mtu = 6; // Default MTU, updated on event
+
+// Shared buffer for CBOR-encoded responses, guarded by cbor_lock
+static uint8_t cbor_response[CBOR_RESPONSE_MAX];
+static SemaphoreHandle_t cbor_lock;
+
+// Reassembly of framed writes, one per session. Only touched by the host task.
+static ble_frame_rx_t rx_frames[BLE_SESSION_MAX];
 
 // Forward declarations for local functions
 static int gatt_char_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
@@ -73,6 +122,21 @@ esp_err_t ble_manager_init(void)
     ble_hs_cfg.reset_cb = on_reset;
     ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
 
+    for (int i = 0; i < BLE_SESSION_MAX; i++)
+    {
+        rx_frames[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+
+    cbor_lock = xSemaphoreCreateMutex();
+    if (cbor_lock == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create CBOR encoder lock.");
+        return ESP_FAIL;
+    }
+
+    // Start the notification sender before any client can connect
+    ESP_ERROR_CHECK(ble_tx_init(&tx_char_handle));
+
     // Set a preferred MTU, the max supported is 517
     ble_att_set_preferred_mtu(517);
 
@@ -80,8 +144,10 @@ esp_err_t ble_manager_init(void)
     ble_svc_gap_init();
     ble_svc_gatt_init();
 
-    // Set the device name from NVS
-    ble_svc_gap_device_name_set(nvs_storage_get_device_name());
+    // Set the device name from NVS; the GAP service keeps its own copy
+    char devname[sizeof(((config_values_t *)0)->devname)];
+    nvs_storage_get_string(CONFIG_DEVNAME, devname, sizeof(devname));
+    ble_svc_gap_device_name_set(devname);
 
     // Add our custom services
     ESP_ERROR_CHECK(ble_gatts_count_cfg(gatt_svcs));
@@ -95,6 +161,34 @@ esp_err_t ble_manager_init(void)
 }
 
 void ble_manager_send_response(const char *msg)
+{
+    ble_manager_send_response_to(BLE_MANAGER_BROADCAST, msg);
+}
+
+void ble_manager_send_response_to(uint16_t conn_handle, const char *msg)
+{
+    ble_manager_send_reply(conn_handle, BLE_MANAGER_RID_NONE, msg);
+}
+
+/**
+ * @brief Queues a prefix and a body as one message, without joining them
+ *        in a temporary buffer first.
+ */
+static void queue_response(uint16_t conn_handle, const void *prefix, size_t prefix_len,
+                           const void *body, size_t body_len)
+{
+    ble_tx_msg_t tx;
+    if (!ble_tx_begin(&tx, conn_handle, pdMS_TO_TICKS(TX_PRODUCER_WAIT_MS)))
+    {
+        ESP_LOGW(TAG, "TX queue busy, dropping response");
+        return;
+    }
+    ble_tx_write(&tx, prefix, prefix_len);
+    ble_tx_write(&tx, body, body_len);
+    ble_tx_commit(&tx);
+}
+
+void ble_manager_send_reply(uint16_t conn_handle, uint32_t rid, const char *msg)
 {
     if (!ble_manager_is_connected() || tx_char_handle == 0)
     {
@@ -102,46 +196,217 @@ void ble_manager_send_response(const char *msg)
         return;
     }
 
-    ESP_LOGI(TAG, "TX: %s", msg);
+    ESP_LOGI(TAG, "TX[%u]: %s", conn_handle, msg);
+
+    ble_session_t sessions[BLE_SESSION_MAX];
+    size_t count = 0;
+    bool any_cbor = false;
+    if (conn_handle == BLE_MANAGER_BROADCAST)
+    {
+        count = ble_session_list(sessions, BLE_SESSION_MAX, true);
+    }
+    else if (ble_session_get(conn_handle, &sessions[0]))
+    {
+        count = 1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        any_cbor |= sessions[i].encoding == BLE_ENCODING_CBOR;
+    }
+
+    // The request id goes in front of the first member of object responses:
+    // {"rid":7,...} in JSON, 0xBF <rid key> <7> ... in CBOR
+    size_t msg_len = strlen(msg);
+    bool tag = rid != BLE_MANAGER_RID_NONE && msg[0] == '{';
+    char json_prefix[24];
+    size_t json_prefix_len = 0;
+    size_t json_skip = 0;
+    if (tag)
+    {
+        json_prefix_len = snprintf(json_prefix, sizeof(json_prefix), "{\"rid\":%lu%s", (unsigned long)rid,
+                                   msg[1] == '}' ? "" : ",");
+        json_skip = 1;
+    }
+
+    // Queue the message; the TX task chunks it to the MTU and paces it
+    // against the stack's buffer availability
+    if (!any_cbor)
+    {
+        queue_response(conn_handle, json_prefix, json_prefix_len, msg + json_skip, msg_len - json_skip);
+        return;
+    }
+
+    // Encode once, then address each client in the encoding it asked for
+    if (xSemaphoreTake(cbor_lock, pdMS_TO_TICKS(TX_PRODUCER_WAIT_MS)) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "CBOR encoder busy, dropping response");
+        return;
+    }
+    bool too_large;
+    size_t cbor_len = cbor_from_json(msg, cbor_response, sizeof(cbor_response), &too_large);
+    if (too_large)
+    {
+        // A CBOR client cannot read the JSON text: tell it what was lost
+        char error[96];
+        snprintf(error, sizeof(error), "{\"error\":\"response too large for CBOR\",\"json_bytes\":%u}",
+                 (unsigned)msg_len);
+        ESP_LOGW(TAG, "Response of %u bytes too large for CBOR, sending an error instead", (unsigned)msg_len);
+        cbor_len = cbor_from_json(error, cbor_response, sizeof(cbor_response), NULL);
+    }
+    else if (cbor_len == 0)
+    {
+        ESP_LOGW(TAG, "Response is not valid JSON, sending it as text");
+    }
 
-    size_t total_len = strlen(msg);
-    uint16_t chunk_size = negotiated_mtu > 3 ? negotiated_mtu - 3 : 20; // 3 bytes for ATT header
+    uint8_t cbor_prefix[16];
+    size_t cbor_prefix_len = 0;
+    size_t cbor_skip = 0;
+    if (tag && cbor_len > 0)
+    {
+        cbor_writer_t w;
+        cbor_writer_init(&w, cbor_prefix, sizeof(cbor_prefix));
+        cbor_prefix[w.len++] = cbor_response[0]; // Map head
+        cbor_put_uint(&w, cbor_key_id("rid", 3));
+        cbor_put_uint(&w, rid);
+        cbor_prefix_len = w.len;
+        cbor_skip = 1;
+    }
 
-    if (total_len <= chunk_size)
+    for (size_t i = 0; i < count; i++)
     {
-        // Message fits in a single notification
-        struct os_mbuf *om = ble_hs_mbuf_from_flat(msg, total_len);
-        if (om)
+        if (sessions[i].encoding == BLE_ENCODING_CBOR && cbor_len > 0)
         {
-            ble_gatts_notify_custom(conn_handle, tx_char_handle, om);
+            queue_response(sessions[i].conn_handle, cbor_prefix, cbor_prefix_len,
+                           cbor_response + cbor_skip, cbor_len - cbor_skip);
+        }
+        else
+        {
+            queue_response(sessions[i].conn_handle, json_prefix, json_prefix_len,
+                           msg + json_skip, msg_len - json_skip);
         }
     }
-    else
+    xSemaphoreGive(cbor_lock);
+}
+
+void ble_manager_get_tx_stats(ble_tx_stats_t *stats)
+{
+    ble_tx_get_stats(stats);
+}
+
+bool ble_manager_is_connected(void)
+{
+    return ble_session_count() > 0;
+}
+
+size_t ble_manager_get_sessions(ble_session_t *sessions, size_t max)
+{
+    return ble_session_list(sessions, max, false);
+}
+
+esp_err_t ble_manager_set_encoding(uint16_t conn_handle, ble_encoding_t encoding)
+{
+    ble_session_t session;
+    if (!ble_session_get(conn_handle, &session))
     {
-        // Message needs to be chunked
-        ESP_LOGI(TAG, "Chunking response of size %d into %d-byte chunks", total_len, chunk_size);
-        for (size_t offset = 0; offset < total_len; offset += chunk_size)
-        {
-            size_t len_to_send = total_len - offset;
-            if (len_to_send > chunk_size)
-            {
-                len_to_send = chunk_size;
-            }
+        return ESP_ERR_NOT_FOUND;
+    }
+    ble_session_set_encoding(conn_handle, encoding);
+    return ESP_OK;
+}
 
-            struct os_mbuf *om = ble_hs_mbuf_from_flat(msg + offset, len_to_send);
-            if (om)
-            {
-                ble_gatts_notify_custom(conn_handle, tx_char_handle, om);
-                // A small delay is crucial to allow the BLE stack and client to process each chunk.
-                vTaskDelay(pdMS_TO_TICKS(20)); 
-            }
+esp_err_t ble_manager_set_framing(uint16_t conn_handle, ble_framing_t framing)
+{
+    ble_session_t session;
+    if (!ble_session_get(conn_handle, &session))
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (!ble_tx_set_framing(conn_handle, framing, pdMS_TO_TICKS(TX_PRODUCER_WAIT_MS)))
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+bool ble_manager_get_session(uint16_t conn_handle, ble_session_t *session)
+{
+    return ble_session_get(conn_handle, session);
+}
+
+const char *ble_manager_link_profile_name(ble_link_profile_t profile)
+{
+    if ((size_t)profile >= sizeof(link_profiles) / sizeof(link_profiles[0]))
+    {
+        return "unknown";
+    }
+    return link_profiles[profile].name;
+}
+
+bool ble_manager_parse_link_profile(const char *name, ble_link_profile_t *profile)
+{
+    for (size_t i = 0; i < sizeof(link_profiles) / sizeof(link_profiles[0]); i++)
+    {
+        if (strcmp(name, link_profiles[i].name) == 0)
+        {
+            *profile = (ble_link_profile_t)i;
+            return true;
         }
     }
+    return false;
 }
 
-bool ble_manager_is_connected(void)
+esp_err_t ble_manager_set_link_profile(uint16_t conn_handle, ble_link_profile_t profile)
+{
+    ble_session_t session;
+    if (!ble_session_get(conn_handle, &session))
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (profile == BLE_LINK_PROFILE_DEFAULT || (size_t)profile >= sizeof(link_profiles) / sizeof(link_profiles[0]))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const link_profile_def_t *def = &link_profiles[profile];
+    ble_session_set_profile(conn_handle, profile);
+
+    // The three procedures are independent: the controller or the central
+    // may refuse one of them, which only costs that part of the speed-up.
+    // Results arrive asynchronously as GAP events and are reported then.
+    int rc = ble_gap_set_data_len(conn_handle, def->tx_octets, def->tx_time);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "Data length request for %u failed; rc=%d", conn_handle, rc);
+    }
+
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(conn_handle, def->phy_mask, def->phy_mask, BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "PHY request for %u failed; rc=%d", conn_handle, rc);
+    }
+#endif
+
+    rc = ble_gap_update_params(conn_handle, &def->params);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "Connection update for %u failed; rc=%d", conn_handle, rc);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Requested %s link profile for %u", def->name, conn_handle);
+    return ESP_OK;
+}
+
+int ble_manager_format_link(const ble_session_t *session, char *buf, size_t size)
 {
-    return device_connected;
+    const ble_link_params_t *link = &session->link;
+    return snprintf(buf, size,
+                    "{\"profile\":\"%s\",\"itvl_us\":%lu,\"latency\":%u,\"timeout_ms\":%lu,"
+                    "\"mtu\":%u,\"data_len\":%u,\"tx_phy\":%u,\"rx_phy\":%u}",
+                    ble_manager_link_profile_name(link->profile), (unsigned long)link->conn_itvl * 1250,
+                    link->conn_latency, (unsigned long)link->supervision_timeout * 10, session->mtu,
+                    link->tx_octets, link->tx_phy, link->rx_phy);
 }
 
 static void on_reset(int reason)
@@ -149,22 +414,165 @@ static void on_reset(int reason)
     ESP_LOGE(TAG, "Resetting state; reason=%d", reason);
 }
 
+/**
+ * @brief Tells the client that a command was rejected and when to retry.
+ *
+ * Runs on the NimBLE host task, so it must not block: if the TX ring is
+ * busy the notification is dropped (and counted) rather than waited for.
+ */
+static void send_busy(uint16_t conn_handle)
+{
+    char resp[64];
+    int len = snprintf(resp, sizeof(resp), "{\"error\":\"busy\",\"retry_after_ms\":%lu}",
+                       (unsigned long)app_task_retry_after_ms());
+    ble_tx_send(conn_handle, resp, len, 0);
+}
+
+/**
+ * @brief Reads the connection parameters in effect from the host.
+ */
+static void refresh_conn_params(uint16_t conn_handle)
+{
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(conn_handle, &desc) == 0)
+    {
+        ble_session_set_conn_params(conn_handle, desc.conn_itvl, desc.conn_latency, desc.supervision_timeout);
+    }
+}
+
+/**
+ * @brief Tells a client that asked for a link profile what it actually got.
+ *
+ * Runs on the NimBLE host task, so like send_busy() it never blocks.
+ */
+static void report_link(uint16_t conn_handle)
+{
+    ble_session_t session;
+    if (!ble_session_get(conn_handle, &session) || session.link.profile == BLE_LINK_PROFILE_DEFAULT)
+    {
+        return;
+    }
+
+    char resp[192];
+    int len = snprintf(resp, sizeof(resp), "{\"blelink\":");
+    len += ble_manager_format_link(&session, resp + len, sizeof(resp) - len - 1);
+    if (len >= (int)sizeof(resp) - 1)
+    {
+        return;
+    }
+    resp[len++] = '}';
+    ble_tx_send(conn_handle, resp, len, 0);
+}
+
+/**
+ * @brief Gets the reassembly state of a client, claiming a free one on the
+ *        client's first framed write.
+ */
+static ble_frame_rx_t *get_rx_frame(uint16_t conn_handle)
+{
+    ble_frame_rx_t *free_slot = NULL;
+    for (int i = 0; i < BLE_SESSION_MAX; i++)
+    {
+        if (rx_frames[i].conn_handle == conn_handle)
+        {
+            return &rx_frames[i];
+        }
+        if (free_slot == NULL && rx_frames[i].conn_handle == BLE_HS_CONN_HANDLE_NONE)
+        {
+            free_slot = &rx_frames[i];
+        }
+    }
+    if (free_slot != NULL)
+    {
+        free_slot->conn_handle = conn_handle;
+    }
+    return free_slot;
+}
+
+static void release_rx_frame(uint16_t conn_handle)
+{
+    for (int i = 0; i < BLE_SESSION_MAX; i++)
+    {
+        if (rx_frames[i].conn_handle == conn_handle)
+        {
+            ble_frame_rx_reset(&rx_frames[i]);
+            rx_frames[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        }
+    }
+}
+
+/**
+ * @brief Handles a framed write: collects the fragments and queues the
+ *        command once the last one arrived.
+ */
+static void receive_frame(uint16_t conn_handle, const struct os_mbuf *om)
+{
+    ble_frame_rx_t *rx = get_rx_frame(conn_handle);
+    if (rx == NULL)
+    {
+        return;
+    }
+
+    app_cmd_buf_t *cmd = NULL;
+    switch (ble_frame_rx_feed(rx, om, &cmd))
+    {
+    case BLE_FRAME_RX_MORE:
+        break;
+    case BLE_FRAME_RX_DONE:
+        ESP_LOGI(TAG, "RX[%u]: Queuing framed command: %s", conn_handle, cmd->data);
+        if (app_task_cmd_submit(cmd) != pdTRUE)
+        {
+            send_busy(conn_handle);
+        }
+        break;
+    case BLE_FRAME_RX_NOMEM:
+        ESP_LOGW(TAG, "RX: No free command buffer, rejecting framed command");
+        send_busy(conn_handle);
+        break;
+    case BLE_FRAME_RX_ERROR:
+    {
+        static const char resp[] = "{\"error\":\"bad frame\"}";
+        ble_tx_send(conn_handle, resp, sizeof(resp) - 1, 0);
+        break;
+    }
+    }
+}
+
 static int gatt_char_access(uint16_t conn_handle_param, uint16_t attr_handle,
                             struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR)
     {
+        if (ble_frame_is_framed(ctxt->om))
+        {
+            receive_frame(conn_handle_param, ctxt->om);
+            return 0;
+        }
+
         uint16_t om_len = OS_MBUF_PKTLEN(ctxt->om);
-        char cmd_buf[APP_CMD_MAX_LEN];
 
-        if (om_len > 0 && om_len < sizeof(cmd_buf))
+        if (om_len > 0 && om_len < APP_CMD_MAX_LEN)
         {
-            ble_hs_mbuf_to_flat(ctxt->om, cmd_buf, om_len, NULL);
-            cmd_buf[om_len] = '\0';
-            ESP_LOGI(TAG, "RX: Queuing command: %s", cmd_buf);
-            
-            // Post the received command to the main application task queue
-            app_task_queue_post(cmd_buf);
+            app_cmd_buf_t *cmd = app_task_cmd_alloc(conn_handle_param);
+            if (cmd == NULL)
+            {
+                ESP_LOGW(TAG, "RX: No free command buffer, rejecting command");
+                send_busy(conn_handle_param);
+                return 0;
+            }
+
+            // The only copy of the command: straight from the mbuf chain into
+            // the pooled buffer that the command handler will parse in place
+            ble_hs_mbuf_to_flat(ctxt->om, cmd->data, om_len, NULL);
+            cmd->data[om_len] = '\0';
+            cmd->len = om_len;
+            ESP_LOGI(TAG, "RX[%u]: Queuing command: %s", conn_handle_param, cmd->data);
+
+            // Hand the buffer over to the main application task
+            if (app_task_cmd_submit(cmd) != pdTRUE)
+            {
+                send_busy(conn_handle_param);
+            }
         }
         return 0;
     }
@@ -179,39 +587,84 @@ static int gap_event_handler(struct ble_gap_event *event, void *arg)
         if (event->connect.status == 0)
         {
             ESP_LOGI(TAG, "BLE Connected; conn_handle=%d", event->connect.conn_handle);
-            device_connected = true;
-            conn_handle = event->connect.conn_handle;
-            // Reset MTU to default on new connection
-            negotiated_mtu = 23;
+            if (!ble_session_open(event->connect.conn_handle))
+            {
+                ESP_LOGE(TAG, "No free session slot, terminating connection");
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                break;
+            }
+            device_state_set_ble_clients(ble_session_count());
+            refresh_conn_params(event->connect.conn_handle);
         }
         else
         {
-            ESP_LOGE(TAG, "BLE Connection failed; status=%d, restarting advertising", event->connect.status);
-            start_ble_advertising(0);
+            ESP_LOGE(TAG, "BLE Connection failed; status=%d", event->connect.status);
         }
+        // Advertising stops on connection; keep accepting more clients
+        start_ble_advertising(0);
         break;
 
     case BLE_GAP_EVENT_DISCONNECT:
-        ESP_LOGI(TAG, "BLE Disconnected; reason=%d", event->disconnect.reason);
-        device_connected = false;
-        conn_handle = BLE_HS_CONN_HANDLE_NONE;
-        // Reset MTU to default
-        negotiated_mtu = 23;
+        ESP_LOGI(TAG, "BLE Disconnected; conn_handle=%d, reason=%d",
+                 event->disconnect.conn.conn_handle, event->disconnect.reason);
+        ble_session_close(event->disconnect.conn.conn_handle);
+        device_state_set_ble_clients(ble_session_count());
+        release_rx_frame(event->disconnect.conn.conn_handle);
+        // Let the sender notice right away if it was streaming to this client
+        ble_tx_on_notify_tx();
         start_ble_advertising(0);
         break;
 
     case BLE_GAP_EVENT_SUBSCRIBE:
-        ESP_LOGI(TAG, "Subscribe event; cur_notify=%d, attr_handle=%d", event->subscribe.cur_notify, event->subscribe.attr_handle);
+        ESP_LOGI(TAG, "Subscribe event; conn_handle=%d, cur_notify=%d, attr_handle=%d",
+                 event->subscribe.conn_handle, event->subscribe.cur_notify, event->subscribe.attr_handle);
         if (event->subscribe.attr_handle == tx_char_handle)
         {
-            // Client subscribed, send initial status
-            app_task_queue_post("status()");
+            ble_session_set_subscribed(event->subscribe.conn_handle, event->subscribe.cur_notify);
+            if (event->subscribe.cur_notify)
+            {
+                // Client subscribed, send it the initial status
+                app_task_request_status(event->subscribe.conn_handle);
+            }
         }
         break;
 
     case BLE_GAP_EVENT_MTU:
         ESP_LOGI(TAG, "MTU update; conn_handle=%d, mtu=%d", event->mtu.conn_handle, event->mtu.value);
-        negotiated_mtu = event->mtu.value;
+        ble_session_set_mtu(event->mtu.conn_handle, event->mtu.value);
+        break;
+
+    case BLE_GAP_EVENT_CONN_UPDATE:
+        ESP_LOGI(TAG, "Connection update; conn_handle=%d, status=%d",
+                 event->conn_update.conn_handle, event->conn_update.status);
+        refresh_conn_params(event->conn_update.conn_handle);
+        report_link(event->conn_update.conn_handle);
+        break;
+
+#ifdef BLE_GAP_EVENT_DATA_LEN_CHG
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        ESP_LOGI(TAG, "Data length change; conn_handle=%d, tx_octets=%d",
+                 event->data_len_chg.conn_handle, event->data_len_chg.max_tx_octets);
+        ble_session_set_data_len(event->data_len_chg.conn_handle, event->data_len_chg.max_tx_octets);
+        report_link(event->data_len_chg.conn_handle);
+        break;
+#endif
+
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        ESP_LOGI(TAG, "PHY update; conn_handle=%d, status=%d, tx=%d, rx=%d", event->phy_updated.conn_handle,
+                 event->phy_updated.status, event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+        if (event->phy_updated.status == 0)
+        {
+            ble_session_set_phy(event->phy_updated.conn_handle, event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+            report_link(event->phy_updated.conn_handle);
+        }
+        break;
+#endif
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        // A notification left the host, the sender may find free mbufs now
+        ble_tx_on_notify_tx();
         break;
     }
     return 0;
@@ -224,6 +677,11 @@ static void start_ble_advertising(int reason)
     struct ble_hs_adv_fields sr_fields; // Scan response
     const char *name = ble_svc_gap_device_name();
 
+    if (ble_gap_adv_active() || ble_session_count() >= BLE_SESSION_MAX)
+    {
+        return;
+    }
+
     memset(&fields, 0, sizeof(fields));
     fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
     fields.name = (uint8_t *)name;
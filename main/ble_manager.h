@@ -3,16 +3,27 @@
  * @brief Manages BLE services, advertising, and communication.
  *
  * This module encapsulates the NimBLE stack initialization, GATT service
- * creation, and GAP event handling. It provides a simple interface for
- * sending notifications to a connected client and for checking the
- * connection status.
+ * creation, and GAP event handling. Several clients can be connected at
+ * once; each has its own session. It provides a simple interface for
+ * sending notifications to one client or to all of them and for checking
+ * the connection status.
  */
 
 #ifndef BLE_MANAGER_H
 #define BLE_MANAGER_H
 
 #include "esp_err.h"
+#include "ble_tx.h"
+#include "ble_session.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Destination that addresses every subscribed client.
+#define BLE_MANAGER_BROADCAST BLE_TX_BROADCAST
+
+// Request id of responses that do not answer a tagged request.
+#define BLE_MANAGER_RID_NONE UINT32_MAX
 
 /**
  * @brief Initializes the BLE manager.
@@ -26,20 +37,137 @@
 esp_err_t ble_manager_init(void);
 
 /**
- * @brief Sends a message to the connected BLE client via GATT notification.
+ * @brief Sends a message to all subscribed BLE clients via GATT notification.
  *
- * If a client is connected and has subscribed to notifications, this function
- * sends the provided string. If not, the message is logged but not sent.
+ * If a client is connected, the message is queued for the asynchronous
+ * transmitter and the function returns without waiting for it to be sent.
+ * If not, the message is logged but not sent.
  *
  * @param msg The null-terminated string to send.
  */
 void ble_manager_send_response(const char *msg);
 
+/**
+ * @brief Sends a message to one BLE client via GATT notification.
+ *
+ * @param conn_handle The client's connection handle, or BLE_MANAGER_BROADCAST.
+ * @param msg The null-terminated string to send.
+ */
+void ble_manager_send_response_to(uint16_t conn_handle, const char *msg);
+
+/**
+ * @brief Sends the response to a tagged request.
+ *
+ * Object responses get a "rid" member holding the request id in front of
+ * their own members, in whatever encoding each client uses. The prefix is
+ * streamed into the TX queue ahead of the response, so no copy is made.
+ * Safe to call from any task except the NimBLE host task.
+ *
+ * @param conn_handle The client's connection handle, or BLE_MANAGER_BROADCAST.
+ * @param rid The request id, or BLE_MANAGER_RID_NONE.
+ * @param msg The null-terminated JSON response.
+ */
+void ble_manager_send_reply(uint16_t conn_handle, uint32_t rid, const char *msg);
+
 /**
  * @brief Checks if a BLE client is currently connected.
  *
- * @return True if a client is connected, false otherwise.
+ * @return True if at least one client is connected, false otherwise.
  */
 bool ble_manager_is_connected(void);
 
+/**
+ * @brief Gets the statistics of the notification transmitter.
+ *
+ * @param[out] stats The statistics.
+ */
+void ble_manager_get_tx_stats(ble_tx_stats_t *stats);
+
+/**
+ * @brief Gets a copy of the sessions of all connected clients.
+ *
+ * @param[out] sessions Array receiving the sessions.
+ * @param max The capacity of the array.
+ * @return The number of sessions copied.
+ */
+size_t ble_manager_get_sessions(ble_session_t *sessions, size_t max);
+
+/**
+ * @brief Gets a copy of one client's session.
+ *
+ * @param conn_handle The client's connection handle.
+ * @param[out] session The session.
+ * @return True if the client is connected.
+ */
+bool ble_manager_get_session(uint16_t conn_handle, ble_session_t *session);
+
+/**
+ * @brief Switches the notification framing of one client.
+ *
+ * Responses queued before the call keep the old framing; the first
+ * response queued after it uses the new one. Writes from the client are
+ * accepted in both forms regardless of this setting, see ble_frame.h.
+ *
+ * @param conn_handle The client's connection handle.
+ * @param framing The new framing.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the client is not
+ *         connected, or ESP_ERR_TIMEOUT if the TX queue was busy.
+ */
+esp_err_t ble_manager_set_framing(uint16_t conn_handle, ble_framing_t framing);
+
+/**
+ * @brief Switches the response encoding of one client.
+ *
+ * Responses are still produced as JSON by the command handlers; for CBOR
+ * clients they are transcoded when queued, see cbor.h. Broadcasts reach
+ * every subscriber in its own encoding.
+ *
+ * @param conn_handle The client's connection handle.
+ * @param encoding The new encoding.
+ * @return ESP_OK on success, or ESP_ERR_NOT_FOUND if the client is not
+ *         connected.
+ */
+esp_err_t ble_manager_set_encoding(uint16_t conn_handle, ble_encoding_t encoding);
+
+/**
+ * @brief Asks for the link parameters of a profile on one connection.
+ *
+ * Requests LE Data Length Extension, the preferred PHY (only on controllers
+ * with BLE 5 support; the ESP32 is limited to the 1M PHY) and a connection
+ * parameter update. The central decides what it accepts; the parameters
+ * actually negotiated are stored in the session and notified to the client
+ * as {"blelink":{...}} when the controller reports them.
+ *
+ * @param conn_handle The client's connection handle.
+ * @param profile The profile to apply, not BLE_LINK_PROFILE_DEFAULT.
+ * @return ESP_OK if the requests were issued, ESP_ERR_NOT_FOUND if the client
+ *         is not connected, ESP_ERR_INVALID_ARG for an invalid profile, or
+ *         ESP_FAIL if the connection update could not be started.
+ */
+esp_err_t ble_manager_set_link_profile(uint16_t conn_handle, ble_link_profile_t profile);
+
+/**
+ * @brief Gets the name of a link profile, as used by the blelink command.
+ */
+const char *ble_manager_link_profile_name(ble_link_profile_t profile);
+
+/**
+ * @brief Looks up a link profile by name.
+ *
+ * @param name "throughput", "balanced", "lowpower" or "default".
+ * @param[out] profile The profile.
+ * @return True if the name is known.
+ */
+bool ble_manager_parse_link_profile(const char *name, ble_link_profile_t *profile);
+
+/**
+ * @brief Formats the link parameters of a session as a JSON object.
+ *
+ * @param session The session.
+ * @param buf The output buffer.
+ * @param size The size of the buffer.
+ * @return The length of the JSON as returned by snprintf().
+ */
+int ble_manager_format_link(const ble_session_t *session, char *buf, size_t size);
+
 #endif // BLE_MANAGER_H
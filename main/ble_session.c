@@ -0,0 +1,260 @@
+/**
+ * @file ble_session.c
+ * @brief Implementation of the BLE session table.
+ */
+
+#include "ble_session.h"
+#include "freertos/FreeRTOS.h"
+
+typedef struct
+{
+    bool in_use;
+    ble_session_t state;
+} session_slot_t;
+
+static session_slot_t sessions[BLE_SESSION_MAX];
+static portMUX_TYPE session_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Must be called with session_lock held
+static session_slot_t *find_slot(uint16_t conn_handle)
+{
+    for (int i = 0; i < BLE_SESSION_MAX; i++)
+    {
+        if (sessions[i].in_use && sessions[i].state.conn_handle == conn_handle)
+        {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+bool ble_session_open(uint16_t conn_handle)
+{
+    bool opened = false;
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    for (int i = 0; slot == NULL && i < BLE_SESSION_MAX; i++)
+    {
+        if (!sessions[i].in_use)
+        {
+            slot = &sessions[i];
+        }
+    }
+    if (slot != NULL)
+    {
+        slot->in_use = true;
+        slot->state = (ble_session_t){
+            .conn_handle = conn_handle,
+            .mtu = BLE_SESSION_DEFAULT_MTU,
+            .link = {
+                .tx_octets = 27,
+                .tx_phy = 1,
+                .rx_phy = 1,
+            },
+        };
+        opened = true;
+    }
+    portEXIT_CRITICAL(&session_lock);
+    return opened;
+}
+
+void ble_session_close(uint16_t conn_handle)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->in_use = false;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_mtu(uint16_t conn_handle, uint16_t mtu)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.mtu = mtu;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_subscribed(uint16_t conn_handle, bool subscribed)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.subscribed = subscribed;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_framing(uint16_t conn_handle, ble_framing_t framing)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.framing = framing;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_encoding(uint16_t conn_handle, ble_encoding_t encoding)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.encoding = encoding;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_status_watch(uint16_t conn_handle, bool watch)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.status_watch = watch;
+        slot->state.status_ack = 0;
+        slot->state.status_sent = 0;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+bool ble_session_ack_status(uint16_t conn_handle, uint32_t version)
+{
+    bool accepted = false;
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL && version >= slot->state.status_ack && version <= slot->state.status_sent)
+    {
+        slot->state.status_ack = version;
+        accepted = true;
+    }
+    portEXIT_CRITICAL(&session_lock);
+    return accepted;
+}
+
+void ble_session_set_status_sent(uint16_t conn_handle, uint32_t version)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.status_sent = version;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_profile(uint16_t conn_handle, ble_link_profile_t profile)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.link.profile = profile;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_conn_params(uint16_t conn_handle, uint16_t itvl, uint16_t latency, uint16_t timeout)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.link.conn_itvl = itvl;
+        slot->state.link.conn_latency = latency;
+        slot->state.link.supervision_timeout = timeout;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_data_len(uint16_t conn_handle, uint16_t tx_octets)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.link.tx_octets = tx_octets;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_set_phy(uint16_t conn_handle, uint8_t tx_phy, uint8_t rx_phy)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        slot->state.link.tx_phy = tx_phy;
+        slot->state.link.rx_phy = rx_phy;
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+void ble_session_add_pending(uint16_t conn_handle, int32_t delta)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        // The session may have been opened after a broadcast was queued
+        if (delta < 0 && (uint32_t)-delta > slot->state.tx_pending)
+        {
+            slot->state.tx_pending = 0;
+        }
+        else
+        {
+            slot->state.tx_pending += delta;
+        }
+    }
+    portEXIT_CRITICAL(&session_lock);
+}
+
+bool ble_session_get(uint16_t conn_handle, ble_session_t *out)
+{
+    portENTER_CRITICAL(&session_lock);
+    session_slot_t *slot = find_slot(conn_handle);
+    if (slot != NULL)
+    {
+        *out = slot->state;
+    }
+    portEXIT_CRITICAL(&session_lock);
+    return slot != NULL;
+}
+
+size_t ble_session_list(ble_session_t *out, size_t max, bool subscribed_only)
+{
+    size_t count = 0;
+    portENTER_CRITICAL(&session_lock);
+    for (int i = 0; i < BLE_SESSION_MAX && count < max; i++)
+    {
+        if (sessions[i].in_use && (!subscribed_only || sessions[i].state.subscribed))
+        {
+            out[count++] = sessions[i].state;
+        }
+    }
+    portEXIT_CRITICAL(&session_lock);
+    return count;
+}
+
+size_t ble_session_count(void)
+{
+    size_t count = 0;
+    portENTER_CRITICAL(&session_lock);
+    for (int i = 0; i < BLE_SESSION_MAX; i++)
+    {
+        if (sessions[i].in_use)
+        {
+            count++;
+        }
+    }
+    portEXIT_CRITICAL(&session_lock);
+    return count;
+}
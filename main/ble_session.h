@@ -0,0 +1,203 @@
+/**
+ * @file ble_session.h
+ * @brief Per-connection state of the BLE clients.
+ *
+ * NimBLE accepts up to CONFIG_BT_NIMBLE_MAX_CONNECTIONS centrals at once.
+ * Each of them gets a session slot holding its connection handle,
+ * negotiated MTU, subscription state and the number of response bytes
+ * still waiting to be sent to it. The table is written by the BLE manager
+ * from GAP events and read by the TX task and the command handler, so all
+ * accessors copy the state out under a lock.
+ */
+
+#ifndef BLE_SESSION_H
+#define BLE_SESSION_H
+
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The maximum number of simultaneous BLE sessions.
+#define BLE_SESSION_MAX CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+// The ATT MTU assumed until the client negotiates a larger one.
+#define BLE_SESSION_DEFAULT_MTU 23
+
+/**
+ * @brief Link profiles a client can ask for with blelink().
+ */
+typedef enum
+{
+    BLE_LINK_PROFILE_DEFAULT = 0, // Whatever the central chose
+    BLE_LINK_PROFILE_THROUGHPUT,  // Short interval, long PDUs, 2M PHY if available
+    BLE_LINK_PROFILE_BALANCED,    // Moderate interval, long PDUs
+    BLE_LINK_PROFILE_LOWPOWER,    // Long interval with slave latency
+} ble_link_profile_t;
+
+/**
+ * @brief How responses are laid out in notifications, see ble_frame.h.
+ */
+typedef enum
+{
+    BLE_FRAMING_RAW = 0, // Bare message bytes split at MTU boundaries
+    BLE_FRAMING_FRAMED,  // Every notification carries a frame header
+} ble_framing_t;
+
+/**
+ * @brief How responses are encoded for a client.
+ */
+typedef enum
+{
+    BLE_ENCODING_JSON = 0, // JSON text
+    BLE_ENCODING_CBOR,     // CBOR with integer keys, see cbor.h
+} ble_encoding_t;
+
+/**
+ * @brief The link parameters currently in effect for a client.
+ */
+typedef struct
+{
+    uint8_t profile;              // Requested ble_link_profile_t
+    uint16_t conn_itvl;           // Connection interval, in 1.25 ms units
+    uint16_t conn_latency;        // Slave latency, in connection events
+    uint16_t supervision_timeout; // Supervision timeout, in 10 ms units
+    uint16_t tx_octets;           // Maximum LL payload length in use
+    uint8_t tx_phy;               // 1 = LE 1M, 2 = LE 2M, 3 = LE Coded
+    uint8_t rx_phy;
+} ble_link_params_t;
+
+/**
+ * @brief The state of one connected client.
+ */
+typedef struct
+{
+    uint16_t conn_handle;
+    uint16_t mtu;
+    bool subscribed;        // Client enabled notifications on the TX characteristic
+    uint32_t tx_pending;    // Response bytes queued for this client
+    ble_link_params_t link; // Negotiated link parameters
+    uint8_t framing;        // ble_framing_t used for notifications
+    uint8_t encoding;       // ble_encoding_t used for responses
+    bool status_watch;      // Client gets status deltas instead of snapshots
+    uint32_t status_ack;    // Last status version the client acknowledged
+    uint32_t status_sent;   // Last status version sent to the client
+} ble_session_t;
+
+/**
+ * @brief Opens a session for a new connection.
+ *
+ * @param conn_handle The connection handle.
+ * @return True on success, false if the table is full.
+ */
+bool ble_session_open(uint16_t conn_handle);
+
+/**
+ * @brief Closes the session of a connection.
+ *
+ * @param conn_handle The connection handle.
+ */
+void ble_session_close(uint16_t conn_handle);
+
+/**
+ * @brief Updates the negotiated MTU of a session.
+ */
+void ble_session_set_mtu(uint16_t conn_handle, uint16_t mtu);
+
+/**
+ * @brief Updates the notification subscription state of a session.
+ */
+void ble_session_set_subscribed(uint16_t conn_handle, bool subscribed);
+
+/**
+ * @brief Sets the notification framing of a session.
+ *
+ * Called by the TX task when it reaches the framing switch in its queue,
+ * so messages queued before the switch keep the previous framing.
+ */
+void ble_session_set_framing(uint16_t conn_handle, ble_framing_t framing);
+
+/**
+ * @brief Sets the response encoding of a session.
+ *
+ * Responses are encoded when they are queued, so the change applies to
+ * every response queued after the call.
+ */
+void ble_session_set_encoding(uint16_t conn_handle, ble_encoding_t encoding);
+
+/**
+ * @brief Switches a session between status snapshots and status deltas.
+ *
+ * Resets the acknowledged and sent versions, so the first delta after a
+ * switch carries every field.
+ */
+void ble_session_set_status_watch(uint16_t conn_handle, bool watch);
+
+/**
+ * @brief Records the status version a client acknowledged.
+ *
+ * Versions that were never sent to the client, or older than the current
+ * acknowledgement, are ignored.
+ *
+ * @return True if the acknowledgement was accepted.
+ */
+bool ble_session_ack_status(uint16_t conn_handle, uint32_t version);
+
+/**
+ * @brief Records the status version last sent to a client.
+ */
+void ble_session_set_status_sent(uint16_t conn_handle, uint32_t version);
+
+/**
+ * @brief Records the link profile a client asked for.
+ */
+void ble_session_set_profile(uint16_t conn_handle, ble_link_profile_t profile);
+
+/**
+ * @brief Records the connection parameters reported by the controller.
+ */
+void ble_session_set_conn_params(uint16_t conn_handle, uint16_t itvl, uint16_t latency, uint16_t timeout);
+
+/**
+ * @brief Records the LL data length reported by the controller.
+ */
+void ble_session_set_data_len(uint16_t conn_handle, uint16_t tx_octets);
+
+/**
+ * @brief Records the PHYs reported by the controller.
+ */
+void ble_session_set_phy(uint16_t conn_handle, uint8_t tx_phy, uint8_t rx_phy);
+
+/**
+ * @brief Adjusts the number of bytes queued for a session.
+ *
+ * @param conn_handle The connection handle.
+ * @param delta Bytes added (positive) or sent/dropped (negative).
+ */
+void ble_session_add_pending(uint16_t conn_handle, int32_t delta);
+
+/**
+ * @brief Gets a copy of the state of one session.
+ *
+ * @param conn_handle The connection handle.
+ * @param[out] out The session state.
+ * @return True if the session exists.
+ */
+bool ble_session_get(uint16_t conn_handle, ble_session_t *out);
+
+/**
+ * @brief Gets a copy of all open sessions.
+ *
+ * @param[out] out Array receiving the sessions.
+ * @param max The capacity of the array.
+ * @param subscribed_only Only list sessions subscribed to notifications.
+ * @return The number of sessions copied.
+ */
+size_t ble_session_list(ble_session_t *out, size_t max, bool subscribed_only);
+
+/**
+ * @brief Gets the number of open sessions.
+ */
+size_t ble_session_count(void);
+
+#endif // BLE_SESSION_H
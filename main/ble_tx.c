@@ -0,0 +1,439 @@
+/**
+ * @file ble_tx.c
+ * @brief Implementation of the asynchronous BLE notification transmitter.
+ */
+
+#include "ble_tx.h"
+#include "freertos/semphr.h"
+#include "host/ble_hs.h"
+#include "ble_session.h"
+#include "ble_frame.h"
+#include <stdatomic.h>
+#include <string.h>
+
+static const char *TAG = "BLE_TX";
+
+#define RING_MASK (BLE_TX_RING_SIZE - 1)
+
+// Kinds of ring records
+#define RECORD_MESSAGE 0
+#define RECORD_SET_FRAMING 1 // Zero-length record, arg is the new ble_framing_t
+
+/**
+ * @brief Header stored in the ring in front of every record.
+ */
+typedef struct
+{
+    uint16_t len;
+    uint16_t conn_handle; // Destination, or BLE_TX_BROADCAST
+    uint8_t kind;         // RECORD_*
+    uint8_t arg;
+} ble_tx_hdr_t;
+
+// Ring storage. Positions are free-running counters, masked on access.
+static uint8_t ring[BLE_TX_RING_SIZE];
+static atomic_uint ring_head; // Published end of committed messages
+static atomic_uint ring_tail; // Start of the oldest unsent message
+
+// Serializes producers; the sender is the only consumer
+static SemaphoreHandle_t producer_lock;
+static TaskHandle_t sender_task;
+
+// Value handle of the TX characteristic
+static const uint16_t *tx_attr_handle;
+
+// Statistics
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static ble_tx_stats_t stats;
+static int64_t active_us;
+
+// Id of the next framed message, only touched by the sender
+static uint8_t next_msg_id;
+
+static void ring_copy_in(uint32_t pos, const void *data, size_t len)
+{
+    size_t idx = pos & RING_MASK;
+    size_t first = BLE_TX_RING_SIZE - idx;
+    if (first > len) first = len;
+    memcpy(&ring[idx], data, first);
+    memcpy(ring, (const uint8_t *)data + first, len - first);
+}
+
+static void ring_copy_out(uint32_t pos, void *data, size_t len)
+{
+    size_t idx = pos & RING_MASK;
+    size_t first = BLE_TX_RING_SIZE - idx;
+    if (first > len) first = len;
+    memcpy(data, &ring[idx], first);
+    memcpy((uint8_t *)data + first, ring, len - first);
+}
+
+/**
+ * @brief Appends a slice of the ring to an mbuf chain without flattening it.
+ */
+static bool ring_append_mbuf(struct os_mbuf *om, uint32_t pos, size_t len)
+{
+    size_t idx = pos & RING_MASK;
+    size_t first = BLE_TX_RING_SIZE - idx;
+    if (first > len) first = len;
+    if (os_mbuf_append(om, &ring[idx], first) != 0) return false;
+    if (len > first && os_mbuf_append(om, ring, len - first) != 0) return false;
+    return true;
+}
+
+static void count_drop(size_t len)
+{
+    portENTER_CRITICAL(&stats_lock);
+    stats.dropped_msgs++;
+    stats.dropped_bytes += len;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * @brief Parks the sender until the stack frees resources or new data arrives.
+ */
+static void wait_for_resources(void)
+{
+    portENTER_CRITICAL(&stats_lock);
+    stats.stalls++;
+    portEXIT_CRITICAL(&stats_lock);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_TX_RETRY_MS));
+}
+
+/**
+ * @brief Sends one message from the ring to one client as a series of
+ *        notifications, prefixing each with a frame header if the client
+ *        uses framed mode.
+ *
+ * @return True if the whole message was handed to the stack.
+ */
+static bool transmit_to(uint16_t conn_handle, uint32_t pos, uint16_t len, uint8_t msg_id)
+{
+    size_t offset = 0;
+    uint32_t notifications = 0;
+    ble_session_t session;
+    ble_frame_hdr_t frame = {.msg_id = msg_id, .len = len};
+    bool framed = false;
+
+    while (offset < len)
+    {
+        // Re-read the session every chunk: the MTU may grow mid-message
+        // and the client may disconnect while we wait for buffers
+        if (!ble_session_get(conn_handle, &session))
+        {
+            ESP_LOGW(TAG, "Client %u gone, dropping remaining %u bytes", conn_handle, (unsigned)(len - offset));
+            count_drop(len);
+            return false;
+        }
+
+        // The framing is fixed for the whole message
+        if (notifications == 0)
+        {
+            framed = session.framing == BLE_FRAMING_FRAMED;
+        }
+        size_t overhead = 3 + (framed ? BLE_FRAME_HDR_LEN : 0); // ATT header, frame header
+        size_t chunk = session.mtu - overhead; // The MTU is never below 23
+        if (chunk > len - offset) chunk = len - offset;
+
+        // Leave some mbufs to the host so RX keeps working while we stream
+        struct os_mbuf *om = NULL;
+        if (os_msys_num_free() > BLE_TX_MSYS_RESERVE)
+        {
+            om = ble_hs_mbuf_att_pkt();
+        }
+        if (om == NULL)
+        {
+            wait_for_resources();
+            continue;
+        }
+        if (framed)
+        {
+            uint8_t raw[BLE_FRAME_HDR_LEN];
+            frame.flags = (offset == 0 ? BLE_FRAME_FLAG_FIRST : 0) | (offset + chunk == len ? BLE_FRAME_FLAG_LAST : 0);
+            frame.seq = notifications;
+            ble_frame_encode(&frame, raw);
+            if (os_mbuf_append(om, raw, sizeof(raw)) != 0)
+            {
+                os_mbuf_free_chain(om);
+                wait_for_resources();
+                continue;
+            }
+        }
+        if (!ring_append_mbuf(om, pos + offset, chunk))
+        {
+            os_mbuf_free_chain(om);
+            wait_for_resources();
+            continue;
+        }
+
+        // The stack consumes the mbuf whatever the outcome
+        int rc = ble_gatts_notify_custom(conn_handle, *tx_attr_handle, om);
+        if (rc == BLE_HS_ENOMEM)
+        {
+            wait_for_resources();
+            continue;
+        }
+        if (rc != 0)
+        {
+            ESP_LOGW(TAG, "Notify to %u failed (rc=%d), dropping message", conn_handle, rc);
+            count_drop(len);
+            return false;
+        }
+
+        offset += chunk;
+        notifications++;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.sent_bytes += len;
+    stats.notifications += notifications;
+    portEXIT_CRITICAL(&stats_lock);
+    return true;
+}
+
+/**
+ * @brief Sends one message from the ring to its destination, fanning
+ *        broadcasts out to every subscribed client.
+ */
+static void transmit_message(const ble_tx_hdr_t *hdr, uint32_t pos)
+{
+    ble_session_t targets[BLE_SESSION_MAX];
+    size_t count;
+
+    if (hdr->conn_handle == BLE_TX_BROADCAST)
+    {
+        count = ble_session_list(targets, BLE_SESSION_MAX, true);
+    }
+    else
+    {
+        count = ble_session_get(hdr->conn_handle, &targets[0]) ? 1 : 0;
+        if (count == 0)
+        {
+            ESP_LOGW(TAG, "Client %u not connected, dropping %u byte message", hdr->conn_handle, hdr->len);
+            count_drop(hdr->len);
+            return;
+        }
+    }
+
+    if (*tx_attr_handle == 0)
+    {
+        count_drop(hdr->len);
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    bool sent = false;
+    uint8_t msg_id = next_msg_id++;
+    for (size_t i = 0; i < count; i++)
+    {
+        sent |= transmit_to(targets[i].conn_handle, pos, hdr->len, msg_id);
+        ble_session_add_pending(targets[i].conn_handle, -(int32_t)hdr->len);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    portENTER_CRITICAL(&stats_lock);
+    if (sent)
+    {
+        stats.sent_msgs++;
+    }
+    active_us += elapsed;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * @brief Sends the oldest record of the ring and releases its space.
+ *
+ * @return False if the ring is empty.
+ */
+static bool send_oldest(void)
+{
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring_head, memory_order_acquire) == tail)
+    {
+        return false;
+    }
+
+    ble_tx_hdr_t hdr;
+    ring_copy_out(tail, &hdr, sizeof(hdr));
+    if (hdr.kind == RECORD_SET_FRAMING)
+    {
+        // Applied in stream order: everything queued earlier was sent
+        // with the old framing, everything after uses the new one
+        ble_session_set_framing(hdr.conn_handle, (ble_framing_t)hdr.arg);
+    }
+    else
+    {
+        transmit_message(&hdr, tail + sizeof(hdr));
+    }
+
+    // Release the space only after the mbufs hold their own copies
+    atomic_store_explicit(&ring_tail, tail + sizeof(hdr) + hdr.len, memory_order_release);
+    portENTER_CRITICAL(&stats_lock);
+    stats.queued_msgs--;
+    portEXIT_CRITICAL(&stats_lock);
+    return true;
+}
+
+static void ble_tx_task(void *param)
+{
+    (void)param;
+    ESP_LOGI(TAG, "BLE TX task started.");
+
+    while (1)
+    {
+        if (!send_oldest())
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+}
+
+esp_err_t ble_tx_init(const uint16_t *attr_handle)
+{
+    tx_attr_handle = attr_handle;
+    atomic_init(&ring_head, 0);
+    atomic_init(&ring_tail, 0);
+
+    producer_lock = xSemaphoreCreateMutex();
+    if (producer_lock == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create TX producer lock.");
+        return ESP_FAIL;
+    }
+
+    // Above app_task so queued responses drain while commands run,
+    // below the NimBLE host task
+    if (xTaskCreate(ble_tx_task, "ble_tx", 3072, NULL, 6, &sender_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create BLE TX task.");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+bool ble_tx_begin(ble_tx_msg_t *msg, uint16_t conn_handle, TickType_t wait)
+{
+    if (producer_lock == NULL || xSemaphoreTake(producer_lock, wait) != pdTRUE)
+    {
+        return false;
+    }
+    msg->conn_handle = conn_handle;
+    msg->kind = RECORD_MESSAGE;
+    msg->arg = 0;
+    msg->start = atomic_load_explicit(&ring_head, memory_order_relaxed);
+
+    // The header is reserved here, so it must fit before anything is
+    // written behind it; the tail only moves on, so it keeps fitting
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (msg->start - tail + sizeof(ble_tx_hdr_t) > BLE_TX_RING_SIZE)
+    {
+        xSemaphoreGive(producer_lock);
+        ESP_LOGW(TAG, "TX ring full, no room for a message header");
+        return false;
+    }
+    msg->pos = msg->start + sizeof(ble_tx_hdr_t);
+    msg->overflow = false;
+    return true;
+}
+
+bool ble_tx_write(ble_tx_msg_t *msg, const void *data, size_t len)
+{
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    uint32_t used = msg->pos - tail;
+    if (msg->overflow || used > BLE_TX_RING_SIZE || len > BLE_TX_RING_SIZE - used ||
+        msg->pos - msg->start + len > UINT16_MAX)
+    {
+        msg->overflow = true;
+        return false;
+    }
+    ring_copy_in(msg->pos, data, len);
+    msg->pos += len;
+    return true;
+}
+
+bool ble_tx_commit(ble_tx_msg_t *msg)
+{
+    ble_tx_hdr_t hdr = {
+        .len = (uint16_t)(msg->pos - msg->start - sizeof(ble_tx_hdr_t)),
+        .conn_handle = msg->conn_handle,
+        .kind = msg->kind,
+        .arg = msg->arg,
+    };
+
+    if (msg->overflow)
+    {
+        xSemaphoreGive(producer_lock);
+        ESP_LOGW(TAG, "TX ring full, dropping message");
+        count_drop(hdr.len);
+        return false;
+    }
+
+    ring_copy_in(msg->start, &hdr, sizeof(hdr));
+    if (hdr.conn_handle == BLE_TX_BROADCAST)
+    {
+        ble_session_t targets[BLE_SESSION_MAX];
+        size_t count = ble_session_list(targets, BLE_SESSION_MAX, true);
+        for (size_t i = 0; i < count; i++)
+        {
+            ble_session_add_pending(targets[i].conn_handle, hdr.len);
+        }
+    }
+    else
+    {
+        ble_session_add_pending(hdr.conn_handle, hdr.len);
+    }
+    portENTER_CRITICAL(&stats_lock);
+    stats.queued_msgs++;
+    portEXIT_CRITICAL(&stats_lock);
+    atomic_store_explicit(&ring_head, msg->pos, memory_order_release);
+    xSemaphoreGive(producer_lock);
+
+    xTaskNotifyGive(sender_task);
+    return true;
+}
+
+bool ble_tx_send(uint16_t conn_handle, const void *data, size_t len, TickType_t wait)
+{
+    ble_tx_msg_t msg;
+    if (!ble_tx_begin(&msg, conn_handle, wait))
+    {
+        count_drop(len);
+        return false;
+    }
+    ble_tx_write(&msg, data, len);
+    return ble_tx_commit(&msg);
+}
+
+bool ble_tx_set_framing(uint16_t conn_handle, ble_framing_t framing, TickType_t wait)
+{
+    ble_tx_msg_t msg;
+    if (conn_handle == BLE_TX_BROADCAST || !ble_tx_begin(&msg, conn_handle, wait))
+    {
+        return false;
+    }
+    msg.kind = RECORD_SET_FRAMING;
+    msg.arg = framing;
+    return ble_tx_commit(&msg);
+}
+
+void ble_tx_on_notify_tx(void)
+{
+    if (sender_task != NULL)
+    {
+        xTaskNotifyGive(sender_task);
+    }
+}
+
+void ble_tx_get_stats(ble_tx_stats_t *out)
+{
+    uint32_t head = atomic_load(&ring_head);
+    uint32_t tail = atomic_load(&ring_tail);
+
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    int64_t active = active_us;
+    portEXIT_CRITICAL(&stats_lock);
+
+    out->queued_bytes = head - tail;
+    out->bytes_per_sec = active > 0 ? (uint32_t)((int64_t)out->sent_bytes * 1000000 / active) : 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file ble_tx.h
+ * @brief Asynchronous, flow-controlled transmitter for BLE notifications.
+ *
+ * Outgoing messages are appended to a byte ring buffer and return to the
+ * caller immediately. A dedicated sender task drains the ring, splits each
+ * message into MTU-sized notifications and builds the notification mbufs
+ * straight from the ring. It keeps pushing while the NimBLE mbuf pool has
+ * room and parks when the pool is exhausted, resuming on the next
+ * BLE_GAP_EVENT_NOTIFY_TX or new data instead of sleeping after every chunk.
+ *
+ * Every message is addressed either to one client or to all subscribed
+ * clients (BLE_TX_BROADCAST). Broadcasts are stored once and fanned out by
+ * the sender, which reads the clients' MTUs from the session table.
+ *
+ * Clients in framed mode get a ble_frame.h header in front of every
+ * notification, built into the same mbuf as the payload slice.
+ */
+
+#ifndef BLE_TX_H
+#define BLE_TX_H
+
+#include "app_includes.h"
+#include "ble_session.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Destination of messages sent to every subscribed client.
+#define BLE_TX_BROADCAST 0xFFFF
+
+// Size of the TX ring buffer in bytes, must be a power of two.
+#define BLE_TX_RING_SIZE 4096
+
+// Number of msys mbufs left for the rest of the host (RX, ATT responses)
+// before the sender stops allocating notifications.
+#define BLE_TX_MSYS_RESERVE 4
+
+// How long the sender parks when the mbuf pool is exhausted before it
+// retries on its own. Normally a NOTIFY_TX event wakes it up earlier.
+#define BLE_TX_RETRY_MS 20
+
+/**
+ * @brief Transmit statistics.
+ */
+typedef struct
+{
+    uint32_t queued_bytes;    // Bytes currently waiting in the ring
+    uint32_t queued_msgs;     // Messages currently waiting in the ring
+    uint32_t sent_msgs;       // Messages fully sent
+    uint32_t sent_bytes;      // Payload bytes sent
+    uint32_t notifications;   // Notifications handed to the stack
+    uint32_t dropped_msgs;    // Messages dropped (ring full, no link)
+    uint32_t dropped_bytes;   // Bytes of dropped messages
+    uint32_t stalls;          // Times the sender parked on mbuf exhaustion
+    uint32_t bytes_per_sec;   // Achieved throughput while transmitting
+} ble_tx_stats_t;
+
+/**
+ * @brief A message being written into the TX ring.
+ *
+ * Obtained with ble_tx_begin() and finished with ble_tx_commit(). While a
+ * message is open, other producers wait for it to be committed.
+ */
+typedef struct
+{
+    uint16_t conn_handle; // Destination of the message
+    uint8_t kind;         // Record kind, set by ble_tx_begin()
+    uint8_t arg;
+    uint32_t start;       // Ring position of the message header
+    uint32_t pos;         // Ring position of the next payload byte
+    bool overflow;        // Set when the payload did not fit into the ring
+} ble_tx_msg_t;
+
+/**
+ * @brief Creates the TX ring and starts the sender task.
+ *
+ * @param attr_handle Pointer to the value handle of the TX characteristic.
+ *                    It is read by the sender, so it may be filled in later
+ *                    when the GATT services are registered.
+ * @return ESP_OK on success, or an error code on failure.
+ */
+esp_err_t ble_tx_init(const uint16_t *attr_handle);
+
+/**
+ * @brief Starts a new message in the TX ring.
+ *
+ * @param msg The message state to initialize.
+ * @param conn_handle The destination client, or BLE_TX_BROADCAST.
+ * @param wait How long to wait for other producers to finish their message.
+ *             Pass 0 from the NimBLE host task.
+ * @return True if the message was started, false if the ring is busy or
+ *         has no room for the message header.
+ */
+bool ble_tx_begin(ble_tx_msg_t *msg, uint16_t conn_handle, TickType_t wait);
+
+/**
+ * @brief Appends payload bytes to an open message.
+ *
+ * @param msg The open message.
+ * @param data The bytes to append.
+ * @param len The number of bytes.
+ * @return True if the bytes fit, false if the ring is full (the message
+ *         will be dropped on commit).
+ */
+bool ble_tx_write(ble_tx_msg_t *msg, const void *data, size_t len);
+
+/**
+ * @brief Publishes an open message to the sender.
+ *
+ * @param msg The open message.
+ * @return True if the message was queued, false if it was dropped.
+ */
+bool ble_tx_commit(ble_tx_msg_t *msg);
+
+/**
+ * @brief Queues a complete message for transmission.
+ *
+ * @param conn_handle The destination client, or BLE_TX_BROADCAST.
+ * @param data The message bytes.
+ * @param len The message length.
+ * @param wait How long to wait for other producers, see ble_tx_begin().
+ * @return True if the message was queued, false if it was dropped.
+ */
+bool ble_tx_send(uint16_t conn_handle, const void *data, size_t len, TickType_t wait);
+
+/**
+ * @brief Switches the notification framing of one client.
+ *
+ * The switch is queued like a message, so it takes effect exactly between
+ * the messages committed before and after this call.
+ *
+ * @param conn_handle The client, not BLE_TX_BROADCAST.
+ * @param framing The new framing.
+ * @param wait How long to wait for other producers, see ble_tx_begin().
+ * @return True if the switch was queued.
+ */
+bool ble_tx_set_framing(uint16_t conn_handle, ble_framing_t framing, TickType_t wait);
+
+/**
+ * @brief Wakes the sender after the stack finished a notification.
+ *
+ * Called by the BLE manager on BLE_GAP_EVENT_NOTIFY_TX.
+ */
+void ble_tx_on_notify_tx(void);
+
+/**
+ * @brief Gets a snapshot of the transmit statistics.
+ *
+ * @param[out] stats The statistics.
+ */
+void ble_tx_get_stats(ble_tx_stats_t *stats);
+
+#endif // BLE_TX_H
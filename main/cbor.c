@@ -0,0 +1,490 @@
+/**
+ * @file cbor.c
+ * @brief Implementation of the CBOR encoder, decoder and JSON transcoder.
+ */
+
+#include "cbor.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Well-known object keys. The id of a key is its index plus one, so the
+ * first 23 keys encode in a single byte. Clients rely on these ids: only
+ * ever append to this table.
+ */
+static const char *const known_keys[] = {
+    "error", "status", "wifi", "rssi", "ip", "heap", "uptime", "ble",
+    "saved_ssid", "autoconnect", "devname", "nvs_free", "available_networks", "ssid", "encryption", "note",
+    "scanning", "commands", "retry_after_ms", "hello", "framing", "caps", "blelink",
+    // Diagnostics and benchmarks
+    "queue", "depth", "capacity", "high_water", "accepted", "rejected", "avg_exec_us", "tx",
+    "queued_bytes", "queued_msgs", "sent_msgs", "sent_bytes", "notifications", "dropped_msgs", "dropped_bytes", "stalls",
+    "bytes_per_sec", "sessions", "conn", "mtu", "subscribed", "tx_pending", "profile", "itvl_us",
+    "latency", "timeout_ms", "data_len", "tx_phy", "rx_phy", "link", "bench", "results",
+    "frame_hdr", "encoding",
+    // Request correlation
+    "rid", "pending", "connect", "scan", "reason",
+    // Status deltas
+    "delta", "v", "base", "watch",
+};
+
+#define KNOWN_KEY_COUNT (sizeof(known_keys) / sizeof(known_keys[0]))
+
+// ==========================================================
+// ENCODER
+// ==========================================================
+
+void cbor_writer_init(cbor_writer_t *w, uint8_t *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->overflow = false;
+}
+
+static void put_bytes(cbor_writer_t *w, const void *data, size_t len)
+{
+    if (w->overflow || len > w->size - w->len)
+    {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void put_byte(cbor_writer_t *w, uint8_t byte)
+{
+    put_bytes(w, &byte, 1);
+}
+
+/**
+ * @brief Writes a head in its shortest form, as required for canonical CBOR.
+ */
+static void put_head(cbor_writer_t *w, uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    size_t len;
+    major <<= 5;
+
+    if (value < 24)
+    {
+        head[0] = major | (uint8_t)value;
+        len = 1;
+    }
+    else if (value <= UINT8_MAX)
+    {
+        head[0] = major | 24;
+        head[1] = (uint8_t)value;
+        len = 2;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        head[0] = major | 25;
+        head[1] = (uint8_t)(value >> 8);
+        head[2] = (uint8_t)value;
+        len = 3;
+    }
+    else if (value <= UINT32_MAX)
+    {
+        head[0] = major | 26;
+        for (int i = 0; i < 4; i++) head[1 + i] = (uint8_t)(value >> (24 - 8 * i));
+        len = 5;
+    }
+    else
+    {
+        head[0] = major | 27;
+        for (int i = 0; i < 8; i++) head[1 + i] = (uint8_t)(value >> (56 - 8 * i));
+        len = 9;
+    }
+    put_bytes(w, head, len);
+}
+
+void cbor_put_uint(cbor_writer_t *w, uint64_t value)
+{
+    put_head(w, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_put_int(cbor_writer_t *w, int64_t value)
+{
+    if (value < 0)
+    {
+        put_head(w, CBOR_MAJOR_NEGINT, (uint64_t)(-1 - value));
+    }
+    else
+    {
+        put_head(w, CBOR_MAJOR_UINT, (uint64_t)value);
+    }
+}
+
+void cbor_put_text(cbor_writer_t *w, const char *str, size_t len)
+{
+    put_head(w, CBOR_MAJOR_TEXT, len);
+    put_bytes(w, str, len);
+}
+
+void cbor_put_bool(cbor_writer_t *w, bool value)
+{
+    put_byte(w, (CBOR_MAJOR_SIMPLE << 5) | (value ? CBOR_TRUE : CBOR_FALSE));
+}
+
+void cbor_put_null(cbor_writer_t *w)
+{
+    put_byte(w, (CBOR_MAJOR_SIMPLE << 5) | CBOR_NULL);
+}
+
+void cbor_put_double(cbor_writer_t *w, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t out[9] = {(CBOR_MAJOR_SIMPLE << 5) | 27};
+    for (int i = 0; i < 8; i++) out[1 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    put_bytes(w, out, sizeof(out));
+}
+
+void cbor_put_array(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_put_map(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_MAP, count);
+}
+
+// ==========================================================
+// DECODER
+// ==========================================================
+
+bool cbor_is_request(const char *buf, size_t len)
+{
+    return len > 0 && ((uint8_t)buf[0] >> 5) == CBOR_MAJOR_ARRAY;
+}
+
+void cbor_reader_init(cbor_reader_t *r, void *buf, size_t len)
+{
+    r->buf = buf;
+    r->len = len;
+    r->pos = 0;
+    r->head = 0;
+}
+
+bool cbor_get_head(cbor_reader_t *r, uint8_t *major, uint64_t *value)
+{
+    if (r->pos >= r->len)
+    {
+        return false;
+    }
+    r->head = r->pos;
+    uint8_t initial = r->buf[r->pos++];
+    uint8_t info = initial & 0x1F;
+    *major = initial >> 5;
+
+    if (info < 24)
+    {
+        *value = info;
+        return true;
+    }
+    if (info > 27 || (*major == CBOR_MAJOR_SIMPLE && info > 24))
+    {
+        // Indefinite lengths, floats and reserved values are not accepted in requests
+        return false;
+    }
+
+    size_t bytes = (size_t)1 << (info - 24);
+    if (r->len - r->pos < bytes)
+    {
+        return false;
+    }
+    *value = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        *value = (*value << 8) | r->buf[r->pos++];
+    }
+    return true;
+}
+
+char *cbor_take_text(cbor_reader_t *r, uint64_t len)
+{
+    if (len > r->len - r->pos)
+    {
+        return NULL;
+    }
+    // The head is at least one byte, so the terminator never reaches the
+    // next item
+    char *str = (char *)r->buf + r->head;
+    memmove(str, r->buf + r->pos, (size_t)len);
+    str[len] = '\0';
+    r->pos += (size_t)len;
+    return str;
+}
+
+// ==========================================================
+// KEY DICTIONARY
+// ==========================================================
+
+uint32_t cbor_key_id(const char *key, size_t len)
+{
+    for (size_t i = 0; i < KNOWN_KEY_COUNT; i++)
+    {
+        if (strncmp(known_keys[i], key, len) == 0 && known_keys[i][len] == '\0')
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+const char *cbor_key_name(uint32_t id)
+{
+    return (id >= 1 && id <= KNOWN_KEY_COUNT) ? known_keys[id - 1] : NULL;
+}
+
+// ==========================================================
+// JSON TRANSCODER
+// ==========================================================
+
+static const char *skip_ws(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Decodes one JSON string escape.
+ *
+ * @param p Points at the character after the backslash; advanced past the escape.
+ * @param out Receives the UTF-8 bytes, NULL to only measure.
+ * @return The number of bytes produced, or -1 if the escape is invalid.
+ */
+static int decode_escape(const char **p, char *out)
+{
+    char c = *(*p)++;
+    char tmp[3];
+    int n = 1;
+
+    switch (c)
+    {
+    case '"': tmp[0] = '"'; break;
+    case '\\': tmp[0] = '\\'; break;
+    case '/': tmp[0] = '/'; break;
+    case 'b': tmp[0] = '\b'; break;
+    case 'f': tmp[0] = '\f'; break;
+    case 'n': tmp[0] = '\n'; break;
+    case 'r': tmp[0] = '\r'; break;
+    case 't': tmp[0] = '\t'; break;
+    case 'u':
+    {
+        uint32_t cp = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            int v = hex_value(*(*p)++);
+            if (v < 0) return -1;
+            cp = (cp << 4) | v;
+        }
+        // Surrogate pairs never occur in our responses; keep the BMP only
+        if (cp < 0x80)
+        {
+            tmp[0] = (char)cp;
+        }
+        else if (cp < 0x800)
+        {
+            tmp[0] = (char)(0xC0 | (cp >> 6));
+            tmp[1] = (char)(0x80 | (cp & 0x3F));
+            n = 2;
+        }
+        else
+        {
+            tmp[0] = (char)(0xE0 | (cp >> 12));
+            tmp[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            tmp[2] = (char)(0x80 | (cp & 0x3F));
+            n = 3;
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    if (out != NULL) memcpy(out, tmp, n);
+    return n;
+}
+
+/**
+ * @brief Transcodes a JSON string, or an object key if key is true.
+ */
+static const char *transcode_string(const char *p, cbor_writer_t *w, bool key)
+{
+    const char *start = ++p; // Skip the opening quote
+
+    // First pass: find the end and the decoded length
+    size_t len = 0;
+    bool escaped = false;
+    while (*p != '"')
+    {
+        if (*p == '\0') return NULL;
+        if (*p == '\\')
+        {
+            p++;
+            int n = decode_escape(&p, NULL);
+            if (n < 0) return NULL;
+            len += n;
+            escaped = true;
+        }
+        else
+        {
+            p++;
+            len++;
+        }
+    }
+    const char *end = p;
+
+    if (key && !escaped)
+    {
+        uint32_t id = cbor_key_id(start, len);
+        if (id != 0)
+        {
+            cbor_put_uint(w, id);
+            return end + 1;
+        }
+    }
+
+    if (!escaped)
+    {
+        cbor_put_text(w, start, len);
+        return end + 1;
+    }
+
+    // Second pass: decode the escapes straight into the output
+    put_head(w, CBOR_MAJOR_TEXT, len);
+    if (w->overflow || len > w->size - w->len)
+    {
+        w->overflow = true;
+        return end + 1;
+    }
+    char *out = (char *)w->buf + w->len;
+    for (p = start; p < end;)
+    {
+        if (*p == '\\')
+        {
+            p++;
+            out += decode_escape(&p, out);
+        }
+        else
+        {
+            *out++ = *p++;
+        }
+    }
+    w->len += len;
+    return end + 1;
+}
+
+static const char *transcode_number(const char *p, cbor_writer_t *w)
+{
+    char *end;
+    long long value = strtoll(p, &end, 10);
+    if (end == p)
+    {
+        return NULL;
+    }
+    if (*end != '.' && *end != 'e' && *end != 'E')
+    {
+        cbor_put_int(w, value);
+        return end;
+    }
+    double d = strtod(p, &end);
+    cbor_put_double(w, d);
+    return end;
+}
+
+static const char *transcode_value(const char *p, cbor_writer_t *w, int depth)
+{
+    p = skip_ws(p);
+    if (depth > CBOR_MAX_DEPTH)
+    {
+        return NULL;
+    }
+
+    switch (*p)
+    {
+    case '{':
+        put_byte(w, (CBOR_MAJOR_MAP << 5) | 31); // Indefinite-length map
+        p = skip_ws(p + 1);
+        while (*p != '}')
+        {
+            if (*p != '"') return NULL;
+            p = transcode_string(p, w, true);
+            if (p == NULL) return NULL;
+            p = skip_ws(p);
+            if (*p++ != ':') return NULL;
+            p = transcode_value(p, w, depth + 1);
+            if (p == NULL) return NULL;
+            p = skip_ws(p);
+            if (*p == ',') p = skip_ws(p + 1);
+            else if (*p != '}') return NULL;
+        }
+        put_byte(w, 0xFF); // Break
+        return p + 1;
+
+    case '[':
+        put_byte(w, (CBOR_MAJOR_ARRAY << 5) | 31);
+        p = skip_ws(p + 1);
+        while (*p != ']')
+        {
+            p = transcode_value(p, w, depth + 1);
+            if (p == NULL) return NULL;
+            p = skip_ws(p);
+            if (*p == ',') p = skip_ws(p + 1);
+            else if (*p != ']') return NULL;
+        }
+        put_byte(w, 0xFF);
+        return p + 1;
+
+    case '"':
+        return transcode_string(p, w, false);
+
+    case 't':
+        if (strncmp(p, "true", 4) != 0) return NULL;
+        cbor_put_bool(w, true);
+        return p + 4;
+
+    case 'f':
+        if (strncmp(p, "false", 5) != 0) return NULL;
+        cbor_put_bool(w, false);
+        return p + 5;
+
+    case 'n':
+        if (strncmp(p, "null", 4) != 0) return NULL;
+        cbor_put_null(w);
+        return p + 4;
+
+    default:
+        return transcode_number(p, w);
+    }
+}
+
+size_t cbor_from_json(const char *json, uint8_t *out, size_t size, bool *too_large)
+{
+    cbor_writer_t w;
+    cbor_writer_init(&w, out, size);
+    // Parsing goes on after an overflow, so the two failures can be told apart
+    const char *end = transcode_value(json, &w, 0);
+    bool valid = end != NULL && *skip_ws(end) == '\0';
+    if (too_large != NULL)
+    {
+        *too_large = valid && w.overflow;
+    }
+    if (!valid || w.overflow)
+    {
+        return 0;
+    }
+    return w.len;
+}
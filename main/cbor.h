@@ -0,0 +1,138 @@
+/**
+ * @file cbor.h
+ * @brief Minimal CBOR (RFC 8949) encoder and decoder for the binary protocol.
+ *
+ * Clients that negotiate the binary encoding with hello(..., "cbor") send
+ * commands as a CBOR array whose first item is the command name or its
+ * permanent numeric id (see command_ids.h), followed by the arguments:
+ *
+ *     [0, "office", "secret"]      same as connect("office","secret")
+ *
+ * Responses are the same documents the text protocol produces, encoded as
+ * CBOR with the well-known object keys replaced by small integers (see
+ * cbor_key_name()). Unknown keys stay text strings, so new responses work
+ * without a protocol change.
+ */
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// CBOR major types.
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_NEGINT 1
+#define CBOR_MAJOR_BYTES 2
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_MAJOR_SIMPLE 7
+
+// Simple values.
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+
+// Deepest JSON nesting the transcoder accepts.
+#define CBOR_MAX_DEPTH 8
+
+/**
+ * @brief Output buffer of the encoder.
+ *
+ * Writes past the end set the overflow flag instead of failing each call,
+ * so a whole document can be encoded before checking once.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} cbor_writer_t;
+
+/**
+ * @brief Input cursor of the decoder.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    size_t head; // Position of the last head read
+} cbor_reader_t;
+
+void cbor_writer_init(cbor_writer_t *w, uint8_t *buf, size_t size);
+void cbor_put_uint(cbor_writer_t *w, uint64_t value);
+void cbor_put_int(cbor_writer_t *w, int64_t value);
+void cbor_put_text(cbor_writer_t *w, const char *str, size_t len);
+void cbor_put_bool(cbor_writer_t *w, bool value);
+void cbor_put_null(cbor_writer_t *w);
+void cbor_put_double(cbor_writer_t *w, double value);
+void cbor_put_array(cbor_writer_t *w, size_t count);
+void cbor_put_map(cbor_writer_t *w, size_t count);
+
+/**
+ * @brief Checks whether a command buffer holds a CBOR request.
+ *
+ * Text commands start with a printable ASCII character, CBOR requests with
+ * an array head (0x80-0x9f), so no mode is needed to tell them apart.
+ */
+bool cbor_is_request(const char *buf, size_t len);
+
+void cbor_reader_init(cbor_reader_t *r, void *buf, size_t len);
+
+/**
+ * @brief Reads a data item head.
+ *
+ * @param r The reader.
+ * @param[out] major The major type.
+ * @param[out] value The argument (length, count, integer or simple value).
+ * @return False on truncated input or unsupported encodings (indefinite
+ *         lengths, floats).
+ */
+bool cbor_get_head(cbor_reader_t *r, uint8_t *major, uint64_t *value);
+
+/**
+ * @brief Reads a text string and null-terminates it in place.
+ *
+ * The string is moved over its own head to make room for the terminator,
+ * so the input buffer is modified, as with the text command tokenizer.
+ *
+ * @param r The reader, positioned right after the head of the string.
+ * @param len The length from the head.
+ * @return The null-terminated string, or NULL on truncated input.
+ */
+char *cbor_take_text(cbor_reader_t *r, uint64_t len);
+
+/**
+ * @brief Transcodes a JSON document into CBOR.
+ *
+ * Objects and arrays become indefinite-length maps and arrays, integers
+ * stay integers, other numbers become doubles and known object keys are
+ * replaced by their integer ids.
+ *
+ * @param json The null-terminated JSON text.
+ * @param out The output buffer.
+ * @param size The size of the output buffer.
+ * @param[out] too_large If not NULL, set to whether the JSON was well-formed
+ *             but its CBOR did not fit.
+ * @return The length of the CBOR document, or 0 if the JSON is malformed or
+ *         does not fit.
+ */
+size_t cbor_from_json(const char *json, uint8_t *out, size_t size, bool *too_large);
+
+/**
+ * @brief Gets the integer id of a well-known object key.
+ *
+ * @return The id, or 0 if the key has none.
+ */
+uint32_t cbor_key_id(const char *key, size_t len);
+
+/**
+ * @brief Gets the name of a key id, NULL if unknown.
+ */
+const char *cbor_key_name(uint32_t id);
+
+#endif // CBOR_H
@@ -4,248 +4,408 @@
  */
 
 #include "command_handler.h"
-#include "minmea.h"
 #include "app_includes.h"
 #include "nvs.h" 
 #include <string.h>
 #include <stdlib.h>
-#include "driver/uart.h"
 #include "driver/gpio.h"
 #include "ble_manager.h"
 #include "wifi_manager.h"
 #include "driver/gpio.h"
 #include "nvs_storage.h"
-#include "utils.h"
 #include "app_task.h" 
+#include "command_registry.h"
+#include "ble_frame.h"
+#include "cbor.h"
+#include "status_model.h"
+#include "json_writer.h"
+#include "json_reader.h"
+#include "scan_store.h"
+#include "device_state.h"
+#include "telemetry.h"
+#include "esp_mac.h"
 
 static const char *TAG = "CMD_HANDLER";
 
+// Deferred commands waiting for WiFi outcomes, and those whose outcome has
+// arrived. The app task adds and answers them; the event loop task only
+// moves them from waiting to finished.
+static portMUX_TYPE pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool connect_pending;
+static command_token_t pending_connect;
+static command_token_t pending_scans[COMMAND_MAX_PENDING_SCANS];
+static size_t pending_scan_count;
+static bool connect_finished;
+static command_token_t finished_connect;
+static wifi_manager_event_t finished_event;
+static int finished_reason;
+static command_token_t finished_scans[COMMAND_MAX_PENDING_SCANS];
+static size_t finished_scan_count;
 
+// Client that issued the command being executed, and its request id
+static uint16_t reply_to = BLE_MANAGER_BROADCAST;
+static uint32_t current_rid = COMMAND_RID_NONE;
 
-// --- Command Handler Forward Declarations ---
-static void cmd_echo(const char *arg);
-static void cmd_connect(const char *ssid, const char *password, bool save);
-static void cmd_reconnect(void);
-static void cmd_disconnect(void);
-static void cmd_led(void);
-static void cmd_forget(void);
-static void cmd_status(void);
-static void cmd_set_auto_connect(bool value);
-static void cmd_set_name(const char *name);
-static void cmd_reset(void);
-static void cmd_restart(void);
-static void cmd_help(void);
-//static void gps(void);
-
-
-// static TaskHandle_t s_gps_task_handle = NULL;
-// // --- U-BLOX M8N CONFIGURATION COMMANDS ---
-// // 1. UBX-CFG-PRT: Set UART1 to 115200 baud, 8N1, UBX+NMEA out
-// static const uint8_t UBX_SET_115200[] = {
-//     0xB5, 0x62, 0x06, 0x00, 0x14, 0x00, 0x01, 0x00, 0x00, 0x00, 
-//     0xD0, 0x08, 0x00, 0x00, 0x00, 0xC2, 0x01, 0x00, 0x07, 0x00, 
-//     0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0xC4, 0x96
-// };
-
-// // 2. UBX-CFG-RATE: Set update rate to 10Hz (100ms)
-// static const uint8_t UBX_SET_10HZ[] = {
-//     0xB5, 0x62, 0x06, 0x08, 0x06, 0x00, 0x64, 0x00, 0x01, 0x00, 
-//     0x01, 0x00, 0x7A, 0x12
-// };
-
-// // 3. UBX-CFG-GNSS: Enable GPS + GLONASS (Better signal for M8N)
-// // This is optional but recommended for M8N to get faster lock
-// static const uint8_t UBX_ENABLE_GPS_GLONASS[] = {
-//     0xB5, 0x62, 0x06, 0x3E, 0x2C, 0x00, 0x00, 0x00, 0x20, 0x05, 
-//     0x00, 0x08, 0x10, 0x00, 0x01, 0x00, 0x01, 0x01, 0x01, 0x01, 
-//     0x03, 0x00, 0x01, 0x00, 0x01, 0x01, 0x04, 0x00, 0x08, 0x00, 
-//     0x00, 0x00, 0x01, 0x01, 0x05, 0x00, 0x03, 0x00, 0x01, 0x00, 
-//     0x01, 0x01, 0x06, 0x08, 0x0E, 0x00, 0x01, 0x00, 0x01, 0x01, 
-//     0xFC, 0x11
-// };
-
-// // ==========================================================
-// // GPS BACKGROUND TASK (High Performance 10Hz Mode)
-// // ==========================================================
-// static void gps_task_entry(void *arg) {
-//     ESP_LOGI(TAG, ">>> GPS TASK STARTED (10Hz High Performance) <<<");
-
-//     // 1. Initial Setup at DEFAULT 9600
-//     // We must start at 9600 to talk to the GPS before we configure it.
-//     if (!uart_is_driver_installed(GPS_UART_NUM)) {
-//         uart_config_t uart_config = {
-//             .baud_rate = 9600,
-//             .data_bits = UART_DATA_8_BITS,
-//             .parity = UART_PARITY_DISABLE,
-//             .stop_bits = UART_STOP_BITS_1,
-//             .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-//             .source_clk = UART_SCLK_DEFAULT,
-//         };
-//         uart_driver_install(GPS_UART_NUM, GPS_BUF_SIZE * 2, 0, 0, NULL, 0);
-//         uart_param_config(GPS_UART_NUM, &uart_config);
-//         uart_set_pin(GPS_UART_NUM, GPS_TX_PIN, GPS_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-//     }
-
-//     // --- BAUD RATE SWITCHING SEQUENCE ---
-//     ESP_LOGW(TAG, "Switching GPS to 115200 baud...");
-
-//     // A. Send command to GPS to switch to 115200 (Sent at 9600)
-//     uart_write_bytes(GPS_UART_NUM, (const char*)UBX_SET_115200, sizeof(UBX_SET_115200));
-    
-//     // B. CRITICAL DELAY: Give GPS time to process command and change its internal clock
-//     vTaskDelay(pdMS_TO_TICKS(200)); 
-
-//     // C. Now switch ESP32 to 115200 to match
-//     uart_flush(GPS_UART_NUM);
-//     uart_set_baudrate(GPS_UART_NUM, 115200);
-//     ESP_LOGI(TAG, "ESP32 UART switched to 115200");
-//     vTaskDelay(pdMS_TO_TICKS(100)); // Let connection stabilize
-
-//     // D. Send 10Hz Command (Sent at 115200)
-//     uart_write_bytes(GPS_UART_NUM, (const char*)UBX_SET_10HZ, sizeof(UBX_SET_10HZ));
-//     vTaskDelay(pdMS_TO_TICKS(50));
-
-//     // E. (Optional) Enable GLONASS for better M8N performance
-//     uart_write_bytes(GPS_UART_NUM, (const char*)UBX_ENABLE_GPS_GLONASS, sizeof(UBX_ENABLE_GPS_GLONASS));
-
-//     uart_flush_input(GPS_UART_NUM); 
-
-//     uint8_t *data = (uint8_t *) malloc(GPS_BUF_SIZE);
-//     char line_buffer[256];
-//     int line_pos = 0;
-//     char response_buffer[128]; 
-
-//     // Timers
-//     uint32_t last_valid_send = 0;
-//     uint32_t last_data_received_time = pdTICKS_TO_MS(xTaskGetTickCount());
-
-//     while (1) {
-//         // Read fast! 10Hz means data comes every 100ms.
-//         int len = uart_read_bytes(GPS_UART_NUM, data, GPS_BUF_SIZE, pdMS_TO_TICKS(50));
-//         uint32_t now = pdTICKS_TO_MS(xTaskGetTickCount());
-
-//         if (len > 0) {
-//             last_data_received_time = now;
-
-//             for (int i = 0; i < len; i++) {
-//                 char c = (char)data[i];
-                
-//                 if (c == '\n' || c == '\r') {
-//                     line_buffer[line_pos] = '\0'; 
-                    
-//                     if (line_pos > 5 && line_buffer[0] == '$') {
-//                         // Accept GNRMC (GLONASS+GPS) or GPRMC (GPS only)
-//                         if (strstr(line_buffer, "RMC") != NULL) {
-                            
-//                             struct minmea_sentence_rmc frame;
-//                             if (minmea_parse_rmc(&frame, line_buffer)) {
-                                
-//                                 if (frame.valid) {
-//                                     // SEND DATA AS FAST AS IT COMES (Limit to approx 10Hz max to not flood BLE)
-//                                     // 80ms throttle ensures we don't choke the BLE stack
-//                                     if ((now - last_valid_send) > 80) { 
-//                                         float lat = minmea_tocoord(&frame.latitude);
-//                                         float lon = minmea_tocoord(&frame.longitude);
-//                                         float speed = minmea_tofloat(&frame.speed) * 1.852; 
-                                        
-//                                         snprintf(response_buffer, sizeof(response_buffer), 
-//                                                  "{\"gps\":true, \"lat\":%f, \"lon\":%f, \"kph\":%.2f}", 
-//                                                  lat, lon, speed);
-                                        
-//                                         ble_manager_send_response(response_buffer);
-//                                         last_valid_send = now;
-//                                     }
-//                                 } else {
-//                                     // Searching... don't spam this, just once per 2s
-//                                     static uint32_t last_search = 0;
-//                                     if (now - last_search > 2000) {
-//                                         ble_manager_send_response("{\"gps\":false, \"status\":\"searching_10hz...\"}");
-//                                         last_search = now;
-//                                     }
-//                                 }
-//                             }
-//                         }
-//                     }
-//                     line_pos = 0; 
-//                 } else {
-//                     if (line_pos < sizeof(line_buffer) - 1) {
-//                         line_buffer[line_pos++] = c;
-//                     }
-//                 }
-//             }
-//         } else {
-//             // Failsafe: If no data for 5 seconds, the baud switch might have failed.
-//             if ((now - last_data_received_time) > 5000) {
-//                 ESP_LOGE(TAG, "GPS TIMEOUT: Reverting to 9600 baud to attempt recovery...");
-//                 uart_set_baudrate(GPS_UART_NUM, 9600);
-//                 last_data_received_time = now; // Reset timer to avoid loops
-//                 vTaskDelay(pdMS_TO_TICKS(1000));
-//             }
-//         }
-//     }
-//     free(data);
-//     vTaskDelete(NULL);
-// }
-
-// // ==========================================================
-// // GPS BACKGROUND TASK 
-// // ==========================================================
-
-// static void gps(void) {
-//     ESP_LOGI(TAG, "GPS Command Triggered!");
-    
-//     if (s_gps_task_handle != NULL) {
-//         ble_manager_send_response("{\"error\":\"already_running\"}");
-//         return;
-//     }
-
-//     // Create the task with 4096 stack size (sufficient for UART/printf)
-//     BaseType_t res = xTaskCreate(gps_task_entry, "gps_task", 4096, NULL, 5, &s_gps_task_handle);
-    
-//     if (res == pdPASS) {
-//         ble_manager_send_response("{\"status\":\"gps_started\"}");
-//     } else {
-//         ble_manager_send_response("{\"error\":\"task_create_failed\"}");
-//     }
-// }
+// Sent instead of a response that did not fit its buffer
+#define RESPONSE_TOO_LARGE "{\"error\":\"response too large\"}"
 
+// The document a writer built, or the error above when it overflowed, so a
+// clipped document never goes out
+static const char *written(const json_writer_t *w, const char *doc)
+{
+    if (w->overflow)
+    {
+        ESP_LOGW(TAG, "Response needs %u bytes, buffer has %u", (unsigned)w->len + 1, (unsigned)w->size);
+        return RESPONSE_TOO_LARGE;
+    }
+    return doc;
+}
+
+// --- Command Handler Forward Declarations ---
+static void cmd_echo(const command_args_t *args);
+static void cmd_connect(const command_args_t *args);
+static void cmd_scan(const command_args_t *args);
+static void cmd_reconnect(const command_args_t *args);
+static void cmd_disconnect(const command_args_t *args);
+static void cmd_led(const command_args_t *args);
+static void cmd_forget(const command_args_t *args);
+static void cmd_known(const command_args_t *args);
+static void cmd_networks(const command_args_t *args);
+static void cmd_priority(const command_args_t *args);
+static void cmd_status(const command_args_t *args);
+static void cmd_set_auto_connect(const command_args_t *args);
+static void cmd_set_name(const command_args_t *args);
+static void cmd_config(const command_args_t *args);
+static void cmd_get(const command_args_t *args);
+static void cmd_set(const command_args_t *args);
+static void cmd_dump(const command_args_t *args);
+static void cmd_reset(const command_args_t *args);
+static void cmd_restart(const command_args_t *args);
+static void cmd_help(const command_args_t *args);
+static void cmd_diag(const command_args_t *args);
+static void cmd_blelink(const command_args_t *args);
+static void cmd_hello(const command_args_t *args);
+static void cmd_queue(const command_args_t *args);
+static void cmd_status_rate(const command_args_t *args);
+static void cmd_wifi(const command_args_t *args);
+static void cmd_watch(const command_args_t *args);
+static void cmd_ack(const command_args_t *args);
 
 // --- STANDARD COMMANDS ---
 
-static void cmd_echo(const char *arg)
+static void cmd_echo(const command_args_t *args)
+{
+    command_handler_reply(args->argc > 0 ? args->argv[0].str : "");
+}
+
+// Connects to the given network and saves it, or with a NULL ssid to the
+// best known network
+static void connect_to(const char *ssid, const char *password)
+{
+    ESP_LOGI(TAG, "Executing command: connect to %s", ssid != NULL ? ssid : "the best known network");
+
+    // The outcome arrives as a WiFi event; answer it then, with this
+    // command's request id, and let the next commands run meanwhile
+    command_token_t token = command_handler_defer();
+    command_token_t superseded;
+    portENTER_CRITICAL(&pending_lock);
+    bool had_pending = connect_pending;
+    superseded = pending_connect;
+    pending_connect = token;
+    connect_pending = true;
+    portEXIT_CRITICAL(&pending_lock);
+    if (had_pending)
+    {
+        command_handler_complete(&superseded, "{\"connect\":\"failed\",\"error\":\"superseded\"}");
+    }
+
+    command_handler_reply("{\"status\":\"connecting\",\"pending\":true}");
+    esp_err_t err = ssid != NULL ? wifi_manager_connect(ssid, password) : wifi_manager_connect_known();
+    if (err != ESP_OK)
+    {
+        portENTER_CRITICAL(&pending_lock);
+        connect_pending = false;
+        portEXIT_CRITICAL(&pending_lock);
+        command_handler_reply("{\"connect\":\"failed\",\"error\":\"could not start\"}");
+        return;
+    }
+    if (ssid != NULL) nvs_storage_save_wifi_credentials(ssid, password);
+}
+
+static void cmd_scan(const command_args_t *args)
+{
+    command_token_t token = command_handler_defer();
+    portENTER_CRITICAL(&pending_lock);
+    bool queued = pending_scan_count < COMMAND_MAX_PENDING_SCANS;
+    if (queued)
+    {
+        pending_scans[pending_scan_count++] = token;
+    }
+    portEXIT_CRITICAL(&pending_lock);
+
+    if (!queued)
+    {
+        command_handler_reply("{\"error\":\"too many pending scans\"}");
+        return;
+    }
+    if (!wifi_manager_start_scan())
+    {
+        // Drop the token again; nothing will complete it
+        portENTER_CRITICAL(&pending_lock);
+        pending_scan_count--;
+        portEXIT_CRITICAL(&pending_lock);
+        command_handler_reply("{\"scan\":\"failed\",\"error\":\"busy\"}");
+        return;
+    }
+    command_handler_reply("{\"scan\":\"started\",\"pending\":true}");
+}
+
+/**
+ * @brief Records the outcome of a deferred connect or scan command.
+ *
+ * Runs on the default event loop task, which must not wait for room to
+ * transmit; the answers are sent by command_handler_finish_deferred().
+ */
+static void on_wifi_event(wifi_manager_event_t event, int reason)
+{
+    bool finished = false;
+    portENTER_CRITICAL(&pending_lock);
+    if (event == WIFI_MANAGER_EVT_SCAN_DONE)
+    {
+        // Scans requested from now on wait for the next one
+        for (size_t i = 0; i < pending_scan_count && finished_scan_count < COMMAND_MAX_PENDING_SCANS; i++)
+        {
+            finished_scans[finished_scan_count++] = pending_scans[i];
+        }
+        finished = pending_scan_count > 0;
+        pending_scan_count = 0;
+    }
+    else if (connect_pending)
+    {
+        finished_connect = pending_connect;
+        finished_event = event;
+        finished_reason = reason;
+        connect_finished = true;
+        connect_pending = false;
+        finished = true;
+    }
+    portEXIT_CRITICAL(&pending_lock);
+
+    if (finished)
+    {
+        app_task_request_deferred();
+    }
+}
+
+void command_handler_finish_deferred(void)
 {
-    ble_manager_send_response(arg);
+    command_token_t scans[COMMAND_MAX_PENDING_SCANS];
+    portENTER_CRITICAL(&pending_lock);
+    size_t scan_count = finished_scan_count;
+    memcpy(scans, finished_scans, scan_count * sizeof(command_token_t));
+    finished_scan_count = 0;
+    bool connected = connect_finished;
+    command_token_t token = finished_connect;
+    wifi_manager_event_t event = finished_event;
+    int reason = finished_reason;
+    connect_finished = false;
+    portEXIT_CRITICAL(&pending_lock);
+
+    if (scan_count > 0)
+    {
+        static char json[600];
+        static char networks[512];
+        wifi_manager_get_networks_json(networks, sizeof(networks));
+        json_writer_t w;
+        json_writer_init(&w, json, sizeof(json));
+        json_begin_object(&w);
+        json_put_key_string(&w, "scan", "done");
+        json_put_raw(&w, networks);
+        json_end_object(&w);
+        const char *msg = written(&w, json);
+        for (size_t i = 0; i < scan_count; i++)
+        {
+            command_handler_complete(&scans[i], msg);
+        }
+    }
+    if (!connected)
+    {
+        return;
+    }
+
+    // Room for a 32 byte SSID with every byte escaped as \uXXXX
+    char resp[256];
+    const char *msg = resp;
+    if (event == WIFI_MANAGER_EVT_CONNECTED)
+    {
+        // Which network it was matters when the best known one was chosen
+        esp_netif_ip_info_t ip_info = {0};
+        wifi_manager_get_ip_info(&ip_info);
+        wifi_ap_record_t ap_info = {0};
+        wifi_manager_get_ap_info(&ap_info);
+        char ip[16];
+        snprintf(ip, sizeof(ip), IPSTR, IP2STR(&ip_info.ip));
+        json_writer_t w;
+        json_writer_init(&w, resp, sizeof(resp));
+        json_begin_object(&w);
+        json_put_key_string(&w, "connect", "ok");
+        json_put_key_string(&w, "ssid", (const char *)ap_info.ssid);
+        json_put_key_string(&w, "ip", ip);
+        json_end_object(&w);
+        msg = written(&w, resp);
+    }
+    else
+    {
+        snprintf(resp, sizeof(resp), "{\"connect\":\"failed\",\"reason\":%d}", reason);
+    }
+    command_handler_complete(&token, msg);
 }
 
-static void cmd_connect(const char *ssid, const char *password, bool save)
+static void cmd_connect(const command_args_t *args)
 {
-    ESP_LOGI(TAG, "Executing command: connect to %s", ssid);
-    ble_manager_send_response("{\"status\":\"connecting\"}");
-    wifi_manager_connect(ssid, password);
-    if (save) nvs_storage_save_wifi_credentials(ssid, password);
+    connect_to(args->argv[0].str, args->argv[1].str);
 }
 
-static void cmd_reconnect(void)
+static void cmd_reconnect(const command_args_t *args)
 {
-    const char *ssid = nvs_storage_get_ssid();
-    if (ssid[0] == '\0') {
-        ble_manager_send_response("{\"error\":\"no saved credentials\"}");
+    nvs_storage_network_t first;
+    if (nvs_storage_get_networks(&first, 1) == 0) {
+        command_handler_reply("{\"error\":\"no saved credentials\"}");
         return;
     }
     ESP_LOGI(TAG, "Executing command: reconnect");
-    cmd_connect(ssid, nvs_storage_get_password(), false);
+    connect_to(NULL, NULL);
+}
+
+static void cmd_known(const command_args_t *args)
+{
+    nvs_storage_network_t networks[NVS_STORAGE_MAX_NETWORKS];
+    size_t count = nvs_storage_get_networks(networks, NVS_STORAGE_MAX_NETWORKS);
+
+    // Each entry fits in 260 bytes even with a 32 byte SSID escaped as \uXXXX
+    static char resp[16 + NVS_STORAGE_MAX_NETWORKS * 260];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "known");
+    json_begin_array(&w);
+    for (size_t i = 0; i < count; i++)
+    {
+        // Passwords never leave the device
+        json_begin_object(&w);
+        json_put_key_string(&w, "ssid", networks[i].ssid);
+        json_put_key_int(&w, "priority", networks[i].priority);
+        json_put_key(&w, "last_success");
+        json_put_uint(&w, networks[i].last_success);
+        json_put_key_bool(&w, "hint", networks[i].has_hint);
+        json_end_object(&w);
+    }
+    json_end_array(&w);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+static void cmd_networks(const command_args_t *args)
+{
+    int32_t offset = args->argc > 0 ? args->argv[0].num : 0;
+    int32_t count = args->argc > 1 ? args->argv[1].num : COMMAND_NETWORKS_PAGE;
+    if (offset < 0 || count < 1 || count > SCAN_STORE_TOP_K)
+    {
+        command_handler_reply("{\"error\":\"offset must be >= 0, count 1..20\"}");
+        return;
+    }
+
+    // Rendered from the scan store only now, one page at a time
+    static scan_store_entry_t page[SCAN_STORE_TOP_K];
+    size_t total;
+    size_t n = scan_store_read(offset, page, count, &total);
+    uint32_t age_ms = 0;
+    bool have_result = scan_store_age((uint32_t)(esp_timer_get_time() / 1000), &age_ms);
+    device_state_t state;
+    device_state_read(&state);
+
+    static char resp[768];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "networks");
+    json_begin_array(&w);
+    size_t sent = 0;
+    for (; sent < n; sent++)
+    {
+        const scan_store_entry_t *ap = &page[sent];
+        char bssid[18];
+        snprintf(bssid, sizeof(bssid), MACSTR, MAC2STR(ap->bssid));
+
+        // Entries that do not fit are left for the next page
+        json_writer_t mark = w;
+        json_begin_object(&w);
+        json_put_key_string(&w, "ssid", ap->ssid);
+        json_put_key_string(&w, "bssid", bssid);
+        json_put_key_int(&w, "rssi", ap->rssi);
+        json_put_key_int(&w, "channel", ap->channel);
+        json_put_key_int(&w, "auth", ap->authmode);
+        json_put_key_int(&w, "seen", ap->seen);
+        json_end_object(&w);
+        if (!json_writer_fits(&w, 96))
+        {
+            json_writer_rewind(&w, &mark);
+            break;
+        }
+    }
+    json_end_array(&w);
+    json_put_key_int(&w, "offset", offset);
+    json_put_key_int(&w, "total", total);
+    if (have_result)
+    {
+        json_put_key(&w, "age_ms");
+        json_put_uint(&w, age_ms);
+    }
+    json_put_key_bool(&w, "scanning", state.scanning);
+    if ((size_t)offset + sent < total)
+    {
+        json_put_key_int(&w, "next", offset + sent);
+    }
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+static void cmd_priority(const command_args_t *args)
+{
+    const char *ssid = args->argv[0].str;
+    int32_t priority = args->argv[1].num;
+    if (priority < 0 || priority > UINT8_MAX)
+    {
+        command_handler_reply("{\"error\":\"priority must be 0..255\"}");
+        return;
+    }
+    ESP_LOGI(TAG, "Executing command: priority of %s to %ld", ssid, (long)priority);
+    if (!nvs_storage_set_network_priority(ssid, (uint8_t)priority))
+    {
+        command_handler_reply("{\"error\":\"unknown network\"}");
+        return;
+    }
+
+    char resp[96];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key_string(&w, "ssid", ssid);
+    json_put_key_int(&w, "priority", priority);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
 }
 
-static void cmd_disconnect(void)
+static void cmd_disconnect(const command_args_t *args)
 {
     ESP_LOGI(TAG, "Executing command: disconnect");
     wifi_manager_disconnect();
-    ble_manager_send_response("{\"status\":\"disconnected\"}");
-    cmd_status(); 
+    command_handler_reply("{\"status\":\"disconnected\"}");
+    cmd_status(NULL);
 }
 #define LED_PIN 23
 
-static void cmd_led(void) {
+static void cmd_led(const command_args_t *args) {
     // 1. Static variable to keep track of the state (persists between calls)
     static bool led_state = false;
 
@@ -270,203 +430,1226 @@ static void cmd_led(void) {
 
 }
 
-static void cmd_forget(void)
+static void cmd_forget(const command_args_t *args)
 {
+    if (args->argc > 0)
+    {
+        ESP_LOGI(TAG, "Executing command: forget %s", args->argv[0].str);
+        if (!nvs_storage_forget_network(args->argv[0].str))
+        {
+            command_handler_reply("{\"error\":\"unknown network\"}");
+            return;
+        }
+        command_handler_reply("{\"status\":\"network_forgotten\"}");
+        return;
+    }
+
     ESP_LOGI(TAG, "Executing command: forget wifi");
     wifi_manager_disconnect();
-    nvs_storage_save_wifi_credentials("", "");
-    ble_manager_send_response("{\"status\":\"credentials_cleared\"}");
+    nvs_storage_forget_network(NULL);
+    command_handler_reply("{\"status\":\"credentials_cleared\"}");
     wifi_manager_start_scan();
 }
 
-static void cmd_status(void)
+size_t command_handler_build_status(char *json, size_t size)
 {
-    static char json[1024];
-    size_t offset = 0;
+    status_model_refresh();
+    return status_model_render_full(json, size);
+}
 
-    wifi_ap_record_t ap_info;
-    bool is_connected = wifi_manager_is_connected();
-    
-    char ssid_escaped[65];
-    json_escape(nvs_storage_get_ssid(), ssid_escaped, sizeof(ssid_escaped));
+// Shared by status() and the coalesced publication, both run on the app task
+static char status_json[1024];
 
-    char devname_escaped[65];
-    json_escape(nvs_storage_get_device_name(), devname_escaped, sizeof(devname_escaped));
+// A full snapshot is also the resync point of a watching client, which
+// acknowledges its version to get deltas relative to it
+static void cmd_status(const command_args_t *args)
+{
+    if (command_handler_build_status(status_json, sizeof(status_json)) == 0)
+    {
+        command_handler_reply(RESPONSE_TOO_LARGE);
+        return;
+    }
+    command_handler_reply(status_json);
+    if (reply_to != BLE_MANAGER_BROADCAST)
+    {
+        ble_session_set_status_sent(reply_to, status_model_version());
+    }
+}
 
-    nvs_stats_t nvs_stats;
-    nvs_get_stats(NULL, &nvs_stats);
+void command_handler_publish_status(uint16_t conn_handle)
+{
+    uint32_t version = status_model_refresh();
 
-    if (is_connected)
+    ble_session_t sessions[BLE_SESSION_MAX];
+    size_t count = 0;
+    size_t watchers = 0;
+    if (conn_handle == BLE_MANAGER_BROADCAST)
     {
-        esp_netif_ip_info_t ip_info;
-        wifi_manager_get_ap_info(&ap_info);
-        wifi_manager_get_ip_info(&ip_info);
-        offset = snprintf(json, sizeof(json),
-                          "{\"wifi\":true,\"rssi\":%d,\"ip\":\"" IPSTR "\",\"heap\":%lu,"
-                          "\"uptime\":%lld,\"ble\":%s,\"saved_ssid\":\"%s\","
-                          "\"autoconnect\":%s,\"devname\":\"%s\",\"nvs_free\":%zu}",
-                          ap_info.rssi, IP2STR(&ip_info.ip), (unsigned long)esp_get_free_heap_size(),
-                          (long long)esp_timer_get_time() / 1000000, ble_manager_is_connected() ? "true" : "false",
-                          ssid_escaped, nvs_storage_get_auto_connect() ? "true" : "false", devname_escaped, nvs_stats.free_entries);
+        count = ble_session_list(sessions, BLE_SESSION_MAX, true);
+    }
+    else if (ble_session_get(conn_handle, &sessions[0]))
+    {
+        count = 1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        watchers += sessions[i].status_watch ? 1 : 0;
+    }
+
+    // Without watchers a broadcast snapshot is queued once for everybody
+    if (conn_handle == BLE_MANAGER_BROADCAST && watchers == 0)
+    {
+        size_t len = status_model_render_full(status_json, sizeof(status_json));
+        ble_manager_send_response_to(BLE_MANAGER_BROADCAST, len > 0 ? status_json : RESPONSE_TOO_LARGE);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const ble_session_t *session = &sessions[i];
+        size_t len;
+        if (!session->status_watch)
+        {
+            len = status_model_render_full(status_json, sizeof(status_json));
+        }
+        else if (session->status_sent != version)
+        {
+            // Everything since the last acknowledgement, so a lost delta
+            // is repaired by the next one
+            len = status_model_render_delta(status_json, sizeof(status_json), session->status_ack);
+            if (len > 0)
+            {
+                ble_session_set_status_sent(session->conn_handle, version);
+            }
+        }
+        else
+        {
+            continue;
+        }
+        ble_manager_send_response_to(session->conn_handle, len > 0 ? status_json : RESPONSE_TOO_LARGE);
+    }
+}
+
+static void cmd_watch(const command_args_t *args)
+{
+    bool watch = args->argv[0].boolean;
+    if (reply_to == BLE_MANAGER_BROADCAST)
+    {
+        command_handler_reply("{\"error\":\"watch needs a client\"}");
+        return;
+    }
+    ESP_LOGI(TAG, "Executing command: watch %d", watch);
+    ble_session_set_status_watch(reply_to, watch);
+    if (watch)
+    {
+        // The snapshot is the baseline for the deltas that follow
+        cmd_status(NULL);
     }
     else
     {
-        offset = snprintf(json, sizeof(json),
-                          "{\"wifi\":false,\"rssi\":0,\"ip\":\"\",\"heap\":%lu,"
-                          "\"uptime\":%lld,\"ble\":%s,\"saved_ssid\":\"%s\","
-                          "\"autoconnect\":%s,\"devname\":\"%s\",\"nvs_free\":%zu",
-                          (unsigned long)esp_get_free_heap_size(), (long long)esp_timer_get_time() / 1000000,
-                          ble_manager_is_connected() ? "true" : "false", ssid_escaped,
-                          nvs_storage_get_auto_connect() ? "true" : "false", devname_escaped, nvs_stats.free_entries);
-        
-        static char network_json[512];
-        wifi_manager_get_networks_json(network_json, sizeof(network_json));
-        snprintf(json + offset, sizeof(json) - offset, ",%s}", network_json);
+        command_handler_reply("{\"watch\":false}");
     }
-    ble_manager_send_response(json);
 }
 
-static void cmd_set_auto_connect(bool value)
+static void cmd_ack(const command_args_t *args)
 {
+    int32_t version = args->argv[0].num;
+    if (version < 0 || !ble_session_ack_status(reply_to, (uint32_t)version))
+    {
+        // Tell the client where the model is so it can resync with status()
+        char resp[64];
+        snprintf(resp, sizeof(resp), "{\"error\":\"unknown status version\",\"v\":%lu}",
+                 (unsigned long)status_model_version());
+        command_handler_reply(resp);
+    }
+    // A successful ack is silent, it is sent after every delta
+}
+
+static void cmd_set_auto_connect(const command_args_t *args)
+{
+    bool value = args->argv[0].boolean;
     ESP_LOGI(TAG, "Executing command: set autoconnect to %d", value);
-    nvs_storage_save_auto_connect(value);
+    nvs_storage_set(CONFIG_AUTOCONNECT, CONFIG_TYPE_BOOL, &(config_value_t){.boolean = value});
     char resp[48];
     snprintf(resp, sizeof(resp), "{\"autoconnect\":%s}", value ? "true" : "false");
-    ble_manager_send_response(resp);
+    command_handler_reply(resp);
 }
 
-static void cmd_set_name(const char *name)
+static void cmd_set_name(const command_args_t *args)
 {
+    const char *name = args->argv[0].str;
     ESP_LOGI(TAG, "Executing command: set device name to %s", name);
-    nvs_storage_save_device_name(name);
+    if (nvs_storage_set(CONFIG_DEVNAME, CONFIG_TYPE_STRING, &(config_value_t){.str = name}) == ESP_ERR_INVALID_ARG)
+    {
+        command_handler_reply("{\"error\":\"name must be 1..32 characters\"}");
+        return;
+    }
+    char devname[33];
+    nvs_storage_get_string(CONFIG_DEVNAME, devname, sizeof(devname));
+    char resp[256];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key_string(&w, "devname", devname);
+    json_put_key_string(&w, "note", "restart required");
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+// What config() changes: any settings of the schema, and a network;
+// absent ones are left alone
+typedef struct
+{
+    uint32_t keys; // Bit per config_key_t given
+    config_value_t settings[CONFIG_KEY_COUNT];
+    const char *ssid;     // Adds the network, or updates its password
+    const char *password; // Required for a network that is not known yet
+    bool has_priority;
+    int32_t priority;     // Of ssid
+} config_request_t;
+
+static config_type_t json_config_type(json_value_type_t type)
+{
+    return type == JSON_VALUE_BOOL  ? CONFIG_TYPE_BOOL
+           : type == JSON_VALUE_INT ? CONFIG_TYPE_INT
+                                    : CONFIG_TYPE_STRING;
+}
+
+static const char *parse_config(char *text, config_request_t *c)
+{
+    json_reader_t r;
+    json_member_t m;
+    if (!json_reader_init(&r, text))
+    {
+        return "expected an object";
+    }
+    while (json_reader_next(&r, &m))
+    {
+        int key = config_find(m.key);
+        if (key >= 0)
+        {
+            config_value_t value = {.boolean = m.boolean, .num = m.num, .str = m.str};
+            if (m.type == JSON_VALUE_NULL || config_check(key, json_config_type(m.type), &value) != NULL)
+            {
+                return "invalid value";
+            }
+            c->settings[key] = value;
+            c->keys |= 1u << key;
+        }
+        else if (strcmp(m.key, "ssid") == 0 && m.type == JSON_VALUE_STRING)
+        {
+            if (m.str[0] == '\0' || strlen(m.str) > 32) return "ssid must be 1..32 characters";
+            c->ssid = m.str;
+        }
+        else if (strcmp(m.key, "password") == 0 && m.type == JSON_VALUE_STRING)
+        {
+            if (strlen(m.str) > 64) return "password must be at most 64 characters";
+            c->password = m.str;
+        }
+        else if (strcmp(m.key, "priority") == 0 && m.type == JSON_VALUE_INT)
+        {
+            if (m.num < 0 || m.num > 255) return "priority must be 0..255";
+            c->has_priority = true;
+            c->priority = m.num;
+        }
+        else
+        {
+            return "unknown key or wrong type";
+        }
+    }
+    if (r.error)
+    {
+        return "invalid object";
+    }
+    if ((c->password != NULL || c->has_priority) && c->ssid == NULL)
+    {
+        return "password and priority need an ssid";
+    }
+    return NULL;
+}
+
+// Applies several settings in one storage transaction: all of them are
+// checked before any is changed, and they are written to flash together
+static void cmd_config(const command_args_t *args)
+{
+    static char text[APP_CMD_MAX_LEN];
+    static config_request_t c;
+    c = (config_request_t){0};
+    snprintf(text, sizeof(text), "%s", args->argv[0].str);
+
+    const char *error = parse_config(text, &c);
+    if (error == NULL && c.ssid != NULL && c.password == NULL)
+    {
+        static nvs_storage_network_t known[NVS_STORAGE_MAX_NETWORKS];
+        size_t count = nvs_storage_get_networks(known, NVS_STORAGE_MAX_NETWORKS);
+        bool found = false;
+        for (size_t i = 0; i < count && !found; i++)
+        {
+            found = strcmp(known[i].ssid, c.ssid) == 0;
+        }
+        error = found ? NULL : "unknown network, give its password";
+    }
+    if (error != NULL)
+    {
+        char resp[128];
+        json_writer_t w;
+        json_writer_init(&w, resp, sizeof(resp));
+        json_begin_object(&w);
+        json_put_key_string(&w, "error", error);
+        json_end_object(&w);
+        command_handler_reply(written(&w, resp));
+        return;
+    }
+
+    ESP_LOGI(TAG, "Executing command: config");
+    nvs_storage_begin();
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        if (c.keys & (1u << key))
+        {
+            nvs_storage_set(key, config_schema[key].type, &c.settings[key]);
+        }
+    }
+    if (c.password != NULL)
+    {
+        nvs_storage_save_wifi_credentials(c.ssid, c.password);
+    }
+    if (c.has_priority)
+    {
+        nvs_storage_set_network_priority(c.ssid, (uint8_t)c.priority);
+    }
+    bool changed;
+    nvs_storage_commit_changed(&changed);
+    nvs_storage_stats_t stats;
+    nvs_storage_get_stats(&stats);
+
+    // The flash is written in the background; tell whether anything
+    // changed and how much is waiting to be written
     char resp[128];
-    char name_escaped[65];
-    json_escape(name, name_escaped, sizeof(name_escaped));
-    snprintf(resp, sizeof(resp), "{\"devname\":\"%s\",\"note\":\"restart required\"}", name_escaped);
-    ble_manager_send_response(resp);
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key_string(&w, "config", "ok");
+    json_put_key_bool(&w, "changed", changed);
+    json_put_key_int(&w, "pending", stats.pending);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
 }
 
-static void cmd_reset(void)
+static void put_config_value(json_writer_t *w, config_key_t key, const config_value_t *value)
+{
+    switch (config_schema[key].type)
+    {
+    case CONFIG_TYPE_BOOL:
+        json_put_bool(w, value->boolean);
+        break;
+    case CONFIG_TYPE_INT:
+        json_put_int(w, value->num);
+        break;
+    case CONFIG_TYPE_STRING:
+        json_put_string(w, value->str);
+        break;
+    }
+}
+
+// A setting with its schema entry
+static void cmd_get(const command_args_t *args)
+{
+    int key = config_find(args->argv[0].str);
+    if (key < 0)
+    {
+        command_handler_reply("{\"error\":\"unknown setting\"}");
+        return;
+    }
+    const config_desc_t *desc = &config_schema[key];
+    static config_values_t values;
+    nvs_storage_get_config(&values);
+    config_value_t value;
+    config_get(&values, key, &value);
+
+    // Room for the 32 byte device name escaped as \uXXXX
+    char resp[384];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key_string(&w, "key", desc->name);
+    json_put_key(&w, "value");
+    put_config_value(&w, key, &value);
+    json_put_key_string(&w, "type", config_type_name(desc->type));
+    if (desc->type != CONFIG_TYPE_BOOL)
+    {
+        json_put_key_int(&w, "min", desc->min);
+        json_put_key_int(&w, "max", desc->max);
+    }
+    json_put_key(&w, "default");
+    put_config_value(&w, key, &desc->def);
+    json_put_key_bool(&w, "persist", desc->persist);
+    json_put_key_bool(&w, "restart", desc->restart);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+static void cmd_set(const command_args_t *args)
+{
+    int key = config_find(args->argv[0].str);
+    if (key < 0)
+    {
+        command_handler_reply("{\"error\":\"unknown setting\"}");
+        return;
+    }
+    const command_arg_t *arg = &args->argv[1];
+    config_type_t type = arg->type == COMMAND_ARG_BOOL  ? CONFIG_TYPE_BOOL
+                         : arg->type == COMMAND_ARG_INT ? CONFIG_TYPE_INT
+                                                        : CONFIG_TYPE_STRING;
+    config_value_t value = {.boolean = arg->boolean, .num = arg->num, .str = arg->str};
+    const char *error = config_check(key, type, &value);
+    if (error != NULL)
+    {
+        char resp[96];
+        json_writer_t w;
+        json_writer_init(&w, resp, sizeof(resp));
+        json_begin_object(&w);
+        json_put_key_string(&w, "error", error);
+        json_end_object(&w);
+        command_handler_reply(written(&w, resp));
+        return;
+    }
+
+    ESP_LOGI(TAG, "Executing command: set %s", config_schema[key].name);
+    esp_err_t err = nvs_storage_set(key, type, &value);
+    char resp[192];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    if (err != ESP_OK)
+    {
+        json_put_key_string(&w, "error", esp_err_to_name(err));
+    }
+    else
+    {
+        json_put_key(&w, config_schema[key].name);
+        put_config_value(&w, key, &value);
+        if (config_schema[key].restart)
+        {
+            json_put_key_string(&w, "note", "restart required");
+        }
+    }
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+// Every setting by name
+static void cmd_dump(const command_args_t *args)
+{
+    static config_values_t values;
+    nvs_storage_get_config(&values);
+
+    // Room for the 32 byte device name escaped as \uXXXX
+    char resp[384];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "config");
+    json_begin_object(&w);
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        config_value_t value;
+        config_get(&values, key, &value);
+        json_put_key(&w, config_schema[key].name);
+        put_config_value(&w, key, &value);
+    }
+    json_end_object(&w);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+static void cmd_reset(const command_args_t *args)
 {
     ESP_LOGI(TAG, "Executing command: factory reset");
+    // Nothing to flush: clearing waits for a write in progress and drops
+    // the pending changes, and the erase itself is not deferred
     nvs_storage_clear_all_preferences();
-    ble_manager_send_response("{\"status\":\"factory_reset\",\"note\":\"restarting...\"}");
+    command_handler_reply("{\"status\":\"factory_reset\",\"note\":\"restarting...\"}");
     vTaskDelay(pdMS_TO_TICKS(500));
     esp_restart();
 }
 
-static void cmd_restart(void)
+static void cmd_restart(const command_args_t *args)
 {
     ESP_LOGI(TAG, "Executing command: restart");
-    ble_manager_send_response("{\"status\":\"restarting...\"}");
+    // Pending changes and samples would be lost with the RAM
+    telemetry_flush();
+    if (nvs_storage_flush() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Restarting with unsaved preferences");
+    }
+    command_handler_reply("{\"status\":\"restarting...\"}");
     vTaskDelay(pdMS_TO_TICKS(500));
     esp_restart();
 }
 
-static void cmd_help(void)
+static void cmd_queue(const command_args_t *args)
+{
+    app_task_queue_stats_t q;
+    app_task_get_queue_stats(&q);
+
+    char resp[224];
+    snprintf(resp, sizeof(resp),
+             "{\"queue\":{\"depth\":%lu,\"capacity\":%lu,\"high_water\":%lu,\"accepted\":%lu,"
+             "\"rejected\":%lu,\"avg_exec_us\":%lu,\"status_requests\":%lu,\"status_published\":%lu}}",
+             (unsigned long)q.depth, (unsigned long)q.capacity, (unsigned long)q.high_water,
+             (unsigned long)q.accepted, (unsigned long)q.rejected, (unsigned long)q.avg_exec_us,
+             (unsigned long)q.status_requests, (unsigned long)q.status_published);
+    command_handler_reply(resp);
+}
+
+static void cmd_status_rate(const command_args_t *args)
+{
+    int32_t ms = args->argv[0].num;
+    if (ms < 0 || ms > 60000)
+    {
+        command_handler_reply("{\"error\":\"interval must be 0..60000 ms\"}");
+        return;
+    }
+    ESP_LOGI(TAG, "Executing command: status interval %ld ms", (long)ms);
+    nvs_storage_set(CONFIG_STATUSRATE, CONFIG_TYPE_INT, &(config_value_t){.num = ms});
+    char resp[48];
+    snprintf(resp, sizeof(resp), "{\"statusrate\":%ld}", (long)ms);
+    command_handler_reply(resp);
+}
+
+static void cmd_diag(const command_args_t *args)
+{
+    ble_tx_stats_t tx;
+    ble_manager_get_tx_stats(&tx);
+    app_task_queue_stats_t q;
+    app_task_get_queue_stats(&q);
+    ble_session_t sessions[BLE_SESSION_MAX];
+    size_t session_count = ble_manager_get_sessions(sessions, BLE_SESSION_MAX);
+    nvs_storage_stats_t nvs;
+    nvs_storage_get_stats(&nvs);
+
+    static char resp[1024];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "tx");
+    json_begin_object(&w);
+    json_put_key_int(&w, "queued_bytes", tx.queued_bytes);
+    json_put_key_int(&w, "queued_msgs", tx.queued_msgs);
+    json_put_key_int(&w, "sent_msgs", tx.sent_msgs);
+    json_put_key_int(&w, "sent_bytes", tx.sent_bytes);
+    json_put_key_int(&w, "notifications", tx.notifications);
+    json_put_key_int(&w, "dropped_msgs", tx.dropped_msgs);
+    json_put_key_int(&w, "dropped_bytes", tx.dropped_bytes);
+    json_put_key_int(&w, "stalls", tx.stalls);
+    json_put_key_int(&w, "bytes_per_sec", tx.bytes_per_sec);
+    json_end_object(&w);
+    json_put_key(&w, "queue");
+    json_begin_object(&w);
+    json_put_key_int(&w, "depth", q.depth);
+    json_put_key_int(&w, "high_water", q.high_water);
+    json_put_key_int(&w, "rejected", q.rejected);
+    json_put_key_int(&w, "avg_exec_us", q.avg_exec_us);
+    json_end_object(&w);
+    json_put_key(&w, "nvs");
+    json_begin_object(&w);
+    json_put_key_int(&w, "transactions", nvs.transactions);
+    json_put_key_int(&w, "skipped", nvs.skipped);
+    json_put_key_int(&w, "pending", nvs.pending);
+    json_put_key_int(&w, "commits", nvs.commits);
+    json_put_key_int(&w, "forced", nvs.forced);
+    json_put_key_int(&w, "key_writes", nvs.key_writes);
+    json_put_key_int(&w, "bytes", nvs.bytes);
+    json_put_key_int(&w, "failures", nvs.failures);
+    json_put_key_int(&w, "last_commit_us", nvs.last_commit_us);
+    json_put_key_int(&w, "max_commit_us", nvs.max_commit_us);
+    json_put_key_int(&w, "mean_commit_us", nvs.mean_commit_us);
+    json_put_key_int(&w, "last_delay_ms", nvs.last_delay_ms);
+    json_put_key_int(&w, "load_us", nvs.load_us);
+    json_end_object(&w);
+    json_put_key(&w, "sessions");
+    json_begin_array(&w);
+    for (size_t i = 0; i < session_count; i++)
+    {
+        json_writer_t mark = w;
+        json_begin_object(&w);
+        json_put_key_int(&w, "conn", sessions[i].conn_handle);
+        json_put_key_int(&w, "mtu", sessions[i].mtu);
+        json_put_key_bool(&w, "subscribed", sessions[i].subscribed);
+        json_put_key_int(&w, "tx_pending", sessions[i].tx_pending);
+        json_end_object(&w);
+        if (!json_writer_fits(&w, 2))
+        {
+            json_writer_rewind(&w, &mark);
+            break;
+        }
+    }
+    json_end_array(&w);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+// Connection state machine counters and the time spent in each phase
+static void cmd_wifi(const command_args_t *args)
 {
-    const char *help =
-        "{\"commands\":["
-        "\"connect(\\\"ssid\\\",\\\"pass\\\")\","
-        "\"reconnect()\","
-        "\"disconnect()\","
-        "\"forget()\","
-        "\"status()\","
-        "\"autoconnect(true|false)\","
-        "\"setname(\\\"name\\\")\","
-        "\"reset()\","
-        "\"restart()\","
-        "\"gps()\","
-        "\"echo(\\\"msg\\\")\""
-        "]}";
-    ble_manager_send_response(help);
+    wifi_sm_stats_t stats;
+    wifi_manager_get_conn_stats(&stats);
+    wifi_manager_connect_time_t connect_time;
+    wifi_manager_get_connect_time(&connect_time);
+    scan_sched_stats_t scan;
+    wifi_manager_get_scan_stats(&scan);
+    device_state_t state;
+    device_state_read(&state);
+
+    static char resp[1024];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "wifi");
+    json_begin_object(&w);
+    json_put_key_string(&w, "state", wifi_sm_state_name(stats.state));
+    json_put_key_int(&w, "in_state_ms", stats.in_state_ms);
+    json_put_key_int(&w, "attempts", stats.attempts);
+    json_put_key_int(&w, "failures", stats.failures);
+    json_put_key_int(&w, "retry", stats.retry);
+    json_put_key_int(&w, "backoff_ms", stats.backoff_ms);
+    json_put_key_int(&w, "last_reason", stats.last_reason);
+    json_put_key_int(&w, "reconnects", stats.reconnects);
+    json_put_key_int(&w, "last_reconnect_ms", stats.last_reconnect_ms);
+    json_put_key_int(&w, "mean_reconnect_ms", stats.mean_reconnect_ms);
+    if (connect_time.valid)
+    {
+        json_put_key(&w, "last_connect");
+        json_begin_object(&w);
+        json_put_key_bool(&w, "fast", connect_time.fast);
+        json_put_key_bool(&w, "fell_back", connect_time.fell_back);
+        json_put_key_string(&w, "ssid", connect_time.ssid);
+        json_put_key_int(&w, "candidate", connect_time.candidate);
+        json_put_key_int(&w, "total_ms", connect_time.total_ms);
+        json_put_key_int(&w, "assoc_ms", connect_time.assoc_ms);
+        json_put_key_int(&w, "dhcp_ms", connect_time.dhcp_ms);
+        json_end_object(&w);
+    }
+    json_put_key(&w, "scan");
+    json_begin_object(&w);
+    json_put_key_string(&w, "mode", scan_sched_mode_name(scan.mode));
+    json_put_key_int(&w, "interval_ms", scan.interval_ms);
+    json_put_key_int(&w, "next_in_ms", scan.next_in_ms);
+    if (scan.have_rssi)
+    {
+        json_put_key_int(&w, "rssi_avg", scan.rssi_avg);
+        json_put_key_int(&w, "trend_db", scan.trend_db);
+    }
+    json_put_key_int(&w, "scans", scan.scans);
+    json_put_key_int(&w, "requests", scan.requests);
+    json_put_key_int(&w, "merged", scan.merged);
+    json_end_object(&w);
+    if (state.roam_hint)
+    {
+        char bssid[18];
+        snprintf(bssid, sizeof(bssid), MACSTR, MAC2STR(state.roam_bssid));
+        json_put_key(&w, "roam");
+        json_begin_object(&w);
+        json_put_key_string(&w, "bssid", bssid);
+        json_put_key_int(&w, "channel", state.roam_channel);
+        json_put_key_int(&w, "rssi", state.roam_rssi);
+        json_end_object(&w);
+    }
+    json_put_key(&w, "phases");
+    json_begin_object(&w);
+    for (int i = 0; i < WIFI_SM_STATE_COUNT; i++)
+    {
+        json_put_key(&w, wifi_sm_state_name(i));
+        json_begin_object(&w);
+        json_put_key_int(&w, "count", stats.phases[i].count);
+        json_put_key_int(&w, "total_ms", stats.phases[i].total_ms);
+        json_put_key_int(&w, "last_ms", stats.phases[i].last_ms);
+        json_end_object(&w);
+    }
+    json_end_object(&w);
+    json_end_object(&w);
+    json_end_object(&w);
+    command_handler_reply(written(&w, resp));
+}
+
+static void cmd_blelink(const command_args_t *args)
+{
+    uint16_t conn_handle = command_handler_origin();
+    ble_session_t session;
+    if (conn_handle == BLE_MANAGER_BROADCAST || !ble_manager_get_session(conn_handle, &session))
+    {
+        command_handler_reply("{\"error\":\"blelink needs a BLE client\"}");
+        return;
+    }
+
+    char resp[192];
+    if (args->argc > 0)
+    {
+        ble_link_profile_t profile;
+        if (!ble_manager_parse_link_profile(args->argv[0].str, &profile) || profile == BLE_LINK_PROFILE_DEFAULT)
+        {
+            command_handler_reply("{\"error\":\"usage: blelink(\\\"throughput|balanced|lowpower\\\")\"}");
+            return;
+        }
+        esp_err_t err = ble_manager_set_link_profile(conn_handle, profile);
+        if (err != ESP_OK)
+        {
+            snprintf(resp, sizeof(resp), "{\"error\":\"blelink failed: %s\"}", esp_err_to_name(err));
+            command_handler_reply(resp);
+            return;
+        }
+        // The negotiated values follow as {"blelink":{...}} once the
+        // controller reports them
+        snprintf(resp, sizeof(resp), "{\"blelink\":\"%s\",\"status\":\"requested\"}",
+                 ble_manager_link_profile_name(profile));
+        command_handler_reply(resp);
+        return;
+    }
+
+    int len = snprintf(resp, sizeof(resp), "{\"blelink\":");
+    len += ble_manager_format_link(&session, resp + len, sizeof(resp) - len);
+    if (len < (int)sizeof(resp) - 1)
+    {
+        snprintf(resp + len, sizeof(resp) - len, "}");
+    }
+    command_handler_reply(resp);
+}
+
+static void cmd_hello(const command_args_t *args)
+{
+    uint16_t conn_handle = command_handler_origin();
+    ble_session_t session;
+    if (conn_handle == BLE_MANAGER_BROADCAST || !ble_manager_get_session(conn_handle, &session))
+    {
+        command_handler_reply("{\"error\":\"hello needs a BLE client\"}");
+        return;
+    }
+
+    ble_framing_t framing = session.framing;
+    ble_encoding_t encoding = session.encoding;
+    bool valid = true;
+    if (args->argc > 0)
+    {
+        if (strcmp(args->argv[0].str, "framed") == 0) framing = BLE_FRAMING_FRAMED;
+        else if (strcmp(args->argv[0].str, "raw") == 0) framing = BLE_FRAMING_RAW;
+        else valid = false;
+    }
+    if (args->argc > 1)
+    {
+        if (strcmp(args->argv[1].str, "cbor") == 0) encoding = BLE_ENCODING_CBOR;
+        else if (strcmp(args->argv[1].str, "json") == 0) encoding = BLE_ENCODING_JSON;
+        else valid = false;
+    }
+    if (!valid)
+    {
+        command_handler_reply("{\"error\":\"usage: hello(\\\"raw|framed\\\",\\\"json|cbor\\\")\"}");
+        return;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (framing != session.framing)
+    {
+        err = ble_manager_set_framing(conn_handle, framing);
+    }
+    if (err == ESP_OK && encoding != session.encoding)
+    {
+        err = ble_manager_set_encoding(conn_handle, encoding);
+    }
+    if (err != ESP_OK)
+    {
+        char resp[64];
+        snprintf(resp, sizeof(resp), "{\"error\":\"hello failed: %s\"}", esp_err_to_name(err));
+        command_handler_reply(resp);
+        return;
+    }
+
+    // Queued after the switch, so this is the first message in the new
+    // framing and encoding
+    char resp[160];
+    snprintf(resp, sizeof(resp),
+             "{\"hello\":{\"framing\":\"%s\",\"encoding\":\"%s\",\"caps\":[\"raw\",\"framed\",\"json\",\"cbor\"],"
+             "\"frame_hdr\":%d}}",
+             framing == BLE_FRAMING_FRAMED ? "framed" : "raw", encoding == BLE_ENCODING_CBOR ? "cbor" : "json",
+             BLE_FRAME_HDR_LEN);
+    command_handler_reply(resp);
 }
 
 // ==========================================================
-// FIXED COMMAND PROCESSOR
-// Handles both "gps" and "gps()" formats
+// COMMAND REGISTRY
 // ==========================================================
-void command_handler_process(const char *input)
+
+static command_slot_t registry_slots[COMMAND_REGISTRY_SLOTS];
+static command_registry_t registry;
+
+static const command_desc_t builtin_commands[] = {
+    {COMMAND_ID_CONNECT, "connect", "ss", "connect(\"ssid\",\"pass\")", cmd_connect},
+    {COMMAND_ID_RECONNECT, "reconnect", "", "reconnect()", cmd_reconnect},
+    {COMMAND_ID_SCAN, "scan", "", "scan()", cmd_scan},
+    {COMMAND_ID_DISCONNECT, "disconnect", "", "disconnect()", cmd_disconnect},
+    {COMMAND_ID_FORGET, "forget", "|s", "forget(\"ssid\")", cmd_forget},
+    {COMMAND_ID_NETWORKS, "networks", "|ii", "networks(offset,count)", cmd_networks},
+    {COMMAND_ID_KNOWN, "known", "", "known()", cmd_known},
+    {COMMAND_ID_PRIORITY, "priority", "si", "priority(\"ssid\",n)", cmd_priority},
+    {COMMAND_ID_STATUS, "status", "", "status()", cmd_status},
+    {COMMAND_ID_AUTOCONNECT, "autoconnect", "b", "autoconnect(true|false)", cmd_set_auto_connect},
+    {COMMAND_ID_SETNAME, "setname", "s", "setname(\"name\")", cmd_set_name},
+    {COMMAND_ID_CONFIG, "config", "o", "config({\"key\":value,...})", cmd_config},
+    {COMMAND_ID_GET, "get", "s", "get(\"key\")", cmd_get},
+    {COMMAND_ID_SET, "set", "sv", "set(\"key\",value)", cmd_set},
+    {COMMAND_ID_DUMP, "dump", "", "dump()", cmd_dump},
+    {COMMAND_ID_RESET, "reset", "", "reset()", cmd_reset},
+    {COMMAND_ID_RESTART, "restart", "", "restart()", cmd_restart},
+    {COMMAND_ID_QUEUE, "queue", "", "queue()", cmd_queue},
+    {COMMAND_ID_STATUSRATE, "statusrate", "i", "statusrate(ms)", cmd_status_rate},
+    {COMMAND_ID_WIFI, "wifi", "", "wifi()", cmd_wifi},
+    {COMMAND_ID_WATCH, "watch", "b", "watch(true|false)", cmd_watch},
+    {COMMAND_ID_ACK, "ack", "i", "ack(version)", cmd_ack},
+    {COMMAND_ID_DIAG, "diag", "", "diag()", cmd_diag},
+    {COMMAND_ID_HELLO, "hello", "|ss", "hello(\"raw|framed\",\"json|cbor\")", cmd_hello},
+    {COMMAND_ID_BLELINK, "blelink", "|s", "blelink(\"throughput|balanced|lowpower\")", cmd_blelink},
+    {COMMAND_ID_LED, "led", "", "led()", cmd_led},
+    {COMMAND_ID_ECHO, "echo", "|s", "echo(\"msg\")", cmd_echo},
+    {COMMAND_ID_HELP, "help", "", "help()", cmd_help},
+};
+
+static void cmd_help(const command_args_t *args)
+{
+    // Generated from the registered tables, in registration order
+    static char help[768];
+    json_writer_t w;
+    json_writer_init(&w, help, sizeof(help));
+    json_begin_object(&w);
+    json_put_key(&w, "commands");
+    json_begin_array(&w);
+
+    bool full = false;
+    for (size_t t = 0; t < registry.table_count && !full; t++)
+    {
+        for (size_t i = 0; i < registry.tables[t].count && !full; i++)
+        {
+            json_writer_t mark = w;
+            json_put_string(&w, registry.tables[t].descs[i].usage);
+            if (!json_writer_fits(&w, 2))
+            {
+                json_writer_rewind(&w, &mark);
+                full = true;
+            }
+        }
+    }
+    json_end_array(&w);
+    json_end_object(&w);
+    command_handler_reply(written(&w, help));
+}
+
+esp_err_t command_handler_init(void)
+{
+    wifi_manager_set_listener(on_wifi_event);
+    command_registry_init(&registry, registry_slots, COMMAND_REGISTRY_SLOTS);
+    return command_handler_register(builtin_commands, sizeof(builtin_commands) / sizeof(builtin_commands[0]));
+}
+
+void command_handler_reply(const char *msg)
+{
+    ble_manager_send_reply(reply_to, current_rid, msg);
+}
+
+command_token_t command_handler_defer(void)
+{
+    return (command_token_t){.origin = reply_to, .rid = current_rid};
+}
+
+void command_handler_complete(const command_token_t *token, const char *msg)
+{
+    ble_manager_send_reply(token->origin, token->rid, msg);
+}
+
+uint16_t command_handler_origin(void)
+{
+    return reply_to;
+}
+
+esp_err_t command_handler_register(const command_desc_t *cmds, size_t count)
+{
+    esp_err_t err = command_registry_add_table(&registry, cmds, count);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to register command table (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+/**
+ * @brief Parses a single argument token in place.
+ *
+ * Quoted strings are terminated in place; bare tokens are trimmed. On return
+ * *cursor points past the token and its trailing separator.
+ */
+static bool next_token(char **cursor, char **token, bool *quoted)
+{
+    char *p = *cursor;
+    while (*p == ' ') p++;
+    if (*p == '\0') return false;
+
+    if (*p == '"')
+    {
+        char *end = strchr(p + 1, '"');
+        if (!end) return false;
+        *end = '\0';
+        *token = p + 1;
+        *quoted = true;
+        p = end + 1;
+        while (*p == ' ') p++;
+    }
+    else
+    {
+        *token = p;
+        *quoted = false;
+        while (*p != '\0' && *p != ',') p++;
+        bool more = (*p == ',');
+        char *end = p;
+        while (end > *token && end[-1] == ' ') end--;
+        *end = '\0';
+        *cursor = more ? p + 1 : p;
+        return true;
+    }
+
+    if (*p == ',') p++;
+    else if (*p != '\0') return false;
+    *cursor = p;
+    return true;
+}
+
+/**
+ * @brief Parses a JSON object argument in place.
+ *
+ * The object runs to the first closing brace outside a string; nested
+ * ones are left for json_reader to reject. It is terminated in place.
+ */
+static bool next_object(char **cursor, char **token)
+{
+    char *p = *cursor;
+    while (*p == ' ') p++;
+    if (*p != '{') return false;
+
+    *token = p;
+    bool in_string = false;
+    for (p++; *p != '\0' && (in_string || *p != '}'); p++)
+    {
+        if (in_string && *p == '\\' && p[1] != '\0') p++;
+        else if (*p == '"') in_string = !in_string;
+    }
+    if (*p != '}') return false;
+
+    char *end = p + 1;
+    p = end;
+    while (*p == ' ') p++;
+    if (*p == ',') p++;
+    else if (*p != '\0') return false;
+    *end = '\0';
+    *cursor = p;
+    return true;
+}
+
+/**
+ * @brief Tokenizes the argument list in place and validates it against a schema.
+ */
+static bool parse_args(char *args, const char *schema, command_args_t *out)
+{
+    out->argc = 0;
+    bool optional = false;
+    char *cursor = args;
+
+    for (const char *s = schema; *s != '\0'; s++)
+    {
+        if (*s == COMMAND_ARG_OPTIONAL)
+        {
+            optional = true;
+            continue;
+        }
+
+        char *token;
+        bool quoted = false;
+        if (*s == COMMAND_ARG_OBJECT)
+        {
+            while (*cursor == ' ') cursor++;
+            if (*cursor == '\0') return optional;
+            if (!next_object(&cursor, &token)) return false;
+        }
+        else if (!next_token(&cursor, &token, &quoted))
+        {
+            return optional;
+        }
+
+        command_arg_t *arg = &out->argv[out->argc++];
+        arg->str = token;
+        arg->type = *s;
+        if (*s == COMMAND_ARG_ANY)
+        {
+            // Typed by its form, then parsed as that type
+            arg->type = quoted ? COMMAND_ARG_STR
+                        : strcmp(token, "true") == 0 || strcmp(token, "false") == 0 ? COMMAND_ARG_BOOL
+                                                                                      : COMMAND_ARG_INT;
+        }
+        switch (arg->type)
+        {
+        case COMMAND_ARG_STR:
+            if (!quoted) return false;
+            break;
+        case COMMAND_ARG_BOOL:
+            if (quoted) return false;
+            if (strcmp(token, "true") == 0) arg->boolean = true;
+            else if (strcmp(token, "false") == 0) arg->boolean = false;
+            else return false;
+            break;
+        case COMMAND_ARG_OBJECT:
+            break;
+        case COMMAND_ARG_INT:
+        {
+            char *end;
+            if (quoted || token[0] == '\0') return false;
+            arg->num = (int32_t)strtol(token, &end, 10);
+            if (*end != '\0') return false;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Reject trailing arguments the schema does not describe
+    while (*cursor == ' ') cursor++;
+    return *cursor == '\0';
+}
+
+/**
+ * @brief Splits a text command into name and arguments and parses them.
+ *
+ * Handles both the "cmd" and "cmd(args)" forms.
+ */
+static esp_err_t parse_text(char *buf, size_t len, const command_desc_t **desc, command_args_t *args,
+                            uint32_t *rid)
 {
-    char buf[APP_CMD_MAX_LEN];
-    strncpy(buf, input, sizeof(buf) - 1);
-    buf[sizeof(buf) - 1] = '\0';
+    *desc = NULL;
+
+    // Optional request id: "#<id> cmd(args)". The rest is moved to the
+    // start of the buffer so the command name stays at buf.
+    if (len > 0 && buf[0] == '#')
+    {
+        char *end;
+        unsigned long id = strtoul(buf + 1, &end, 10);
+        if (end == buf + 1 || *end != ' ' || id >= COMMAND_RID_NONE)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        while (*end == ' ') end++;
+        len -= end - buf;
+        memmove(buf, end, len + 1);
+        *rid = (uint32_t)id;
+    }
 
     // Remove any trailing newline characters
-    size_t len = strlen(buf);
     while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n')) {
         buf[len - 1] = '\0';
         len--;
     }
 
     char *cmd = buf;
-    char *args = ""; 
-    char *arg1 = NULL;
-    char *arg2 = NULL;
+    char *arg_text = "";
+    size_t cmd_len = len;
 
     // Check if arguments exist (look for parenthesis)
-    char *paren = strchr(buf, '(');
+    char *paren = memchr(buf, '(', len);
     if (paren) {
         *paren = '\0'; // Split command from args
-        args = paren + 1;
-        char *end = strrchr(args, ')');
+        cmd_len = paren - buf;
+        arg_text = paren + 1;
+        char *end = strrchr(arg_text, ')');
         if (end) *end = '\0';
-    } 
+    }
     // If no parenthesis, cmd is just the whole buffer, and args is empty string
 
-    // Parse arguments if they exist
-    if (args[0] != '\0') {
-        char *q1 = strchr(args, '"');
-        if (q1) {
-            arg1 = q1 + 1;
-            char *q2 = strchr(arg1, '"');
-            if (q2) {
-                *q2 = '\0';
-                char *q3 = strchr(q2 + 1, '"');
-                if (q3) {
-                    arg2 = q3 + 1;
-                    char *q4 = strchr(arg2, '"');
-                    if (q4) *q4 = '\0';
-                }
+    *desc = command_registry_find(&registry, cmd, cmd_len);
+    if (*desc == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return parse_args(arg_text, (*desc)->args, args) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+/**
+ * @brief Parses a CBOR request, [name or id, args...], in place.
+ */
+static esp_err_t parse_binary(char *buf, size_t len, const command_desc_t **desc, command_args_t *args,
+                              uint32_t *rid)
+{
+    cbor_reader_t r;
+    uint8_t major;
+    uint64_t count, value;
+
+    *desc = NULL;
+    cbor_reader_init(&r, buf, len);
+    if (!cbor_get_head(&r, &major, &count) || major != CBOR_MAJOR_ARRAY || count == 0 ||
+        !cbor_get_head(&r, &major, &value))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Optional leading options map; only the request id is defined
+    if (major == CBOR_MAJOR_MAP)
+    {
+        for (uint64_t i = 0; i < value; i++)
+        {
+            uint8_t key_major, val_major;
+            uint64_t key, val;
+            if (!cbor_get_head(&r, &key_major, &key) || key_major != CBOR_MAJOR_UINT ||
+                key != cbor_key_id("rid", 3) || !cbor_get_head(&r, &val_major, &val) ||
+                val_major != CBOR_MAJOR_UINT || val >= COMMAND_RID_NONE)
+            {
+                return ESP_ERR_INVALID_SIZE;
             }
+            *rid = (uint32_t)val;
+        }
+        if (--count == 0 || !cbor_get_head(&r, &major, &value))
+        {
+            return ESP_ERR_INVALID_SIZE;
         }
     }
 
-    bool bool_arg = false;
-    bool has_bool_arg = (strcmp(args, "true") == 0 || strcmp(args, "false") == 0);
-    if (has_bool_arg) bool_arg = (strcmp(args, "true") == 0);
-
-    // --- EXECUTE COMMANDS ---
-    if (strcmp(cmd, "echo") == 0)
-        cmd_echo(arg1 ? arg1 : "");
-    else if (strcmp(cmd, "connect") == 0)
-        (arg1 && arg2) ? cmd_connect(arg1, arg2, true) : ble_manager_send_response("{\"error\":\"usage: connect(\\\"ssid\\\",\\\"pass\\\")\"}");
-    else if (strcmp(cmd, "reconnect") == 0)
-        cmd_reconnect();
-    else if (strcmp(cmd, "led") == 0)
-        cmd_led();
-    else if (strcmp(cmd, "disconnect") == 0)
-        cmd_disconnect();
-    else if (strcmp(cmd, "forget") == 0)
-        cmd_forget();
-    else if (strcmp(cmd, "status") == 0)
-        cmd_status();
-    else if (strcmp(cmd, "autoconnect") == 0)
-        has_bool_arg ? cmd_set_auto_connect(bool_arg) : ble_manager_send_response("{\"error\":\"usage: autoconnect(true|false)\"}");
-    else if (strcmp(cmd, "setname") == 0)
-        arg1 ? cmd_set_name(arg1) : ble_manager_send_response("{\"error\":\"usage: setname(\\\"name\\\")\"}");
-    else if (strcmp(cmd, "reset") == 0)
-        cmd_reset();
-    else if (strcmp(cmd, "restart") == 0)
-        cmd_restart();
-    // else if (strcmp(cmd, "gps") == 0)
-    //  //  gps(); // <--- Now triggers even if you just typed "gps"
-    else if (strcmp(cmd, "help") == 0)
-        cmd_help();
-    else
+    if (major == CBOR_MAJOR_UINT)
+    {
+        *desc = command_registry_get(&registry, (uint32_t)value);
+    }
+    else if (major == CBOR_MAJOR_TEXT)
+    {
+        char *name = cbor_take_text(&r, value);
+        if (name == NULL) return ESP_ERR_INVALID_SIZE;
+        *desc = command_registry_find(&registry, name, (size_t)value);
+    }
+    if (*desc == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t given = (size_t)count - 1;
+    bool optional = false;
+    args->argc = 0;
+    const char *s = (*desc)->args;
+    for (; *s != '\0' && args->argc < given; s++)
+    {
+        if (*s == COMMAND_ARG_OPTIONAL)
+        {
+            optional = true;
+            continue;
+        }
+        if (!cbor_get_head(&r, &major, &value))
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        command_arg_t *arg = &args->argv[args->argc++];
+        arg->str = "";
+        arg->type = *s;
+        if (*s == COMMAND_ARG_ANY)
+        {
+            arg->type = major == CBOR_MAJOR_TEXT     ? COMMAND_ARG_STR
+                        : major == CBOR_MAJOR_SIMPLE ? COMMAND_ARG_BOOL
+                                                     : COMMAND_ARG_INT;
+        }
+        switch (arg->type)
+        {
+        case COMMAND_ARG_STR:
+        case COMMAND_ARG_OBJECT:
+            if (major != CBOR_MAJOR_TEXT) return ESP_ERR_INVALID_ARG;
+            arg->str = cbor_take_text(&r, value);
+            if (arg->str == NULL) return ESP_ERR_INVALID_SIZE;
+            break;
+        case COMMAND_ARG_BOOL:
+            if (major != CBOR_MAJOR_SIMPLE || (value != CBOR_TRUE && value != CBOR_FALSE)) return ESP_ERR_INVALID_ARG;
+            arg->boolean = (value == CBOR_TRUE);
+            break;
+        case COMMAND_ARG_INT:
+            if ((major != CBOR_MAJOR_UINT && major != CBOR_MAJOR_NEGINT) || value > INT32_MAX) return ESP_ERR_INVALID_ARG;
+            arg->num = (major == CBOR_MAJOR_UINT) ? (int32_t)value : -1 - (int32_t)value;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    // More arguments than the schema describes, or a required one missing
+    if (args->argc != given || (*s != '\0' && *s != COMMAND_ARG_OPTIONAL && !optional))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return r.pos == len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t command_handler_parse(char *buf, size_t len, const command_desc_t **desc, command_args_t *args,
+                                uint32_t *rid)
+{
+    *rid = COMMAND_RID_NONE;
+    if (cbor_is_request(buf, len))
+    {
+        return parse_binary(buf, len, desc, args, rid);
+    }
+    return parse_text(buf, len, desc, args, rid);
+}
+
+// ==========================================================
+// COMMAND PROCESSOR
+// ==========================================================
+void command_handler_process(char *buf, size_t len, uint16_t origin)
+{
+    // Internal commands (APP_CMD_ORIGIN_INTERNAL) broadcast their responses
+    reply_to = (origin == APP_CMD_ORIGIN_INTERNAL) ? BLE_MANAGER_BROADCAST : origin;
+
+    bool binary = cbor_is_request(buf, len);
+    const command_desc_t *desc;
+    command_args_t parsed;
+    esp_err_t err = command_handler_parse(buf, len, &desc, &parsed, &current_rid);
+
+    if (err == ESP_ERR_NOT_FOUND)
+    {
+        if (binary)
+        {
+            command_handler_reply("{\"error\":\"unknown command\"}");
+            return;
+        }
+        // The text parser left the null-terminated name at the start
+        char resp[160];
+        json_writer_t w;
+        json_writer_init(&w, resp, sizeof(resp));
+        json_begin_object(&w);
+        json_put_key(&w, "error");
+        json_begin_string(&w);
+        json_append_string(&w, "unknown: ", 9);
+        json_append_string(&w, buf, strlen(buf));
+        json_end_string(&w);
+        json_end_object(&w);
+        command_handler_reply(w.overflow ? "{\"error\":\"unknown command\"}" : resp);
+        return;
+    }
+    if (err == ESP_ERR_INVALID_ARG)
     {
         char resp[160];
-        snprintf(resp, sizeof(resp), "{\"error\":\"unknown: %s\"}", cmd);
-        ble_manager_send_response(resp);
+        json_writer_t w;
+        json_writer_init(&w, resp, sizeof(resp));
+        json_begin_object(&w);
+        json_put_key(&w, "error");
+        json_begin_string(&w);
+        json_append_string(&w, "usage: ", 7);
+        json_append_string(&w, desc->usage, strlen(desc->usage));
+        json_end_string(&w);
+        json_end_object(&w);
+        command_handler_reply(written(&w, resp));
+        return;
+    }
+    if (err != ESP_OK)
+    {
+        command_handler_reply("{\"error\":\"malformed request\"}");
+        return;
     }
-}
\ No newline at end of file
+
+    desc->fn(&parsed);
+}
@@ -11,13 +11,158 @@
 #ifndef COMMAND_HANDLER_H
 #define COMMAND_HANDLER_H
 
+#include "command_registry.h"
+#include "command_ids.h"
+#include <stdint.h>
+
+// Request id of commands that were sent without one.
+#define COMMAND_RID_NONE UINT32_MAX
+
+// The maximum number of scan() requests that can wait for the same scan.
+#define COMMAND_MAX_PENDING_SCANS 4
+
+// Networks per networks() reply when no count is given.
+#define COMMAND_NETWORKS_PAGE 5
+
+/**
+ * @brief Identifies a command whose answer is sent later.
+ *
+ * Obtained with command_handler_defer() while the command runs, and passed
+ * to command_handler_complete() once the slow operation has finished.
+ */
+typedef struct
+{
+    uint16_t origin; // Client that issued the command
+    uint32_t rid;    // Its request id, or COMMAND_RID_NONE
+} command_token_t;
+
+/**
+ * @brief Initializes the command handler and registers the built-in commands.
+ *
+ * Must be called before any other module registers its own commands and
+ * before the first command is processed.
+ *
+ * @return ESP_OK on success, or an error code on failure.
+ */
+esp_err_t command_handler_init(void);
+
+/**
+ * @brief Registers a module's table of commands.
+ *
+ * Modules call this once during their initialization with a static table
+ * of descriptors. The commands become available to command_handler_process()
+ * and are listed by help().
+ *
+ * @param cmds The command descriptors, must remain valid forever.
+ * @param count The number of descriptors.
+ * @return ESP_OK on success, or an error code if a name clashes or the
+ *         registry is full.
+ */
+esp_err_t command_handler_register(const command_desc_t *cmds, size_t count);
+
 /**
  * @brief Processes a command string.
  *
- * Parses the command and its arguments, then executes the corresponding action.
+ * Looks up the command in the registry, validates its arguments against the
+ * command's schema and invokes the registered handler. The command is
+ * tokenized in place, so the buffer is modified. Both text and CBOR
+ * requests are accepted, see command_handler_parse().
  *
  * @param command The null-terminated command string to process.
+ * @param len The length of the command string.
+ * Commands may carry a request id, which is echoed as "rid" in every
+ * response to them: "#<id> cmd(args)" in text form, or a leading
+ * {"rid": id} map in CBOR form, e.g. [{rid: 7}, "status"].
+ *
+ * @param origin The connection that issued the command, or
+ *               APP_CMD_ORIGIN_INTERNAL. Responses are routed back to it.
+ */
+void command_handler_process(char *command, size_t len, uint16_t origin);
+
+/**
+ * @brief Parses a command without executing it.
+ *
+ * Accepts both the text form, e.g. connect("ssid","pass"), and the CBOR
+ * form described in cbor.h. The buffer is tokenized in place.
+ *
+ * @param buf The command; text commands must be null-terminated.
+ * @param len The length of the command.
+ * @param[out] desc The command descriptor, NULL if the command is unknown.
+ * @param[out] args The parsed arguments.
+ * @param[out] rid The request id, COMMAND_RID_NONE if there is none.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for unknown commands,
+ *         ESP_ERR_INVALID_ARG if the arguments do not match the schema, or
+ *         ESP_ERR_INVALID_SIZE for malformed CBOR or request ids.
+ */
+esp_err_t command_handler_parse(char *buf, size_t len, const command_desc_t **desc, command_args_t *args,
+                                uint32_t *rid);
+
+/**
+ * @brief Sends a response to the client that issued the current command.
+ *
+ * Command handlers use this instead of talking to the BLE manager directly,
+ * so that each client only receives the answers to its own commands.
+ * Responses to internally raised commands go to every subscribed client.
+ *
+ * @param msg The null-terminated response.
+ */
+void command_handler_reply(const char *msg);
+
+/**
+ * @brief Takes over answering the current command.
+ *
+ * Handlers of slow commands call this, reply right away with an
+ * acknowledgement and return, so the commands queued behind them run
+ * immediately. The final answer is sent later with
+ * command_handler_complete().
+ *
+ * @return The token of the current command.
+ */
+command_token_t command_handler_defer(void);
+
+/**
+ * @brief Sends the final answer to a deferred command.
+ *
+ * May block until there is room to transmit, so it is called from the
+ * application task, never from the NimBLE host or event loop tasks.
+ *
+ * @param token The token from command_handler_defer().
+ * @param msg The null-terminated JSON response.
+ */
+void command_handler_complete(const command_token_t *token, const char *msg);
+
+/**
+ * @brief Answers the deferred commands whose outcome is known.
+ *
+ * The WiFi event handler only records the outcomes; the application task
+ * calls this afterwards, see app_task_request_deferred().
+ */
+void command_handler_finish_deferred(void);
+
+/**
+ * @brief Builds the status() response.
+ *
+ * @param json The output buffer.
+ * @param size The size of the buffer.
+ * @return The length of the JSON document, 0 if it did not fit.
+ */
+size_t command_handler_build_status(char *json, size_t size);
+
+/**
+ * @brief Sends an unsolicited status to one or all subscribed clients.
+ *
+ * Called by the application task when a coalesced status request is due.
+ *
+ * @param conn_handle The client, or APP_CMD_ORIGIN_INTERNAL for all clients.
+ */
+void command_handler_publish_status(uint16_t conn_handle);
+
+/**
+ * @brief Gets the client that issued the current command.
+ *
+ * @return The client's connection handle, or BLE_TX_BROADCAST when the
+ *         command was raised internally.
  */
-void command_handler_process(const char *command);
+uint16_t command_handler_origin(void);
 
 #endif // COMMAND_HANDLER_H
@@ -0,0 +1,52 @@
+/**
+ * @file command_ids.h
+ * @brief Numeric ids of all commands, as used by the binary protocol.
+ *
+ * A CBOR request may name its command by one of these ids instead of by
+ * its name. The ids are part of the protocol: once a command has an id, it
+ * keeps it for good, whatever order the tables are registered in, and the
+ * id of a removed command is never given to another one. New commands take
+ * the next unused number. The first ones are the order the commands were
+ * listed in when the binary protocol was introduced.
+ */
+
+#ifndef COMMAND_IDS_H
+#define COMMAND_IDS_H
+
+enum
+{
+    COMMAND_ID_CONNECT = 0,
+    COMMAND_ID_RECONNECT = 1,
+    COMMAND_ID_DISCONNECT = 2,
+    COMMAND_ID_FORGET = 3,
+    COMMAND_ID_STATUS = 4,
+    COMMAND_ID_AUTOCONNECT = 5,
+    COMMAND_ID_SETNAME = 6,
+    COMMAND_ID_RESET = 7,
+    COMMAND_ID_RESTART = 8,
+    COMMAND_ID_QUEUE = 9,
+    COMMAND_ID_DIAG = 10,
+    COMMAND_ID_HELLO = 11,
+    COMMAND_ID_BLELINK = 12,
+    COMMAND_ID_LED = 13,
+    COMMAND_ID_ECHO = 14,
+    COMMAND_ID_HELP = 15,
+    COMMAND_ID_BENCH = 16,
+    COMMAND_ID_SCAN = 17,
+    COMMAND_ID_NETWORKS = 18,
+    COMMAND_ID_KNOWN = 19,
+    COMMAND_ID_PRIORITY = 20,
+    COMMAND_ID_CONFIG = 21,
+    COMMAND_ID_GET = 22,
+    COMMAND_ID_SET = 23,
+    COMMAND_ID_DUMP = 24,
+    COMMAND_ID_STATUSRATE = 25,
+    COMMAND_ID_WIFI = 26,
+    COMMAND_ID_WATCH = 27,
+    COMMAND_ID_ACK = 28,
+    COMMAND_ID_HISTORY = 29,
+    COMMAND_ID_LOGSTAT = 30,
+    COMMAND_ID_GPS = 31,
+};
+
+#endif // COMMAND_IDS_H
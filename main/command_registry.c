@@ -0,0 +1,106 @@
+/**
+ * @file command_registry.c
+ * @brief Implementation of the command registry.
+ */
+
+#include "command_registry.h"
+#include <string.h>
+
+uint32_t command_registry_hash(const char *name, size_t len)
+{
+    // 32-bit FNV-1a, short command names hash in a handful of cycles
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void command_registry_init(command_registry_t *reg, command_slot_t *slots, size_t slot_count)
+{
+    memset(reg, 0, sizeof(*reg));
+    memset(slots, 0, slot_count * sizeof(command_slot_t));
+    reg->slots = slots;
+    reg->slot_mask = slot_count - 1;
+}
+
+esp_err_t command_registry_add_table(command_registry_t *reg, const command_desc_t *descs, size_t count)
+{
+    if (reg->table_count >= COMMAND_REGISTRY_MAX_TABLES)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // Keep the load factor at or below one half so probe chains stay short
+        if ((reg->count + 1) * 2 > reg->slot_mask + 1)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        size_t len = strlen(descs[i].name);
+        if (command_registry_find(reg, descs[i].name, len) != NULL ||
+            command_registry_get(reg, descs[i].id) != NULL)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        for (size_t j = 0; j < i; j++)
+        {
+            if (descs[j].id == descs[i].id)
+            {
+                return ESP_ERR_INVALID_STATE;
+            }
+        }
+
+        uint32_t hash = command_registry_hash(descs[i].name, len);
+        size_t idx = hash & reg->slot_mask;
+        while (reg->slots[idx].desc != NULL)
+        {
+            idx = (idx + 1) & reg->slot_mask;
+        }
+        reg->slots[idx].hash = hash;
+        reg->slots[idx].desc = &descs[i];
+        reg->count++;
+    }
+
+    reg->tables[reg->table_count].descs = descs;
+    reg->tables[reg->table_count].count = count;
+    reg->table_count++;
+    return ESP_OK;
+}
+
+const command_desc_t *command_registry_find(const command_registry_t *reg, const char *name, size_t len)
+{
+    uint32_t hash = command_registry_hash(name, len);
+    size_t idx = hash & reg->slot_mask;
+
+    // Linear probing; an empty slot terminates the chain
+    while (reg->slots[idx].desc != NULL)
+    {
+        const command_desc_t *desc = reg->slots[idx].desc;
+        if (reg->slots[idx].hash == hash && strncmp(desc->name, name, len) == 0 && desc->name[len] == '\0')
+        {
+            return desc;
+        }
+        idx = (idx + 1) & reg->slot_mask;
+    }
+    return NULL;
+}
+
+const command_desc_t *command_registry_get(const command_registry_t *reg, uint32_t id)
+{
+    for (size_t t = 0; t < reg->table_count; t++)
+    {
+        for (size_t i = 0; i < reg->tables[t].count; i++)
+        {
+            if (reg->tables[t].descs[i].id == id)
+            {
+                return &reg->tables[t].descs[i];
+            }
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,173 @@
+/**
+ * @file command_registry.h
+ * @brief Table-driven registry of the commands understood by the device.
+ *
+ * Every module that exposes commands describes them in a static table of
+ * command_desc_t entries and registers that table once at startup. The
+ * registry indexes all registered names in an open-addressing hash table,
+ * so looking up a command costs one hash and (almost always) one string
+ * comparison, no matter how many commands exist. The registration order is
+ * preserved so that help() can be generated from the same tables. Every
+ * command also carries a fixed numeric id (see command_ids.h), which the
+ * binary protocol uses in place of the name.
+ */
+
+#ifndef COMMAND_REGISTRY_H
+#define COMMAND_REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// The maximum number of arguments a single command can take.
+#define COMMAND_MAX_ARGS 4
+
+// The maximum number of command tables (one per module) that can be registered.
+#define COMMAND_REGISTRY_MAX_TABLES 8
+
+// Number of hash slots of the global registry. Must be a power of two and
+// comfortably larger than the number of registered commands.
+#define COMMAND_REGISTRY_SLOTS 64
+
+/*
+ * Argument schema characters used in command_desc_t::args.
+ *
+ * Each character describes one positional argument. Arguments listed after a
+ * COMMAND_ARG_OPTIONAL marker may be omitted, e.g. "s|s" is one required and
+ * one optional string argument.
+ */
+#define COMMAND_ARG_STR 's'      // Quoted string: "text"
+#define COMMAND_ARG_BOOL 'b'     // Bare true or false
+#define COMMAND_ARG_INT 'i'      // Bare signed decimal integer
+#define COMMAND_ARG_OBJECT 'o'   // Flat JSON object: {"key":value,...}; a text string in CBOR
+#define COMMAND_ARG_ANY 'v'      // A string, bool or integer; command_arg_t::type tells which
+#define COMMAND_ARG_OPTIONAL '|' // Following arguments are optional
+
+/**
+ * @brief A single parsed command argument.
+ *
+ * Only the member matching the schema character for the argument is valid.
+ */
+typedef struct
+{
+    const char *str;
+    int32_t num;
+    bool boolean;
+    char type; // Schema character of the value: 's', 'b', 'i' or 'o'
+} command_arg_t;
+
+/**
+ * @brief The parsed, schema-validated arguments of a command.
+ */
+typedef struct
+{
+    uint8_t argc;
+    command_arg_t argv[COMMAND_MAX_ARGS];
+} command_args_t;
+
+/**
+ * @brief Signature of a command handler.
+ *
+ * @param args The arguments, already validated against the command's schema.
+ */
+typedef void (*command_fn_t)(const command_args_t *args);
+
+/**
+ * @brief Describes a single command.
+ */
+typedef struct
+{
+    uint16_t id;       // Permanent numeric id, see command_ids.h
+    const char *name;  // Name used to invoke the command, e.g. "connect"
+    const char *args;  // Argument schema, see COMMAND_ARG_*
+    const char *usage; // Usage string shown by help() and on argument errors
+    command_fn_t fn;   // Handler invoked with the parsed arguments
+} command_desc_t;
+
+/**
+ * @brief A hash slot of the registry index.
+ */
+typedef struct
+{
+    uint32_t hash;
+    const command_desc_t *desc;
+} command_slot_t;
+
+/**
+ * @brief A registered table of command descriptors.
+ */
+typedef struct
+{
+    const command_desc_t *descs;
+    size_t count;
+} command_table_t;
+
+/**
+ * @brief A command registry instance.
+ *
+ * The hash slots are provided by the caller so that registries of different
+ * sizes can be created (the global registry uses COMMAND_REGISTRY_SLOTS).
+ */
+typedef struct
+{
+    command_slot_t *slots;
+    size_t slot_mask;
+    size_t count;
+    command_table_t tables[COMMAND_REGISTRY_MAX_TABLES];
+    size_t table_count;
+} command_registry_t;
+
+/**
+ * @brief Initializes an empty registry on top of caller-provided hash slots.
+ *
+ * @param reg The registry to initialize.
+ * @param slots Storage for the hash slots.
+ * @param slot_count The number of slots, must be a power of two.
+ */
+void command_registry_init(command_registry_t *reg, command_slot_t *slots, size_t slot_count);
+
+/**
+ * @brief Registers a table of command descriptors.
+ *
+ * The table must stay valid for the lifetime of the registry (in practice it
+ * is a static const array in the registering module).
+ *
+ * @param reg The registry.
+ * @param descs The command descriptors.
+ * @param count The number of descriptors in the table.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if a name or an id is
+ *         already registered, or ESP_ERR_NO_MEM if the registry is full.
+ */
+esp_err_t command_registry_add_table(command_registry_t *reg, const command_desc_t *descs, size_t count);
+
+/**
+ * @brief Looks up a command by name.
+ *
+ * @param reg The registry.
+ * @param name The command name, not necessarily null-terminated.
+ * @param len The length of the name.
+ * @return The command descriptor, or NULL if no such command exists.
+ */
+const command_desc_t *command_registry_find(const command_registry_t *reg, const char *name, size_t len);
+
+/**
+ * @brief Looks up a command by its numeric id.
+ *
+ * The id is the one in the command's descriptor, independent of the order
+ * the tables were registered in. The binary protocol uses it instead of the
+ * name. Ids are compared one by one; there are few enough commands that
+ * this costs about as much as hashing a name.
+ *
+ * @param reg The registry.
+ * @param id The command id.
+ * @return The command descriptor, or NULL if no such command exists.
+ */
+const command_desc_t *command_registry_get(const command_registry_t *reg, uint32_t id);
+
+/**
+ * @brief Computes the hash of a command name as used by the registry.
+ */
+uint32_t command_registry_hash(const char *name, size_t len);
+
+#endif // COMMAND_REGISTRY_H
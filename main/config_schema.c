@@ -0,0 +1,164 @@
+/**
+ * @file config_schema.c
+ * @brief The settings schema and typed access to the values.
+ */
+
+#include "config_schema.h"
+#include "app_task.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MEMBER(m) .offset = offsetof(config_values_t, m), .size = sizeof(((config_values_t *)0)->m)
+
+static void apply_statusrate(const config_value_t *value)
+{
+    app_task_set_status_interval((uint32_t)value->num);
+}
+
+const config_desc_t config_schema[CONFIG_KEY_COUNT] = {
+    [CONFIG_AUTOCONNECT] = {
+        .name = "autoconnect",
+        .type = CONFIG_TYPE_BOOL,
+        .def = {.boolean = true},
+        .persist = true,
+        MEMBER(autoconnect),
+    },
+    [CONFIG_DEVNAME] = {
+        .name = "devname",
+        .type = CONFIG_TYPE_STRING,
+        .min = 1,
+        .max = 32,
+        .def = {.str = "ESP32-BLE"},
+        .persist = true,
+        .restart = true,
+        MEMBER(devname),
+    },
+    // Clients tune it for their session, so it is not kept
+    [CONFIG_STATUSRATE] = {
+        .name = "statusrate",
+        .type = CONFIG_TYPE_INT,
+        .min = 0,
+        .max = 60000,
+        .def = {.num = APP_TASK_STATUS_INTERVAL_MS},
+        MEMBER(statusrate),
+        .apply = apply_statusrate,
+    },
+};
+
+int config_find(const char *name)
+{
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        if (strcmp(config_schema[key].name, name) == 0)
+        {
+            return key;
+        }
+    }
+    return -1;
+}
+
+const char *config_check(config_key_t key, config_type_t type, const config_value_t *value)
+{
+    const config_desc_t *desc = &config_schema[key];
+    if (type != desc->type)
+    {
+        return "wrong type";
+    }
+    switch (desc->type)
+    {
+    case CONFIG_TYPE_INT:
+        if (value->num < desc->min || value->num > desc->max)
+        {
+            return "out of range";
+        }
+        break;
+    case CONFIG_TYPE_STRING:
+    {
+        size_t len = strlen(value->str);
+        if (len < (size_t)desc->min || len > (size_t)desc->max || len >= desc->size)
+        {
+            return "bad length";
+        }
+        break;
+    }
+    case CONFIG_TYPE_BOOL:
+        break;
+    }
+    return NULL;
+}
+
+void config_defaults(config_values_t *values)
+{
+    memset(values, 0, sizeof(*values));
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        config_set(values, key, &config_schema[key].def);
+    }
+}
+
+void config_get(const config_values_t *values, config_key_t key, config_value_t *out)
+{
+    const config_desc_t *desc = &config_schema[key];
+    const uint8_t *field = (const uint8_t *)values + desc->offset;
+    *out = (config_value_t){0};
+    switch (desc->type)
+    {
+    case CONFIG_TYPE_BOOL:
+        out->boolean = *(const bool *)field;
+        break;
+    case CONFIG_TYPE_INT:
+        memcpy(&out->num, field, sizeof(out->num));
+        break;
+    case CONFIG_TYPE_STRING:
+        out->str = (const char *)field;
+        break;
+    }
+}
+
+bool config_set(config_values_t *values, config_key_t key, const config_value_t *value)
+{
+    const config_desc_t *desc = &config_schema[key];
+    uint8_t *field = (uint8_t *)values + desc->offset;
+    switch (desc->type)
+    {
+    case CONFIG_TYPE_BOOL:
+    {
+        bool *b = (bool *)field;
+        if (*b == value->boolean)
+        {
+            return false;
+        }
+        *b = value->boolean;
+        return true;
+    }
+    case CONFIG_TYPE_INT:
+        if (memcmp(field, &value->num, sizeof(value->num)) == 0)
+        {
+            return false;
+        }
+        memcpy(field, &value->num, sizeof(value->num));
+        return true;
+    case CONFIG_TYPE_STRING:
+        if (strncmp((const char *)field, value->str, desc->size - 1) == 0)
+        {
+            return false;
+        }
+        snprintf((char *)field, desc->size, "%s", value->str);
+        return true;
+    }
+    return false;
+}
+
+const char *config_type_name(config_type_t type)
+{
+    switch (type)
+    {
+    case CONFIG_TYPE_BOOL:
+        return "bool";
+    case CONFIG_TYPE_INT:
+        return "int";
+    case CONFIG_TYPE_STRING:
+        return "string";
+    }
+    return "unknown";
+}
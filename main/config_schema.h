@@ -0,0 +1,128 @@
+/**
+ * @file config_schema.h
+ * @brief Declarative schema of the device settings.
+ *
+ * Every setting is one entry of config_schema[], indexed by its
+ * config_key_t: name, type, bounds, default, whether it is persisted, and
+ * an optional hook that applies a committed change. Its value lives in
+ * one member of config_values_t, found through the entry's offset, so
+ * any setting is read or written by index without code of its own.
+ * nvs_storage keeps the values and persists them; the get(), set() and
+ * dump() commands reach every setting through the schema.
+ *
+ * A new setting is a member of config_values_t, a key and a schema entry.
+ */
+
+#ifndef CONFIG_SCHEMA_H
+#define CONFIG_SCHEMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Value types; in NVS a bool is a u8 and an int an i32.
+ */
+typedef enum
+{
+    CONFIG_TYPE_BOOL,
+    CONFIG_TYPE_INT,
+    CONFIG_TYPE_STRING,
+} config_type_t;
+
+/**
+ * @brief The settings, as indexes into config_schema[].
+ */
+typedef enum
+{
+    CONFIG_AUTOCONNECT, // Connect to the best known network at boot and after losses
+    CONFIG_DEVNAME,     // BLE device name
+    CONFIG_STATUSRATE,  // Minimum interval between status publications, ms
+    CONFIG_KEY_COUNT
+} config_key_t;
+
+/**
+ * @brief The values of all settings, one member per key.
+ *
+ * Members are ordered by alignment, so the struct has no padding inside.
+ */
+typedef struct
+{
+    int32_t statusrate;
+    char devname[33];
+    bool autoconnect;
+} config_values_t;
+
+/**
+ * @brief A value of any type; only the member matching the type is valid.
+ */
+typedef struct
+{
+    bool boolean;
+    int32_t num;
+    const char *str;
+} config_value_t;
+
+/**
+ * @brief Describes one setting.
+ */
+typedef struct
+{
+    const char *name;   // Name in get()/set() and NVS key
+    config_type_t type;
+    int32_t min;        // Bounds of an int, or of a string's length
+    int32_t max;
+    config_value_t def; // Default
+    bool persist;       // Kept in NVS; otherwise back to the default at boot
+    bool restart;       // Only takes effect after a restart
+    uint16_t offset;    // Of the value in config_values_t
+    uint16_t size;      // Of that member
+    // Applies a committed change; called without the storage lock. May be NULL
+    void (*apply)(const config_value_t *value);
+} config_desc_t;
+
+/**
+ * @brief The schema, indexed by config_key_t.
+ */
+extern const config_desc_t config_schema[CONFIG_KEY_COUNT];
+
+/**
+ * @brief Finds a setting by name.
+ *
+ * @return The key, or -1 if there is no such setting.
+ */
+int config_find(const char *name);
+
+/**
+ * @brief Checks a value against the setting's type and bounds.
+ *
+ * @param type The type the value was given as.
+ * @return NULL if the value is valid, else why not.
+ */
+const char *config_check(config_key_t key, config_type_t type, const config_value_t *value);
+
+/**
+ * @brief Sets every setting to its default.
+ */
+void config_defaults(config_values_t *values);
+
+/**
+ * @brief Reads one setting.
+ *
+ * @param[out] out The value; a string points into values.
+ */
+void config_get(const config_values_t *values, config_key_t key, config_value_t *out);
+
+/**
+ * @brief Writes one setting; the value must have passed config_check().
+ *
+ * @return True if the value changed.
+ */
+bool config_set(config_values_t *values, config_key_t key, const config_value_t *value);
+
+/**
+ * @brief Gets the name of a type, as reported by get().
+ */
+const char *config_type_name(config_type_t type);
+
+#endif // CONFIG_SCHEMA_H
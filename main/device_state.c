@@ -0,0 +1,112 @@
+/**
+ * @file device_state.c
+ * @brief Implementation of the device state seqlock.
+ */
+
+#include "device_state.h"
+#include "app_includes.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+// Odd while a publication is in progress
+static atomic_uint sequence;
+
+// Serializes writers; readers never take it
+static portMUX_TYPE writer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static device_state_t state = {
+    .devname = "ESP32-BLE",
+    .autoconnect = true,
+};
+
+// Writers hold the spinlock with interrupts off, so a reader can only spin
+// while a writer runs on the other core, and never for long
+static void write_begin(void)
+{
+    portENTER_CRITICAL(&writer_lock);
+    unsigned seq = atomic_load_explicit(&sequence, memory_order_relaxed);
+    atomic_store_explicit(&sequence, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(void)
+{
+    unsigned seq = atomic_load_explicit(&sequence, memory_order_relaxed);
+    state.version = (seq + 1) / 2;
+    atomic_store_explicit(&sequence, seq + 1, memory_order_release);
+    portEXIT_CRITICAL(&writer_lock);
+}
+
+void device_state_read(device_state_t *out)
+{
+    unsigned before;
+    unsigned after;
+    do
+    {
+        before = atomic_load_explicit(&sequence, memory_order_acquire);
+        if (before & 1)
+        {
+            continue;
+        }
+        memcpy(out, &state, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+void device_state_set_wifi(bool connected, const esp_ip4_addr_t *ip)
+{
+    write_begin();
+    state.wifi_connected = connected;
+    state.ip.addr = connected && ip != NULL ? ip->addr : 0;
+    if (!connected)
+    {
+        state.rssi = 0;
+        state.roam_hint = false;
+    }
+    write_end();
+}
+
+void device_state_set_rssi(int8_t rssi)
+{
+    write_begin();
+    state.rssi = rssi;
+    write_end();
+}
+
+void device_state_set_scan(bool scanning)
+{
+    write_begin();
+    state.scanning = scanning;
+    write_end();
+}
+
+void device_state_set_roam(const uint8_t *bssid, uint8_t channel, int8_t rssi)
+{
+    write_begin();
+    state.roam_hint = bssid != NULL;
+    if (bssid != NULL)
+    {
+        memcpy(state.roam_bssid, bssid, sizeof(state.roam_bssid));
+        state.roam_channel = channel;
+        state.roam_rssi = rssi;
+    }
+    write_end();
+}
+
+void device_state_set_ble_clients(uint8_t clients)
+{
+    write_begin();
+    state.ble_clients = clients;
+    write_end();
+}
+
+void device_state_set_config(const char *ssid, bool autoconnect, const char *devname)
+{
+    write_begin();
+    snprintf(state.ssid, sizeof(state.ssid), "%s", ssid);
+    state.autoconnect = autoconnect;
+    snprintf(state.devname, sizeof(state.devname), "%s", devname);
+    write_end();
+}
@@ -0,0 +1,96 @@
+/**
+ * @file device_state.h
+ * @brief Versioned snapshot of the device state shared by all tasks.
+ *
+ * The WiFi event handler, the NimBLE host and the NVS storage each publish
+ * their part of the state here as it changes. Writers are serialized with
+ * a spinlock and bump a sequence counter around every update (a seqlock),
+ * so readers copy out a consistent snapshot without taking a lock and
+ * without calling into the WiFi driver.
+ */
+
+#ifndef DEVICE_STATE_H
+#define DEVICE_STATE_H
+
+#include "esp_netif_types.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief The published device state.
+ */
+typedef struct
+{
+    uint32_t version;       // Number of publications so far
+
+    // WiFi, published by the WiFi manager
+    bool wifi_connected;    // Associated and got an IP address
+    int8_t rssi;            // Last sampled RSSI, 0 when not connected
+    esp_ip4_addr_t ip;      // STA address, 0 when not connected
+    bool scanning;          // A scan is in progress; the result is in scan_store
+    bool roam_hint;         // A clearly stronger AP of the current network is in range
+    uint8_t roam_bssid[6];  // ...this one
+    uint8_t roam_channel;
+    int8_t roam_rssi;
+
+    // BLE, published by the BLE manager
+    uint8_t ble_clients;    // Connected centrals
+
+    // Preferences, published by the NVS storage
+    char ssid[33];
+    bool autoconnect;
+    char devname[33];
+} device_state_t;
+
+/**
+ * @brief Copies out a consistent snapshot of the device state.
+ *
+ * Never blocks; retries while a publication is in progress.
+ *
+ * @param[out] state The snapshot.
+ */
+void device_state_read(device_state_t *state);
+
+/**
+ * @brief Publishes the WiFi connection state.
+ *
+ * Also clears the RSSI and the roaming candidate when the connection is
+ * gone.
+ *
+ * @param connected True once an IP address was obtained.
+ * @param ip The STA address, ignored when not connected.
+ */
+void device_state_set_wifi(bool connected, const esp_ip4_addr_t *ip);
+
+/**
+ * @brief Publishes a newly sampled RSSI.
+ */
+void device_state_set_rssi(int8_t rssi);
+
+/**
+ * @brief Publishes the start or the end of a scan.
+ *
+ * @param scanning True when a scan starts.
+ */
+void device_state_set_scan(bool scanning);
+
+/**
+ * @brief Publishes or withdraws the roaming candidate.
+ *
+ * @param bssid The candidate AP, or NULL to withdraw it.
+ * @param channel Its primary channel.
+ * @param rssi Its RSSI in the last scan.
+ */
+void device_state_set_roam(const uint8_t *bssid, uint8_t channel, int8_t rssi);
+
+/**
+ * @brief Publishes the number of connected BLE clients.
+ */
+void device_state_set_ble_clients(uint8_t clients);
+
+/**
+ * @brief Publishes the stored preferences.
+ */
+void device_state_set_config(const char *ssid, bool autoconnect, const char *devname);
+
+#endif // DEVICE_STATE_H
@@ -12,6 +12,10 @@
 #include "wifi_manager.h"
 #include "ble_manager.h"
 #include "app_task.h"
+#include "command_handler.h"
+#include "bench.h"
+#include "telemetry.h"
+#include "gps_manager.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
@@ -34,17 +38,23 @@ void app_main(void)
     // 1. Initialize Non-Volatile Storage
     ESP_ERROR_CHECK(nvs_storage_init());
 
-    // 2. Initialize the application task and its command queue.
+    // 2. Build the command registry before anything can issue commands
+    ESP_ERROR_CHECK(command_handler_init());
+    ESP_ERROR_CHECK(bench_init());
+    ESP_ERROR_CHECK(telemetry_init());
+    ESP_ERROR_CHECK(gps_manager_init());
+
+    // 3. Initialize the application task and its command queue.
     //    The task will block until the init_done_sem is given.
     ESP_ERROR_CHECK(app_task_start(init_done_sem));
 
-    // 3. Initialize the WiFi Manager
+    // 4. Initialize the WiFi Manager
     ESP_ERROR_CHECK(wifi_manager_init());
 
-    // 4. Initialize the BLE Manager (which starts advertising)
+    // 5. Initialize the BLE Manager (which starts advertising)
     ESP_ERROR_CHECK(ble_manager_init());
 
-    // 5. Signal the application task that it can now proceed.
+    // 6. Signal the application task that it can now proceed.
     xSemaphoreGive(init_done_sem);
 
     ESP_LOGI(TAG, "===== ESP-OS Startup Complete =====");
@@ -0,0 +1,502 @@
+/**
+ * @file gps_manager.c
+ * @brief Implementation of the GPS manager.
+ */
+
+#include "gps_manager.h"
+#include "app_includes.h"
+#include "driver/uart.h"
+#include "freertos/semphr.h"
+#include "gps_stream.h"
+#include "command_handler.h"
+#include "ble_manager.h"
+#include "json_writer.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "GPS";
+
+// UART driver buffer and event queue; the pattern queue holds the
+// positions of line ends not read yet
+#define GPS_UART_BUF_SIZE 2048
+#define GPS_EVENT_QUEUE_LEN 16
+#define GPS_PATTERN_QUEUE_LEN 16
+
+// Fewer, larger FIFO transfers into the driver buffer
+#define GPS_RX_FULL_THRESHOLD 100
+
+// How long the task sleeps without events before it checks for a stop
+// request and a timeout
+#define GPS_WAIT_MS 250
+
+// Interval of the "searching" message while there is no fix
+#define GPS_SEARCHING_MS 2000
+
+// --- U-BLOX M8N CONFIGURATION COMMANDS ---
+// 1. UBX-CFG-PRT: Set UART1 to 115200 baud, 8N1, UBX+NMEA out
+static const uint8_t UBX_SET_115200[] = {
+    0xB5, 0x62, 0x06, 0x00, 0x14, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0xD0, 0x08, 0x00, 0x00, 0x00, 0xC2, 0x01, 0x00, 0x07, 0x00,
+    0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0xC4, 0x96};
+
+// 2. UBX-CFG-RATE: Set update rate to 10Hz (100ms)
+static const uint8_t UBX_SET_10HZ[] = {
+    0xB5, 0x62, 0x06, 0x08, 0x06, 0x00, 0x64, 0x00, 0x01, 0x00,
+    0x01, 0x00, 0x7A, 0x12};
+
+// 3. UBX-CFG-GNSS: Enable GPS + GLONASS (Better signal for M8N)
+static const uint8_t UBX_ENABLE_GPS_GLONASS[] = {
+    0xB5, 0x62, 0x06, 0x3E, 0x2C, 0x00, 0x00, 0x00, 0x20, 0x05,
+    0x00, 0x08, 0x10, 0x00, 0x01, 0x00, 0x01, 0x01, 0x01, 0x01,
+    0x03, 0x00, 0x01, 0x00, 0x01, 0x01, 0x04, 0x00, 0x08, 0x00,
+    0x00, 0x00, 0x01, 0x01, 0x05, 0x00, 0x03, 0x00, 0x01, 0x00,
+    0x01, 0x01, 0x06, 0x08, 0x0E, 0x00, 0x01, 0x00, 0x01, 0x01,
+    0xFC, 0x11};
+
+typedef enum
+{
+    GPS_STOPPED,
+    GPS_RUNNING,
+    GPS_STOPPING,
+} gps_state_t;
+
+static const char *const state_names[] = {
+    [GPS_STOPPED] = "stopped",
+    [GPS_RUNNING] = "running",
+    [GPS_STOPPING] = "stopping",
+};
+
+typedef struct
+{
+    uint32_t events;     // UART events received
+    uint32_t reads;      // uart_read_bytes() calls
+    uint32_t overflows;  // Times received data was lost and flushed
+    uint32_t recoveries; // Times the receiver was configured again
+    uint32_t published;  // Fixes broadcast
+    uint64_t cpu_us;     // Spent reading and decoding
+    int64_t started_us;
+    int64_t last_fix_us; // When the last RMC came in, 0 for never
+    uint32_t baud;
+} gps_counters_t;
+
+// The state and everything gps() reports, under the lock. The stream is
+// only written by the task, which holds the lock while it commits
+static SemaphoreHandle_t gps_lock;
+static gps_state_t state;
+static gps_stream_t stream;
+static gps_counters_t counters;
+static QueueHandle_t uart_queue;
+
+static void set_baud(uint32_t baud)
+{
+    uart_set_baudrate(GPS_UART_NUM, baud);
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    counters.baud = baud;
+    xSemaphoreGive(gps_lock);
+}
+
+static bool open_uart(void)
+{
+    uart_config_t uart_config = {
+        .baud_rate = GPS_DEFAULT_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    esp_err_t err = uart_driver_install(GPS_UART_NUM, GPS_UART_BUF_SIZE, 0, GPS_EVENT_QUEUE_LEN, &uart_queue, 0);
+    if (err == ESP_OK)
+    {
+        err = uart_param_config(GPS_UART_NUM, &uart_config);
+    }
+    if (err == ESP_OK)
+    {
+        err = uart_set_pin(GPS_UART_NUM, GPS_TX_PIN, GPS_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    }
+    if (err == ESP_OK)
+    {
+        err = uart_set_rx_full_threshold(GPS_UART_NUM, GPS_RX_FULL_THRESHOLD);
+    }
+    if (err == ESP_OK)
+    {
+        // An event per '\n', with its position in the driver buffer
+        err = uart_enable_pattern_det_baud_intr(GPS_UART_NUM, '\n', 1, 9, 0, 0);
+    }
+    if (err == ESP_OK)
+    {
+        err = uart_pattern_queue_reset(GPS_UART_NUM, GPS_PATTERN_QUEUE_LEN);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set up UART%d: %s", GPS_UART_NUM, esp_err_to_name(err));
+        if (uart_is_driver_installed(GPS_UART_NUM))
+        {
+            uart_driver_delete(GPS_UART_NUM);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Drops everything received so far, e.g. after the driver buffer overflowed
+static void discard_input(void)
+{
+    uart_flush_input(GPS_UART_NUM);
+    xQueueReset(uart_queue);
+    uart_pattern_queue_reset(GPS_UART_NUM, GPS_PATTERN_QUEUE_LEN);
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    gps_stream_reset(&stream);
+    xSemaphoreGive(gps_lock);
+}
+
+// Switches the receiver to GPS_BAUD and 10 Hz. It is talked to at its
+// default rate first, so this also recovers a receiver that lost its
+// configuration
+static void configure_receiver(void)
+{
+    set_baud(GPS_DEFAULT_BAUD);
+    uart_write_bytes(GPS_UART_NUM, UBX_SET_115200, sizeof(UBX_SET_115200));
+    uart_wait_tx_done(GPS_UART_NUM, pdMS_TO_TICKS(100));
+    // Give the receiver time to switch its own clock
+    vTaskDelay(pdMS_TO_TICKS(200));
+
+    set_baud(GPS_BAUD);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    uart_write_bytes(GPS_UART_NUM, UBX_SET_10HZ, sizeof(UBX_SET_10HZ));
+    vTaskDelay(pdMS_TO_TICKS(50));
+    uart_write_bytes(GPS_UART_NUM, UBX_ENABLE_GPS_GLONASS, sizeof(UBX_ENABLE_GPS_GLONASS));
+    uart_wait_tx_done(GPS_UART_NUM, pdMS_TO_TICKS(100));
+
+    // Whatever came in at the wrong rate is garbage
+    discard_input();
+    ESP_LOGI(TAG, "Receiver configured for %d baud, 10 Hz", GPS_BAUD);
+}
+
+// Writes value / 10^decimals without going through floats
+static void put_fixed(json_writer_t *w, const char *key, int32_t value, int decimals)
+{
+    static const uint32_t scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+    uint32_t mag = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    char num[16];
+    snprintf(num, sizeof(num), "%s%lu.%0*lu", value < 0 ? "-" : "", (unsigned long)(mag / scale[decimals]),
+             decimals, (unsigned long)(mag % scale[decimals]));
+    json_put_key(w, key);
+    json_put_raw(w, num);
+}
+
+static void put_fix(json_writer_t *w, const gps_fix_t *fix)
+{
+    put_fixed(w, "lat", fix->lat_e7, 7);
+    put_fixed(w, "lon", fix->lon_e7, 7);
+    put_fixed(w, "kph", fix->speed_kmh_e2, 2);
+    put_fixed(w, "course", fix->course_e2, 2);
+    json_put_key_int(w, "sats", fix->satellites);
+}
+
+// Broadcasts the fix, or now and then that there is none
+static void publish(const gps_fix_t *fix, int64_t now)
+{
+    static int64_t last_publish_us, last_searching_us;
+    if (!ble_manager_is_connected())
+    {
+        return;
+    }
+    if (!fix->valid)
+    {
+        if (now - last_searching_us >= (int64_t)GPS_SEARCHING_MS * 1000)
+        {
+            ble_manager_send_response("{\"gps\":false,\"status\":\"searching\"}");
+            last_searching_us = now;
+        }
+        return;
+    }
+    if (now - last_publish_us < (int64_t)GPS_PUBLISH_MS * 1000)
+    {
+        return;
+    }
+
+    char msg[160];
+    json_writer_t w;
+    json_writer_init(&w, msg, sizeof(msg));
+    json_begin_object(&w);
+    json_put_key_bool(&w, "gps", true);
+    put_fix(&w, fix);
+    json_end_object(&w);
+    ble_manager_send_response(msg);
+    last_publish_us = now;
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    counters.published++;
+    xSemaphoreGive(gps_lock);
+}
+
+// Reads the line whose end the driver found, straight into the ring
+static void read_line(void)
+{
+    int pos = uart_pattern_pop_pos(GPS_UART_NUM);
+    if (pos < 0)
+    {
+        // The position queue overflowed, so lines can no longer be found
+        ESP_LOGW(TAG, "Line ends lost, flushing the input");
+        discard_input();
+        xSemaphoreTake(gps_lock, portMAX_DELAY);
+        counters.overflows++;
+        xSemaphoreGive(gps_lock);
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    size_t left = (size_t)pos + 1;
+    uint32_t updates = 0, reads = 0;
+    while (left > 0)
+    {
+        char *dst;
+        size_t space = gps_stream_write_space(&stream, &dst);
+        int got = uart_read_bytes(GPS_UART_NUM, dst, left < space ? left : space, 0);
+        if (got <= 0)
+        {
+            break;
+        }
+        reads++;
+        left -= got;
+        xSemaphoreTake(gps_lock, portMAX_DELAY);
+        updates += gps_stream_commit(&stream, got);
+        xSemaphoreGive(gps_lock);
+    }
+
+    int64_t now = esp_timer_get_time();
+    gps_fix_t fix;
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    counters.reads += reads;
+    counters.cpu_us += now - start;
+    if (updates > 0)
+    {
+        counters.last_fix_us = now;
+    }
+    gps_stream_get_fix(&stream, &fix);
+    xSemaphoreGive(gps_lock);
+    if (updates > 0)
+    {
+        publish(&fix, now);
+    }
+}
+
+static void gps_task(void *arg)
+{
+    ESP_LOGI(TAG, "GPS task started on UART%d", GPS_UART_NUM);
+    configure_receiver();
+
+    int64_t heard_us = esp_timer_get_time();
+    uint32_t sentences = 0;
+    for (;;)
+    {
+        xSemaphoreTake(gps_lock, portMAX_DELAY);
+        bool stopping = state == GPS_STOPPING;
+        xSemaphoreGive(gps_lock);
+        if (stopping)
+        {
+            break;
+        }
+
+        uart_event_t event;
+        if (xQueueReceive(uart_queue, &event, pdMS_TO_TICKS(GPS_WAIT_MS)) == pdTRUE)
+        {
+            xSemaphoreTake(gps_lock, portMAX_DELAY);
+            counters.events++;
+            xSemaphoreGive(gps_lock);
+            switch (event.type)
+            {
+            case UART_PATTERN_DET:
+                read_line();
+                break;
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                ESP_LOGW(TAG, "UART overflow, flushing the input");
+                discard_input();
+                xSemaphoreTake(gps_lock, portMAX_DELAY);
+                counters.overflows++;
+                xSemaphoreGive(gps_lock);
+                break;
+            default:
+                // Data without a line end stays in the driver buffer
+                break;
+            }
+        }
+
+        // Only sentences with a valid checksum show the baud rate is right
+        gps_stream_stats_t stats;
+        xSemaphoreTake(gps_lock, portMAX_DELAY);
+        gps_stream_get_stats(&stream, &stats);
+        xSemaphoreGive(gps_lock);
+        int64_t now = esp_timer_get_time();
+        uint32_t valid = stats.rmc + stats.gga + stats.other;
+        if (valid != sentences)
+        {
+            sentences = valid;
+            heard_us = now;
+        }
+        else if (now - heard_us > (int64_t)GPS_TIMEOUT_MS * 1000)
+        {
+            ESP_LOGE(TAG, "GPS timeout: configuring the receiver again");
+            xSemaphoreTake(gps_lock, portMAX_DELAY);
+            counters.recoveries++;
+            xSemaphoreGive(gps_lock);
+            configure_receiver();
+            heard_us = esp_timer_get_time();
+        }
+    }
+
+    uart_driver_delete(GPS_UART_NUM);
+    ESP_LOGI(TAG, "GPS task stopped");
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    state = GPS_STOPPED;
+    xSemaphoreGive(gps_lock);
+    vTaskDelete(NULL);
+}
+
+static void gps_start(void)
+{
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    gps_state_t current = state;
+    xSemaphoreGive(gps_lock);
+    if (current != GPS_STOPPED)
+    {
+        command_handler_reply(current == GPS_RUNNING ? "{\"error\":\"already_running\"}"
+                                                     : "{\"error\":\"gps is stopping\"}");
+        return;
+    }
+    if (!open_uart())
+    {
+        command_handler_reply("{\"error\":\"uart_setup_failed\"}");
+        return;
+    }
+
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    gps_stream_init(&stream, NULL, NULL);
+    counters = (gps_counters_t){.started_us = esp_timer_get_time(), .baud = GPS_DEFAULT_BAUD};
+    state = GPS_RUNNING;
+    xSemaphoreGive(gps_lock);
+
+    // Below the application tasks: the driver buffers the data meanwhile
+    if (xTaskCreate(gps_task, "gps_task", 4096, NULL, 4, NULL) != pdPASS)
+    {
+        uart_driver_delete(GPS_UART_NUM);
+        xSemaphoreTake(gps_lock, portMAX_DELAY);
+        state = GPS_STOPPED;
+        xSemaphoreGive(gps_lock);
+        command_handler_reply("{\"error\":\"task_create_failed\"}");
+        return;
+    }
+    command_handler_reply("{\"status\":\"gps_started\"}");
+}
+
+static void gps_stop(void)
+{
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    bool running = state == GPS_RUNNING;
+    if (running)
+    {
+        state = GPS_STOPPING;
+    }
+    xSemaphoreGive(gps_lock);
+    // The task notices within GPS_WAIT_MS and releases the UART
+    command_handler_reply(running ? "{\"status\":\"gps_stopping\"}" : "{\"error\":\"not_running\"}");
+}
+
+static void gps_status(void)
+{
+    gps_fix_t fix;
+    gps_stream_stats_t stats;
+    xSemaphoreTake(gps_lock, portMAX_DELAY);
+    gps_state_t current = state;
+    gps_counters_t c = counters;
+    gps_stream_get_fix(&stream, &fix);
+    gps_stream_get_stats(&stream, &stats);
+    xSemaphoreGive(gps_lock);
+    int64_t now = esp_timer_get_time();
+
+    static char resp[640];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "gps");
+    json_begin_object(&w);
+    json_put_key_string(&w, "state", state_names[current]);
+    json_put_key_bool(&w, "fix", fix.valid);
+    if (fix.valid)
+    {
+        put_fix(&w, &fix);
+        json_put_key_int(&w, "quality", fix.quality);
+        put_fixed(&w, "hdop", fix.hdop_e2, 2);
+        put_fixed(&w, "alt", fix.alt_dm, 1);
+    }
+    if (fix.date != 0)
+    {
+        json_put_key_int(&w, "date", fix.date);
+    }
+    if (fix.utc_ms >= 0)
+    {
+        json_put_key_int(&w, "utc_ms", fix.utc_ms);
+    }
+    if (c.last_fix_us != 0)
+    {
+        json_put_key_int(&w, "age_ms", (now - c.last_fix_us) / 1000);
+    }
+    if (c.started_us != 0)
+    {
+        json_put_key_int(&w, "baud", c.baud);
+        json_put_key_int(&w, "running_ms", (now - c.started_us) / 1000);
+        json_put_key_int(&w, "cpu_us", c.cpu_us);
+        json_put_key_int(&w, "bytes", stats.bytes);
+        json_put_key_int(&w, "lines", stats.lines);
+        json_put_key_int(&w, "rmc", stats.rmc);
+        json_put_key_int(&w, "gga", stats.gga);
+        json_put_key_int(&w, "other", stats.other);
+        json_put_key_int(&w, "invalid", stats.invalid);
+        json_put_key_int(&w, "too_long", stats.too_long);
+        json_put_key_int(&w, "events", c.events);
+        json_put_key_int(&w, "reads", c.reads);
+        json_put_key_int(&w, "overflows", c.overflows);
+        json_put_key_int(&w, "recoveries", c.recoveries);
+        json_put_key_int(&w, "published", c.published);
+    }
+    json_end_object(&w);
+    json_end_object(&w);
+    command_handler_reply(resp);
+}
+
+static void cmd_gps(const command_args_t *args)
+{
+    const char *action = args->argc > 0 ? args->argv[0].str : "status";
+    if (strcmp(action, "start") == 0)
+    {
+        gps_start();
+    }
+    else if (strcmp(action, "stop") == 0)
+    {
+        gps_stop();
+    }
+    else if (strcmp(action, "status") == 0)
+    {
+        gps_status();
+    }
+    else
+    {
+        command_handler_reply("{\"error\":\"usage: gps(\\\"start|stop|status\\\")\"}");
+    }
+}
+
+static const command_desc_t gps_commands[] = {
+    {COMMAND_ID_GPS, "gps", "|s", "gps(\"start|stop|status\")", cmd_gps},
+};
+
+esp_err_t gps_manager_init(void)
+{
+    gps_lock = xSemaphoreCreateMutex();
+    if (gps_lock == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    gps_stream_init(&stream, NULL, NULL);
+    return command_handler_register(gps_commands, sizeof(gps_commands) / sizeof(gps_commands[0]));
+}
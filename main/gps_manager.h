@@ -0,0 +1,47 @@
+/**
+ * @file gps_manager.h
+ * @brief GPS receiver on a UART, streaming fixes to BLE clients.
+ *
+ * gps("start") installs the UART driver and starts a task that configures
+ * a u-blox M8N for 115200 baud and 10 Hz. The driver detects every '\n'
+ * in the incoming data and queues an event with its position, so the task
+ * sleeps until a whole line is there, reads exactly that line into the
+ * gps_stream ring and decodes it in place; nothing polls and nothing is
+ * copied byte by byte. Valid fixes are broadcast to the subscribers as
+ * {"gps":true,"lat":..,"lon":..,"kph":..,"sats":..} at most every
+ * GPS_PUBLISH_MS, and {"gps":false,"status":"searching"} now and then
+ * while there is none. If no valid sentence arrives for GPS_TIMEOUT_MS,
+ * the receiver is configured again, starting from its default baud rate.
+ *
+ * gps("stop") releases the UART, and gps() or gps("status") reports the
+ * state, the last fix, the stream counters and the CPU time spent on it.
+ */
+
+#ifndef GPS_MANAGER_H
+#define GPS_MANAGER_H
+
+#include "esp_err.h"
+
+// UART and pins the receiver is wired to.
+#define GPS_UART_NUM 2 // UART_NUM_2
+#define GPS_RX_PIN 16
+#define GPS_TX_PIN 17
+
+// Baud rate the receiver starts with, and the one it is switched to.
+#define GPS_DEFAULT_BAUD 9600
+#define GPS_BAUD 115200
+
+// Minimum interval between broadcast fixes.
+#define GPS_PUBLISH_MS 100
+
+// Silence after which the receiver is configured again.
+#define GPS_TIMEOUT_MS 5000
+
+/**
+ * @brief Registers the gps() command; the UART stays free until it is started.
+ *
+ * @return ESP_OK on success, or an error code on failure.
+ */
+esp_err_t gps_manager_init(void);
+
+#endif // GPS_MANAGER_H
@@ -0,0 +1,212 @@
+/**
+ * @file gps_stream.c
+ * @brief Implementation of the NMEA stream pipeline.
+ */
+
+#include "gps_stream.h"
+#include "minmea.h"
+#include <string.h>
+
+#define RING_MASK (GPS_STREAM_RING_SIZE - 1)
+
+_Static_assert((GPS_STREAM_RING_SIZE & RING_MASK) == 0, "GPS_STREAM_RING_SIZE must be a power of two");
+_Static_assert(GPS_STREAM_LINE_MAX < GPS_STREAM_RING_SIZE / 2, "a line must leave room to read the next");
+
+void gps_stream_init(gps_stream_t *s, gps_line_fn on_line, void *ctx)
+{
+    memset(s, 0, sizeof(*s));
+    s->on_line = on_line;
+    s->ctx = ctx;
+    s->fix.utc_ms = -1;
+}
+
+// NMEA coordinates are DDDMM.MMMM
+static int32_t coord_e7(const struct minmea_float *f)
+{
+    if (f->scale == 0)
+    {
+        return 0;
+    }
+    int64_t unit = (int64_t)f->scale * 100;
+    int64_t degrees = f->value / unit;
+    int64_t minutes = f->value % unit; // * scale
+    return (int32_t)(degrees * 10000000 + minutes * 10000000 / (60 * (int64_t)f->scale));
+}
+
+static void apply_rmc(gps_fix_t *fix, struct minmea_sentence_rmc *frame)
+{
+    fix->valid = frame->valid && frame->latitude.scale != 0 && frame->longitude.scale != 0;
+    if (fix->valid)
+    {
+        fix->lat_e7 = coord_e7(&frame->latitude);
+        fix->lon_e7 = coord_e7(&frame->longitude);
+        fix->speed_kmh_e2 = (int32_t)((int64_t)minmea_rescale(&frame->speed, 100) * 1852 / 1000);
+        fix->course_e2 = minmea_rescale(&frame->course, 100);
+    }
+    if (frame->time.hours >= 0)
+    {
+        fix->utc_ms = ((frame->time.hours * 60 + frame->time.minutes) * 60 + frame->time.seconds) * 1000 +
+                      frame->time.microseconds / 1000;
+    }
+    if (frame->date.day > 0)
+    {
+        int year = frame->date.year < 100 ? 2000 + frame->date.year : frame->date.year;
+        fix->date = (uint32_t)(year * 10000 + frame->date.month * 100 + frame->date.day);
+    }
+    fix->updates++;
+}
+
+static void apply_gga(gps_fix_t *fix, struct minmea_sentence_gga *frame)
+{
+    fix->quality = (uint8_t)frame->fix_quality;
+    fix->satellites = (uint8_t)frame->satellites_tracked;
+    fix->hdop_e2 = minmea_rescale(&frame->hdop, 100);
+    if (frame->fix_quality > 0)
+    {
+        fix->alt_dm = minmea_rescale(&frame->altitude, 10);
+    }
+}
+
+// Returns true for an RMC sentence
+static bool decode(gps_stream_t *s, const char *text)
+{
+    switch (minmea_sentence_id(text, true))
+    {
+    case MINMEA_SENTENCE_RMC:
+    {
+        struct minmea_sentence_rmc frame;
+        if (!minmea_parse_rmc(&frame, text))
+        {
+            break;
+        }
+        s->stats.rmc++;
+        apply_rmc(&s->fix, &frame);
+        return true;
+    }
+    case MINMEA_SENTENCE_GGA:
+    {
+        struct minmea_sentence_gga frame;
+        if (!minmea_parse_gga(&frame, text))
+        {
+            break;
+        }
+        s->stats.gga++;
+        apply_gga(&s->fix, &frame);
+        return false;
+    }
+    case MINMEA_INVALID:
+        break;
+    default:
+        s->stats.other++;
+        return false;
+    }
+    s->stats.invalid++;
+    return false;
+}
+
+// Passes on the line from start up to its '\n' at end, both counted like head
+static bool emit(gps_stream_t *s, uint32_t start, uint32_t end)
+{
+    uint32_t len = end - start;
+    char *text = &s->ring[start & RING_MASK];
+    if (len > 0 && s->ring[(end - 1) & RING_MASK] == '\r')
+    {
+        len--;
+    }
+    if (len > GPS_STREAM_LINE_MAX)
+    {
+        s->stats.too_long++;
+        return false;
+    }
+
+    // Only a line that wraps is copied, its start to after the ring
+    uint32_t first = start & RING_MASK;
+    if (first + len > GPS_STREAM_RING_SIZE)
+    {
+        memcpy(&s->ring[GPS_STREAM_RING_SIZE], s->ring, first + len - GPS_STREAM_RING_SIZE);
+    }
+    text[len] = '\0';
+
+    s->stats.lines++;
+    if (s->on_line != NULL)
+    {
+        gps_line_t line = {.text = text, .len = len};
+        s->on_line(s->ctx, &line);
+    }
+    return decode(s, text);
+}
+
+size_t gps_stream_write_space(gps_stream_t *s, char **dst)
+{
+    uint32_t at = s->head & RING_MASK;
+    uint32_t free = GPS_STREAM_RING_SIZE - (s->head - s->line_start);
+    uint32_t contiguous = GPS_STREAM_RING_SIZE - at;
+    *dst = &s->ring[at];
+    return free < contiguous ? free : contiguous;
+}
+
+uint32_t gps_stream_commit(gps_stream_t *s, size_t len)
+{
+    uint32_t updates = 0;
+    s->head += len;
+    s->stats.bytes += len;
+
+    while (s->scan != s->head)
+    {
+        uint32_t at = s->scan & RING_MASK;
+        uint32_t n = s->head - s->scan;
+        if (n > GPS_STREAM_RING_SIZE - at)
+        {
+            n = GPS_STREAM_RING_SIZE - at;
+        }
+        const char *nl = memchr(&s->ring[at], '\n', n);
+        if (nl == NULL)
+        {
+            s->scan += n;
+            continue;
+        }
+
+        uint32_t end = s->scan + (uint32_t)(nl - &s->ring[at]);
+        if (s->discarding)
+        {
+            s->discarding = false;
+        }
+        else if (emit(s, s->line_start, end))
+        {
+            updates++;
+        }
+        s->line_start = s->scan = end + 1;
+    }
+
+    // A line this long is no sentence; skip the rest of it as it comes in
+    if (!s->discarding && s->head - s->line_start > GPS_STREAM_LINE_MAX + 1)
+    {
+        s->stats.too_long++;
+        s->discarding = true;
+    }
+    if (s->discarding)
+    {
+        s->line_start = s->head;
+    }
+    return updates;
+}
+
+void gps_stream_reset(gps_stream_t *s)
+{
+    if (s->head != s->line_start || s->discarding)
+    {
+        s->stats.resets++;
+    }
+    s->line_start = s->scan = s->head;
+    s->discarding = false;
+}
+
+void gps_stream_get_fix(const gps_stream_t *s, gps_fix_t *fix)
+{
+    *fix = s->fix;
+}
+
+void gps_stream_get_stats(const gps_stream_t *s, gps_stream_stats_t *stats)
+{
+    *stats = s->stats;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file gps_stream.h
+ * @brief NMEA byte stream to GPS fix pipeline.
+ *
+ * Bytes from the receiver go straight into a ring buffer: the reader asks
+ * for the free space with gps_stream_write_space(), reads into it and
+ * commits what it got. The commit finds the line ends with memchr() and
+ * hands every complete line on as a slice of the ring, terminated in
+ * place, without copying it; only a line that wraps around the end of the
+ * ring is made contiguous by copying its start past the end. Lines longer
+ * than GPS_STREAM_LINE_MAX cannot be NMEA sentences and are skipped up to
+ * the next line end.
+ *
+ * Each line is checked (a valid checksum is required) and identified by
+ * minmea; RMC sentences update the position, speed and time of the fix,
+ * GGA sentences its quality, satellites, HDOP and altitude. Everything
+ * else is counted and ignored.
+ *
+ * The module has no ESP-IDF dependencies: the device feeds it from the
+ * UART, the host replay harness from recorded files. It is not
+ * thread-safe.
+ */
+
+#ifndef GPS_STREAM_H
+#define GPS_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the ring, a power of two.
+#define GPS_STREAM_RING_SIZE 1024
+
+// Longest line passed on, without CR LF; NMEA allows 80 characters.
+#define GPS_STREAM_LINE_MAX 96
+
+/**
+ * @brief A complete line, without its CR LF.
+ *
+ * The text is NUL-terminated and points into the ring; it is only valid
+ * until the callback returns.
+ */
+typedef struct
+{
+    const char *text;
+    size_t len;
+} gps_line_t;
+
+/**
+ * @brief Called for every complete line before it is decoded.
+ */
+typedef void (*gps_line_fn)(void *ctx, const gps_line_t *line);
+
+/**
+ * @brief The fix as the last sentences described it.
+ */
+typedef struct
+{
+    bool valid;            // The last RMC reported an active fix
+    int32_t lat_e7;        // Degrees * 10^7, north positive
+    int32_t lon_e7;        // Degrees * 10^7, east positive
+    int32_t speed_kmh_e2;  // km/h * 100
+    int32_t course_e2;     // Degrees * 100
+    int32_t utc_ms;        // Time of day of the last RMC, -1 if unknown
+    uint32_t date;         // Its date as YYYYMMDD, 0 if unknown
+    uint8_t quality;       // GGA fix quality, 0 without a fix
+    uint8_t satellites;    // GGA satellites in use
+    int32_t hdop_e2;       // HDOP * 100
+    int32_t alt_dm;        // Altitude above mean sea level, decimeters
+    uint32_t updates;      // RMC sentences decoded
+} gps_fix_t;
+
+/**
+ * @brief Counters of the stream.
+ */
+typedef struct
+{
+    uint32_t bytes;    // Committed
+    uint32_t lines;    // Complete lines passed on
+    uint32_t rmc;      // Sentences decoded, by type
+    uint32_t gga;
+    uint32_t other;    // Valid sentences of other types
+    uint32_t invalid;  // Lines that are not valid sentences
+    uint32_t too_long; // Lines skipped for their length
+    uint32_t resets;   // Partial lines dropped by gps_stream_reset()
+} gps_stream_stats_t;
+
+/**
+ * @brief Stream instance; treat as opaque.
+ */
+typedef struct
+{
+    // One extra line after the ring, where a wrapped line is made contiguous
+    char ring[GPS_STREAM_RING_SIZE + GPS_STREAM_LINE_MAX + 1];
+    uint32_t head;       // Bytes committed, ever
+    uint32_t line_start; // Where the current line starts, in the same count
+    uint32_t scan;       // How far it has been searched for its end
+    bool discarding;     // The current line is too long
+    gps_line_fn on_line;
+    void *ctx;
+    gps_fix_t fix;
+    gps_stream_stats_t stats;
+} gps_stream_t;
+
+/**
+ * @brief Initializes an empty stream.
+ *
+ * @param on_line Optional callback for every complete line.
+ */
+void gps_stream_init(gps_stream_t *s, gps_line_fn on_line, void *ctx);
+
+/**
+ * @brief Gets where the next bytes go.
+ *
+ * @param dst Set to the free space of the ring after the committed bytes.
+ * @return Its size; never 0.
+ */
+size_t gps_stream_write_space(gps_stream_t *s, char **dst);
+
+/**
+ * @brief Processes bytes written to the space from gps_stream_write_space().
+ *
+ * @param len At most the size of the space.
+ * @return The number of RMC sentences decoded, i.e. fix updates.
+ */
+uint32_t gps_stream_commit(gps_stream_t *s, size_t len);
+
+/**
+ * @brief Drops the line in progress, e.g. after the reader lost bytes.
+ */
+void gps_stream_reset(gps_stream_t *s);
+
+/**
+ * @brief Gets the current fix.
+ */
+void gps_stream_get_fix(const gps_stream_t *s, gps_fix_t *fix);
+
+/**
+ * @brief Gets the counters.
+ */
+void gps_stream_get_stats(const gps_stream_t *s, gps_stream_stats_t *stats);
+
+#endif // GPS_STREAM_H
@@ -0,0 +1,202 @@
+/**
+ * @file json_reader.c
+ * @brief Implementation of the flat JSON object reader.
+ */
+
+#include "json_reader.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *skip_space(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+        p++;
+    }
+    return p;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Unescapes the string that starts after the opening quote at p. The
+// result is never longer than the escaped text, so it is written over it
+// and terminated; returns the position after the closing quote, or NULL
+static char *read_string(char *p, const char **out)
+{
+    char *dst = p;
+    *out = p;
+    while (*p != '"')
+    {
+        if (*p == '\0' || (unsigned char)*p < 0x20)
+        {
+            return NULL;
+        }
+        if (*p != '\\')
+        {
+            *dst++ = *p++;
+            continue;
+        }
+
+        p++;
+        switch (*p++)
+        {
+        case '"': *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; break;
+        case '/': *dst++ = '/'; break;
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u':
+        {
+            // Six escaped bytes make at most three UTF-8 ones; surrogate
+            // pairs are not supported
+            uint32_t cp = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                int d = hex_digit(*p++);
+                if (d < 0)
+                {
+                    return NULL;
+                }
+                cp = cp << 4 | (uint32_t)d;
+            }
+            if (cp == 0 || (cp >= 0xD800 && cp <= 0xDFFF))
+            {
+                return NULL;
+            }
+            if (cp < 0x80)
+            {
+                *dst++ = (char)cp;
+            }
+            else if (cp < 0x800)
+            {
+                *dst++ = (char)(0xC0 | cp >> 6);
+                *dst++ = (char)(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                *dst++ = (char)(0xE0 | cp >> 12);
+                *dst++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *dst++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default:
+            return NULL;
+        }
+    }
+    *dst = '\0';
+    return p + 1;
+}
+
+// Matches a bare literal; it must not run into a longer word
+static char *read_literal(char *p, const char *word)
+{
+    size_t len = strlen(word);
+    if (strncmp(p, word, len) != 0 || (p[len] >= 'a' && p[len] <= 'z'))
+    {
+        return NULL;
+    }
+    return p + len;
+}
+
+static char *read_value(char *p, json_member_t *m)
+{
+    char *end;
+    if (*p == '"')
+    {
+        m->type = JSON_VALUE_STRING;
+        return read_string(p + 1, &m->str);
+    }
+    if ((end = read_literal(p, "true")) != NULL || (end = read_literal(p, "false")) != NULL)
+    {
+        m->type = JSON_VALUE_BOOL;
+        m->boolean = *p == 't';
+        return end;
+    }
+    if ((end = read_literal(p, "null")) != NULL)
+    {
+        m->type = JSON_VALUE_NULL;
+        return end;
+    }
+    if (*p == '-' || (*p >= '0' && *p <= '9'))
+    {
+        long value = strtol(p, &end, 10);
+        if (end == p || *end == '.' || *end == 'e' || *end == 'E' || value < INT32_MIN || value > INT32_MAX)
+        {
+            return NULL;
+        }
+        m->type = JSON_VALUE_INT;
+        m->num = (int32_t)value;
+        return end;
+    }
+    return NULL; // Nested values and anything else
+}
+
+bool json_reader_init(json_reader_t *r, char *text)
+{
+    char *p = skip_space(text);
+    r->pos = p + 1;
+    r->done = false;
+    r->error = *p != '{';
+    if (!r->error)
+    {
+        // An empty object has no members
+        char *q = skip_space(r->pos);
+        if (*q == '}')
+        {
+            r->done = true;
+            r->error = *skip_space(q + 1) != '\0';
+        }
+    }
+    return !r->error;
+}
+
+bool json_reader_next(json_reader_t *r, json_member_t *m)
+{
+    if (r->done || r->error)
+    {
+        return false;
+    }
+
+    char *p = skip_space(r->pos);
+    if (*p != '"' || (p = read_string(p + 1, &m->key)) == NULL)
+    {
+        r->error = true;
+        return false;
+    }
+    p = skip_space(p);
+    if (*p != ':' || (p = read_value(skip_space(p + 1), m)) == NULL)
+    {
+        r->error = true;
+        return false;
+    }
+
+    // Members end with a comma, the last one with the closing brace
+    p = skip_space(p);
+    if (*p == '}')
+    {
+        r->done = true;
+        if (*skip_space(p + 1) != '\0')
+        {
+            r->error = true;
+            return false;
+        }
+    }
+    else if (*p != ',')
+    {
+        r->error = true;
+        return false;
+    }
+    r->pos = p + 1;
+    return true;
+}
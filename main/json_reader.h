@@ -0,0 +1,71 @@
+/**
+ * @file json_reader.h
+ * @brief In-place reader for flat JSON objects.
+ *
+ * Commands that take several named values at once, such as config(), get
+ * them as one JSON object of strings, integers, booleans and nulls. The
+ * reader walks its members one at a time and unescapes strings in place,
+ * so keys and string values point into the caller's buffer and nothing
+ * is copied or allocated. Nested objects and arrays, fractions and
+ * exponents are rejected.
+ */
+
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Type of a member value.
+ */
+typedef enum
+{
+    JSON_VALUE_STRING,
+    JSON_VALUE_INT,
+    JSON_VALUE_BOOL,
+    JSON_VALUE_NULL,
+} json_value_type_t;
+
+/**
+ * @brief One member of the object.
+ *
+ * Only the value member matching type is valid.
+ */
+typedef struct
+{
+    const char *key;
+    json_value_type_t type;
+    const char *str;
+    int32_t num;
+    bool boolean;
+} json_member_t;
+
+/**
+ * @brief Reader state.
+ */
+typedef struct
+{
+    char *pos;
+    bool done;  // The closing brace was read
+    bool error; // The text is not a flat object; set once, never cleared
+} json_reader_t;
+
+/**
+ * @brief Starts reading an object.
+ *
+ * @param text The object, null-terminated. It is modified while reading.
+ * @return False if the text does not start with an object.
+ */
+bool json_reader_init(json_reader_t *r, char *text);
+
+/**
+ * @brief Reads the next member.
+ *
+ * @param[out] m The member; its strings stay valid as long as the text.
+ * @return False at the end of the object or on an error; r->error tells
+ *         which.
+ */
+bool json_reader_next(json_reader_t *r, json_member_t *m);
+
+#endif // JSON_READER_H
@@ -0,0 +1,287 @@
+/**
+ * @file json_writer.c
+ * @brief Implementation of the streaming JSON writer.
+ */
+
+#include "json_writer.h"
+#include "utils.h"
+#include <string.h>
+
+// Room left in the buffer; a flat buffer keeps one byte for the terminator
+static size_t room(const json_writer_t *w)
+{
+    size_t usable = w->sink != NULL || w->size == 0 ? w->size : w->size - 1;
+    return w->pos < usable ? usable - w->pos : 0;
+}
+
+static void flush(json_writer_t *w)
+{
+    if (w->sink != NULL && w->pos > 0)
+    {
+        if (!w->overflow && !w->sink(w->ctx, w->buf, w->pos))
+        {
+            w->overflow = true;
+        }
+        w->pos = 0;
+    }
+}
+
+// Slow path of emit(): the bytes do not fit, flush or overflow
+static void emit_split(json_writer_t *w, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = room(w);
+        if (n == 0)
+        {
+            if (w->sink == NULL || w->size == 0)
+            {
+                w->overflow = true;
+                break;
+            }
+            flush(w);
+            continue;
+        }
+        if (n > len) n = len;
+        memcpy(w->buf + w->pos, data, n);
+        w->pos += n;
+        data += n;
+        len -= n;
+    }
+    if (w->sink == NULL && w->size > 0)
+    {
+        w->buf[w->pos] = '\0';
+    }
+}
+
+// Most pieces are a few bytes and fit, so check the room once and copy
+static inline void emit(json_writer_t *w, const char *data, size_t len)
+{
+    w->len += len;
+    if (len <= room(w))
+    {
+        memcpy(w->buf + w->pos, data, len);
+        w->pos += len;
+        if (w->sink == NULL)
+        {
+            w->buf[w->pos] = '\0';
+        }
+        return;
+    }
+    emit_split(w, data, len);
+}
+
+static inline void emit_char(json_writer_t *w, char c)
+{
+    emit(w, &c, 1);
+}
+
+// Comma before every item but the first of a container, none after a key
+static void begin_item(json_writer_t *w)
+{
+    if (w->after_key)
+    {
+        w->after_key = false;
+        return;
+    }
+    uint32_t bit = 1u << w->depth;
+    if (w->has_items & bit)
+    {
+        emit_char(w, ',');
+    }
+    w->has_items |= bit;
+}
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+    *w = (json_writer_t){.buf = buf, .size = size};
+    if (size > 0)
+    {
+        buf[0] = '\0';
+    }
+    else
+    {
+        w->overflow = true;
+    }
+}
+
+void json_writer_init_sink(json_writer_t *w, char *buf, size_t size, json_sink_t sink, void *ctx)
+{
+    *w = (json_writer_t){.buf = buf, .size = size, .sink = sink, .ctx = ctx};
+}
+
+size_t json_writer_finish(json_writer_t *w)
+{
+    flush(w);
+    return w->len;
+}
+
+bool json_writer_fits(const json_writer_t *w, size_t reserve)
+{
+    return !w->overflow && w->len + reserve < w->size;
+}
+
+void json_writer_rewind(json_writer_t *w, const json_writer_t *mark)
+{
+    *w = *mark;
+    if (w->sink == NULL && w->size > 0)
+    {
+        w->buf[w->pos] = '\0';
+    }
+}
+
+static void begin_container(json_writer_t *w, char open)
+{
+    begin_item(w);
+    emit_char(w, open);
+    if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->depth++;
+    w->has_items &= ~(1u << w->depth);
+}
+
+static void end_container(json_writer_t *w, char close)
+{
+    if (w->depth > 0)
+    {
+        w->depth--;
+    }
+    emit_char(w, close);
+}
+
+void json_begin_object(json_writer_t *w)
+{
+    begin_container(w, '{');
+}
+
+void json_end_object(json_writer_t *w)
+{
+    end_container(w, '}');
+}
+
+void json_begin_array(json_writer_t *w)
+{
+    begin_container(w, '[');
+}
+
+void json_end_array(json_writer_t *w)
+{
+    end_container(w, ']');
+}
+
+void json_put_key(json_writer_t *w, const char *key)
+{
+    begin_item(w);
+    emit_char(w, '"');
+    json_append_string(w, key, strlen(key));
+    emit(w, "\":", 2);
+    w->after_key = true;
+}
+
+void json_begin_string(json_writer_t *w)
+{
+    begin_item(w);
+    emit_char(w, '"');
+}
+
+void json_append_string(json_writer_t *w, const char *str, size_t len)
+{
+    // Copy runs of plain bytes at once, escape the rest
+    while (len > 0)
+    {
+        size_t plain = json_plain_prefix(str, len);
+        emit(w, str, plain);
+        str += plain;
+        len -= plain;
+        if (len > 0)
+        {
+            char esc[JSON_ESCAPE_MAX];
+            size_t used;
+            emit(w, esc, json_escape_char(str, len, esc, &used));
+            str += used;
+            len -= used;
+        }
+    }
+}
+
+void json_end_string(json_writer_t *w)
+{
+    emit_char(w, '"');
+}
+
+void json_put_string(json_writer_t *w, const char *str)
+{
+    json_begin_string(w);
+    if (str != NULL)
+    {
+        json_append_string(w, str, strlen(str));
+    }
+    json_end_string(w);
+}
+
+static void emit_uint(json_writer_t *w, uint64_t value)
+{
+    char digits[20];
+    size_t n = sizeof(digits);
+    // 64-bit division is a library call on the ESP32; most values need none
+    while (value > UINT32_MAX)
+    {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    }
+    uint32_t small = (uint32_t)value;
+    do
+    {
+        digits[--n] = '0' + small % 10;
+        small /= 10;
+    } while (small != 0);
+    emit(w, digits + n, sizeof(digits) - n);
+}
+
+void json_put_uint(json_writer_t *w, uint64_t value)
+{
+    begin_item(w);
+    emit_uint(w, value);
+}
+
+void json_put_int(json_writer_t *w, int64_t value)
+{
+    begin_item(w);
+    if (value < 0)
+    {
+        emit_char(w, '-');
+        emit_uint(w, 0 - (uint64_t)value);
+    }
+    else
+    {
+        emit_uint(w, (uint64_t)value);
+    }
+}
+
+void json_put_bool(json_writer_t *w, bool value)
+{
+    begin_item(w);
+    if (value)
+    {
+        emit(w, "true", 4);
+    }
+    else
+    {
+        emit(w, "false", 5);
+    }
+}
+
+void json_put_null(json_writer_t *w)
+{
+    begin_item(w);
+    emit(w, "null", 4);
+}
+
+void json_put_raw(json_writer_t *w, const char *json)
+{
+    begin_item(w);
+    emit(w, json, strlen(json));
+}
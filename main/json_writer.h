@@ -0,0 +1,153 @@
+/**
+ * @file json_writer.h
+ * @brief Streaming, bounds-checked JSON writer.
+ *
+ * Documents are written member by member; the writer inserts the commas
+ * and colons and escapes strings inline, so no temporary escape buffers
+ * are needed. Output goes into a caller-provided buffer. Without a sink
+ * the buffer holds the whole document and is kept null-terminated; with a
+ * sink it is only a staging area that is flushed whenever it fills up, so
+ * a document of any length can be streamed, e.g. into ble_tx_write().
+ *
+ * Like cbor_writer_t, a writer that runs out of room sets its overflow
+ * flag and keeps counting, so a whole document can be written before
+ * checking once, and len tells how much room it would have needed.
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deepest object/array nesting the writer tracks.
+#define JSON_WRITER_MAX_DEPTH 16
+
+/**
+ * @brief Receives a chunk of the document.
+ *
+ * @param ctx The context passed to json_writer_init_sink().
+ * @param data The bytes, not null-terminated.
+ * @param len The number of bytes.
+ * @return True if the bytes were taken, false to mark the writer overflowed.
+ */
+typedef bool (*json_sink_t)(void *ctx, const char *data, size_t len);
+
+/**
+ * @brief Writer state.
+ */
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t pos;         // Bytes in buf not yet flushed
+    size_t len;         // Bytes of the document so far, including lost ones
+    json_sink_t sink;   // NULL for a flat buffer
+    void *ctx;
+    bool overflow;
+    bool after_key;     // The next value completes a member
+    uint8_t depth;
+    uint32_t has_items; // Bit per nesting level: a comma goes before the next item
+} json_writer_t;
+
+/**
+ * @brief Starts a document in a flat buffer.
+ *
+ * The buffer is null-terminated after every call; one byte is reserved
+ * for the terminator.
+ */
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+
+/**
+ * @brief Starts a document that is streamed to a sink.
+ *
+ * @param buf Staging buffer, chunks handed to the sink are at most this big.
+ */
+void json_writer_init_sink(json_writer_t *w, char *buf, size_t size, json_sink_t sink, void *ctx);
+
+/**
+ * @brief Hands buffered bytes to the sink, if any.
+ *
+ * @return The length of the document; check w->overflow for truncation.
+ */
+size_t json_writer_finish(json_writer_t *w);
+
+/**
+ * @brief Checks that a flat-buffer document still fits with some room to spare.
+ *
+ * Used to stop adding list items while the closing brackets still fit:
+ * take a copy of the writer before an item and restore it with
+ * json_writer_rewind() when the item made this fail.
+ *
+ * @param reserve Bytes that must remain free after the current content.
+ */
+bool json_writer_fits(const json_writer_t *w, size_t reserve);
+
+/**
+ * @brief Restores a flat-buffer writer to a copy taken earlier.
+ */
+void json_writer_rewind(json_writer_t *w, const json_writer_t *mark);
+
+void json_begin_object(json_writer_t *w);
+void json_end_object(json_writer_t *w);
+void json_begin_array(json_writer_t *w);
+void json_end_array(json_writer_t *w);
+
+/**
+ * @brief Writes a member name; the next value completes the member.
+ */
+void json_put_key(json_writer_t *w, const char *key);
+
+void json_put_string(json_writer_t *w, const char *str);
+void json_put_int(json_writer_t *w, int64_t value);
+void json_put_uint(json_writer_t *w, uint64_t value);
+void json_put_bool(json_writer_t *w, bool value);
+void json_put_null(json_writer_t *w);
+
+/**
+ * @brief Inserts an already serialized value or list of members.
+ *
+ * Commas are handled as for any other item, the text itself is copied
+ * verbatim.
+ */
+void json_put_raw(json_writer_t *w, const char *json);
+
+/**
+ * @brief Writes a string value in pieces.
+ *
+ * json_begin_string() opens the quotes, every json_append_string() adds
+ * escaped text and json_end_string() closes them.
+ */
+void json_begin_string(json_writer_t *w);
+void json_append_string(json_writer_t *w, const char *str, size_t len);
+void json_end_string(json_writer_t *w);
+
+/**
+ * @brief Writes a member with a string value.
+ */
+static inline void json_put_key_string(json_writer_t *w, const char *key, const char *str)
+{
+    json_put_key(w, key);
+    json_put_string(w, str);
+}
+
+/**
+ * @brief Writes a member with an integer value.
+ */
+static inline void json_put_key_int(json_writer_t *w, const char *key, int64_t value)
+{
+    json_put_key(w, key);
+    json_put_int(w, value);
+}
+
+/**
+ * @brief Writes a member with a boolean value.
+ */
+static inline void json_put_key_bool(json_writer_t *w, const char *key, bool value)
+{
+    json_put_key(w, key);
+    json_put_bool(w, value);
+}
+
+#endif // JSON_WRITER_H
@@ -7,56 +7,620 @@
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "device_state.h"
+#include <stdio.h>
 #include <string.h>
 
 static const char *TAG = "NVS_STORAGE";
 
-// Static variables to hold the configuration in memory
-static char stored_ssid[33] = {0};
-static char stored_password[65] = {0};
-static bool auto_connect = true;
-static char device_name[33] = "ESP32-BLE";
+// The settings, described by config_schema[]
+static config_values_t values;
+
+// Known networks, in the order they were first saved. The app task edits
+// them and the event loop records successes, so both go through the lock;
+// it is recursive, as a transaction holds it around the setters it calls
+static nvs_storage_network_t networks[NVS_STORAGE_MAX_NETWORKS];
+static size_t network_count = 0;
+static uint32_t success_seq = 0; // Highest last_success handed out
+static SemaphoreHandle_t storage_lock;
+
+// What a transaction changed, as bits: the network list, then one per
+// setting. Any persisted change rewrites the blob
+#define DIRTY_NETWORKS (1u << 0)
+#define DIRTY_SETTING(key) (1u << (1 + (key)))
+
+// Everything persisted is one blob in the "config" namespace, so booting
+// is a single lookup however many settings there are. After the header
+// come the network count and, for each network, its number of fields and
+// one record per field; then one record per persisted setting. A record
+// is name length, name, value length, value. Fields and settings are
+// found by name, so adding or dropping one keeps the others; a new
+// BLOB_VERSION is only needed when this framing changes, and older
+// versions are still read, field by field, like the per-key layout
+#define BLOB_KEY "blob"
+#define BLOB_VERSION 2
+
+typedef struct
+{
+    uint16_t version;
+    uint16_t length; // Of what follows the header
+    uint32_t crc;    // CRC-32 of what follows the header
+} blob_header_t;
+
+// Version 1 stored the networks as they were laid out in memory then
+typedef struct
+{
+    char ssid[33];
+    char password[65];
+    uint8_t priority;
+    bool has_hint;
+    uint8_t hint[8]; // bssid[6], channel, authmode
+    uint32_t last_success;
+} network_v1_t;
+
+_Static_assert(sizeof(network_v1_t) == 112, "the version 1 layout is fixed");
+
+// Names are NVS key names, at most 15 characters. An older blob is never
+// larger than the current one would be
+#define NETWORK_FIELDS 5
+#define NETWORK_MAX_SIZE (1 + NETWORK_FIELDS * (2 + NVS_KEY_NAME_MAX_SIZE) + sizeof(nvs_storage_network_t))
+#define BLOB_MAX_SIZE                                                                   \
+    (sizeof(blob_header_t) + 1 + NETWORK_MAX_SIZE * NVS_STORAGE_MAX_NETWORKS +          \
+     CONFIG_KEY_COUNT * (2 + NVS_KEY_NAME_MAX_SIZE) + sizeof(config_values_t))
+
+// Encoded blob, under the flush lock
+static uint8_t blob[BLOB_MAX_SIZE];
+
+// Transaction state and flash counters, under the lock
+static unsigned txn_depth; // Nesting of nvs_storage_begin()
+static uint32_t dirty;     // Keys to write for the current transaction
+static uint32_t changed;   // Settings it changed, persisted or not
+static nvs_storage_stats_t stats;
+static uint64_t commit_total_us;
+
+// Write-behind: committed changes wait in memory for the persistence task,
+// so callers never wait for the flash and a burst of changes is written
+// once. The flush lock keeps writers of the blob in order; it is taken
+// before the storage lock, which is not held while the flash is written
+#define RETRY_MS 10000 // After a failed write
+static TaskHandle_t persist_task;
+static SemaphoreHandle_t flush_lock;
+static uint32_t pending;         // Transactions committed but not written, under the lock
+static int64_t pending_since_us; // When the oldest of them was committed
+
+static void persist_task_main(void *arg);
+
+static void lock(void)
+{
+    xSemaphoreTakeRecursive(storage_lock, portMAX_DELAY);
+}
+
+static void unlock(void)
+{
+    xSemaphoreGiveRecursive(storage_lock);
+}
+
+// The network status() reports: the last one that worked, else the newest
+static const nvs_storage_network_t *current_network(void)
+{
+    const nvs_storage_network_t *best = NULL;
+    for (size_t i = 0; i < network_count; i++)
+    {
+        if (best == NULL || networks[i].last_success >= best->last_success)
+        {
+            best = &networks[i];
+        }
+    }
+    return best;
+}
+
+static nvs_storage_network_t *find_network(const char *ssid)
+{
+    for (size_t i = 0; i < network_count; i++)
+    {
+        if (strcmp(networks[i].ssid, ssid) == 0)
+        {
+            return &networks[i];
+        }
+    }
+    return NULL;
+}
+
+// Makes the in-memory values visible to the other tasks; lock held
+static void publish_preferences(void)
+{
+    const nvs_storage_network_t *current = current_network();
+    device_state_set_config(current != NULL ? current->ssid : "", values.autoconnect, values.devname);
+}
+
+static uint8_t *put_record(uint8_t *p, const char *name, const void *data, size_t len)
+{
+    size_t name_len = strlen(name);
+    *p++ = (uint8_t)name_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    *p++ = (uint8_t)len;
+    memcpy(p, data, len);
+    return p + len;
+}
+
+static uint8_t *put_network(uint8_t *p, const nvs_storage_network_t *net)
+{
+    uint8_t *fields = p++;
+    p = put_record(p, "ssid", net->ssid, strlen(net->ssid));
+    p = put_record(p, "password", net->password, strlen(net->password));
+    p = put_record(p, "priority", &net->priority, sizeof(net->priority));
+    p = put_record(p, "last_success", &net->last_success, sizeof(net->last_success));
+    *fields = 4;
+    if (net->has_hint)
+    {
+        uint8_t hint[8];
+        memcpy(hint, net->hint.bssid, 6);
+        hint[6] = net->hint.channel;
+        hint[7] = net->hint.authmode;
+        p = put_record(p, "hint", hint, sizeof(hint));
+        (*fields)++;
+    }
+    return p;
+}
+
+// Encodes the persisted values into blob; lock held. Returns its size
+static size_t encode_blob(void)
+{
+    uint8_t *p = blob + sizeof(blob_header_t);
+    *p++ = (uint8_t)network_count;
+    for (size_t i = 0; i < network_count; i++)
+    {
+        p = put_network(p, &networks[i]);
+    }
+
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        const config_desc_t *desc = &config_schema[key];
+        if (!desc->persist)
+        {
+            continue;
+        }
+
+        config_value_t value;
+        config_get(&values, key, &value);
+        uint8_t boolean = value.boolean ? 1 : 0;
+        const void *data = &boolean;
+        size_t len = sizeof(boolean);
+        if (desc->type == CONFIG_TYPE_INT)
+        {
+            data = &value.num;
+            len = sizeof(value.num);
+        }
+        else if (desc->type == CONFIG_TYPE_STRING)
+        {
+            data = value.str;
+            len = strlen(value.str);
+        }
+
+        p = put_record(p, desc->name, data, len);
+    }
+
+    blob_header_t header = {.version = BLOB_VERSION};
+    header.length = (uint16_t)(p - blob - sizeof(header));
+    header.crc = esp_rom_crc32_le(0, blob + sizeof(header), header.length);
+    memcpy(blob, &header, sizeof(header));
+    return p - blob;
+}
+
+static int find_setting(const uint8_t *name, size_t len)
+{
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        if (strlen(config_schema[key].name) == len && memcmp(config_schema[key].name, name, len) == 0)
+        {
+            return key;
+        }
+    }
+    return -1;
+}
+
+// Reads one setting record; unknown settings and invalid values are skipped
+static void decode_setting(const uint8_t *name, size_t name_len, const uint8_t *data, size_t len)
+{
+    int key = find_setting(name, name_len);
+    if (key < 0 || !config_schema[key].persist)
+    {
+        return;
+    }
+
+    config_value_t value = {0};
+    char str[sizeof(values)]; // Longer than any string setting
+    switch (config_schema[key].type)
+    {
+    case CONFIG_TYPE_BOOL:
+        if (len != 1) return;
+        value.boolean = data[0] != 0;
+        break;
+    case CONFIG_TYPE_INT:
+        if (len != sizeof(value.num)) return;
+        memcpy(&value.num, data, len);
+        break;
+    case CONFIG_TYPE_STRING:
+        if (len >= sizeof(str)) return;
+        memcpy(str, data, len);
+        str[len] = '\0';
+        value.str = str;
+        break;
+    }
+    if (config_check(key, config_schema[key].type, &value) == NULL)
+    {
+        config_set(&values, key, &value);
+    }
+}
+
+// Splits off the next record; false if it is cut short
+static bool next_record(const uint8_t **p, const uint8_t *end, const uint8_t **name, size_t *name_len,
+                        const uint8_t **data, size_t *len)
+{
+    if (*p == end)
+    {
+        return false;
+    }
+    *name_len = *(*p)++;
+    if ((size_t)(end - *p) < *name_len + 1)
+    {
+        return false;
+    }
+    *name = *p;
+    *p += *name_len;
+    *len = *(*p)++;
+    if ((size_t)(end - *p) < *len)
+    {
+        return false;
+    }
+    *data = *p;
+    *p += *len;
+    return true;
+}
+
+static bool field_is(const uint8_t *name, size_t name_len, const char *field)
+{
+    return strlen(field) == name_len && memcmp(field, name, name_len) == 0;
+}
+
+// Reads one network field; unknown fields and invalid values are skipped
+static void decode_network_field(nvs_storage_network_t *net, const uint8_t *name, size_t name_len,
+                                 const uint8_t *data, size_t len)
+{
+    if (field_is(name, name_len, "ssid") && len < sizeof(net->ssid))
+    {
+        memcpy(net->ssid, data, len);
+        net->ssid[len] = '\0';
+    }
+    else if (field_is(name, name_len, "password") && len < sizeof(net->password))
+    {
+        memcpy(net->password, data, len);
+        net->password[len] = '\0';
+    }
+    else if (field_is(name, name_len, "priority") && len == sizeof(net->priority))
+    {
+        net->priority = data[0];
+    }
+    else if (field_is(name, name_len, "last_success") && len == sizeof(net->last_success))
+    {
+        memcpy(&net->last_success, data, len);
+    }
+    else if (field_is(name, name_len, "hint") && len == 8)
+    {
+        memcpy(net->hint.bssid, data, 6);
+        net->hint.channel = data[6];
+        net->hint.authmode = data[7];
+        net->has_hint = true;
+    }
+}
+
+// Reads the networks of a version 2 blob; one without an SSID is dropped
+static bool decode_networks(const uint8_t **p, const uint8_t *end, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (*p == end)
+        {
+            return false;
+        }
+        nvs_storage_network_t net = {0};
+        for (size_t fields = *(*p)++; fields > 0; fields--)
+        {
+            const uint8_t *name, *data;
+            size_t name_len, len;
+            if (!next_record(p, end, &name, &name_len, &data, &len))
+            {
+                return false;
+            }
+            decode_network_field(&net, name, name_len, data, len);
+        }
+        if (net.ssid[0] != '\0')
+        {
+            networks[network_count++] = net;
+        }
+    }
+    return true;
+}
+
+// Reads the networks of a version 1 blob, field by field from its layout
+static bool decode_networks_v1(const uint8_t **p, const uint8_t *end, size_t count)
+{
+    if ((size_t)(end - *p) < count * sizeof(network_v1_t))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        network_v1_t old;
+        memcpy(&old, *p, sizeof(old));
+        *p += sizeof(old);
+
+        nvs_storage_network_t *net = &networks[network_count++];
+        *net = (nvs_storage_network_t){0};
+        memcpy(net->ssid, old.ssid, sizeof(old.ssid));
+        memcpy(net->password, old.password, sizeof(old.password));
+        net->priority = old.priority;
+        net->has_hint = old.has_hint;
+        memcpy(net->hint.bssid, old.hint, 6);
+        net->hint.channel = old.hint[6];
+        net->hint.authmode = old.hint[7];
+        net->last_success = old.last_success;
+    }
+    return true;
+}
+
+// Loads the values from a blob read from flash, of this version or an
+// older one, and tells which. Returns false if it is corrupt or newer;
+// the values are then partly loaded
+static bool decode_blob(size_t size, uint16_t *version)
+{
+    blob_header_t header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, blob, sizeof(header));
+    const uint8_t *p = blob + sizeof(header);
+    const uint8_t *end = blob + size;
+    if (header.version < 1 || header.version > BLOB_VERSION || header.length != size - sizeof(header) ||
+        header.crc != esp_rom_crc32_le(0, p, header.length))
+    {
+        return false;
+    }
+
+    if (p == end || *p > NVS_STORAGE_MAX_NETWORKS)
+    {
+        return false;
+    }
+    size_t count = *p++;
+    network_count = 0;
+    if (!(header.version == 1 ? decode_networks_v1(&p, end, count) : decode_networks(&p, end, count)))
+    {
+        return false;
+    }
+
+    while (p != end)
+    {
+        const uint8_t *name, *data;
+        size_t name_len, len;
+        if (!next_record(&p, end, &name, &name_len, &data, &len))
+        {
+            return false;
+        }
+        decode_setting(name, name_len, data, len);
+    }
+    *version = header.version;
+    return true;
+}
+
+// Writes the encoded blob with one open and one commit; flush lock held
+static esp_err_t write_blob(size_t size)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_blob(handle, BLOB_KEY, blob, size);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+// Keys of the per-key layout of older firmware, besides one per setting
+static const char *const legacy_keys[] = {"networks", "ssid", "password", "aphint"};
+
+// Reads the network list of older firmware, or its single network
+static void load_legacy_networks(nvs_handle_t handle)
+{
+    size_t len = sizeof(networks);
+    if (nvs_get_blob(handle, "networks", networks, &len) == ESP_OK && len % sizeof(networks[0]) == 0)
+    {
+        network_count = len / sizeof(networks[0]);
+        return;
+    }
+
+    nvs_storage_network_t net = {0};
+    len = sizeof(net.ssid);
+    if (nvs_get_str(handle, "ssid", net.ssid, &len) != ESP_OK || net.ssid[0] == '\0')
+    {
+        return;
+    }
+    len = sizeof(net.password);
+    nvs_get_str(handle, "password", net.password, &len);
+    len = sizeof(net.hint);
+    net.has_hint = nvs_get_blob(handle, "aphint", &net.hint, &len) == ESP_OK && len == sizeof(net.hint);
+    networks[0] = net;
+    network_count = 1;
+}
+
+// Reads the settings of older firmware; a missing or invalid one keeps its
+// default
+static void load_legacy_settings(nvs_handle_t handle)
+{
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        const config_desc_t *desc = &config_schema[key];
+        if (!desc->persist)
+        {
+            continue;
+        }
+
+        config_value_t value = {0};
+        char str[sizeof(values)]; // Longer than any string setting
+        esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+        switch (desc->type)
+        {
+        case CONFIG_TYPE_BOOL:
+        {
+            uint8_t u8;
+            err = nvs_get_u8(handle, desc->name, &u8);
+            value.boolean = u8 != 0;
+            break;
+        }
+        case CONFIG_TYPE_INT:
+            err = nvs_get_i32(handle, desc->name, &value.num);
+            break;
+        case CONFIG_TYPE_STRING:
+        {
+            size_t len = sizeof(str);
+            err = nvs_get_str(handle, desc->name, str, &len);
+            value.str = str;
+            break;
+        }
+        }
+        if (err == ESP_OK && config_check(key, desc->type, &value) == NULL)
+        {
+            config_set(&values, key, &value);
+        }
+    }
+}
+
+// Stores what was loaded from the per-key layout as a blob, then erases
+// the old keys. If the blob cannot be written they stay, and the next
+// boot tries again
+static void migrate_legacy(nvs_handle_t handle)
+{
+    if (nvs_set_blob(handle, BLOB_KEY, blob, encode_blob()) != ESP_OK || nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Could not store the preferences as a blob, keeping the old keys.");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(legacy_keys) / sizeof(legacy_keys[0]); i++)
+    {
+        nvs_erase_key(handle, legacy_keys[i]);
+    }
+    for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+    {
+        nvs_erase_key(handle, config_schema[key].name);
+    }
+    nvs_commit(handle);
+    ESP_LOGI(TAG, "Moved the stored preferences into the blob.");
+}
+
+// Rewrites a blob of an older version in the current one. If that fails
+// the old blob stays, and the next boot reads it again
+static void upgrade_blob(nvs_handle_t handle, uint16_t version)
+{
+    if (nvs_set_blob(handle, BLOB_KEY, blob, encode_blob()) != ESP_OK || nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Could not rewrite the version %u blob.", version);
+        return;
+    }
+    ESP_LOGI(TAG, "Rewrote the version %u blob as version %u.", version, BLOB_VERSION);
+}
 
 /**
  * @brief Loads all preferences from NVS into memory.
  *
- * This is an internal function called by nvs_storage_init.
+ * This is an internal function called by nvs_storage_init. A blob of an
+ * older version is read and rewritten in the current one. One that is
+ * corrupt or newer leaves the defaults; it is replaced by the next change.
  */
 static void load_preferences(void)
 {
+    int64_t start = esp_timer_get_time();
+    const char *source = "defaults";
     nvs_handle_t handle;
-    esp_err_t err = nvs_open("config", NVS_READONLY, &handle);
+    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
     if (err == ESP_OK)
     {
-        size_t len;
-
-        len = sizeof(stored_ssid);
-        nvs_get_str(handle, "ssid", stored_ssid, &len);
-
-        len = sizeof(stored_password);
-        nvs_get_str(handle, "password", stored_password, &len);
-
-        uint8_t ac = 1;
-        nvs_get_u8(handle, "autoconnect", &ac);
-        auto_connect = (ac != 0);
+        size_t len = sizeof(blob);
+        uint16_t version = 0;
+        err = nvs_get_blob(handle, BLOB_KEY, blob, &len);
+        if (err == ESP_OK && decode_blob(len, &version))
+        {
+            source = version == BLOB_VERSION ? "blob" : "older blob";
+        }
+        else if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            load_legacy_networks(handle);
+            load_legacy_settings(handle);
+            source = "keys";
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Stored preferences are corrupt (%s). Using defaults.",
+                     err == ESP_OK ? "bad blob" : esp_err_to_name(err));
+            network_count = 0;
+            config_defaults(&values);
+        }
 
-        len = sizeof(device_name);
-        if (nvs_get_str(handle, "devname", device_name, &len) != ESP_OK)
+        for (size_t i = 0; i < network_count; i++)
         {
-            strcpy(device_name, "ESP32-BLE");
+            networks[i].ssid[sizeof(networks[i].ssid) - 1] = '\0';
+            networks[i].password[sizeof(networks[i].password) - 1] = '\0';
+            if (networks[i].last_success > success_seq)
+            {
+                success_seq = networks[i].last_success;
+            }
         }
+        stats.load_us = (uint32_t)(esp_timer_get_time() - start);
 
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            migrate_legacy(handle);
+        }
+        else if (version != 0 && version != BLOB_VERSION)
+        {
+            upgrade_blob(handle, version);
+        }
         nvs_close(handle);
-        ESP_LOGI(TAG, "Preferences loaded from NVS.");
     }
     else
     {
         ESP_LOGW(TAG, "Could not open NVS to load preferences. Using defaults.");
     }
 
-    ESP_LOGI(TAG, "  SSID: %s", stored_ssid[0] ? stored_ssid : "(not set)");
-    ESP_LOGI(TAG, "  Auto-connect: %s", auto_connect ? "true" : "false");
-    ESP_LOGI(TAG, "  Device name: %s", device_name);
+    ESP_LOGI(TAG, "Preferences loaded from %s in %u us.", source, (unsigned)stats.load_us);
+    ESP_LOGI(TAG, "  Networks: %u", (unsigned)network_count);
+    for (size_t i = 0; i < network_count; i++)
+    {
+        const nvs_storage_network_t *net = &networks[i];
+        if (net->has_hint)
+        {
+            ESP_LOGI(TAG, "    %s (priority %u, AP " MACSTR " on channel %u)", net->ssid, net->priority,
+                     MAC2STR(net->hint.bssid), net->hint.channel);
+        }
+        else
+        {
+            ESP_LOGI(TAG, "    %s (priority %u)", net->ssid, net->priority);
+        }
+    }
+    ESP_LOGI(TAG, "  Auto-connect: %s", values.autoconnect ? "true" : "false");
+    ESP_LOGI(TAG, "  Device name: %s", values.devname);
+    publish_preferences();
 }
 
 esp_err_t nvs_storage_init(void)
@@ -70,113 +634,410 @@ esp_err_t nvs_storage_init(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    config_defaults(&values);
+    storage_lock = xSemaphoreCreateRecursiveMutex();
+    flush_lock = xSemaphoreCreateMutex();
+    if (storage_lock == NULL || flush_lock == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
     load_preferences();
+
+    // Below the application tasks: writing the flash is never urgent
+    if (xTaskCreate(persist_task_main, "nvs_persist", 3072, NULL, 1, &persist_task) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
     return ret;
 }
 
-void nvs_storage_save_wifi_credentials(const char *ssid, const char *password)
+static void count_commit(int64_t start_us)
 {
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
-    if (err == ESP_OK)
+    uint32_t took = (uint32_t)(esp_timer_get_time() - start_us);
+    stats.commits++;
+    stats.last_commit_us = took;
+    if (took > stats.max_commit_us)
     {
-        nvs_set_str(handle, "ssid", ssid);
-        nvs_set_str(handle, "password", password);
-        nvs_commit(handle);
-        nvs_close(handle);
+        stats.max_commit_us = took;
+    }
+    commit_total_us += took;
+    stats.mean_commit_us = (uint32_t)(commit_total_us / stats.commits);
+}
 
-        strncpy(stored_ssid, ssid, sizeof(stored_ssid) - 1);
-        stored_ssid[sizeof(stored_ssid) - 1] = '\0';
-        strncpy(stored_password, password, sizeof(stored_password) - 1);
-        stored_password[sizeof(stored_password) - 1] = '\0';
+// Writes the pending changes. The values are encoded under the storage
+// lock and written without it, so other tasks keep reading and changing
+// them meanwhile; if the write fails they stay pending
+static esp_err_t flush_pending(bool forced)
+{
+    xSemaphoreTake(flush_lock, portMAX_DELAY);
+    lock();
+    uint32_t count = pending;
+    int64_t since = pending_since_us;
+    size_t size = count != 0 ? encode_blob() : 0;
+    pending = 0;
+    unlock();
+
+    esp_err_t err = ESP_OK;
+    if (count != 0)
+    {
+        int64_t start = esp_timer_get_time();
+        err = write_blob(size);
 
-        ESP_LOGI(TAG, "WiFi credentials saved to NVS");
+        lock();
+        count_commit(start);
+        stats.last_delay_ms = (uint32_t)((start - since) / 1000);
+        stats.forced += forced ? 1 : 0;
+        if (err == ESP_OK)
+        {
+            stats.key_writes++;
+            stats.bytes += size;
+        }
+        else
+        {
+            stats.failures++;
+            pending += count;
+            pending_since_us = since;
+        }
+        unlock();
     }
-    else
+    xSemaphoreGive(flush_lock);
+
+    if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to open NVS for writing credentials.");
+        ESP_LOGE(TAG, "Failed to save preferences, will retry: %s", esp_err_to_name(err));
     }
+    return err;
 }
 
-void nvs_storage_save_auto_connect(bool value)
+// Writes the changes once they stop coming for NVS_STORAGE_DEBOUNCE_MS, or
+// NVS_STORAGE_FLUSH_MAX_MS after the first one at the latest
+static void persist_task_main(void *arg)
 {
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
-    if (err == ESP_OK)
+    for (;;)
     {
-        nvs_set_u8(handle, "autoconnect", value ? 1 : 0);
-        nvs_commit(handle);
-        nvs_close(handle);
-
-        auto_connect = value;
-        ESP_LOGI(TAG, "Auto-connect set to: %s", value ? "true" : "false");
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t first = esp_timer_get_time();
+        while (esp_timer_get_time() - first < NVS_STORAGE_FLUSH_MAX_MS * 1000LL &&
+               ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NVS_STORAGE_DEBOUNCE_MS)) != 0)
+        {
+        }
+        if (flush_pending(false) != ESP_OK)
+        {
+            vTaskDelay(pdMS_TO_TICKS(RETRY_MS));
+            xTaskNotifyGive(persist_task);
+        }
     }
-    else
+}
+
+esp_err_t nvs_storage_flush(void)
+{
+    return flush_pending(true);
+}
+
+void nvs_storage_begin(void)
+{
+    lock();
+    if (txn_depth++ == 0)
     {
-        ESP_LOGE(TAG, "Failed to open NVS for writing auto-connect.");
+        dirty = 0;
+        changed = 0;
     }
 }
 
-void nvs_storage_save_device_name(const char *name)
+esp_err_t nvs_storage_commit(void)
 {
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
-    if (err == ESP_OK)
+    bool changed;
+    return nvs_storage_commit_changed(&changed);
+}
+
+esp_err_t nvs_storage_commit_changed(bool *changed_out)
+{
+    bool notify = false;
+    uint32_t applied = 0;
+    config_values_t applied_values;
+    *changed_out = false;
+    if (--txn_depth == 0)
     {
-        nvs_set_str(handle, "devname", name);
-        nvs_commit(handle);
-        nvs_close(handle);
+        *changed_out = dirty != 0 || changed != 0;
+        stats.transactions++;
+        if (dirty != 0)
+        {
+            if (pending++ == 0)
+            {
+                pending_since_us = esp_timer_get_time();
+            }
+            notify = true;
+        }
+        else
+        {
+            stats.skipped++;
+        }
+        if (dirty != 0 || changed != 0)
+        {
+            publish_preferences();
+        }
+        applied = changed;
+        applied_values = values;
+        dirty = 0;
+        changed = 0;
+    }
+    unlock();
 
-        strncpy(device_name, name, sizeof(device_name) - 1);
-        device_name[sizeof(device_name) - 1] = '\0';
-        ESP_LOGI(TAG, "Device name set to: %s (restart required)", name);
+    if (notify && persist_task != NULL)
+    {
+        xTaskNotifyGive(persist_task);
     }
-    else
+    for (int key = 0; key < CONFIG_KEY_COUNT && applied != 0; key++)
+    {
+        if ((applied & DIRTY_SETTING(key)) && config_schema[key].apply != NULL)
+        {
+            config_value_t value;
+            config_get(&applied_values, key, &value);
+            config_schema[key].apply(&value);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_storage_set(config_key_t key, config_type_t type, const config_value_t *value)
+{
+    if (config_check(key, type, value) != NULL)
     {
-        ESP_LOGE(TAG, "Failed to open NVS for writing device name.");
+        return ESP_ERR_INVALID_ARG;
     }
+    nvs_storage_begin();
+    if (config_set(&values, key, value))
+    {
+        changed |= DIRTY_SETTING(key);
+        if (config_schema[key].persist)
+        {
+            dirty |= DIRTY_SETTING(key);
+        }
+    }
+    return nvs_storage_commit();
 }
 
-void nvs_storage_clear_all_preferences(void)
+void nvs_storage_get_config(config_values_t *out)
 {
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
-    if (err == ESP_OK)
+    lock();
+    *out = values;
+    unlock();
+}
+
+bool nvs_storage_get_bool(config_key_t key)
+{
+    config_values_t copy;
+    config_value_t value;
+    nvs_storage_get_config(&copy);
+    config_get(&copy, key, &value);
+    return value.boolean;
+}
+
+int32_t nvs_storage_get_int(config_key_t key)
+{
+    config_values_t copy;
+    config_value_t value;
+    nvs_storage_get_config(&copy);
+    config_get(&copy, key, &value);
+    return value.num;
+}
+
+void nvs_storage_get_string(config_key_t key, char *out, size_t size)
+{
+    config_values_t copy;
+    config_value_t value;
+    nvs_storage_get_config(&copy);
+    config_get(&copy, key, &value);
+    snprintf(out, size, "%s", value.str);
+}
+
+void nvs_storage_get_stats(nvs_storage_stats_t *out)
+{
+    lock();
+    *out = stats;
+    out->pending = pending;
+    unlock();
+}
+
+// Slot for a new network: a free one, else the least wanted one, which is
+// the lowest priority and among those the one that worked longest ago
+static nvs_storage_network_t *claim_slot(void)
+{
+    if (network_count < NVS_STORAGE_MAX_NETWORKS)
     {
-        nvs_erase_all(handle);
-        nvs_commit(handle);
-        nvs_close(handle);
+        return &networks[network_count++];
+    }
 
-        // Reset in-memory values to defaults
-        stored_ssid[0] = '\0';
-        stored_password[0] = '\0';
-        auto_connect = true;
-        strcpy(device_name, "ESP32-BLE");
+    size_t victim = 0;
+    for (size_t i = 1; i < network_count; i++)
+    {
+        const nvs_storage_network_t *a = &networks[i], *b = &networks[victim];
+        if (a->priority < b->priority || (a->priority == b->priority && a->last_success < b->last_success))
+        {
+            victim = i;
+        }
+    }
+    ESP_LOGI(TAG, "Network list full, forgetting %s", networks[victim].ssid);
+    // Keep the list in the order the networks were saved
+    memmove(&networks[victim], &networks[victim + 1], (network_count - victim - 1) * sizeof(networks[0]));
+    return &networks[network_count - 1];
+}
 
-        ESP_LOGI(TAG, "All preferences cleared from NVS.");
+void nvs_storage_save_wifi_credentials(const char *ssid, const char *password)
+{
+    nvs_storage_begin();
+    nvs_storage_network_t *net = find_network(ssid);
+    if (net == NULL)
+    {
+        net = claim_slot();
+        *net = (nvs_storage_network_t){0};
+        strncpy(net->ssid, ssid, sizeof(net->ssid) - 1);
+        dirty |= DIRTY_NETWORKS;
+    }
+    // A new password does not move the AP, so the hint stays
+    if (strncmp(net->password, password, sizeof(net->password) - 1) != 0)
+    {
+        memset(net->password, 0, sizeof(net->password));
+        strncpy(net->password, password, sizeof(net->password) - 1);
+        dirty |= DIRTY_NETWORKS;
+    }
+    if (nvs_storage_commit() == ESP_OK)
+    {
+        ESP_LOGI(TAG, "WiFi credentials saved");
+    }
+}
+
+bool nvs_storage_forget_network(const char *ssid)
+{
+    nvs_storage_begin();
+    bool found = true;
+    if (ssid == NULL)
+    {
+        found = network_count > 0;
+        network_count = 0;
     }
     else
     {
-        ESP_LOGE(TAG, "Failed to open NVS to clear preferences.");
+        nvs_storage_network_t *net = find_network(ssid);
+        found = net != NULL;
+        if (found)
+        {
+            size_t i = net - networks;
+            memmove(&networks[i], &networks[i + 1], (network_count - i - 1) * sizeof(networks[0]));
+            network_count--;
+        }
+    }
+    if (found)
+    {
+        dirty |= DIRTY_NETWORKS;
+    }
+    nvs_storage_commit();
+    return found || ssid == NULL;
+}
+
+bool nvs_storage_set_network_priority(const char *ssid, uint8_t priority)
+{
+    nvs_storage_begin();
+    nvs_storage_network_t *net = find_network(ssid);
+    if (net != NULL && net->priority != priority)
+    {
+        net->priority = priority;
+        dirty |= DIRTY_NETWORKS;
     }
+    nvs_storage_commit();
+    return net != NULL;
 }
 
-const char *nvs_storage_get_ssid(void)
+size_t nvs_storage_get_networks(nvs_storage_network_t *out, size_t max)
 {
-    return stored_ssid;
+    lock();
+    size_t count = network_count < max ? network_count : max;
+    memcpy(out, networks, count * sizeof(networks[0]));
+    unlock();
+    return count;
 }
 
-const char *nvs_storage_get_password(void)
+void nvs_storage_record_success(const char *ssid, const nvs_storage_ap_hint_t *hint)
 {
-    return stored_password;
+    nvs_storage_begin();
+    nvs_storage_network_t *net = find_network(ssid);
+    if (net == NULL)
+    {
+        nvs_storage_commit();
+        return; // Connected with credentials that were not saved
+    }
+
+    // Reconnecting to the network that worked last, through the same AP,
+    // is the common case and changes nothing: spare the flash
+    if (net->last_success != success_seq || net->last_success == 0)
+    {
+        net->last_success = ++success_seq;
+        dirty |= DIRTY_NETWORKS;
+    }
+    if (hint != NULL && (!net->has_hint || memcmp(&net->hint, hint, sizeof(*hint)) != 0))
+    {
+        net->hint = *hint;
+        net->has_hint = true;
+        dirty |= DIRTY_NETWORKS;
+        ESP_LOGI(TAG, "AP hint for %s: " MACSTR " on channel %u", ssid, MAC2STR(hint->bssid), hint->channel);
+    }
+    nvs_storage_commit();
 }
 
-bool nvs_storage_get_auto_connect(void)
+bool nvs_storage_get_ap_hint(const char *ssid, nvs_storage_ap_hint_t *hint)
 {
-    return auto_connect;
+    lock();
+    const nvs_storage_network_t *net = find_network(ssid);
+    bool valid = net != NULL && net->has_hint;
+    if (valid)
+    {
+        *hint = net->hint;
+    }
+    unlock();
+    return valid;
 }
 
-const char *nvs_storage_get_device_name(void)
+void nvs_storage_clear_all_preferences(void)
 {
-    return device_name;
+    // A write in progress must not bring the erased values back
+    xSemaphoreTake(flush_lock, portMAX_DELAY);
+    nvs_storage_begin();
+    int64_t start = esp_timer_get_time();
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("config", NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        nvs_erase_all(handle);
+        nvs_commit(handle);
+        nvs_close(handle);
+        count_commit(start);
+
+        // Reset in-memory values to defaults; nothing is left to write,
+        // pending changes included, but the settings that changed are
+        // applied
+        config_values_t old = values;
+        network_count = 0;
+        success_seq = 0;
+        config_defaults(&values);
+        for (int key = 0; key < CONFIG_KEY_COUNT; key++)
+        {
+            config_value_t value;
+            config_get(&values, key, &value);
+            if (config_set(&old, key, &value))
+            {
+                changed |= DIRTY_SETTING(key);
+            }
+        }
+        dirty = 0;
+        pending = 0;
+        publish_preferences();
+
+        ESP_LOGI(TAG, "All preferences cleared from NVS.");
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to open NVS to clear preferences.");
+    }
+    nvs_storage_commit();
+    xSemaphoreGive(flush_lock);
 }
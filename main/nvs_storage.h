@@ -3,30 +3,160 @@
  * @brief Handles reading from and writing to Non-Volatile Storage (NVS).
  *
  * This module encapsulates all interactions with the NVS, providing a clear
- * API for managing persistent configuration data such as WiFi credentials,
- * device name, and other settings.
+ * API for managing persistent configuration data: the known WiFi networks
+ * and the settings described by config_schema.h, which are read and
+ * written by key through nvs_storage_set() and the typed getters.
+ *
+ * Everything persisted is kept as one versioned blob with a CRC, so boot
+ * reads it with a single lookup; the per-key layout of older firmware is
+ * moved into it on the first boot.
+ *
+ * Every change goes through a transaction. Setters called between
+ * nvs_storage_begin() and nvs_storage_commit() only change the values in
+ * memory and note whether they really changed one. A setter called on its
+ * own is a transaction of one. Other tasks see the values of a
+ * transaction once it is committed; the commit does not write them, but
+ * marks them pending for a low-priority persistence task. That task
+ * writes the blob, with a single open and commit, once the changes have
+ * settled, so a burst of changes is written once and nobody waits for the
+ * flash. A failed write is retried. Paths that restart the device call
+ * nvs_storage_flush() first.
  */
 
 #ifndef NVS_STORAGE_H
 #define NVS_STORAGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "config_schema.h"
+
+// How many networks are remembered; saving one more forgets the least wanted.
+#define NVS_STORAGE_MAX_NETWORKS 5
+
+// Pending changes are written once none came for NVS_STORAGE_DEBOUNCE_MS,
+// and at the latest NVS_STORAGE_FLUSH_MAX_MS after the first.
+#define NVS_STORAGE_DEBOUNCE_MS 1000
+#define NVS_STORAGE_FLUSH_MAX_MS 5000
+
+/**
+ * @brief Where a known network was last found.
+ *
+ * Lets the next connection go straight to the access point instead of
+ * scanning every channel for it.
+ */
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode; // A wifi_auth_mode_t
+} nvs_storage_ap_hint_t;
+
+/**
+ * @brief A known network.
+ *
+ * Stored field by field under names, so fields can be added or dropped
+ * without a new blob version: unknown ones are skipped on load, and
+ * missing ones are zero.
+ */
+typedef struct
+{
+    char ssid[33];
+    char password[65];
+    uint8_t priority;      // Higher is tried first; 0 by default
+    bool has_hint;
+    nvs_storage_ap_hint_t hint;
+    uint32_t last_success; // Order of the last successful connection, 0 if never
+} nvs_storage_network_t;
+
+/**
+ * @brief Flash write counters, see nvs_storage_get_stats().
+ */
+typedef struct
+{
+    uint32_t transactions;   // Transactions committed
+    uint32_t skipped;        // ...that changed nothing persisted
+    uint32_t pending;        // ...waiting to be written
+    uint32_t commits;        // Flushes to flash, each of any number of transactions
+    uint32_t forced;         // ...asked for by nvs_storage_flush()
+    uint32_t key_writes;     // Blobs written
+    uint32_t bytes;          // Blob bytes written
+    uint32_t failures;       // Flushes that failed, to be retried
+    uint32_t last_commit_us; // Duration of the last flush, open to close
+    uint32_t max_commit_us;
+    uint32_t mean_commit_us;
+    uint32_t last_delay_ms;  // From the oldest change to its last flush
+    uint32_t load_us;        // Reading the preferences at boot
+} nvs_storage_stats_t;
 
 /**
  * @brief Initializes the NVS flash and loads all preferences into memory.
  *
  * This function must be called once at startup before any other function in
  * this module. It handles the initialization of the underlying NVS flash
- * partition and loads all stored settings. If the NVS is corrupted, it will
- * attempt to erase and re-initialize it.
+ * partition, loads all stored settings and starts the persistence task. If the NVS partition is
+ * unusable, it will erase and re-initialize it; if only the stored
+ * preferences are corrupt, the defaults are used and the partition is
+ * left alone.
  *
  * @return ESP_OK on success, or an error code from nvs_flash_init on failure.
  */
 esp_err_t nvs_storage_init(void);
 
 /**
- * @brief Saves the WiFi credentials to NVS.
+ * @brief Starts a transaction.
+ *
+ * Blocks other tasks' changes, and their reads of the known networks,
+ * until nvs_storage_commit(). Transactions nest: only the outermost
+ * commit writes.
+ */
+void nvs_storage_begin(void);
+
+/**
+ * @brief Ends a transaction.
+ *
+ * Publishes its values and, if it changed a persisted one, hands them to
+ * the persistence task. Only the outermost commit does so.
+ *
+ * @return ESP_OK; writing errors are counted in the stats and retried.
+ */
+esp_err_t nvs_storage_commit(void);
+
+/**
+ * @brief Ends a transaction, like nvs_storage_commit(), and tells whether
+ *        it changed anything.
+ *
+ * @param[out] changed Set if the transaction changed a setting, persisted
+ *                     or not, or a known network. Always false for a
+ *                     nested commit; the outermost one reports them all.
+ * @return ESP_OK; writing errors are counted in the stats and retried.
+ */
+esp_err_t nvs_storage_commit_changed(bool *changed);
+
+/**
+ * @brief Writes the pending changes now.
+ *
+ * Blocks until they are in flash; call it before restarting. Must not be
+ * called inside a transaction.
+ *
+ * @return ESP_OK if nothing was pending or the write succeeded, else the
+ *         NVS error; the changes then stay pending.
+ */
+esp_err_t nvs_storage_flush(void);
+
+/**
+ * @brief Gets the flash write counters.
+ *
+ * @param[out] stats The counters.
+ */
+void nvs_storage_get_stats(nvs_storage_stats_t *stats);
+
+/**
+ * @brief Adds a network to the known networks, or updates its password.
+ *
+ * When the list is full, the network with the lowest priority that worked
+ * longest ago is forgotten to make room.
  *
  * @param ssid The WiFi network SSID.
  * @param password The WiFi network password.
@@ -34,55 +164,101 @@ esp_err_t nvs_storage_init(void);
 void nvs_storage_save_wifi_credentials(const char *ssid, const char *password);
 
 /**
- * @brief Saves the auto-connect preference to NVS.
+ * @brief Forgets a known network.
  *
- * @param value The auto-connect preference (true or false).
+ * @param ssid The network to forget, or NULL to forget all of them.
+ * @return False if the network was not known; always true for NULL.
  */
-void nvs_storage_save_auto_connect(bool value);
+bool nvs_storage_forget_network(const char *ssid);
 
 /**
- * @brief Saves the device name to NVS.
+ * @brief Sets the priority of a known network.
  *
- * Note: A restart is required for the new device name to be used for BLE advertising.
+ * @param ssid The network.
+ * @param priority The new priority; higher is tried first.
+ * @return False if the network is not known.
+ */
+bool nvs_storage_set_network_priority(const char *ssid, uint8_t priority);
+
+/**
+ * @brief Copies the known networks, in the order they were first saved.
+ *
+ * Safe to call from any task.
  *
- * @param name The new device name.
+ * @param[out] out Receives the networks.
+ * @param max The capacity of out.
+ * @return The number of networks copied.
  */
-void nvs_storage_save_device_name(const char *name);
+size_t nvs_storage_get_networks(nvs_storage_network_t *out, size_t max);
 
 /**
- * @brief Erases all stored preferences from NVS.
+ * @brief Records a successful connection to a known network.
+ *
+ * Makes it the most recently used network and remembers where it was
+ * found. Only written to flash when something changed. Ignored for
+ * networks that are not known.
  *
- * This will clear WiFi credentials, auto-connect settings, and the device name,
- * reverting them to their default values.
+ * @param ssid The network.
+ * @param hint The access point it was found on, or NULL to keep the old hint.
  */
-void nvs_storage_clear_all_preferences(void);
+void nvs_storage_record_success(const char *ssid, const nvs_storage_ap_hint_t *hint);
 
 /**
- * @brief Gets the stored WiFi SSID.
+ * @brief Gets where a known network was last found.
  *
- * @return A pointer to the null-terminated SSID string.
+ * Safe to call from any task.
+ *
+ * @param ssid The network.
+ * @param[out] hint The access point of the last successful connection.
+ * @return True if the network is known and has a hint.
  */
-const char *nvs_storage_get_ssid(void);
+bool nvs_storage_get_ap_hint(const char *ssid, nvs_storage_ap_hint_t *hint);
 
 /**
- * @brief Gets the stored WiFi password.
+ * @brief Changes a setting.
+ *
+ * The value is checked against the schema first. Persisted settings are
+ * written after the commit of the transaction, and only if the value
+ * changed; the setting's apply hook runs once the change is committed.
  *
- * @return A pointer to the null-terminated password string.
+ * @param key The setting.
+ * @param type The type the value was given as; must be the setting's.
+ * @param value The new value.
+ * @return ESP_ERR_INVALID_ARG if the value does not fit the schema, else
+ *         as nvs_storage_commit().
+ */
+esp_err_t nvs_storage_set(config_key_t key, config_type_t type, const config_value_t *value);
+
+/**
+ * @brief Copies the values of all settings.
+ *
+ * Safe to call from any task; read the copy with config_get().
+ */
+void nvs_storage_get_config(config_values_t *out);
+
+/**
+ * @brief Gets a boolean setting.
  */
-const char *nvs_storage_get_password(void);
+bool nvs_storage_get_bool(config_key_t key);
 
 /**
- * @brief Gets the auto-connect preference.
+ * @brief Gets an integer setting.
+ */
+int32_t nvs_storage_get_int(config_key_t key);
+
+/**
+ * @brief Copies a string setting.
  *
- * @return True if auto-connect is enabled, false otherwise.
+ * @param[out] out Receives the string, truncated to size.
  */
-bool nvs_storage_get_auto_connect(void);
+void nvs_storage_get_string(config_key_t key, char *out, size_t size);
 
 /**
- * @brief Gets the device name.
+ * @brief Erases all stored preferences from NVS.
  *
- * @return A pointer to the null-terminated device name string.
+ * This will clear the known networks and revert every setting to its
+ * default.
  */
-const char *nvs_storage_get_device_name(void);
+void nvs_storage_clear_all_preferences(void);
 
 #endif // NVS_STORAGE_H
@@ -0,0 +1,161 @@
+/**
+ * @file scan_sched.c
+ * @brief Implementation of the background scan scheduler.
+ */
+
+#include "scan_sched.h"
+#include <string.h>
+
+static const char *const mode_names[SCAN_SCHED_MODE_COUNT] = {
+    [SCAN_SCHED_IDLE] = "idle",
+    [SCAN_SCHED_STABLE] = "stable",
+    [SCAN_SCHED_DEGRADED] = "degraded",
+};
+
+static const uint32_t min_interval[SCAN_SCHED_MODE_COUNT] = {
+    [SCAN_SCHED_IDLE] = SCAN_SCHED_IDLE_MIN_MS,
+    [SCAN_SCHED_STABLE] = SCAN_SCHED_STABLE_MIN_MS,
+    [SCAN_SCHED_DEGRADED] = SCAN_SCHED_DEGRADED_MIN_MS,
+};
+
+static const uint32_t max_interval[SCAN_SCHED_MODE_COUNT] = {
+    [SCAN_SCHED_IDLE] = SCAN_SCHED_IDLE_MAX_MS,
+    [SCAN_SCHED_STABLE] = SCAN_SCHED_STABLE_MAX_MS,
+    [SCAN_SCHED_DEGRADED] = SCAN_SCHED_DEGRADED_MAX_MS,
+};
+
+const char *scan_sched_mode_name(scan_sched_mode_t mode)
+{
+    return mode < SCAN_SCHED_MODE_COUNT ? mode_names[mode] : "unknown";
+}
+
+// Switches mode, and schedules its first scan after delay_ms
+static void enter(scan_sched_t *s, scan_sched_mode_t mode, uint32_t delay_ms, uint32_t now_ms)
+{
+    s->mode = mode;
+    s->interval_ms = min_interval[mode];
+    s->next_ms = now_ms + delay_ms;
+}
+
+void scan_sched_init(scan_sched_t *s, uint32_t now_ms)
+{
+    memset(s, 0, sizeof(*s));
+    enter(s, SCAN_SCHED_IDLE, SCAN_SCHED_IDLE_MIN_MS, now_ms);
+}
+
+void scan_sched_set_connected(scan_sched_t *s, bool connected, uint32_t now_ms)
+{
+    s->have_rssi = false;
+    scan_sched_mode_t mode = connected ? SCAN_SCHED_STABLE : SCAN_SCHED_IDLE;
+    enter(s, mode, min_interval[mode], now_ms);
+}
+
+bool scan_sched_rssi(scan_sched_t *s, int8_t rssi, uint32_t now_ms)
+{
+    if (s->mode == SCAN_SCHED_IDLE)
+    {
+        return false;
+    }
+
+    int32_t sample = (int32_t)rssi * 16;
+    if (!s->have_rssi)
+    {
+        s->fast_x16 = sample;
+        s->slow_x16 = sample;
+        s->have_rssi = true;
+    }
+    else
+    {
+        // Weights 1/2 and 1/8: the fast one follows within a few samples
+        s->fast_x16 += (sample - s->fast_x16) / 2;
+        s->slow_x16 += (sample - s->slow_x16) / 8;
+    }
+
+    int32_t drop = s->slow_x16 - s->fast_x16;
+    if (s->mode == SCAN_SCHED_STABLE)
+    {
+        if (s->fast_x16 < SCAN_SCHED_WEAK_RSSI * 16 || drop >= SCAN_SCHED_DROP_DB * 16)
+        {
+            enter(s, SCAN_SCHED_DEGRADED, 0, now_ms);
+            return true;
+        }
+    }
+    else if (s->fast_x16 > SCAN_SCHED_RECOVER_RSSI * 16 && drop < SCAN_SCHED_DROP_DB * 8)
+    {
+        enter(s, SCAN_SCHED_STABLE, SCAN_SCHED_STABLE_MIN_MS, now_ms);
+    }
+    return false;
+}
+
+void scan_sched_request(scan_sched_t *s)
+{
+    s->stats.requests++;
+    if (s->requested || s->scanning)
+    {
+        // The running scan's result is as fresh as a new one would be
+        s->stats.merged++;
+        return;
+    }
+    s->requested = true;
+}
+
+scan_sched_kind_t scan_sched_poll(const scan_sched_t *s, uint32_t now_ms)
+{
+    if (s->scanning)
+    {
+        return SCAN_SCHED_NONE;
+    }
+    if (s->requested)
+    {
+        // Whoever asked is waiting for a complete result
+        return SCAN_SCHED_ACTIVE;
+    }
+    if ((int32_t)(now_ms - s->next_ms) < 0)
+    {
+        return SCAN_SCHED_NONE;
+    }
+    return s->mode == SCAN_SCHED_IDLE ? SCAN_SCHED_ACTIVE : SCAN_SCHED_PASSIVE;
+}
+
+void scan_sched_started(scan_sched_t *s)
+{
+    s->scanning = true;
+    s->requested = false;
+    s->stats.scans++;
+}
+
+void scan_sched_done(scan_sched_t *s, uint32_t now_ms)
+{
+    if (!s->scanning)
+    {
+        return;
+    }
+    s->scanning = false;
+
+    // Any scan counts as the scheduled one; the next waits a bit longer
+    s->next_ms = now_ms + s->interval_ms;
+    uint32_t max = max_interval[s->mode];
+    s->interval_ms = s->interval_ms < max / 2 ? s->interval_ms * 2 : max;
+}
+
+bool scan_sched_scanning(const scan_sched_t *s)
+{
+    return s->scanning;
+}
+
+bool scan_sched_pending(const scan_sched_t *s)
+{
+    return s->requested;
+}
+
+void scan_sched_get_stats(const scan_sched_t *s, scan_sched_stats_t *stats, uint32_t now_ms)
+{
+    *stats = s->stats;
+    stats->mode = s->mode;
+    stats->interval_ms = s->interval_ms;
+    int32_t left = (int32_t)(s->next_ms - now_ms);
+    stats->next_in_ms = left > 0 ? (uint32_t)left : 0;
+    stats->have_rssi = s->have_rssi;
+    stats->rssi_avg = s->slow_x16 / 16;
+    stats->trend_db = (s->fast_x16 - s->slow_x16) / 16;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file scan_sched.h
+ * @brief Background scan scheduler.
+ *
+ * Decides when the WiFi manager scans and how, so that scans run in the
+ * background instead of on the path of whoever wants the result. The
+ * interval depends on the mode: idle (not connected), stable (connected)
+ * or degraded (connected, signal weak or falling). It doubles after every
+ * scheduled scan up to the mode's maximum, and starts over from the
+ * mode's minimum when the mode changes. Scans while connected are
+ * passive, so the link keeps its channel most of the time; the others,
+ * and those asked for, are active. Requests that come in while one is
+ * pending or running are merged into it.
+ *
+ * The RSSI trend is tracked with two moving averages of the sampled RSSI,
+ * a fast and a slow one; the fast one falling below the slow one means
+ * the signal is getting worse.
+ *
+ * Like wifi_sm, it has no ESP-IDF dependencies and is not thread-safe; the
+ * WiFi manager drives it under its state machine lock.
+ */
+
+#ifndef SCAN_SCHED_H
+#define SCAN_SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How often the RSSI is sampled and due scans are started.
+#define SCAN_SCHED_TICK_MS 5000
+
+// Scan interval range per mode.
+#define SCAN_SCHED_IDLE_MIN_MS 30000
+#define SCAN_SCHED_IDLE_MAX_MS 240000
+#define SCAN_SCHED_STABLE_MIN_MS 60000
+#define SCAN_SCHED_STABLE_MAX_MS 300000
+#define SCAN_SCHED_DEGRADED_MIN_MS 15000
+#define SCAN_SCHED_DEGRADED_MAX_MS 60000
+
+// The signal is degraded below SCAN_SCHED_WEAK_RSSI, or when the fast
+// average is SCAN_SCHED_DROP_DB under the slow one; it has recovered
+// above SCAN_SCHED_RECOVER_RSSI with less than half that drop.
+#define SCAN_SCHED_WEAK_RSSI (-75)
+#define SCAN_SCHED_RECOVER_RSSI (-70)
+#define SCAN_SCHED_DROP_DB 5
+
+/**
+ * @brief Scheduling modes.
+ */
+typedef enum
+{
+    SCAN_SCHED_IDLE,     // Not connected
+    SCAN_SCHED_STABLE,   // Connected with a good signal
+    SCAN_SCHED_DEGRADED, // Connected, the signal is weak or falling
+    SCAN_SCHED_MODE_COUNT
+} scan_sched_mode_t;
+
+/**
+ * @brief What kind of scan to start, see scan_sched_poll().
+ */
+typedef enum
+{
+    SCAN_SCHED_NONE, // Nothing is due
+    SCAN_SCHED_ACTIVE,
+    SCAN_SCHED_PASSIVE,
+} scan_sched_kind_t;
+
+/**
+ * @brief Counters and the current schedule, see scan_sched_get_stats().
+ */
+typedef struct
+{
+    scan_sched_mode_t mode;
+    uint32_t interval_ms; // Interval after the next scheduled scan
+    uint32_t next_in_ms;  // Until the next scheduled scan, 0 when due
+    bool have_rssi;       // The averages below are valid
+    int rssi_avg;         // Slow average, dBm
+    int trend_db;         // Fast minus slow average; negative while falling
+    uint32_t scans;       // Scans started
+    uint32_t requests;    // Scans asked for
+    uint32_t merged;      // Requests that joined a pending or running scan
+} scan_sched_stats_t;
+
+/**
+ * @brief Scheduler instance; treat as opaque.
+ */
+typedef struct
+{
+    scan_sched_mode_t mode;
+    bool requested;   // A scan was asked for and has not started yet
+    bool scanning;
+    bool have_rssi;
+    int32_t fast_x16; // Moving averages of the RSSI, in 1/16 dBm
+    int32_t slow_x16;
+    uint32_t interval_ms;
+    uint32_t next_ms;
+    scan_sched_stats_t stats;
+} scan_sched_t;
+
+/**
+ * @brief Initializes a scheduler in the idle mode.
+ */
+void scan_sched_init(scan_sched_t *s, uint32_t now_ms);
+
+/**
+ * @brief Tells the scheduler that the link came up or went away.
+ *
+ * Either way the RSSI history is dropped and the new mode starts over
+ * from its minimum interval.
+ */
+void scan_sched_set_connected(scan_sched_t *s, bool connected, uint32_t now_ms);
+
+/**
+ * @brief Feeds an RSSI sample of the current link.
+ *
+ * @return True if the signal just became degraded; a scan is then due at
+ *         once, to look for a better AP.
+ */
+bool scan_sched_rssi(scan_sched_t *s, int8_t rssi, uint32_t now_ms);
+
+/**
+ * @brief Asks for a scan as soon as possible.
+ *
+ * Merged with a scan that is already asked for or running; a running one
+ * answers it.
+ */
+void scan_sched_request(scan_sched_t *s);
+
+/**
+ * @brief Tells whether a scan should start now, and which kind.
+ *
+ * Call it whenever the driver is free to scan; nothing changes until
+ * scan_sched_started() confirms that the scan did start.
+ */
+scan_sched_kind_t scan_sched_poll(const scan_sched_t *s, uint32_t now_ms);
+
+/**
+ * @brief Records that the scan returned by scan_sched_poll() started.
+ */
+void scan_sched_started(scan_sched_t *s);
+
+/**
+ * @brief Records that the running scan finished and schedules the next.
+ */
+void scan_sched_done(scan_sched_t *s, uint32_t now_ms);
+
+/**
+ * @brief Tells whether a scan is running.
+ */
+bool scan_sched_scanning(const scan_sched_t *s);
+
+/**
+ * @brief Tells whether a requested scan is waiting to start.
+ */
+bool scan_sched_pending(const scan_sched_t *s);
+
+/**
+ * @brief Gets the counters and the current schedule.
+ */
+void scan_sched_get_stats(const scan_sched_t *s, scan_sched_stats_t *stats, uint32_t now_ms);
+
+/**
+ * @brief Gets the name of a mode, as reported by the wifi() command.
+ */
+const char *scan_sched_mode_name(scan_sched_mode_t mode);
+
+#endif // SCAN_SCHED_H
@@ -0,0 +1,141 @@
+/**
+ * @file scan_store.c
+ * @brief Implementation of the ranked scan result store.
+ */
+
+#include "scan_store.h"
+#include "freertos/FreeRTOS.h"
+#include <string.h>
+
+// Collected by the event loop only, best first
+static scan_store_entry_t staging[SCAN_STORE_TOP_K];
+static size_t staging_count;
+
+// Published result, best first; copies are short, so a spinlock will do
+static scan_store_entry_t entries[SCAN_STORE_TOP_K];
+static size_t entry_count;
+static uint32_t result_ms;
+static bool have_result;
+static portMUX_TYPE store_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void scan_store_begin(void)
+{
+    staging_count = 0;
+}
+
+// Moves the entry at i up past weaker ones, keeping equal ones in order
+static void rise(size_t i)
+{
+    while (i > 0 && staging[i - 1].rssi < staging[i].rssi)
+    {
+        scan_store_entry_t tmp = staging[i - 1];
+        staging[i - 1] = staging[i];
+        staging[i] = tmp;
+        i--;
+    }
+}
+
+void scan_store_offer(const scan_store_entry_t *ap)
+{
+    if (ap->ssid[0] == '\0')
+    {
+        return;
+    }
+
+    // Another AP of a known SSID only counts, unless it is stronger
+    for (size_t i = 0; i < staging_count; i++)
+    {
+        scan_store_entry_t *e = &staging[i];
+        if (strcmp(e->ssid, ap->ssid) == 0)
+        {
+            uint8_t seen = e->seen < UINT8_MAX ? e->seen + 1 : UINT8_MAX;
+            if (ap->rssi > e->rssi)
+            {
+                *e = *ap;
+                e->ssid[sizeof(e->ssid) - 1] = '\0';
+            }
+            e->seen = seen;
+            rise(i);
+            return;
+        }
+    }
+
+    // A new SSID takes the last place if there is room, or the weakest one's
+    size_t slot = staging_count;
+    if (staging_count == SCAN_STORE_TOP_K)
+    {
+        slot = SCAN_STORE_TOP_K - 1;
+        if (ap->rssi <= staging[slot].rssi)
+        {
+            return;
+        }
+    }
+    else
+    {
+        staging_count++;
+    }
+    staging[slot] = *ap;
+    staging[slot].ssid[sizeof(staging[slot].ssid) - 1] = '\0';
+    staging[slot].seen = 1;
+    rise(slot);
+}
+
+void scan_store_commit(uint32_t now_ms)
+{
+    portENTER_CRITICAL(&store_lock);
+    memcpy(entries, staging, staging_count * sizeof(entries[0]));
+    entry_count = staging_count;
+    result_ms = now_ms;
+    have_result = true;
+    portEXIT_CRITICAL(&store_lock);
+}
+
+void scan_store_clear(void)
+{
+    portENTER_CRITICAL(&store_lock);
+    entry_count = 0;
+    have_result = false;
+    portEXIT_CRITICAL(&store_lock);
+}
+
+bool scan_store_age(uint32_t now_ms, uint32_t *age_ms)
+{
+    portENTER_CRITICAL(&store_lock);
+    bool valid = have_result;
+    *age_ms = now_ms - result_ms;
+    portEXIT_CRITICAL(&store_lock);
+    return valid;
+}
+
+size_t scan_store_read(size_t offset, scan_store_entry_t *out, size_t max, size_t *total)
+{
+    portENTER_CRITICAL(&store_lock);
+    size_t count = 0;
+    if (offset < entry_count && max > 0)
+    {
+        count = entry_count - offset < max ? entry_count - offset : max;
+        memcpy(out, &entries[offset], count * sizeof(entries[0]));
+    }
+    if (total != NULL)
+    {
+        *total = entry_count;
+    }
+    portEXIT_CRITICAL(&store_lock);
+    return count;
+}
+
+bool scan_store_find(const char *ssid, scan_store_entry_t *out)
+{
+    bool found = false;
+    portENTER_CRITICAL(&store_lock);
+    for (size_t i = 0; i < entry_count && !found; i++)
+    {
+        if (strcmp(entries[i].ssid, ssid) == 0)
+        {
+            *out = entries[i];
+            found = true;
+        }
+    }
+    portEXIT_CRITICAL(&store_lock);
+    return found;
+}
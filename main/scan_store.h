@@ -0,0 +1,97 @@
+/**
+ * @file scan_store.h
+ * @brief Ranked store of the last WiFi scan result.
+ *
+ * Every access point of a scan is offered to the store, which keeps one
+ * entry per SSID (the AP with the best signal, and how many APs of the
+ * SSID it has seen) and the SCAN_STORE_TOP_K strongest SSIDs, best first. Nothing is
+ * serialized here; readers copy out the entries they need, a page at a
+ * time, and render them when asked.
+ *
+ * A scan is collected on the default event loop and published as a
+ * whole, so readers on other tasks never see a half-built result.
+ */
+
+#ifndef SCAN_STORE_H
+#define SCAN_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How many SSIDs are kept from a scan, the strongest ones.
+#define SCAN_STORE_TOP_K 20
+
+/**
+ * @brief One SSID of a scan, described by its strongest AP.
+ */
+typedef struct
+{
+    char ssid[33];
+    uint8_t bssid[6];
+    int8_t rssi;
+    uint8_t channel;  // Primary channel
+    uint8_t authmode; // A wifi_auth_mode_t
+    uint8_t seen;     // APs seen with this SSID; only the strongest is kept
+} scan_store_entry_t;
+
+/**
+ * @brief Starts collecting a new scan result.
+ *
+ * The previous result stays visible until scan_store_commit(). Only one
+ * task may collect at a time.
+ */
+void scan_store_begin(void);
+
+/**
+ * @brief Offers an access point of the scan being collected.
+ *
+ * Hidden networks (empty SSID) are ignored. seen of the entry is ignored,
+ * the store counts the APs itself: every AP offered while its SSID is
+ * ranked. An SSID pushed out of the ranking by stronger ones starts over
+ * if it comes back, so seen is a lower bound for it.
+ */
+void scan_store_offer(const scan_store_entry_t *ap);
+
+/**
+ * @brief Publishes the collected result, replacing the previous one.
+ *
+ * @param now_ms The current time in milliseconds, the time of the result.
+ */
+void scan_store_commit(uint32_t now_ms);
+
+/**
+ * @brief Drops the published result.
+ */
+void scan_store_clear(void);
+
+/**
+ * @brief Tells how old the published result is.
+ *
+ * @param now_ms The current time in milliseconds.
+ * @param[out] age_ms The age of the result.
+ * @return False if there is no result.
+ */
+bool scan_store_age(uint32_t now_ms, uint32_t *age_ms);
+
+/**
+ * @brief Copies a page of the published result, strongest first.
+ *
+ * @param offset Rank of the first entry to copy.
+ * @param[out] out Receives the entries.
+ * @param max The capacity of out.
+ * @param[out] total The number of entries in the result; may be NULL.
+ * @return The number of entries copied.
+ */
+size_t scan_store_read(size_t offset, scan_store_entry_t *out, size_t max, size_t *total);
+
+/**
+ * @brief Finds an SSID in the published result.
+ *
+ * @param ssid The SSID.
+ * @param[out] out The entry, if found.
+ * @return True if the SSID was in the result.
+ */
+bool scan_store_find(const char *ssid, scan_store_entry_t *out);
+
+#endif // SCAN_STORE_H
@@ -0,0 +1,238 @@
+/**
+ * @file status_model.c
+ * @brief Implementation of the versioned status model.
+ */
+
+#include "status_model.h"
+#include "app_includes.h"
+
+#include "device_state.h"
+#include "json_writer.h"
+#include "nvs.h"
+#include "wifi_manager.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Status fields, in the order status() has always listed them
+typedef enum
+{
+    FIELD_WIFI,
+    FIELD_RSSI,
+    FIELD_IP,
+    FIELD_HEAP,
+    FIELD_UPTIME,
+    FIELD_BLE,
+    FIELD_SAVED_SSID,
+    FIELD_AUTOCONNECT,
+    FIELD_DEVNAME,
+    FIELD_NVS_FREE,
+    FIELD_NETWORKS,
+    FIELD_COUNT
+} field_id_t;
+
+typedef struct
+{
+    const char *key;  // JSON key; the networks field renders its own keys
+    char *value;      // Rendered JSON value, NULL for the unversioned uptime
+    size_t size;
+    int32_t num;      // Last accepted reading of numeric fields
+    uint32_t version; // Model version of the last change, 0 before the first refresh
+} status_field_t;
+
+// Fits a quoted 32-character string even if every character needs \u00XX
+#define FIELD_VALUE_LEN (32 * 6 + 3)
+
+static char field_values[FIELD_COUNT][FIELD_VALUE_LEN];
+static char networks_value[512];
+
+#define FIELD(id, name) [id] = {name, field_values[id], FIELD_VALUE_LEN}
+
+static status_field_t fields[FIELD_COUNT] = {
+    FIELD(FIELD_WIFI, "wifi"),
+    FIELD(FIELD_RSSI, "rssi"),
+    FIELD(FIELD_IP, "ip"),
+    FIELD(FIELD_HEAP, "heap"),
+    [FIELD_UPTIME] = {"uptime", NULL, 0},
+    FIELD(FIELD_BLE, "ble"),
+    FIELD(FIELD_SAVED_SSID, "saved_ssid"),
+    FIELD(FIELD_AUTOCONNECT, "autoconnect"),
+    FIELD(FIELD_DEVNAME, "devname"),
+    FIELD(FIELD_NVS_FREE, "nvs_free"),
+    [FIELD_NETWORKS] = {NULL, networks_value, sizeof(networks_value)},
+};
+
+static uint32_t model_version;
+static bool refresh_changed;
+
+static void mark_changed(status_field_t *f)
+{
+    f->version = model_version + 1;
+    refresh_changed = true;
+}
+
+static void set_text(field_id_t id, const char *text)
+{
+    status_field_t *f = &fields[id];
+    if (f->version != 0 && strcmp(f->value, text) == 0)
+    {
+        return;
+    }
+    snprintf(f->value, f->size, "%s", text);
+    mark_changed(f);
+}
+
+static void set_string(field_id_t id, const char *str)
+{
+    char quoted[FIELD_VALUE_LEN];
+    json_writer_t w;
+    json_writer_init(&w, quoted, sizeof(quoted));
+    json_put_string(&w, str);
+    set_text(id, w.overflow ? "\"\"" : quoted);
+}
+
+static void set_num(field_id_t id, int32_t value, int32_t step)
+{
+    status_field_t *f = &fields[id];
+    if (f->version != 0 && abs(value - f->num) < step)
+    {
+        return;
+    }
+    f->num = value;
+    snprintf(f->value, f->size, "%ld", (long)value);
+    mark_changed(f);
+}
+
+uint32_t status_model_refresh(void)
+{
+    refresh_changed = false;
+
+    // Everything comes from one consistent snapshot; the RSSI in it is
+    // sampled by the scan scheduler, so no reading needs the driver
+    static device_state_t state;
+    device_state_read(&state);
+
+    set_text(FIELD_WIFI, state.wifi_connected ? "true" : "false");
+
+    if (state.wifi_connected)
+    {
+        char ip[24];
+        snprintf(ip, sizeof(ip), "\"" IPSTR "\"", IP2STR(&state.ip));
+        set_num(FIELD_RSSI, state.rssi, STATUS_MODEL_RSSI_STEP);
+        set_text(FIELD_IP, ip);
+        set_text(FIELD_NETWORKS, "");
+    }
+    else
+    {
+        set_num(FIELD_RSSI, 0, 1);
+        set_text(FIELD_IP, "\"\"");
+
+        // A cached list carries no scanning flag; add it so that a delta
+        // always clears a scanning:true sent earlier
+        static char networks[sizeof(networks_value)];
+        static const char scanning_prefix[] = "\"scanning\":false,";
+        size_t prefix_len = sizeof(scanning_prefix) - 1;
+        wifi_manager_get_networks_json(networks + prefix_len, sizeof(networks) - prefix_len);
+        if (strstr(networks + prefix_len, "\"scanning\"") == NULL)
+        {
+            memcpy(networks, scanning_prefix, prefix_len);
+            set_text(FIELD_NETWORKS, networks);
+        }
+        else
+        {
+            set_text(FIELD_NETWORKS, networks + prefix_len);
+        }
+    }
+
+    nvs_stats_t nvs_stats;
+    nvs_get_stats(NULL, &nvs_stats);
+
+    set_num(FIELD_HEAP, (int32_t)esp_get_free_heap_size(), STATUS_MODEL_HEAP_STEP);
+    set_text(FIELD_BLE, state.ble_clients > 0 ? "true" : "false");
+    set_string(FIELD_SAVED_SSID, state.ssid);
+    set_text(FIELD_AUTOCONNECT, state.autoconnect ? "true" : "false");
+    set_string(FIELD_DEVNAME, state.devname);
+    set_num(FIELD_NVS_FREE, (int32_t)nvs_stats.free_entries, 1);
+
+    if (refresh_changed)
+    {
+        model_version++;
+    }
+    return model_version;
+}
+
+uint32_t status_model_version(void)
+{
+    return model_version;
+}
+
+static void put_field(json_writer_t *w, const status_field_t *f)
+{
+    if (f->value == NULL)
+    {
+        json_put_key_int(w, f->key, esp_timer_get_time() / 1000000);
+    }
+    else if (f->key == NULL)
+    {
+        // The networks field is a group of keys, sent as null once it is gone
+        json_put_raw(w, f->value[0] != '\0' ? f->value : "\"scanning\":null,\"available_networks\":null");
+    }
+    else
+    {
+        json_put_key(w, f->key);
+        json_put_raw(w, f->value);
+    }
+}
+
+// The length of what was written, 0 when the document did not fit
+static size_t finish(json_writer_t *w)
+{
+    size_t len = json_writer_finish(w);
+    return w->overflow ? 0 : len;
+}
+
+size_t status_model_render_full(char *json, size_t size)
+{
+    json_writer_t w;
+    json_writer_init(&w, json, size);
+    json_begin_object(&w);
+    for (int i = 0; i < FIELD_COUNT; i++)
+    {
+        // An absent group is simply left out of a snapshot
+        if (fields[i].key == NULL && fields[i].value[0] == '\0')
+        {
+            continue;
+        }
+        put_field(&w, &fields[i]);
+    }
+    json_put_key(&w, "v");
+    json_put_uint(&w, model_version);
+    json_end_object(&w);
+    return finish(&w);
+}
+
+size_t status_model_render_delta(char *json, size_t size, uint32_t since)
+{
+    json_writer_t w;
+    json_writer_init(&w, json, size);
+    json_begin_object(&w);
+    json_put_key(&w, "delta");
+    json_begin_object(&w);
+    // The uptime leads every delta, so it is never empty
+    put_field(&w, &fields[FIELD_UPTIME]);
+    for (int i = 0; i < FIELD_COUNT; i++)
+    {
+        if (fields[i].value != NULL && fields[i].version > since)
+        {
+            put_field(&w, &fields[i]);
+        }
+    }
+    json_end_object(&w);
+    json_put_key(&w, "v");
+    json_put_uint(&w, model_version);
+    json_put_key(&w, "base");
+    json_put_uint(&w, since);
+    json_end_object(&w);
+    return finish(&w);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file status_model.h
+ * @brief Versioned model of the device status reported by status().
+ *
+ * Every status field carries the version at which it last changed. The
+ * model version grows by one each time a refresh finds a changed field, so
+ * a client that acknowledged version N only needs the fields whose version
+ * is above N. Full snapshots and deltas are rendered from the same model.
+ *
+ * Noisy readings only count as a change once they move by more than a
+ * threshold (RSSI, free heap), and the uptime is never versioned: it is
+ * sent with every snapshot and delta, but never causes one.
+ *
+ * The model is refreshed and rendered on the application task only.
+ */
+
+#ifndef STATUS_MODEL_H
+#define STATUS_MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimum RSSI change, in dBm, that counts as a new value.
+#define STATUS_MODEL_RSSI_STEP 3
+
+// Minimum free heap change, in bytes, that counts as a new value.
+#define STATUS_MODEL_HEAP_STEP 1024
+
+/**
+ * @brief Samples the device state and bumps the version of changed fields.
+ *
+ * @return The model version after the refresh.
+ */
+uint32_t status_model_refresh(void);
+
+/**
+ * @brief Gets the current model version without refreshing.
+ */
+uint32_t status_model_version(void);
+
+/**
+ * @brief Renders the full status document.
+ *
+ * The document is the status() response with its version added as "v".
+ *
+ * @param json The output buffer.
+ * @param size The size of the buffer.
+ * @return The length of the JSON document, 0 if it did not fit.
+ */
+size_t status_model_render_full(char *json, size_t size);
+
+/**
+ * @brief Renders the fields changed since a version.
+ *
+ * The document is {"delta":{...},"v":<version>,"base":<since>}. Removed
+ * fields are sent as null.
+ *
+ * @param json The output buffer.
+ * @param size The size of the buffer.
+ * @param since The version the client acknowledged, 0 for everything.
+ * @return The length of the JSON document, 0 if it did not fit.
+ */
+size_t status_model_render_delta(char *json, size_t size, uint32_t since);
+
+#endif // STATUS_MODEL_H
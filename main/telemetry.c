@@ -0,0 +1,392 @@
+/**
+ * @file telemetry.c
+ * @brief Implementation of the telemetry history.
+ */
+
+#include "telemetry.h"
+#include "app_includes.h"
+#include "esp_partition.h"
+#include "freertos/semphr.h"
+#include "tslog.h"
+#include "device_state.h"
+#include "command_handler.h"
+#include "ble_manager.h"
+#include "json_writer.h"
+#include <string.h>
+
+static const char *TAG = "TELEMETRY";
+
+// Size of one {"rows":[...]} message of a download
+#define TELEMETRY_MSG_LEN 480
+
+// Names of the record values, in order, after the timestamp
+static const char *const field_names[TSLOG_FIELDS] = {"rssi", "heap", "ble", "wifi"};
+
+// The log and the download in progress, under the lock. The task appends
+// and streams; commands read the counters, request downloads and flush
+static tslog_t history;
+static tslog_flash_t flash;
+static bool mounted;
+static SemaphoreHandle_t log_lock;
+static TaskHandle_t task;
+static uint32_t time_base; // Log time at boot, seconds
+static int64_t next_sample_us;
+
+typedef struct
+{
+    bool requested;
+    bool active;
+    uint16_t conn_handle;
+    uint32_t from, to;
+} download_t;
+
+static download_t download;
+
+static bool partition_read(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    return esp_partition_read(ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool partition_write(void *ctx, uint32_t offset, const void *buf, size_t len)
+{
+    return esp_partition_write(ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool partition_erase(void *ctx, uint32_t offset, size_t len)
+{
+    return esp_partition_erase_range(ctx, offset, len) == ESP_OK;
+}
+
+static uint32_t log_time(void)
+{
+    return time_base + (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+static void sample(void)
+{
+    device_state_t state;
+    device_state_read(&state);
+    tslog_record_t rec = {
+        .t = log_time(),
+        .v = {state.rssi, (int32_t)esp_get_free_heap_size(), state.ble_clients, state.wifi_connected},
+    };
+
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    bool ok = tslog_append(&history, &rec);
+    xSemaphoreGive(log_lock);
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Could not log the sample at %lu", (unsigned long)rec.t);
+    }
+}
+
+// Samples if the interval is over; downloads call it too, so a long one
+// leaves no gap in the history
+static void sample_if_due(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (now < next_sample_us)
+    {
+        return;
+    }
+    sample();
+    next_sample_us += (int64_t)TELEMETRY_INTERVAL_MS * 1000;
+    if (next_sample_us <= now)
+    {
+        next_sample_us = now + (int64_t)TELEMETRY_INTERVAL_MS * 1000;
+    }
+}
+
+static void put_row(json_writer_t *w, const tslog_record_t *rec)
+{
+    json_begin_array(w);
+    json_put_uint(w, rec->t);
+    for (int i = 0; i < TSLOG_FIELDS; i++)
+    {
+        json_put_int(w, rec->v[i]);
+    }
+    json_end_array(w);
+}
+
+// Streams the requested range to the client, one message of rows at a
+// time. Like bench("notify"), it keeps the client's transmit queue at most
+// half full, so other responses still get through. A slow download can be
+// overtaken by the ring; it then resumes at the oldest sector left and
+// reports the sectors it lost
+static void stream(void)
+{
+    static tslog_iter_t it;
+    static char msg[TELEMETRY_MSG_LEN];
+
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    download_t d = download;
+    download.requested = false;
+    tslog_iter_begin(&history, &it, d.from, d.to);
+    xSemaphoreGive(log_lock);
+
+    int64_t start = esp_timer_get_time();
+    uint32_t rows = 0;
+    tslog_record_t rec;
+    bool held = false; // rec did not fit into the last message
+    bool more = true, sent = true;
+    ble_session_t session;
+    while (more && sent && ble_manager_get_session(d.conn_handle, &session))
+    {
+        sample_if_due();
+        if (session.tx_pending + TELEMETRY_MSG_LEN > BLE_TX_RING_SIZE / 2)
+        {
+            vTaskDelay(1);
+            continue;
+        }
+
+        json_writer_t w;
+        json_writer_init(&w, msg, sizeof(msg));
+        json_begin_object(&w);
+        json_put_key(&w, "rows");
+        json_begin_array(&w);
+        uint32_t n = 0;
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        for (;;)
+        {
+            if (!held && !(held = tslog_iter_next(&it, &rec)))
+            {
+                more = false;
+                break;
+            }
+            json_writer_t mark = w;
+            put_row(&w, &rec);
+            if (!json_writer_fits(&w, 2))
+            {
+                json_writer_rewind(&w, &mark);
+                break;
+            }
+            held = false;
+            n++;
+        }
+        xSemaphoreGive(log_lock);
+        json_end_array(&w);
+        json_end_object(&w);
+
+        if (n > 0)
+        {
+            sent = ble_tx_send(d.conn_handle, msg, json_writer_finish(&w), pdMS_TO_TICKS(100));
+            rows += sent ? n : 0;
+        }
+    }
+
+    char end[128];
+    json_writer_t w;
+    json_writer_init(&w, end, sizeof(end));
+    json_begin_object(&w);
+    json_put_key(&w, "history_end");
+    json_begin_object(&w);
+    json_put_key_int(&w, "rows", rows);
+    json_put_key_int(&w, "ms", (esp_timer_get_time() - start) / 1000);
+    json_put_key_bool(&w, "complete", !more);
+    json_put_key_int(&w, "lost_sectors", tslog_iter_lost(&it));
+    json_end_object(&w);
+    json_end_object(&w);
+    ble_tx_send(d.conn_handle, end, json_writer_finish(&w), pdMS_TO_TICKS(100));
+    ESP_LOGI(TAG, "Sent %lu records to %u", (unsigned long)rows, d.conn_handle);
+
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    download.active = false;
+    xSemaphoreGive(log_lock);
+}
+
+static void telemetry_task(void *arg)
+{
+    next_sample_us = esp_timer_get_time();
+    for (;;)
+    {
+        sample_if_due();
+
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        bool requested = download.requested;
+        xSemaphoreGive(log_lock);
+        if (requested)
+        {
+            stream();
+            continue;
+        }
+
+        int64_t wait_us = next_sample_us - esp_timer_get_time();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_us > 0 ? wait_us / 1000 + 1 : 0));
+    }
+}
+
+// A negative time is that many seconds before now
+static uint32_t resolve_time(int32_t t)
+{
+    if (t >= 0)
+    {
+        return (uint32_t)t;
+    }
+    uint32_t now = log_time();
+    return (uint32_t)-(int64_t)t > now ? 0 : now + t;
+}
+
+static void cmd_history(const command_args_t *args)
+{
+    uint16_t conn_handle = command_handler_origin();
+    ble_session_t session;
+    if (!mounted)
+    {
+        command_handler_reply("{\"error\":\"no telemetry partition\"}");
+        return;
+    }
+    if (conn_handle == BLE_MANAGER_BROADCAST || !ble_manager_get_session(conn_handle, &session))
+    {
+        command_handler_reply("{\"error\":\"history() needs a BLE client\"}");
+        return;
+    }
+
+    uint32_t from = args->argc > 0 ? resolve_time(args->argv[0].num) : 0;
+    uint32_t to = args->argc > 1 ? resolve_time(args->argv[1].num) : UINT32_MAX;
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    bool busy = download.active;
+    if (!busy)
+    {
+        download = (download_t){.requested = true, .active = true, .conn_handle = conn_handle, .from = from, .to = to};
+    }
+    xSemaphoreGive(log_lock);
+    if (busy)
+    {
+        command_handler_reply("{\"error\":\"a download is in progress\"}");
+        return;
+    }
+
+    char resp[192];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "history");
+    json_begin_object(&w);
+    json_put_key(&w, "fields");
+    json_begin_array(&w);
+    json_put_string(&w, "t");
+    for (int i = 0; i < TSLOG_FIELDS; i++)
+    {
+        json_put_string(&w, field_names[i]);
+    }
+    json_end_array(&w);
+    json_put_key_int(&w, "from", from);
+    json_put_key_int(&w, "to", to);
+    json_put_key_int(&w, "now", log_time());
+    json_end_object(&w);
+    json_end_object(&w);
+    command_handler_reply(resp);
+    xTaskNotifyGive(task);
+}
+
+static void cmd_logstat(const command_args_t *args)
+{
+    if (!mounted)
+    {
+        command_handler_reply("{\"error\":\"no telemetry partition\"}");
+        return;
+    }
+    tslog_stats_t stats;
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    tslog_get_stats(&history, &stats);
+    xSemaphoreGive(log_lock);
+
+    char resp[384];
+    json_writer_t w;
+    json_writer_init(&w, resp, sizeof(resp));
+    json_begin_object(&w);
+    json_put_key(&w, "logstat");
+    json_begin_object(&w);
+    json_put_key_int(&w, "sectors", stats.sectors);
+    json_put_key_int(&w, "used", stats.used);
+    json_put_key_int(&w, "oldest", stats.oldest_t);
+    json_put_key_int(&w, "newest", stats.newest_t);
+    json_put_key_int(&w, "now", log_time());
+    json_put_key_int(&w, "interval_ms", TELEMETRY_INTERVAL_MS);
+    json_put_key_int(&w, "pending", stats.pending);
+    json_put_key_int(&w, "records", stats.records);
+    json_put_key_int(&w, "chunks", stats.chunks);
+    json_put_key_int(&w, "bytes", stats.bytes);
+    json_put_key_int(&w, "raw_bytes", (uint64_t)(stats.records - stats.pending) * sizeof(tslog_record_t));
+    json_put_key_int(&w, "erases", stats.erases);
+    json_put_key_int(&w, "rejected", stats.rejected);
+    json_put_key_int(&w, "failures", stats.failures);
+    json_end_object(&w);
+    json_end_object(&w);
+    command_handler_reply(resp);
+}
+
+static const command_desc_t telemetry_commands[] = {
+    {COMMAND_ID_HISTORY, "history", "|ii", "history(from,to)", cmd_history},
+    {COMMAND_ID_LOGSTAT, "logstat", "", "logstat()", cmd_logstat},
+};
+
+void telemetry_flush(void)
+{
+    if (!mounted)
+    {
+        return;
+    }
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    tslog_flush(&history);
+    xSemaphoreGive(log_lock);
+}
+
+esp_err_t telemetry_init(void)
+{
+    ESP_RETURN_ON_ERROR(command_handler_register(telemetry_commands,
+                                                 sizeof(telemetry_commands) / sizeof(telemetry_commands[0])),
+                        TAG, "Failed to register commands");
+
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, TELEMETRY_PARTITION_SUBTYPE,
+                                                           TELEMETRY_PARTITION_LABEL);
+    if (part == NULL)
+    {
+        ESP_LOGW(TAG, "No \"%s\" partition, telemetry is off.", TELEMETRY_PARTITION_LABEL);
+        return ESP_OK;
+    }
+    log_lock = xSemaphoreCreateMutex();
+    if (log_lock == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // A larger partition is only used as far as the time index reaches
+    flash = (tslog_flash_t){
+        .ctx = (void *)part,
+        .size = part->size < TSLOG_MAX_SECTORS * TSLOG_SECTOR_SIZE ? part->size : TSLOG_MAX_SECTORS * TSLOG_SECTOR_SIZE,
+        .read = partition_read,
+        .write = partition_write,
+        .erase = partition_erase,
+    };
+    int64_t start = esp_timer_get_time();
+    if (!tslog_mount(&history, &flash))
+    {
+        ESP_LOGE(TAG, "Could not mount the telemetry log.");
+        return ESP_OK;
+    }
+    mounted = true;
+
+    // Continue after the last record, whatever the uptime is
+    uint32_t last;
+    int64_t uptime_s = esp_timer_get_time() / 1000000;
+    if (tslog_last_time(&history, &last) && (int64_t)last + 1 > uptime_s)
+    {
+        time_base = (uint32_t)(last + 1 - uptime_s);
+    }
+
+    tslog_stats_t stats;
+    tslog_get_stats(&history, &stats);
+    ESP_LOGI(TAG, "Telemetry log: %lu of %lu sectors, t %lu..%lu, mounted in %lu us", (unsigned long)stats.used,
+             (unsigned long)stats.sectors, (unsigned long)stats.oldest_t, (unsigned long)stats.newest_t,
+             (unsigned long)(esp_timer_get_time() - start));
+
+    // Below the application tasks: flash writes and downloads can wait
+    if (xTaskCreate(telemetry_task, "telemetry", 4096, NULL, 1, &task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create telemetry task.");
+        mounted = false;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
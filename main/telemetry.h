@@ -0,0 +1,48 @@
+/**
+ * @file telemetry.h
+ * @brief Telemetry history kept in flash across disconnects and resets.
+ *
+ * A low-priority task samples the device state every
+ * TELEMETRY_INTERVAL_MS (RSSI, free heap, BLE clients, WiFi link) and
+ * appends it to a tslog ring on the "tslog" data partition, so the newest
+ * history survives however long no client is connected.
+ *
+ * The device has no wall clock, so records are stamped in seconds of log
+ * time: the uptime, offset so that every boot continues after the last
+ * stored record. history(from,to) takes log time, or seconds before now
+ * when negative, and streams the records of the range to the client in
+ * bulk as {"rows":[[t,rssi,heap,ble,wifi],...]} messages, paced to the
+ * client's transmit queue, ending with {"history_end":{...}}. logstat()
+ * reports the extent and counters of the log.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "esp_err.h"
+
+// Sampling interval.
+#define TELEMETRY_INTERVAL_MS 10000
+
+// The data partition that holds the log.
+#define TELEMETRY_PARTITION_LABEL "tslog"
+#define TELEMETRY_PARTITION_SUBTYPE 0x40
+
+/**
+ * @brief Mounts the log, registers its commands and starts sampling.
+ *
+ * Without the partition the commands report an error and nothing is
+ * sampled; that is not an error of the initialization.
+ *
+ * @return ESP_OK on success, or an error code on failure.
+ */
+esp_err_t telemetry_init(void);
+
+/**
+ * @brief Writes the samples still held in RAM to flash.
+ *
+ * Call it before restarting; samples not flushed are lost on a reset.
+ */
+void telemetry_flush(void);
+
+#endif // TELEMETRY_H
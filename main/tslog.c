@@ -0,0 +1,631 @@
+/**
+ * @file tslog.c
+ * @brief Implementation of the time-series ring log.
+ *
+ * Sector layout: a 16-byte header (magic, sequence number, timestamp of
+ * the first record, CRC-32 of the three), then chunks up to the first
+ * erased byte. Chunk layout: a 16-byte header (payload length, record
+ * count, marker, first and last timestamp, CRC-32 of the header and the
+ * payload), then the bit-packed payload. All integers are little endian.
+ */
+
+#include "tslog.h"
+#include <string.h>
+
+#define SECTOR_HDR_SIZE 16
+#define SECTOR_MAGIC (0x54530000u | (1u << 8) | TSLOG_FIELDS) // "TS", version 1, fields
+#define CHUNK_MARKER 0xC5
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t t_first;
+} sector_hdr_t;
+
+typedef struct
+{
+    uint16_t len; // Of the payload
+    uint8_t count;
+    uint8_t marker;
+    uint32_t t_first;
+    uint32_t t_last;
+    uint32_t crc;
+} chunk_hdr_t;
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads and checks the header of a sector; false if it holds no log data
+static bool read_sector_hdr(const tslog_t *log, uint32_t sector, sector_hdr_t *hdr)
+{
+    uint8_t raw[SECTOR_HDR_SIZE];
+    if (!log->flash->read(log->flash->ctx, sector * TSLOG_SECTOR_SIZE, raw, sizeof(raw)))
+    {
+        return false;
+    }
+    hdr->magic = get_le32(raw);
+    hdr->seq = get_le32(raw + 4);
+    hdr->t_first = get_le32(raw + 8);
+    return hdr->magic == SECTOR_MAGIC && get_le32(raw + 12) == crc32_update(0, raw, 12);
+}
+
+typedef enum
+{
+    CHUNK_OK,
+    CHUNK_END,     // Erased flash: the sector ends here
+    CHUNK_CORRUPT, // Incomplete or damaged: nothing after it is trusted
+} chunk_status_t;
+
+// Reads the chunk at off of a sector; the whole chunk goes into buf, which
+// holds TSLOG_CHUNK_MAX_SIZE bytes
+static chunk_status_t read_chunk(const tslog_t *log, uint32_t sector, uint32_t off, uint8_t *buf, chunk_hdr_t *hdr)
+{
+    if (off + TSLOG_CHUNK_HDR_SIZE > TSLOG_SECTOR_SIZE)
+    {
+        return CHUNK_END;
+    }
+    uint32_t base = sector * TSLOG_SECTOR_SIZE + off;
+    if (!log->flash->read(log->flash->ctx, base, buf, TSLOG_CHUNK_HDR_SIZE))
+    {
+        return CHUNK_CORRUPT;
+    }
+    hdr->len = (uint16_t)(buf[0] | buf[1] << 8);
+    hdr->count = buf[2];
+    hdr->marker = buf[3];
+    hdr->t_first = get_le32(buf + 4);
+    hdr->t_last = get_le32(buf + 8);
+    hdr->crc = get_le32(buf + 12);
+    if (hdr->len == 0xFFFF && hdr->count == 0xFF && hdr->marker == 0xFF)
+    {
+        return CHUNK_END;
+    }
+
+    size_t size = TSLOG_CHUNK_HDR_SIZE + hdr->len;
+    if (hdr->marker != CHUNK_MARKER || hdr->count == 0 || hdr->count > TSLOG_CHUNK_RECORDS ||
+        size > TSLOG_CHUNK_MAX_SIZE || off + size > TSLOG_SECTOR_SIZE ||
+        !log->flash->read(log->flash->ctx, base + TSLOG_CHUNK_HDR_SIZE, buf + TSLOG_CHUNK_HDR_SIZE, hdr->len))
+    {
+        return CHUNK_CORRUPT;
+    }
+    uint32_t crc = crc32_update(0, buf, 12);
+    crc = crc32_update(crc, buf + TSLOG_CHUNK_HDR_SIZE, hdr->len);
+    return crc == hdr->crc ? CHUNK_OK : CHUNK_CORRUPT;
+}
+
+// Bit-packed payload, most significant bit first. The payload area is
+// zeroed when a chunk starts, so bits are only ever set
+static void put_bits(uint8_t *payload, uint32_t *pos, uint32_t value, unsigned n)
+{
+    while (n--)
+    {
+        if (value >> n & 1)
+        {
+            payload[*pos >> 3] |= (uint8_t)(0x80 >> (*pos & 7));
+        }
+        (*pos)++;
+    }
+}
+
+static bool get_bits(const uint8_t *payload, uint32_t *pos, uint32_t end, unsigned n, uint32_t *value)
+{
+    if (end - *pos < n)
+    {
+        return false;
+    }
+    uint32_t v = 0;
+    while (n--)
+    {
+        v = v << 1 | (payload[*pos >> 3] >> (7 - (*pos & 7)) & 1);
+        (*pos)++;
+    }
+    *value = v;
+    return true;
+}
+
+// A delta-of-delta, zigzag-mapped so that small negative ones are small
+static void put_dod(uint8_t *payload, uint32_t *pos, uint32_t dod)
+{
+    uint32_t zz = dod << 1 ^ (uint32_t)((int32_t)dod >> 31);
+    if (zz == 0)
+    {
+        put_bits(payload, pos, 0x0, 1);
+    }
+    else if (zz < 1u << 7)
+    {
+        put_bits(payload, pos, 0x2, 2);
+        put_bits(payload, pos, zz, 7);
+    }
+    else if (zz < 1u << 9)
+    {
+        put_bits(payload, pos, 0x6, 3);
+        put_bits(payload, pos, zz, 9);
+    }
+    else if (zz < 1u << 12)
+    {
+        put_bits(payload, pos, 0xE, 4);
+        put_bits(payload, pos, zz, 12);
+    }
+    else
+    {
+        put_bits(payload, pos, 0xF, 4);
+        put_bits(payload, pos, zz, 32);
+    }
+}
+
+static bool get_dod(const uint8_t *payload, uint32_t *pos, uint32_t end, uint32_t *dod)
+{
+    static const unsigned widths[] = {7, 9, 12, 32};
+    uint32_t bit, zz = 0;
+    unsigned ones = 0;
+    // The prefix is up to four ones, ended by a zero before the fourth
+    while (ones < 4)
+    {
+        if (!get_bits(payload, pos, end, 1, &bit))
+        {
+            return false;
+        }
+        if (bit == 0)
+        {
+            break;
+        }
+        ones++;
+    }
+    if (ones > 0 && !get_bits(payload, pos, end, widths[ones - 1], &zz))
+    {
+        return false;
+    }
+    *dod = zz >> 1 ^ -(zz & 1);
+    return true;
+}
+
+// Codes one value against the previous one and its delta; the arithmetic
+// wraps, so any int32 sequence round-trips
+static void encode_value(uint8_t *payload, uint32_t *pos, uint32_t value, uint32_t *prev, uint32_t *prev_delta)
+{
+    uint32_t delta = value - *prev;
+    put_dod(payload, pos, delta - *prev_delta);
+    *prev = value;
+    *prev_delta = delta;
+}
+
+static bool decode_value(const uint8_t *payload, uint32_t *pos, uint32_t end, uint32_t *prev, uint32_t *prev_delta)
+{
+    uint32_t dod;
+    if (!get_dod(payload, pos, end, &dod))
+    {
+        return false;
+    }
+    *prev_delta += dod;
+    *prev += *prev_delta;
+    return true;
+}
+
+// Decodes the next record of a chunk payload
+static bool decode_record(const uint8_t *payload, uint32_t *pos, uint32_t end, bool first, tslog_delta_t *d,
+                          tslog_record_t *rec)
+{
+    if (first)
+    {
+        *d = (tslog_delta_t){0};
+        if (!get_bits(payload, pos, end, 32, &d->t))
+        {
+            return false;
+        }
+        for (int i = 0; i < TSLOG_FIELDS; i++)
+        {
+            if (!get_bits(payload, pos, end, 32, &d->v[i]))
+            {
+                return false;
+            }
+        }
+    }
+    else
+    {
+        if (!decode_value(payload, pos, end, &d->t, &d->dt))
+        {
+            return false;
+        }
+        for (int i = 0; i < TSLOG_FIELDS; i++)
+        {
+            if (!decode_value(payload, pos, end, &d->v[i], &d->dv[i]))
+            {
+                return false;
+            }
+        }
+    }
+    rec->t = d->t;
+    for (int i = 0; i < TSLOG_FIELDS; i++)
+    {
+        rec->v[i] = (int32_t)d->v[i];
+    }
+    return true;
+}
+
+static void reset_chunk(tslog_t *log)
+{
+    log->count = 0;
+    log->bits = 0;
+}
+
+bool tslog_mount(tslog_t *log, const tslog_flash_t *flash)
+{
+    memset(log, 0, sizeof(*log));
+    log->flash = flash;
+    log->sectors = flash->size / TSLOG_SECTOR_SIZE;
+    if (log->sectors < 2 || log->sectors > TSLOG_MAX_SECTORS)
+    {
+        return false;
+    }
+
+    // The newest sector has the highest sequence number
+    bool found = false;
+    for (uint32_t s = 0; s < log->sectors; s++)
+    {
+        sector_hdr_t hdr;
+        if (read_sector_hdr(log, s, &hdr) && (!found || (int32_t)(hdr.seq - log->head_seq) > 0))
+        {
+            log->head = s;
+            log->head_seq = hdr.seq;
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        return true; // Empty
+    }
+
+    // The log runs back from it as long as the sequence numbers do
+    for (uint32_t k = 0; k < log->sectors; k++)
+    {
+        uint32_t s = (log->head + log->sectors - k) % log->sectors;
+        sector_hdr_t hdr;
+        if (!read_sector_hdr(log, s, &hdr) || hdr.seq != log->head_seq - k)
+        {
+            break;
+        }
+        log->t_first[s] = hdr.t_first;
+        log->tail = s;
+        log->used++;
+    }
+
+    // Appending continues after the last good chunk of the newest sector.
+    // Without one, the sector's first timestamp bounds what may follow
+    log->last_t = log->t_first[log->head];
+    log->have_last = true;
+    uint32_t off = SECTOR_HDR_SIZE;
+    for (;;)
+    {
+        chunk_hdr_t hdr;
+        chunk_status_t status = read_chunk(log, log->head, off, log->chunk, &hdr);
+        if (status == CHUNK_END)
+        {
+            break;
+        }
+        if (status == CHUNK_CORRUPT)
+        {
+            off = TSLOG_SECTOR_SIZE;
+            break;
+        }
+        log->last_t = hdr.t_last;
+        off += TSLOG_CHUNK_HDR_SIZE + hdr.len;
+    }
+    log->head_off = off;
+    reset_chunk(log);
+    return true;
+}
+
+// Erases the sector after the head, dropping the oldest one if the ring is
+// full, and makes it the head
+static bool open_sector(tslog_t *log, uint32_t t_first)
+{
+    uint32_t next = log->used == 0 ? 0 : (log->head + 1) % log->sectors;
+    if (log->used == log->sectors)
+    {
+        log->tail = (log->tail + 1) % log->sectors;
+        log->used--;
+    }
+    if (!log->flash->erase(log->flash->ctx, next * TSLOG_SECTOR_SIZE, TSLOG_SECTOR_SIZE))
+    {
+        return false;
+    }
+    log->stats.erases++;
+
+    uint8_t raw[SECTOR_HDR_SIZE];
+    put_le32(raw, SECTOR_MAGIC);
+    put_le32(raw + 4, log->head_seq + 1);
+    put_le32(raw + 8, t_first);
+    put_le32(raw + 12, crc32_update(0, raw, 12));
+    if (!log->flash->write(log->flash->ctx, next * TSLOG_SECTOR_SIZE, raw, sizeof(raw)))
+    {
+        return false;
+    }
+
+    if (log->used == 0)
+    {
+        log->tail = next;
+    }
+    log->head = next;
+    log->head_seq++;
+    log->head_off = SECTOR_HDR_SIZE;
+    log->t_first[next] = t_first;
+    log->used++;
+    return true;
+}
+
+bool tslog_flush(tslog_t *log)
+{
+    if (log->count == 0)
+    {
+        return true;
+    }
+
+    uint32_t len = (log->bits + 7) / 8;
+    uint32_t size = TSLOG_CHUNK_HDR_SIZE + len;
+    bool ok = true;
+    if (log->used == 0 || log->head_off + size > TSLOG_SECTOR_SIZE)
+    {
+        ok = open_sector(log, log->chunk_t_first);
+    }
+    if (ok)
+    {
+        uint8_t *hdr = log->chunk;
+        hdr[0] = (uint8_t)len;
+        hdr[1] = (uint8_t)(len >> 8);
+        hdr[2] = (uint8_t)log->count;
+        hdr[3] = CHUNK_MARKER;
+        put_le32(hdr + 4, log->chunk_t_first);
+        put_le32(hdr + 8, log->last_t);
+        uint32_t crc = crc32_update(0, hdr, 12);
+        put_le32(hdr + 12, crc32_update(crc, hdr + TSLOG_CHUNK_HDR_SIZE, len));
+
+        ok = log->flash->write(log->flash->ctx, log->head * TSLOG_SECTOR_SIZE + log->head_off, log->chunk, size);
+        if (ok)
+        {
+            log->head_off += size;
+            log->stats.chunks++;
+            log->stats.bytes += size;
+        }
+        else
+        {
+            // Whatever got written would end the sector at mount anyway
+            log->head_off = TSLOG_SECTOR_SIZE;
+        }
+    }
+    if (!ok)
+    {
+        log->stats.failures++;
+    }
+    reset_chunk(log);
+    return ok;
+}
+
+bool tslog_append(tslog_t *log, const tslog_record_t *rec)
+{
+    if (log->have_last && rec->t < log->last_t)
+    {
+        log->stats.rejected++;
+        return false;
+    }
+
+    uint8_t *payload = log->chunk + TSLOG_CHUNK_HDR_SIZE;
+    tslog_delta_t *d = &log->delta;
+    if (log->count == 0)
+    {
+        memset(payload, 0, sizeof(log->chunk) - TSLOG_CHUNK_HDR_SIZE);
+        put_bits(payload, &log->bits, rec->t, 32);
+        for (int i = 0; i < TSLOG_FIELDS; i++)
+        {
+            put_bits(payload, &log->bits, (uint32_t)rec->v[i], 32);
+        }
+        *d = (tslog_delta_t){.t = rec->t};
+        for (int i = 0; i < TSLOG_FIELDS; i++)
+        {
+            d->v[i] = (uint32_t)rec->v[i];
+        }
+        log->chunk_t_first = rec->t;
+    }
+    else
+    {
+        encode_value(payload, &log->bits, rec->t, &d->t, &d->dt);
+        for (int i = 0; i < TSLOG_FIELDS; i++)
+        {
+            encode_value(payload, &log->bits, (uint32_t)rec->v[i], &d->v[i], &d->dv[i]);
+        }
+    }
+    log->count++;
+    log->last_t = rec->t;
+    log->have_last = true;
+    log->stats.records++;
+
+    if (log->count == TSLOG_CHUNK_RECORDS)
+    {
+        return tslog_flush(log);
+    }
+    return true;
+}
+
+bool tslog_last_time(const tslog_t *log, uint32_t *t)
+{
+    *t = log->last_t;
+    return log->have_last;
+}
+
+// Sector of the k-th oldest sector in use
+static uint32_t sector_at(const tslog_t *log, uint32_t k)
+{
+    return (log->tail + k) % log->sectors;
+}
+
+void tslog_iter_begin(const tslog_t *log, tslog_iter_t *it, uint32_t from, uint32_t to)
+{
+    memset(it, 0, sizeof(*it));
+    it->log = log;
+    it->from = from;
+    it->to = to;
+    it->done = from > to;
+    it->off = SECTOR_HDR_SIZE;
+    if (log->used == 0)
+    {
+        it->in_ram = true;
+        return;
+    }
+
+    // Records before from may only be in the last sector that starts
+    // before it; with none, the query starts at the oldest
+    uint32_t lo = 0, hi = log->used - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (log->t_first[sector_at(log, mid)] < from)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    it->seq = log->head_seq - (log->used - 1 - lo);
+}
+
+// Loads the next chunk that may hold records in the range
+static bool next_chunk(tslog_iter_t *it)
+{
+    const tslog_t *log = it->log;
+    while (!it->in_ram)
+    {
+        // The sector may have been reused since the last chunk was read: its
+        // records are gone, so the query goes on at the oldest sector left
+        uint32_t behind = log->head_seq - it->seq;
+        if (behind >= log->used)
+        {
+            if (log->used == 0)
+            {
+                return false;
+            }
+            uint32_t tail_seq = log->head_seq - (log->used - 1);
+            it->lost += tail_seq - it->seq;
+            it->seq = tail_seq;
+            it->off = SECTOR_HDR_SIZE;
+            continue;
+        }
+        uint32_t sector = (log->head + log->sectors - behind) % log->sectors;
+        if (it->off == SECTOR_HDR_SIZE)
+        {
+            sector_hdr_t hdr;
+            if (!read_sector_hdr(log, sector, &hdr) || hdr.seq != it->seq)
+            {
+                return false;
+            }
+        }
+
+        chunk_hdr_t hdr;
+        chunk_status_t status = read_chunk(log, sector, it->off, it->chunk, &hdr);
+        if (status != CHUNK_OK)
+        {
+            // On to the next sector, or to the records in RAM after the newest
+            it->in_ram = behind == 0;
+            it->seq++;
+            it->off = SECTOR_HDR_SIZE;
+            continue;
+        }
+        it->off += TSLOG_CHUNK_HDR_SIZE + hdr.len;
+        if (hdr.t_first > it->to)
+        {
+            return false;
+        }
+        if (hdr.t_last < it->from)
+        {
+            continue;
+        }
+        it->bits = 0;
+        it->end = hdr.len * 8;
+        it->left = hdr.count;
+        it->first = true;
+        return true;
+    }
+
+    // Copied once: records appended after this are not part of the query
+    if (it->ram_read || log->count == 0 || log->last_t < it->from || log->chunk_t_first > it->to)
+    {
+        return false;
+    }
+    it->ram_read = true;
+    memcpy(it->chunk, log->chunk, sizeof(it->chunk));
+    it->bits = 0;
+    it->end = log->bits;
+    it->left = log->count;
+    it->first = true;
+    return true;
+}
+
+bool tslog_iter_next(tslog_iter_t *it, tslog_record_t *rec)
+{
+    while (!it->done)
+    {
+        if (it->left == 0 && !next_chunk(it))
+        {
+            it->done = true;
+            break;
+        }
+
+        const uint8_t *payload = it->chunk + TSLOG_CHUNK_HDR_SIZE;
+        if (!decode_record(payload, &it->bits, it->end, it->first, &it->delta, rec))
+        {
+            it->done = true;
+            break;
+        }
+        it->first = false;
+        it->left--;
+        if (rec->t > it->to)
+        {
+            it->done = true;
+            break;
+        }
+        if (rec->t >= it->from)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t tslog_iter_lost(const tslog_iter_t *it)
+{
+    return it->lost;
+}
+
+void tslog_get_stats(const tslog_t *log, tslog_stats_t *stats)
+{
+    *stats = log->stats;
+    stats->sectors = log->sectors;
+    stats->used = log->used;
+    stats->oldest_t = log->used > 0 ? log->t_first[log->tail] : (log->count > 0 ? log->chunk_t_first : 0);
+    stats->newest_t = log->have_last ? log->last_t : 0;
+    stats->pending = log->count;
+}
@@ -0,0 +1,223 @@
+/**
+ * @file tslog.h
+ * @brief Append-only time-series ring log on raw flash.
+ *
+ * Stores fixed-size records (a timestamp and TSLOG_FIELDS integer values)
+ * on a flash area divided into TSLOG_SECTOR_SIZE sectors, used as a ring:
+ * records are appended to the newest sector, and when the area is full
+ * the oldest sector is erased and reused. Every sector is erased once per
+ * trip around the ring, so wear is spread evenly over the whole area.
+ *
+ * Records are compressed in chunks of up to TSLOG_CHUNK_RECORDS, the way
+ * Gorilla does it: the first record of a chunk is stored as is, and every
+ * following timestamp and value as its delta-of-delta, which is zero for
+ * a steady interval and an unchanged or steadily moving value. A zero
+ * takes one bit, small ones a prefix and 7, 9 or 12 bits, anything else
+ * a prefix and 32 bits. A chunk is built in RAM and written with its
+ * header and CRC in one go when it is full or on tslog_flush(); records
+ * not flushed yet are lost on a reset.
+ *
+ * Every sector header holds the timestamp of its first record, and the
+ * log keeps these in RAM as a time index: a range query finds its first
+ * sector with a binary search and skips chunks by their headers, so it
+ * only decodes chunks that overlap the range.
+ *
+ * Timestamps must never decrease. The module has no ESP-IDF dependencies:
+ * it reaches the flash through tslog_flash_t, so it runs on the host over
+ * a file as well as on the device over a partition. It is not thread-safe.
+ */
+
+#ifndef TSLOG_H
+#define TSLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Values per record.
+#define TSLOG_FIELDS 4
+
+// Erase unit of the flash; the area is a whole number of sectors.
+#define TSLOG_SECTOR_SIZE 4096
+
+// Largest area, in sectors, that the time index covers.
+#define TSLOG_MAX_SECTORS 512
+
+// Records per chunk: more compress better, fewer lose less on a reset.
+#define TSLOG_CHUNK_RECORDS 32
+
+// Chunk header and the worst case of its payload: a plain record, then
+// up to 4 + 32 bits per timestamp and value.
+#define TSLOG_CHUNK_HDR_SIZE 16
+#define TSLOG_CHUNK_MAX_SIZE                                                               \
+    (TSLOG_CHUNK_HDR_SIZE + 4 * (1 + TSLOG_FIELDS) +                                      \
+     ((TSLOG_CHUNK_RECORDS - 1) * (1 + TSLOG_FIELDS) * 36 + 7) / 8)
+
+/**
+ * @brief One record.
+ */
+typedef struct
+{
+    uint32_t t; // Seconds on the caller's clock
+    int32_t v[TSLOG_FIELDS];
+} tslog_record_t;
+
+/**
+ * @brief Access to the flash area; each function returns false on an error.
+ *
+ * Writes only ever go to erased bytes, and erases are whole sectors.
+ */
+typedef struct
+{
+    void *ctx;
+    uint32_t size; // Of the area, in bytes
+    bool (*read)(void *ctx, uint32_t offset, void *buf, size_t len);
+    bool (*write)(void *ctx, uint32_t offset, const void *buf, size_t len);
+    bool (*erase)(void *ctx, uint32_t offset, size_t len);
+} tslog_flash_t;
+
+/**
+ * @brief Counters and the extent of the log, see tslog_get_stats().
+ */
+typedef struct
+{
+    uint32_t sectors;   // In the area
+    uint32_t used;      // Holding records
+    uint32_t oldest_t;  // First record kept, if there is one
+    uint32_t newest_t;  // Last record appended, pending ones included
+    uint32_t pending;   // Records not flushed yet
+    uint32_t records;   // Appended since the log was mounted
+    uint32_t chunks;    // Written since then
+    uint32_t bytes;     // Flash bytes written for them, headers included
+    uint32_t erases;    // Sectors erased
+    uint32_t rejected;  // Records older than the last one
+    uint32_t failures;  // Flash errors; each loses the chunk being written
+} tslog_stats_t;
+
+/**
+ * @brief Delta-of-delta coding state of a chunk.
+ */
+typedef struct
+{
+    uint32_t t, dt;
+    uint32_t v[TSLOG_FIELDS], dv[TSLOG_FIELDS];
+} tslog_delta_t;
+
+/**
+ * @brief Log instance; treat as opaque.
+ */
+typedef struct
+{
+    const tslog_flash_t *flash;
+    uint32_t sectors;
+    uint32_t head;     // Sector being appended to
+    uint32_t head_seq; // Its sequence number; sectors are numbered as they are opened
+    uint32_t head_off; // Where its next chunk goes; TSLOG_SECTOR_SIZE when full
+    uint32_t tail;     // Oldest sector in use
+    uint32_t used;     // Sectors in use, 0 for an empty log
+    uint32_t last_t;
+    bool have_last;
+    uint32_t t_first[TSLOG_MAX_SECTORS]; // Time index: first timestamp of each sector
+
+    // The chunk being built; the header is filled in when it is written
+    uint8_t chunk[TSLOG_CHUNK_MAX_SIZE];
+    uint32_t bits; // Of payload
+    uint32_t count;
+    uint32_t chunk_t_first;
+    tslog_delta_t delta;
+
+    tslog_stats_t stats;
+} tslog_t;
+
+/**
+ * @brief A range query in progress; treat as opaque.
+ */
+typedef struct
+{
+    const tslog_t *log;
+    uint32_t from, to;
+    uint32_t seq;      // Sector being read, by sequence number: it may move or be reused
+    uint32_t off;      // Next chunk in it
+    bool in_ram;       // Past the flash, at the chunk that is not flushed yet
+    bool ram_read;     // ...which has been copied
+    bool done;
+    uint8_t chunk[TSLOG_CHUNK_MAX_SIZE];
+    uint32_t bits;     // Of payload read so far
+    uint32_t end;      // Of payload in the chunk
+    uint32_t left;     // Records left in the chunk
+    uint32_t lost;     // Sectors erased by the ring before they were read
+    bool first;        // The next record is the chunk's first
+    tslog_delta_t delta;
+} tslog_iter_t;
+
+/**
+ * @brief Mounts the log stored in a flash area, or an empty one.
+ *
+ * Reads every sector header to rebuild the time index, then the chunk
+ * headers of the newest sector to find where appending continues. A
+ * chunk left incomplete by a reset ends that sector; appending goes on
+ * in the next.
+ *
+ * @param flash The area; must stay valid while the log is used.
+ * @return False if the area is smaller than two sectors or larger than
+ *         TSLOG_MAX_SECTORS, or cannot be read.
+ */
+bool tslog_mount(tslog_t *log, const tslog_flash_t *flash);
+
+/**
+ * @brief Appends a record.
+ *
+ * Writes the chunk once it holds TSLOG_CHUNK_RECORDS records, erasing the
+ * next sector first when the current one is full.
+ *
+ * @return False if the record is older than the last one, or writing the
+ *         chunk failed.
+ */
+bool tslog_append(tslog_t *log, const tslog_record_t *rec);
+
+/**
+ * @brief Writes the records that are still in RAM.
+ *
+ * @return False if writing failed; the records are then lost.
+ */
+bool tslog_flush(tslog_t *log);
+
+/**
+ * @brief Tells the timestamp of the last record, pending ones included.
+ *
+ * @return False if the log is empty.
+ */
+bool tslog_last_time(const tslog_t *log, uint32_t *t);
+
+/**
+ * @brief Starts a query of the records with from <= t <= to.
+ *
+ * The log may be appended to between calls of tslog_iter_next(); records
+ * appended before the query reaches the end of the log are returned too
+ * if they are in the range. If the ring wraps around onto the sector
+ * being read, the records it held are lost to the query, which goes on
+ * at the oldest sector left; tslog_iter_lost() tells how many sectors
+ * were skipped.
+ */
+void tslog_iter_begin(const tslog_t *log, tslog_iter_t *it, uint32_t from, uint32_t to);
+
+/**
+ * @brief Gets the next record of a query, oldest first.
+ *
+ * @return False when there are no more.
+ */
+bool tslog_iter_next(tslog_iter_t *it, tslog_record_t *rec);
+
+/**
+ * @brief Tells how many sectors a query lost to the ring wrapping around.
+ *
+ * @return 0 if every record in the range was returned.
+ */
+uint32_t tslog_iter_lost(const tslog_iter_t *it);
+
+/**
+ * @brief Gets the counters and the extent of the log.
+ */
+void tslog_get_stats(const tslog_t *log, tslog_stats_t *stats);
+
+#endif // TSLOG_H
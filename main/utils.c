@@ -4,69 +4,247 @@
  */
 
 #include "utils.h"
-#include <stdio.h> // For snprintf
+#include <stdint.h>
+#include <string.h>
 
-void json_escape(const char *str, char *out, size_t out_size)
+static const char hex_digits[] = "0123456789abcdef";
+
+// Word-at-a-time byte tests on 32-bit words, see "Bit Twiddling Hacks":
+// a nonzero result means at least one byte of x matches
+#define ONES 0x01010101u
+#define HIGHS 0x80808080u
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+#define HAS_LESS(x, n) (((x) - ONES * (n)) & ~(x) & HIGHS)
+#define HAS_BYTE(x, b) HAS_ZERO((x) ^ (ONES * (b)))
+
+static inline int needs_escape(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+}
+
+static inline size_t plain_prefix(const char *str, size_t len)
 {
-    if (!str || !out || out_size == 0)
+    size_t i = 0;
+
+    // Bytewise up to the first aligned word
+    while (i < len && ((uintptr_t)(str + i) & 3) != 0)
     {
-        if (out && out_size > 0) out[0] = '\0';
-        return;
+        if (needs_escape((unsigned char)str[i]))
+        {
+            return i;
+        }
+        i++;
     }
 
-    size_t j = 0;
-    for (size_t i = 0; str[i] && j < out_size - 6; i++) // -6 for worst case \uXXXX and null
+    // Skip whole words of plain ASCII
+    while (len - i >= 4)
     {
-        char c = str[i];
-        switch (c)
+        uint32_t x;
+        memcpy(&x, __builtin_assume_aligned(str + i, 4), 4);
+        if ((x & HIGHS) | HAS_LESS(x, 0x20) | HAS_BYTE(x, '"') | HAS_BYTE(x, '\\'))
         {
-        case '"':
-            out[j++] = '\\';
-            out[j++] = '"';
-            break;
-        case '\\':
-            out[j++] = '\\';
-            out[j++] = '\\';
-            break;
-        case '\b':
-            out[j++] = '\\';
-            out[j++] = 'b';
-            break;
-        case '\f':
-            out[j++] = '\\';
-            out[j++] = 'f';
-            break;
-        case '\n':
-            out[j++] = '\\';
-            out[j++] = 'n';
             break;
-        case '\r':
-            out[j++] = '\\';
-            out[j++] = 'r';
-            break;
-        case '\t':
-            out[j++] = '\\';
-            out[j++] = 't';
-            break;
-        default:
-            // Control characters and other non-printables
-            if (c < 32)
+        }
+        i += 4;
+    }
+
+    // The word that stopped the scan, or the tail
+    while (i < len && !needs_escape((unsigned char)str[i]))
+    {
+        i++;
+    }
+    return i;
+}
+
+size_t json_plain_prefix(const char *str, size_t len)
+{
+    return plain_prefix(str, len);
+}
+
+// Length of the valid UTF-8 sequence at the start of s, 0 if invalid
+static size_t utf8_sequence(const unsigned char *s, size_t len)
+{
+    unsigned char c = s[0];
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF; // Range of the second byte
+
+    if (c >= 0xC2 && c <= 0xDF)
+    {
+        n = 2;
+    }
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        n = 3;
+        if (c == 0xE0) lo = 0xA0;      // No overlong forms
+        if (c == 0xED) hi = 0x9F;      // No surrogates
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        n = 4;
+        if (c == 0xF0) lo = 0x90;      // No overlong forms
+        if (c == 0xF4) hi = 0x8F;      // Nothing above U+10FFFF
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (len < n || s[1] < lo || s[1] > hi)
+    {
+        return 0;
+    }
+    for (size_t i = 2; i < n; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// Escapes an ASCII character, see json_escape_char()
+static inline size_t escape_ascii(unsigned char c, char *out)
+{
+    out[0] = '\\';
+    switch (c)
+    {
+    case '"': out[1] = '"'; return 2;
+    case '\\': out[1] = '\\'; return 2;
+    case '\b': out[1] = 'b'; return 2;
+    case '\f': out[1] = 'f'; return 2;
+    case '\n': out[1] = 'n'; return 2;
+    case '\r': out[1] = 'r'; return 2;
+    case '\t': out[1] = 't'; return 2;
+    default:
+        if (c >= 0x20)
+        {
+            out[0] = (char)c;
+            return 1;
+        }
+        out[1] = 'u';
+        out[2] = '0';
+        out[3] = '0';
+        out[4] = hex_digits[c >> 4];
+        out[5] = hex_digits[c & 0xF];
+        return 6;
+    }
+}
+
+size_t json_escape_char(const char *str, size_t len, char *out, size_t *used)
+{
+    unsigned char c = (unsigned char)str[0];
+    *used = 1;
+
+    if (c >= 0x80)
+    {
+        size_t n = utf8_sequence((const unsigned char *)str, len);
+        if (n > 0)
+        {
+            memcpy(out, str, n);
+            *used = n;
+            return n;
+        }
+        memcpy(out, "\\ufffd", 6);
+        return 6;
+    }
+    return escape_ascii(c, out);
+}
+
+size_t json_escape(const char *str, char *out, size_t out_size)
+{
+    if (out == NULL || out_size == 0)
+    {
+        out_size = 0;
+    }
+    if (str == NULL)
+    {
+        if (out_size > 0) out[0] = '\0';
+        return 0;
+    }
+
+    size_t len = strlen(str);
+    size_t room = out_size > 0 ? out_size - 1 : 0;
+    size_t written = 0; // Bytes in out
+    size_t needed = 0;  // Bytes the complete output takes
+    size_t i = 0;
+
+    while (i < len)
+    {
+        // Escapes come in clusters: a short run between two is checked
+        // byte by byte, only a longer one is worth scanning by the word
+        size_t plain = 0;
+        while (plain < 8 && i + plain < len && !needs_escape((unsigned char)str[i + plain]))
+        {
+            plain++;
+        }
+        if (plain == 8)
+        {
+            plain += plain_prefix(str + i + 8, len - i - 8);
+        }
+        if (plain > 0)
+        {
+            if (needed == written)
+            {
+                // Plain runs can be cut anywhere, they are ASCII
+                size_t n = plain < room - written ? plain : room - written;
+                if (n <= 8)
+                {
+                    for (size_t k = 0; k < n; k++) out[written + k] = str[i + k];
+                }
+                else
+                {
+                    memcpy(out + written, str + i, n);
+                }
+                written += n;
+            }
+            needed += plain;
+            i += plain;
+            if (i == len)
+            {
+                break;
+            }
+        }
+
+        unsigned char c = (unsigned char)str[i];
+        size_t used = 1;
+        size_t n;
+        if (needed == written && room - written >= JSON_ESCAPE_MAX)
+        {
+            // Room for the longest escape: write it in place
+            if (c < 0x80)
+            {
+                n = escape_ascii(c, out + written);
+            }
+            else if ((used = utf8_sequence((const unsigned char *)str + i, len - i)) > 0)
             {
-                j += snprintf(&out[j], out_size - j, "\\u%04x", (unsigned int)c);
+                for (n = 0; n < used; n++) out[written + n] = str[i + n];
             }
             else
             {
-                out[j++] = c;
+                used = 1;
+                n = 6;
+                memcpy(out + written, "\\ufffd", 6);
             }
+            written += n;
         }
+        else
+        {
+            char esc[JSON_ESCAPE_MAX];
+            n = json_escape_char(str + i, len - i, esc, &used);
+            if (needed == written && n <= room - written)
+            {
+                memcpy(out + written, esc, n);
+                written += n;
+            }
+        }
+        needed += n;
+        i += used;
     }
-    // Ensure null termination
-    if (j < out_size)
-    {
-        out[j] = '\0';
-    }
-    else
+
+    if (out_size > 0)
     {
-        out[out_size - 1] = '\0';
+        out[written] = '\0';
     }
+    return needed;
 }
@@ -8,17 +8,50 @@
 
 #include <stddef.h>
 
+// Longest output of json_escape_char(): a \uXXXX escape.
+#define JSON_ESCAPE_MAX 6
+
 /**
  * @brief Escapes a string for inclusion in a JSON document.
  *
- * This function takes a raw string and produces a new string where special
- * characters (like quotes, backslashes, and newlines) are properly escaped
- * according to JSON string standards.
+ * Quotes, backslashes and control characters are escaped, valid UTF-8 is
+ * copied as is and invalid UTF-8 bytes are replaced with \ufffd. Runs of
+ * characters that need no escaping are found a word at a time and copied
+ * in bulk.
+ *
+ * Like snprintf, the return value is the length the complete escaped
+ * string needs; the output was truncated if it is out_size or more. A
+ * truncated output never ends in the middle of an escape sequence or a
+ * multi-byte character, and is always null-terminated.
  *
  * @param[in]  str The input string to escape.
  * @param[out] out The output buffer to write the escaped string to.
  * @param[in]  out_size The size of the output buffer.
+ * @return The length of the complete escaped string, without the terminator.
+ */
+size_t json_escape(const char *str, char *out, size_t out_size);
+
+/**
+ * @brief Finds how many leading bytes can be copied into a JSON string as is.
+ *
+ * Stops at the first quote, backslash, control character or non-ASCII
+ * byte; pass what it stopped at to json_escape_char().
+ *
+ * @param str The input, not necessarily null-terminated.
+ * @param len The length of the input.
+ * @return The number of leading bytes that need no escaping.
+ */
+size_t json_plain_prefix(const char *str, size_t len);
+
+/**
+ * @brief Escapes the character at the start of a string.
+ *
+ * @param[in]  str The input, at least one byte.
+ * @param[in]  len The length of the input.
+ * @param[out] out Receives up to JSON_ESCAPE_MAX bytes.
+ * @param[out] used The number of input bytes consumed.
+ * @return The number of bytes written to out.
  */
-void json_escape(const char *str, char *out, size_t out_size);
+size_t json_escape_char(const char *str, size_t len, char *out, size_t *used);
 
 #endif // UTILS_H
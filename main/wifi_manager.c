@@ -7,23 +7,581 @@
 #include "app_includes.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
-#include "freertos/event_groups.h"
-#include "app_task.h" // For app_task_queue_post
-#include "utils.h"    // For json_escape
+#include "esp_mac.h"
+#include "freertos/semphr.h"
+#include "esp_random.h"
+#include "app_task.h" // For app_task_request_status
+#include "json_writer.h"
+#include "device_state.h"
+#include "wifi_sm.h"
+#include "nvs_storage.h"
+#include "scan_store.h"
+#include "scan_sched.h"
+#include <limits.h>
 
 static const char *TAG = "WIFI_MANAGER";
 
-#define MAX_NETWORKS 5
-#define SCAN_CACHE_DURATION_MS 30000
+#define MAX_NETWORKS 5 // In status() and scan replies; networks() pages through all of them
+#define SCAN_CACHE_DURATION_MS 30000 // A connect_known() older than this scans first
+#define ROAM_MARGIN_DB 8              // How much stronger another AP must be to be a roaming candidate
 
-// Module-level static variables
-static bool scan_in_progress = false;
-static int64_t last_scan_time = 0;
-static char cached_networks_json[512] = {0};
+// Requests to the state machine, posted to the default event loop so that
+// it only ever runs there, in order with the driver events
+ESP_EVENT_DEFINE_BASE(WIFI_MANAGER_EVENT);
+
+enum
+{
+    SM_REQ_CONNECT,       // Data: connect_request_t
+    SM_REQ_CONNECT_KNOWN, // Data: int, nonzero to keep retrying
+    SM_REQ_RETRY,         // Start the next attempt now, the driver is configured for it
+    SM_REQ_DISCONNECT,
+    SM_REQ_SCAN,          // A caller wants a scan; merged with any pending or running one
+    SM_REQ_SCHED_TICK,    // Sample the RSSI and start a scan that is due
+    SM_REQ_TIMEOUT,       // Data: uint32_t, generation of the timer that fired
+};
+
+typedef struct
+{
+    char ssid[33];
+    char password[65];
+} candidate_t;
+
+typedef struct
+{
+    candidate_t network;
+    int keep_trying; // Nonzero to keep retrying
+} connect_request_t;
+
+#define SM_POST_WAIT_MS 100
+
+// Module-level static variables; the scan state lives in device_state and
+// the result in scan_store
+static wifi_manager_listener_t listener = NULL;
+
+// Connection state machine; the lock lets other tasks read its statistics
+static wifi_sm_t sm;
+static SemaphoreHandle_t sm_lock;
+static esp_timer_handle_t sm_timer;
+static volatile uint32_t sm_timer_gen; // Bumped whenever the timer is re-armed
+
+// Connect-time bookkeeping, under sm_lock like the state machine
+static bool hint_configured;  // The driver config targets the remembered AP
+static bool hint_failed;      // ...and that failed during this request
+static bool timing_connect;   // A requested connection is in progress
+static uint32_t connect_start_ms;
+static wifi_manager_connect_time_t last_connect;
+
+// Networks to try for the current request, best first; an explicit
+// wifi_manager_connect() is a list of one. Under sm_lock
+static candidate_t candidates[NVS_STORAGE_MAX_NETWORKS];
+static size_t candidate_count;
+static size_t candidate_index;
+static bool select_pending;   // Waiting for a scan to choose the candidates
+static int select_keep_trying;
+static bool failover_pending; // An SM_REQ_RETRY is queued and still wanted
+
+// Background scans, under sm_lock too: the scheduler must know what the
+// connection is doing, and starting a scan changes the state machine
+static scan_sched_t sched;
+static esp_timer_handle_t sched_timer;
 
 // Forward declaration for the event handler
 static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+static void collect_scan(void);
 static void build_networks_json(char *json_out, size_t max_size);
+static bool scan_is_fresh(void);
+
+static uint32_t now_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static bool sm_connect(void *ctx)
+{
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    }
+    return err == ESP_OK;
+}
+
+static void sm_disconnect(void *ctx)
+{
+    esp_wifi_disconnect();
+}
+
+static void sm_set_timer(void *ctx, uint32_t ms)
+{
+    esp_timer_stop(sm_timer);
+    sm_timer_gen++;
+    if (ms > 0)
+    {
+        esp_timer_start_once(sm_timer, (uint64_t)ms * 1000);
+    }
+}
+
+static uint32_t sm_random(void *ctx)
+{
+    return esp_random();
+}
+
+static void notify_listener(wifi_manager_event_t event, int reason);
+
+// Makes the next attempt scan every channel for the SSID
+static void drop_ap_hint(void)
+{
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) == ESP_OK)
+    {
+        wifi_config.sta.bssid_set = false;
+        wifi_config.sta.channel = 0;
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    }
+    hint_configured = false;
+    hint_failed = true;
+}
+
+static void record_connect_time(void)
+{
+    last_connect = (wifi_manager_connect_time_t){
+        .valid = true,
+        .fast = hint_configured,
+        .fell_back = hint_failed,
+        .candidate = candidate_index,
+        .total_ms = now_ms() - connect_start_ms,
+        .assoc_ms = sm.stats.phases[WIFI_SM_ASSOCIATING].last_ms,
+        .dhcp_ms = sm.stats.phases[WIFI_SM_DHCP].last_ms,
+    };
+    memcpy(last_connect.ssid, candidates[candidate_index].ssid, sizeof(last_connect.ssid));
+    timing_connect = false;
+    ESP_LOGI(TAG, "Connected to %s in %lu ms (%s): associating %lu ms, dhcp %lu ms",
+             last_connect.ssid, (unsigned long)last_connect.total_ms,
+             last_connect.fast ? "fast connect" : last_connect.fell_back ? "full scan after fast connect failed" : "full scan",
+             (unsigned long)last_connect.assoc_ms, (unsigned long)last_connect.dhcp_ms);
+}
+
+// Points the driver at a network; if it was found before, only the AP it
+// was found on is probed instead of scanning every channel. Under sm_lock
+static esp_err_t configure_candidate(const candidate_t *candidate)
+{
+    wifi_config_t wifi_config = {0};
+    strncpy((char *)wifi_config.sta.ssid, candidate->ssid, sizeof(wifi_config.sta.ssid) - 1);
+    strncpy((char *)wifi_config.sta.password, candidate->password, sizeof(wifi_config.sta.password) - 1);
+
+    nvs_storage_ap_hint_t hint;
+    hint_configured = nvs_storage_get_ap_hint(candidate->ssid, &hint);
+    if (hint_configured)
+    {
+        memcpy(wifi_config.sta.bssid, hint.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.bssid_set = true;
+        wifi_config.sta.channel = hint.channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        wifi_config.sta.threshold.authmode = hint.authmode;
+        ESP_LOGI(TAG, "Fast connect to %s at " MACSTR " on channel %u", candidate->ssid, MAC2STR(hint.bssid),
+                 hint.channel);
+    }
+    return esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+}
+
+// Whether network a should be tried before b
+static bool better_candidate(const nvs_storage_network_t *a, int rssi_a, const nvs_storage_network_t *b, int rssi_b)
+{
+    bool seen_a = rssi_a != INT_MIN, seen_b = rssi_b != INT_MIN;
+    if (seen_a != seen_b)
+    {
+        return seen_a;
+    }
+    if (a->priority != b->priority)
+    {
+        return a->priority > b->priority;
+    }
+    return seen_a ? rssi_a > rssi_b : a->last_success > b->last_success;
+}
+
+// Orders the known networks for a connection: those in the last scan come
+// first, by priority and then signal; the rest, which may be hidden, by
+// priority and then how recently they worked. Under sm_lock
+static size_t select_candidates(void)
+{
+    static nvs_storage_network_t known[NVS_STORAGE_MAX_NETWORKS]; // Off the event loop stack
+    int rssi[NVS_STORAGE_MAX_NETWORKS];
+    size_t order[NVS_STORAGE_MAX_NETWORKS];
+    size_t count = nvs_storage_get_networks(known, NVS_STORAGE_MAX_NETWORKS);
+    bool fresh = scan_is_fresh();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        scan_store_entry_t seen;
+        rssi[i] = fresh && scan_store_find(known[i].ssid, &seen) ? seen.rssi : INT_MIN; // INT_MIN: not seen
+
+        // Insertion sort, the list is tiny
+        size_t k = i;
+        while (k > 0 && better_candidate(&known[i], rssi[i], &known[order[k - 1]], rssi[order[k - 1]]))
+        {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const nvs_storage_network_t *net = &known[order[i]];
+        memcpy(candidates[i].ssid, net->ssid, sizeof(candidates[i].ssid));
+        memcpy(candidates[i].password, net->password, sizeof(candidates[i].password));
+        if (rssi[order[i]] != INT_MIN)
+        {
+            ESP_LOGI(TAG, "Candidate %u: %s (priority %u, rssi %d)", (unsigned)i, net->ssid, net->priority,
+                     rssi[order[i]]);
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Candidate %u: %s (priority %u, not seen)", (unsigned)i, net->ssid, net->priority);
+        }
+    }
+    return count;
+}
+
+// Starts a request on the first candidate; under sm_lock
+static void start_candidates(int keep_trying)
+{
+    failover_pending = false;
+    candidate_index = 0;
+    esp_wifi_disconnect();
+    esp_err_t err = configure_candidate(&candidates[0]);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set WiFi config: %s", esp_err_to_name(err));
+        wifi_sm_handle(&sm, WIFI_SM_EV_DISCONNECT, 0, now_ms());
+        timing_connect = false;
+        notify_listener(WIFI_MANAGER_EVT_CONNECT_FAILED, WIFI_SM_REASON_START_FAILED);
+        return;
+    }
+    wifi_sm_handle(&sm, WIFI_SM_EV_CONNECT, keep_trying, now_ms());
+}
+
+// Chooses the candidates from the last scan and starts; under sm_lock
+static void connect_best(void)
+{
+    select_pending = false;
+    candidate_count = select_candidates();
+    if (candidate_count == 0)
+    {
+        timing_connect = false;
+        notify_listener(WIFI_MANAGER_EVT_CONNECT_FAILED, WIFI_SM_REASON_START_FAILED);
+        return;
+    }
+    start_candidates(select_keep_trying);
+}
+
+// Decides where the attempt after a failed association goes: the same
+// network with a full scan if only its remembered AP was probed, else the
+// next candidate. True if that attempt was queued to start right away;
+// false once every candidate failed, which is reported
+static bool fail_over(void)
+{
+    if (hint_configured)
+    {
+        // The AP may have moved to another channel or been replaced
+        ESP_LOGW(TAG, "Fast connect failed, falling back to a full scan");
+        drop_ap_hint();
+    }
+    else if (candidate_index + 1 < candidate_count)
+    {
+        candidate_index++;
+        ESP_LOGW(TAG, "Connecting to %s failed, trying %s", candidates[candidate_index - 1].ssid,
+                 candidates[candidate_index].ssid);
+        if (configure_candidate(&candidates[candidate_index]) != ESP_OK)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // Any retry after the backoff starts over from the best one
+        if (candidate_index > 0)
+        {
+            candidate_index = 0;
+            configure_candidate(&candidates[0]);
+        }
+        return false;
+    }
+
+    // Posted without waiting, this runs on the event loop itself
+    failover_pending = esp_event_post(WIFI_MANAGER_EVENT, SM_REQ_RETRY, NULL, 0, 0) == ESP_OK;
+    return failover_pending;
+}
+
+static void sm_on_transition(void *ctx, wifi_sm_state_t from, wifi_sm_state_t to, int reason)
+{
+    ESP_LOGI(TAG, "Connection %s -> %s%s", wifi_sm_state_name(from), wifi_sm_state_name(to),
+             reason != 0 ? " (failed)" : "");
+    if (to == WIFI_SM_CONNECTED || from == WIFI_SM_CONNECTED)
+    {
+        scan_sched_set_connected(&sched, to == WIFI_SM_CONNECTED, now_ms());
+    }
+    // A scan asked for while an attempt was in progress can run now
+    if ((to == WIFI_SM_IDLE || to == WIFI_SM_CONNECTED) && scan_sched_pending(&sched))
+    {
+        esp_event_post(WIFI_MANAGER_EVENT, SM_REQ_SCHED_TICK, NULL, 0, 0);
+    }
+
+    if (to == WIFI_SM_CONNECTED)
+    {
+        if (timing_connect)
+        {
+            record_connect_time();
+        }
+        notify_listener(WIFI_MANAGER_EVT_CONNECTED, 0);
+        return;
+    }
+
+    // The failure is only reported once nothing is left to try at once
+    if (reason != 0 && from == WIFI_SM_ASSOCIATING && fail_over())
+    {
+        return;
+    }
+
+    if (to == WIFI_SM_IDLE)
+    {
+        timing_connect = false;
+    }
+    if (reason != 0)
+    {
+        notify_listener(WIFI_MANAGER_EVT_CONNECT_FAILED, reason);
+    }
+}
+
+static const wifi_sm_ops_t sm_ops = {
+    .connect = sm_connect,
+    .disconnect = sm_disconnect,
+    .set_timer = sm_set_timer,
+    .random = sm_random,
+    .on_transition = sm_on_transition,
+};
+
+static void sm_feed(wifi_sm_event_t event, int arg)
+{
+    xSemaphoreTake(sm_lock, portMAX_DELAY);
+    wifi_sm_handle(&sm, event, arg, now_ms());
+    xSemaphoreGive(sm_lock);
+}
+
+// Runs on the esp_timer task; hands the timeout over to the event loop
+static void sm_timer_cb(void *arg)
+{
+    uint32_t gen = sm_timer_gen;
+    esp_event_post(WIFI_MANAGER_EVENT, SM_REQ_TIMEOUT, &gen, sizeof(gen), 0);
+}
+
+// Runs on the esp_timer task, like sm_timer_cb
+static void sched_timer_cb(void *arg)
+{
+    esp_event_post(WIFI_MANAGER_EVENT, SM_REQ_SCHED_TICK, NULL, 0, 0);
+}
+
+static esp_err_t start_scan_driver(bool passive);
+
+// Starts the scan the scheduler wants, if the driver is free for it. True
+// if a scan is running afterwards, this one or an earlier one; under sm_lock
+static bool sched_run(void)
+{
+    if (scan_sched_scanning(&sched))
+    {
+        return true;
+    }
+    // A scan would hold up an attempt in progress, or the one a backoff ends with
+    if (sm.state != WIFI_SM_IDLE && sm.state != WIFI_SM_CONNECTED)
+    {
+        return false;
+    }
+    scan_sched_kind_t kind = scan_sched_poll(&sched, now_ms());
+    if (kind == SCAN_SCHED_NONE)
+    {
+        return false;
+    }
+
+    esp_err_t err = start_scan_driver(kind == SCAN_SCHED_PASSIVE);
+    if (err != ESP_OK)
+    {
+        // Still due; the next tick tries again
+        ESP_LOGW(TAG, "Failed to start scan: %s", esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGI(TAG, "Started %s scan", kind == SCAN_SCHED_PASSIVE ? "passive" : "active");
+    scan_sched_started(&sched);
+    wifi_sm_handle(&sm, WIFI_SM_EV_SCAN_START, 0, now_ms());
+    return true;
+}
+
+// Publishes the strongest AP of the current network as a roaming candidate
+// while the signal is degraded, if it is clearly better than ours. The
+// scan store keeps the best AP per SSID, which is all this needs; under
+// sm_lock, right after a scan
+static void update_roam_hint(void)
+{
+    device_state_t state;
+    device_state_read(&state);
+    wifi_ap_record_t ap_info;
+    scan_store_entry_t best;
+    scan_sched_stats_t stats;
+    scan_sched_get_stats(&sched, &stats, now_ms());
+    if (stats.mode != SCAN_SCHED_DEGRADED || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK ||
+        !scan_store_find((const char *)ap_info.ssid, &best) || memcmp(best.bssid, ap_info.bssid, sizeof(best.bssid)) == 0 ||
+        best.rssi < ap_info.rssi + ROAM_MARGIN_DB)
+    {
+        if (state.roam_hint)
+        {
+            device_state_set_roam(NULL, 0, 0);
+        }
+        return;
+    }
+
+    if (!state.roam_hint || memcmp(state.roam_bssid, best.bssid, sizeof(best.bssid)) != 0)
+    {
+        ESP_LOGI(TAG, "Roaming candidate for %s: " MACSTR " on channel %u at %d dBm, we have %d dBm", best.ssid,
+                 MAC2STR(best.bssid), best.channel, best.rssi, ap_info.rssi);
+    }
+    device_state_set_roam(best.bssid, best.channel, best.rssi);
+}
+
+// A new request replaces whatever the previous one was doing; under sm_lock
+static void begin_request(void)
+{
+    select_pending = false;
+    failover_pending = false;
+    hint_failed = false;
+    timing_connect = true;
+    connect_start_ms = now_ms();
+}
+
+static void connect_known(int keep_trying)
+{
+    bool fresh = scan_is_fresh();
+    if (!fresh && (sm.state == WIFI_SM_ASSOCIATING || sm.state == WIFI_SM_DHCP || sm.state == WIFI_SM_BACKOFF))
+    {
+        // Choose by what is in range: stop attempts in progress so the scan can run
+        wifi_sm_handle(&sm, WIFI_SM_EV_DISCONNECT, 0, now_ms());
+    }
+
+    begin_request();
+    select_keep_trying = keep_trying;
+    if (fresh)
+    {
+        connect_best();
+        return;
+    }
+
+    scan_sched_request(&sched);
+    if (sched_run())
+    {
+        select_pending = true;
+    }
+    else
+    {
+        // Without a scan, go by priority and history alone
+        connect_best();
+    }
+}
+
+static void sm_request_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    switch (event_id)
+    {
+    case SM_REQ_CONNECT:
+    {
+        const connect_request_t *request = (const connect_request_t *)event_data;
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        begin_request();
+        candidates[0] = request->network;
+        candidate_count = 1;
+        start_candidates(request->keep_trying);
+        xSemaphoreGive(sm_lock);
+        break;
+    }
+    case SM_REQ_CONNECT_KNOWN:
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        connect_known(*(int *)event_data);
+        xSemaphoreGive(sm_lock);
+        break;
+    case SM_REQ_RETRY:
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        // Dropped if a newer request or a disconnect came in between
+        if (failover_pending)
+        {
+            failover_pending = false;
+            if (sm.state == WIFI_SM_BACKOFF)
+            {
+                wifi_sm_handle(&sm, WIFI_SM_EV_RETRY, 0, now_ms());
+            }
+            else if (sm.state == WIFI_SM_IDLE)
+            {
+                // Not retrying by itself, but this attempt belongs to the failed one
+                wifi_sm_handle(&sm, WIFI_SM_EV_CONNECT, 0, now_ms());
+            }
+        }
+        xSemaphoreGive(sm_lock);
+        break;
+    case SM_REQ_DISCONNECT:
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        select_pending = false;
+        failover_pending = false;
+        timing_connect = false;
+        wifi_sm_handle(&sm, WIFI_SM_EV_DISCONNECT, 0, now_ms());
+        xSemaphoreGive(sm_lock);
+        break;
+    case SM_REQ_SCAN:
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        scan_sched_request(&sched);
+        if (!sched_run())
+        {
+            ESP_LOGI(TAG, "Scan deferred until the connection attempt ends");
+        }
+        xSemaphoreGive(sm_lock);
+        break;
+    case SM_REQ_SCHED_TICK:
+        xSemaphoreTake(sm_lock, portMAX_DELAY);
+        if (sm.state == WIFI_SM_CONNECTED)
+        {
+            int8_t rssi = wifi_manager_sample_rssi();
+            if (rssi != 0 && scan_sched_rssi(&sched, rssi, now_ms()))
+            {
+                ESP_LOGI(TAG, "Signal degraded (%d dBm), looking for a better AP", rssi);
+            }
+        }
+        sched_run();
+        xSemaphoreGive(sm_lock);
+        break;
+    case SM_REQ_TIMEOUT:
+        // A timer that was re-armed or cancelled after it fired is stale
+        if (*(uint32_t *)event_data == sm_timer_gen)
+        {
+            sm_feed(WIFI_SM_EV_TIMEOUT, 0);
+        }
+        break;
+    }
+}
+
+static esp_err_t sm_post(int32_t request, const void *data, size_t size)
+{
+    return esp_event_post(WIFI_MANAGER_EVENT, request, data, size, pdMS_TO_TICKS(SM_POST_WAIT_MS));
+}
+
+void wifi_manager_set_listener(wifi_manager_listener_t new_listener)
+{
+    listener = new_listener;
+}
+
+static void notify_listener(wifi_manager_event_t event, int reason)
+{
+    if (listener != NULL)
+    {
+        listener(event, reason);
+    }
+}
 
 esp_err_t wifi_manager_init(void)
 {
@@ -34,11 +592,28 @@ esp_err_t wifi_manager_init(void)
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+    sm_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(sm_lock != NULL, ESP_ERR_NO_MEM, TAG, "Failed to create state machine lock");
+    const esp_timer_create_args_t timer_args = {
+        .callback = sm_timer_cb,
+        .name = "wifi_sm",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sm_timer));
+    wifi_sm_init(&sm, &sm_ops, NULL, now_ms());
+    scan_sched_init(&sched, now_ms());
+    const esp_timer_create_args_t sched_timer_args = {
+        .callback = sched_timer_cb,
+        .name = "scan_sched",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&sched_timer_args, &sched_timer));
+
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_MANAGER_EVENT, ESP_EVENT_ANY_ID, &sm_request_handler, NULL));
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_timer_start_periodic(sched_timer, (uint64_t)SCAN_SCHED_TICK_MS * 1000));
 
     ESP_LOGI(TAG, "WiFi Manager initialized.");
     return ESP_OK;
@@ -48,16 +623,35 @@ esp_err_t wifi_manager_connect(const char *ssid, const char *password)
 {
     ESP_LOGI(TAG, "Connecting to SSID: %s", ssid);
 
-    cached_networks_json[0] = '\0';
-    last_scan_time = 0;
+    connect_request_t request = {0};
+    strncpy(request.network.ssid, ssid, sizeof(request.network.ssid) - 1);
+    strncpy(request.network.password, password, sizeof(request.network.password) - 1);
 
-    wifi_config_t wifi_config = {0};
-    strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid) - 1);
-    strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password) - 1);
+    // Keep reconnecting after failures when auto-connect is on
+    device_state_t state;
+    device_state_read(&state);
+    request.keep_trying = state.autoconnect;
+    ESP_RETURN_ON_ERROR(sm_post(SM_REQ_CONNECT, &request, sizeof(request)), TAG,
+                        "Failed to start WiFi connection");
 
-    ESP_RETURN_ON_ERROR(esp_wifi_disconnect(), TAG, "Failed to disconnect before connecting");
-    ESP_RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), TAG, "Failed to set WiFi config");
-    ESP_RETURN_ON_ERROR(esp_wifi_connect(), TAG, "Failed to start WiFi connection");
+    return ESP_OK;
+}
+
+esp_err_t wifi_manager_connect_known(void)
+{
+    nvs_storage_network_t first;
+    if (nvs_storage_get_networks(&first, 1) == 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    // The scan result is kept: it is what the choice is based on
+    ESP_LOGI(TAG, "Connecting to the best known network");
+
+    device_state_t state;
+    device_state_read(&state);
+    int keep_trying = state.autoconnect;
+    ESP_RETURN_ON_ERROR(sm_post(SM_REQ_CONNECT_KNOWN, &keep_trying, sizeof(keep_trying)), TAG,
+                        "Failed to start WiFi connection");
 
     return ESP_OK;
 }
@@ -65,80 +659,149 @@ esp_err_t wifi_manager_connect(const char *ssid, const char *password)
 esp_err_t wifi_manager_disconnect(void)
 {
     ESP_LOGI(TAG, "Disconnecting from WiFi.");
-    cached_networks_json[0] = '\0';
-    last_scan_time = 0;
+    // Cancel retries first, then drop the link right away
+    esp_err_t err = sm_post(SM_REQ_DISCONNECT, NULL, 0);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to stop the connection state machine: %s", esp_err_to_name(err));
+    }
+    device_state_set_wifi(false, NULL);
     return esp_wifi_disconnect();
 }
 
-bool wifi_manager_start_scan(void)
+void wifi_manager_get_conn_stats(wifi_sm_stats_t *stats)
 {
-    if (scan_in_progress)
+    xSemaphoreTake(sm_lock, portMAX_DELAY);
+    wifi_sm_get_stats(&sm, stats, now_ms());
+    xSemaphoreGive(sm_lock);
+}
+
+void wifi_manager_get_connect_time(wifi_manager_connect_time_t *time)
+{
+    xSemaphoreTake(sm_lock, portMAX_DELAY);
+    *time = last_connect;
+    xSemaphoreGive(sm_lock);
+}
+
+// Records the success with the known network, and where it was found for
+// the next connection
+static void remember_ap(void)
+{
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
     {
-        ESP_LOGI(TAG, "Scan already in progress.");
-        return true; // Not an error, just busy
+        return;
     }
 
-    ESP_LOGI(TAG, "Starting asynchronous WiFi scan...");
+    nvs_storage_ap_hint_t hint = {
+        .channel = ap_info.primary,
+        .authmode = ap_info.authmode,
+    };
+    memcpy(hint.bssid, ap_info.bssid, sizeof(hint.bssid));
+    nvs_storage_record_success((const char *)ap_info.ssid, &hint);
+}
 
+// Passive scans only listen for beacons, and return to the AP's channel
+// between the others, so a connected link keeps most of its airtime
+static esp_err_t start_scan_driver(bool passive)
+{
     wifi_scan_config_t scan_config = {
         .ssid = NULL, .bssid = NULL, .channel = 0, .show_hidden = false, .scan_type = WIFI_SCAN_TYPE_ACTIVE, .scan_time.active = {.min = 100, .max = 300}};
+    if (passive)
+    {
+        scan_config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+        scan_config.scan_time.passive = 120; // Just over one beacon interval
+        scan_config.home_chan_dwell_time = 60;
+    }
 
     esp_err_t err = esp_wifi_scan_start(&scan_config, false); // Non-blocking
-
     if (err == ESP_OK)
     {
-        scan_in_progress = true;
-        ESP_LOGI(TAG, "Scan started successfully.");
-        return true;
+        device_state_set_scan(true);
     }
-    else
+    return err;
+}
+
+bool wifi_manager_start_scan(void)
+{
+    // The event loop starts it, or joins the request to a scan already
+    // pending or running; the caller never waits for the driver
+    esp_err_t err = sm_post(SM_REQ_SCAN, NULL, 0);
+    if (err != ESP_OK)
     {
-        ESP_LOGW(TAG, "Failed to start scan: %s. Device might be connecting.", esp_err_to_name(err));
+        ESP_LOGW(TAG, "Failed to request scan: %s", esp_err_to_name(err));
         return false;
     }
+    return true;
+}
+
+void wifi_manager_get_scan_stats(scan_sched_stats_t *stats)
+{
+    xSemaphoreTake(sm_lock, portMAX_DELAY);
+    scan_sched_get_stats(&sched, stats, now_ms());
+    xSemaphoreGive(sm_lock);
+}
+
+static bool scan_is_fresh(void)
+{
+    uint32_t age_ms;
+    return scan_store_age(now_ms(), &age_ms) && age_ms < SCAN_CACHE_DURATION_MS;
 }
 
 void wifi_manager_get_networks_json(char *json_out, size_t max_size)
 {
-    int64_t time_since_scan = (esp_timer_get_time() / 1000) - last_scan_time;
+    device_state_t state;
+    device_state_read(&state);
+    uint32_t age_ms;
+    bool have_result = scan_store_age(now_ms(), &age_ms);
 
-    if (scan_in_progress)
+    // Whatever the scheduler found last; this never starts a scan
+    if (state.scanning)
     {
-        snprintf(json_out, max_size, "\"scanning\":true");
+        int len = snprintf(json_out, max_size, have_result ? "\"scanning\":true," : "\"scanning\":true");
+        if (have_result && len > 0 && (size_t)len < max_size)
+        {
+            build_networks_json(json_out + len, max_size - len);
+        }
     }
-    else if (cached_networks_json[0] != '\0' && time_since_scan < SCAN_CACHE_DURATION_MS)
+    else if (have_result)
     {
-        snprintf(json_out, max_size, "%s", cached_networks_json);
+        build_networks_json(json_out, max_size);
     }
     else
     {
-        // Cache is stale or empty, start a new scan
-        bool scan_started = wifi_manager_start_scan();
-        if (scan_started)
-        {
-            snprintf(json_out, max_size, "\"scanning\":true");
-        }
-        else
-        {
-            // Scan didn't start (maybe connecting), return empty list
-            snprintf(json_out, max_size, "\"scanning\":false, \"available_networks\":[]");
-        }
+        snprintf(json_out, max_size, "\"scanning\":false, \"available_networks\":[]");
     }
 }
 
 bool wifi_manager_is_connected(void)
 {
-    wifi_ap_record_t ap_info;
-    return (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK);
+    device_state_t state;
+    device_state_read(&state);
+    return state.wifi_connected;
 }
 
 esp_err_t wifi_manager_get_ip_info(esp_netif_ip_info_t *ip_info)
 {
-    if (wifi_manager_is_connected())
+    device_state_t state;
+    device_state_read(&state);
+    if (!state.wifi_connected)
     {
-        return esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"), ip_info);
+        return ESP_FAIL;
     }
-    return ESP_FAIL;
+    *ip_info = (esp_netif_ip_info_t){.ip = state.ip};
+    return ESP_OK;
+}
+
+int8_t wifi_manager_sample_rssi(void)
+{
+    wifi_ap_record_t ap_info;
+    if (!wifi_manager_is_connected() || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+    {
+        return 0;
+    }
+    device_state_set_rssi(ap_info.rssi);
+    return ap_info.rssi;
 }
 
 esp_err_t wifi_manager_get_ap_info(wifi_ap_record_t *ap_info)
@@ -159,65 +822,115 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         {
             ESP_LOGI(TAG, "WiFi STA Started");
         }
+        else if (event_id == WIFI_EVENT_STA_CONNECTED)
+        {
+            sm_feed(WIFI_SM_EV_ASSOCIATED, 0);
+        }
         else if (event_id == WIFI_EVENT_STA_DISCONNECTED)
         {
-            ESP_LOGI(TAG, "WiFi disconnected.");
-            app_task_queue_post("status()");
-
-            // Optionally attempt to reconnect if auto-connect is enabled
+            wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+            ESP_LOGI(TAG, "WiFi disconnected; reason=%d", event->reason);
+            device_state_set_wifi(false, NULL);
+            app_task_request_status(APP_CMD_ORIGIN_INTERNAL);
+
+            // Leaving on our own (disconnect, or before a new connect) is not a
+            // failure; the state machine already knows about it
+            if (event->reason != WIFI_REASON_ASSOC_LEAVE)
+            {
+                sm_feed(WIFI_SM_EV_LINK_LOST, event->reason);
+            }
         }
         else if (event_id == WIFI_EVENT_SCAN_DONE)
         {
-            ESP_LOGI(TAG, "WiFi scan done, building networks list...");
-            build_networks_json(cached_networks_json, sizeof(cached_networks_json));
-            scan_in_progress = false;
+            collect_scan();
+            device_state_set_scan(false);
+
+            xSemaphoreTake(sm_lock, portMAX_DELAY);
+            scan_sched_done(&sched, now_ms());
+            wifi_sm_handle(&sm, WIFI_SM_EV_SCAN_DONE, 0, now_ms());
+            update_roam_hint();
+            if (select_pending)
+            {
+                connect_best();
+            }
+            xSemaphoreGive(sm_lock);
+            notify_listener(WIFI_MANAGER_EVT_SCAN_DONE, 0);
 
             // Notify the main app task to send a status update
-            app_task_queue_post("status()");
+            app_task_request_status(APP_CMD_ORIGIN_INTERNAL);
         }
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
         ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        device_state_set_wifi(true, &event->ip_info.ip);
+        wifi_manager_sample_rssi();
+        sm_feed(WIFI_SM_EV_GOT_IP, 0);
+        remember_ap();
 
         // Notify the main app task to send a status update
-        app_task_queue_post("status()");
+        app_task_request_status(APP_CMD_ORIGIN_INTERNAL);
     }
 }
 
-static void build_networks_json(char *json_out, size_t max_size)
+// Ranks the driver's result into the scan store, one record at a time so
+// that every AP counts, not only as many as a buffer holds
+static void collect_scan(void)
 {
     uint16_t ap_count = 0;
     esp_wifi_scan_get_ap_num(&ap_count);
-
-    if (ap_count == 0)
+    scan_store_begin();
+    for (uint16_t i = 0; i < ap_count; i++)
     {
-        snprintf(json_out, max_size, "\"available_networks\":[]");
-        return;
+        wifi_ap_record_t record;
+        if (esp_wifi_scan_get_ap_record(&record) != ESP_OK)
+        {
+            break;
+        }
+        scan_store_entry_t ap = {
+            .rssi = record.rssi,
+            .channel = record.primary,
+            .authmode = record.authmode,
+        };
+        memcpy(ap.ssid, record.ssid, sizeof(ap.ssid) - 1);
+        memcpy(ap.bssid, record.bssid, sizeof(ap.bssid));
+        scan_store_offer(&ap);
     }
+    esp_wifi_clear_ap_list();
+    scan_store_commit(now_ms());
 
-    uint16_t num_to_get = (ap_count < MAX_NETWORKS) ? ap_count : MAX_NETWORKS;
-    wifi_ap_record_t ap_records[MAX_NETWORKS];
+    size_t total;
+    scan_store_read(0, NULL, 0, &total);
+    ESP_LOGI(TAG, "WiFi scan done: %u APs, %u networks kept", ap_count, (unsigned)total);
+}
 
-    esp_wifi_scan_get_ap_records(&num_to_get, ap_records);
+// Renders the strongest networks for status() and scan replies, on request
+static void build_networks_json(char *json_out, size_t max_size)
+{
+    scan_store_entry_t top[MAX_NETWORKS];
+    size_t count = scan_store_read(0, top, MAX_NETWORKS, NULL);
 
-    size_t offset = snprintf(json_out, max_size, "\"available_networks\":[");
+    json_writer_t w;
+    json_writer_init(&w, json_out, max_size);
+    json_put_key(&w, "available_networks");
+    json_begin_array(&w);
 
-    for (int i = 0; i < num_to_get && offset < max_size - 128; i++)
+    for (size_t i = 0; i < count; i++)
     {
-        char ssid_escaped[65];
-        json_escape((char *)ap_records[i].ssid, ssid_escaped, sizeof(ssid_escaped));
-
-        offset += snprintf(json_out + offset, max_size - offset,
-                           "%s{\"ssid\":\"%s\",\"rssi\":%d,\"encryption\":%d}",
-                           i > 0 ? "," : "",
-                           ssid_escaped,
-                           ap_records[i].rssi,
-                           ap_records[i].authmode == WIFI_AUTH_OPEN ? 0 : 1);
+        // Networks that do not fit are left out, the list stays well-formed
+        json_writer_t mark = w;
+        json_begin_object(&w);
+        json_put_key_string(&w, "ssid", top[i].ssid);
+        json_put_key_int(&w, "rssi", top[i].rssi);
+        json_put_key_int(&w, "encryption", top[i].authmode == WIFI_AUTH_OPEN ? 0 : 1);
+        json_end_object(&w);
+        if (!json_writer_fits(&w, 1))
+        {
+            json_writer_rewind(&w, &mark);
+            break;
+        }
     }
 
-    snprintf(json_out + offset, max_size - offset, "]");
-
-    last_scan_time = esp_timer_get_time() / 1000;
+    json_end_array(&w);
 }
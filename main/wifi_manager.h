@@ -14,8 +14,56 @@
 #include "esp_err.h"
 #include "esp_wifi_types.h"
 #include "esp_netif_types.h"
+#include "wifi_sm.h"
+#include "scan_sched.h"
 #include <stdbool.h>
 
+/**
+ * @brief Outcomes of asynchronous WiFi operations reported to the listener.
+ */
+typedef enum
+{
+    WIFI_MANAGER_EVT_CONNECTED,      // Associated and got an IP address
+    WIFI_MANAGER_EVT_CONNECT_FAILED, // The connection attempt or link was lost
+    WIFI_MANAGER_EVT_SCAN_DONE,      // A scan finished, the network list is fresh
+} wifi_manager_event_t;
+
+/**
+ * @brief How long the last requested connection took, see
+ *        wifi_manager_get_connect_time().
+ */
+typedef struct
+{
+    bool valid;        // A requested connection has completed
+    bool fast;         // It went straight to the remembered AP
+    bool fell_back;    // The remembered AP failed and a full scan found one
+    char ssid[33];     // The network it connected to
+    uint8_t candidate; // Its place among the candidates, 0 for the first choice
+    uint32_t total_ms; // From wifi_manager_connect() to the address
+    uint32_t assoc_ms; // Time spent associating in the last attempt
+    uint32_t dhcp_ms;  // Time spent waiting for the address
+} wifi_manager_connect_time_t;
+
+/**
+ * @brief Listener for WiFi outcomes.
+ *
+ * Called from the default event loop task, so it must not block.
+ *
+ * @param event The outcome.
+ * @param reason For WIFI_MANAGER_EVT_CONNECT_FAILED the wifi_err_reason_t, or
+ *               WIFI_SM_REASON_TIMEOUT / WIFI_SM_REASON_START_FAILED; 0 otherwise.
+ */
+typedef void (*wifi_manager_listener_t)(wifi_manager_event_t event, int reason);
+
+/**
+ * @brief Sets the listener notified of WiFi outcomes.
+ *
+ * May be called before wifi_manager_init().
+ *
+ * @param listener The listener, or NULL to remove it.
+ */
+void wifi_manager_set_listener(wifi_manager_listener_t listener);
+
 /**
  * @brief Initializes the WiFi manager.
  *
@@ -28,35 +76,99 @@ esp_err_t wifi_manager_init(void);
 /**
  * @brief Connects to a WiFi access point.
  *
+ * The attempt is driven by the connection state machine (wifi_sm.h). With
+ * auto-connect enabled, failed attempts and lost links are retried with
+ * backoff until wifi_manager_disconnect() is called; otherwise the first
+ * failure ends it. The listener hears about every success and failure.
+ *
+ * When connecting to a known network, the BSSID, channel and auth mode it
+ * was last found with are used to skip the all-channel scan. If that
+ * fails, the hint is dropped and the next attempt scans every channel; an
+ * attempt without retries gets that one extra full-scan attempt before
+ * the failure is reported.
+ *
+ * The driver is configured on the event loop; if that fails, the listener
+ * gets WIFI_MANAGER_EVT_CONNECT_FAILED with WIFI_SM_REASON_START_FAILED.
+ *
  * @param ssid The SSID of the network to connect to.
  * @param password The password for the network.
  * @return ESP_OK if the connection process is initiated successfully.
  */
 esp_err_t wifi_manager_connect(const char *ssid, const char *password);
 
+/**
+ * @brief Connects to the best of the known networks (see nvs_storage.h).
+ *
+ * Known networks in the last scan are tried first, by priority and then
+ * signal strength; the others follow by priority and how recently they
+ * worked, as they may be hidden. A scan is started first when the last
+ * one is older than the scan cache. When an association fails, the next
+ * candidate is tried right away; the failure is only reported once all
+ * of them failed, after which retries (with auto-connect) start over from
+ * the best one.
+ *
+ * @return ESP_OK if the connection process was started, ESP_ERR_NOT_FOUND
+ *         if no network is known.
+ */
+esp_err_t wifi_manager_connect_known(void);
+
 /**
  * @brief Disconnects from the currently connected WiFi access point.
  *
+ * Also cancels pending retries.
+ *
  * @return ESP_OK on success.
  */
 esp_err_t wifi_manager_disconnect(void);
 
 /**
- * @brief Starts an asynchronous (non-blocking) WiFi scan.
+ * @brief Gets the state and phase timings of the connection state machine.
+ *
+ * @param[out] stats The statistics.
+ */
+void wifi_manager_get_conn_stats(wifi_sm_stats_t *stats);
+
+/**
+ * @brief Gets how long the last requested connection took.
+ *
+ * @param[out] time The timings; valid is false until a connection completed.
+ */
+void wifi_manager_get_connect_time(wifi_manager_connect_time_t *time);
+
+/**
+ * @brief Asks for a WiFi scan, without waiting for it to start.
+ *
+ * Scans are run by the background scheduler (scan_sched.h) on the event
+ * loop, which also scans by itself: every 30 s to 4 min while not
+ * connected, every 1 to 5 min with passive scans while connected, and
+ * every 15 to 60 s while the signal is weak or falling. A request runs as
+ * an active scan as soon as no connection attempt is in progress; requests
+ * made while one is pending or running are answered by that scan. Every
+ * scan ends with WIFI_MANAGER_EVT_SCAN_DONE.
  *
- * The results of the scan will be cached internally. Use
- * wifi_manager_get_networks_json to retrieve them.
+ * The results are ranked into the scan store (scan_store.h). Use
+ * wifi_manager_get_networks_json to retrieve the strongest ones, or
+ * scan_store_read() to page through all of them.
  *
- * @return True if the scan was started successfully, false otherwise (e.g., if a
- *         scan is already in progress).
+ * @return True if the request was queued, false if the event loop is
+ *         backed up.
  */
 bool wifi_manager_start_scan(void);
 
 /**
- * @brief Gets the list of available networks from the last scan as a JSON string.
+ * @brief Gets the scan scheduler's mode, interval, RSSI trend and counters.
  *
- * This function returns cached results if a scan was performed recently.
- * If the cache is stale, it may trigger a new scan implicitly.
+ * @param[out] stats The statistics.
+ */
+void wifi_manager_get_scan_stats(scan_sched_stats_t *stats);
+
+/**
+ * @brief Gets the strongest networks from the last scan as a JSON string.
+ *
+ * The string is rendered from the scan store on every call, one entry per
+ * SSID, strongest first, at most five of them, with "scanning":true in
+ * front while a scan runs. It never starts a scan; the scheduler keeps
+ * the result current.
  *
  * @param[out] json_out Buffer to write the JSON string to.
  * @param[in]  max_size The maximum size of the output buffer.
@@ -66,18 +178,32 @@ void wifi_manager_get_networks_json(char *json_out, size_t max_size);
 /**
  * @brief Checks if the device is currently connected to a WiFi network.
  *
- * @return True if connected, false otherwise.
+ * Reads the published device state, not the driver.
+ *
+ * @return True if connected and an IP address was obtained, false otherwise.
  */
 bool wifi_manager_is_connected(void);
 
 /**
  * @brief Gets the IP information of the STA interface.
  *
+ * Only the address is filled in, from the published device state.
+ *
  * @param[out] ip_info Pointer to a structure to store the IP information.
  * @return ESP_OK on success, ESP_FAIL if not connected.
  */
 esp_err_t wifi_manager_get_ip_info(esp_netif_ip_info_t *ip_info);
 
+/**
+ * @brief Reads the RSSI of the current AP from the driver and publishes it.
+ *
+ * The scan scheduler samples it every SCAN_SCHED_TICK_MS for its trend;
+ * readers of the published state get that sample without a driver call.
+ *
+ * @return The RSSI, or 0 if not connected.
+ */
+int8_t wifi_manager_sample_rssi(void);
+
 
 /**
  * @brief Gets the AP information of the STA interface.
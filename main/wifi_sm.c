@@ -0,0 +1,229 @@
+/**
+ * @file wifi_sm.c
+ * @brief Implementation of the WiFi connection state machine.
+ */
+
+#include "wifi_sm.h"
+#include <string.h>
+
+static const char *const state_names[WIFI_SM_STATE_COUNT] = {
+    [WIFI_SM_IDLE] = "idle",
+    [WIFI_SM_SCANNING] = "scanning",
+    [WIFI_SM_ASSOCIATING] = "associating",
+    [WIFI_SM_DHCP] = "dhcp",
+    [WIFI_SM_CONNECTED] = "connected",
+    [WIFI_SM_BACKOFF] = "backoff",
+};
+
+const char *wifi_sm_state_name(wifi_sm_state_t state)
+{
+    return state < WIFI_SM_STATE_COUNT ? state_names[state] : "unknown";
+}
+
+static void enter(wifi_sm_t *sm, wifi_sm_state_t to, int reason, uint32_t now_ms)
+{
+    wifi_sm_state_t from = sm->state;
+    wifi_sm_phase_stats_t *phase = &sm->stats.phases[from];
+    uint32_t stay = now_ms - sm->entered_ms;
+    phase->total_ms += stay;
+    phase->last_ms = stay;
+
+    sm->state = to;
+    sm->entered_ms = now_ms;
+    sm->stats.phases[to].count++;
+    if (sm->ops->on_transition != NULL)
+    {
+        sm->ops->on_transition(sm->ctx, from, to, reason);
+    }
+}
+
+static bool has_link(const wifi_sm_t *sm)
+{
+    return sm->state == WIFI_SM_ASSOCIATING || sm->state == WIFI_SM_DHCP || sm->state == WIFI_SM_CONNECTED;
+}
+
+// The first retry after losing a working link is immediate; otherwise the
+// delay doubles per failure and is drawn from its upper half
+static uint32_t backoff_delay(wifi_sm_t *sm)
+{
+    uint32_t n = sm->stats.retry;
+    if (sm->lost_link)
+    {
+        if (n <= 1)
+        {
+            return 0;
+        }
+        n--;
+    }
+
+    uint32_t delay = WIFI_SM_BACKOFF_MAX_MS;
+    if (n - 1 < 16 && (WIFI_SM_BACKOFF_BASE_MS << (n - 1)) < WIFI_SM_BACKOFF_MAX_MS)
+    {
+        delay = WIFI_SM_BACKOFF_BASE_MS << (n - 1);
+    }
+    return delay / 2 + sm->ops->random(sm->ctx) % (delay / 2 + 1);
+}
+
+static void fail(wifi_sm_t *sm, int reason, uint32_t now_ms);
+
+static void start_attempt(wifi_sm_t *sm, uint32_t now_ms)
+{
+    sm->stats.attempts++;
+    sm->ops->set_timer(sm->ctx, WIFI_SM_ASSOC_TIMEOUT_MS);
+    enter(sm, WIFI_SM_ASSOCIATING, 0, now_ms);
+    if (!sm->ops->connect(sm->ctx))
+    {
+        fail(sm, WIFI_SM_REASON_START_FAILED, now_ms);
+    }
+}
+
+static void fail(wifi_sm_t *sm, int reason, uint32_t now_ms)
+{
+    sm->stats.failures++;
+    sm->stats.retry++;
+    sm->stats.last_reason = reason;
+
+    if (!sm->want_link || !sm->keep_trying)
+    {
+        sm->ops->set_timer(sm->ctx, 0);
+        sm->want_link = false;
+        sm->lost_link = false;
+        enter(sm, WIFI_SM_IDLE, reason, now_ms);
+        return;
+    }
+
+    uint32_t delay = backoff_delay(sm);
+    sm->stats.backoff_ms = delay;
+    if (delay == 0)
+    {
+        // Fast reconnect: report the failure, then go straight back in
+        enter(sm, WIFI_SM_BACKOFF, reason, now_ms);
+        start_attempt(sm, now_ms);
+        return;
+    }
+    sm->ops->set_timer(sm->ctx, delay);
+    enter(sm, WIFI_SM_BACKOFF, reason, now_ms);
+}
+
+void wifi_sm_init(wifi_sm_t *sm, const wifi_sm_ops_t *ops, void *ctx, uint32_t now_ms)
+{
+    memset(sm, 0, sizeof(*sm));
+    sm->ops = ops;
+    sm->ctx = ctx;
+    sm->state = WIFI_SM_IDLE;
+    sm->entered_ms = now_ms;
+    sm->stats.phases[WIFI_SM_IDLE].count = 1;
+}
+
+void wifi_sm_handle(wifi_sm_t *sm, wifi_sm_event_t event, int arg, uint32_t now_ms)
+{
+    switch (event)
+    {
+    case WIFI_SM_EV_CONNECT:
+        if (has_link(sm))
+        {
+            sm->ops->disconnect(sm->ctx);
+        }
+        sm->want_link = true;
+        sm->keep_trying = arg != 0;
+        sm->lost_link = false;
+        sm->stats.retry = 0;
+        start_attempt(sm, now_ms);
+        break;
+
+    case WIFI_SM_EV_DISCONNECT:
+        sm->want_link = false;
+        sm->lost_link = false;
+        if (has_link(sm))
+        {
+            sm->ops->disconnect(sm->ctx);
+        }
+        if (has_link(sm) || sm->state == WIFI_SM_BACKOFF)
+        {
+            sm->ops->set_timer(sm->ctx, 0);
+            enter(sm, WIFI_SM_IDLE, 0, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_SCAN_START:
+        if (sm->state == WIFI_SM_IDLE)
+        {
+            enter(sm, WIFI_SM_SCANNING, 0, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_SCAN_DONE:
+        if (sm->state == WIFI_SM_SCANNING)
+        {
+            enter(sm, WIFI_SM_IDLE, 0, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_ASSOCIATED:
+        if (sm->state == WIFI_SM_ASSOCIATING)
+        {
+            sm->ops->set_timer(sm->ctx, WIFI_SM_DHCP_TIMEOUT_MS);
+            enter(sm, WIFI_SM_DHCP, 0, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_GOT_IP:
+        if (sm->state == WIFI_SM_ASSOCIATING || sm->state == WIFI_SM_DHCP)
+        {
+            sm->ops->set_timer(sm->ctx, 0);
+            sm->stats.retry = 0;
+            if (sm->lost_link)
+            {
+                uint32_t took = now_ms - sm->lost_ms;
+                sm->stats.reconnects++;
+                sm->stats.last_reconnect_ms = took;
+                sm->reconnect_total_ms += took;
+                sm->stats.mean_reconnect_ms = sm->reconnect_total_ms / sm->stats.reconnects;
+                sm->lost_link = false;
+            }
+            enter(sm, WIFI_SM_CONNECTED, 0, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_LINK_LOST:
+        if (sm->state == WIFI_SM_CONNECTED)
+        {
+            sm->lost_link = true;
+            sm->lost_ms = now_ms;
+            fail(sm, arg, now_ms);
+        }
+        else if (sm->state == WIFI_SM_ASSOCIATING || sm->state == WIFI_SM_DHCP)
+        {
+            fail(sm, arg, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_TIMEOUT:
+        if (sm->state == WIFI_SM_ASSOCIATING || sm->state == WIFI_SM_DHCP)
+        {
+            sm->ops->disconnect(sm->ctx);
+            fail(sm, WIFI_SM_REASON_TIMEOUT, now_ms);
+        }
+        else if (sm->state == WIFI_SM_BACKOFF)
+        {
+            start_attempt(sm, now_ms);
+        }
+        break;
+
+    case WIFI_SM_EV_RETRY:
+        // Unlike a new connect, the failures so far still count for the backoff
+        if (sm->state == WIFI_SM_BACKOFF)
+        {
+            start_attempt(sm, now_ms);
+        }
+        break;
+    }
+}
+
+void wifi_sm_get_stats(const wifi_sm_t *sm, wifi_sm_stats_t *stats, uint32_t now_ms)
+{
+    *stats = sm->stats;
+    stats->state = sm->state;
+    stats->in_state_ms = now_ms - sm->entered_ms;
+    stats->phases[sm->state].total_ms += stats->in_state_ms;
+}
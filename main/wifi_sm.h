@@ -0,0 +1,153 @@
+/**
+ * @file wifi_sm.h
+ * @brief WiFi station connection state machine.
+ *
+ * Tracks a connection through its phases (scanning, associating, DHCP,
+ * connected) and brings it back after failures and link losses: the first
+ * retry after losing a working link is immediate, later ones wait with a
+ * jittered exponential backoff. It records how long every phase took, so
+ * the time to reconnect can be measured.
+ *
+ * The machine has no ESP-IDF dependencies. Events and the current time are
+ * passed in, and everything it does goes through wifi_sm_ops_t, so it can
+ * be driven by a simulated event source on the host. It is not thread-safe;
+ * the WiFi manager feeds it from the default event loop only.
+ */
+
+#ifndef WIFI_SM_H
+#define WIFI_SM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How long association and DHCP may take before the attempt is abandoned.
+#define WIFI_SM_ASSOC_TIMEOUT_MS 10000
+#define WIFI_SM_DHCP_TIMEOUT_MS 15000
+
+// Backoff before the second retry, doubled on every further failure.
+#define WIFI_SM_BACKOFF_BASE_MS 1000
+#define WIFI_SM_BACKOFF_MAX_MS 60000
+
+// Failure reasons that are not driver disconnect reasons.
+#define WIFI_SM_REASON_TIMEOUT (-1)     // A phase took too long
+#define WIFI_SM_REASON_START_FAILED (-2) // The driver refused to connect
+
+/**
+ * @brief Connection phases.
+ */
+typedef enum
+{
+    WIFI_SM_IDLE,        // Not connected and not trying
+    WIFI_SM_SCANNING,    // A scan started while idle
+    WIFI_SM_ASSOCIATING, // Waiting for the AP to accept us
+    WIFI_SM_DHCP,        // Associated, waiting for an address
+    WIFI_SM_CONNECTED,   // Got an address
+    WIFI_SM_BACKOFF,     // Waiting before the next attempt
+    WIFI_SM_STATE_COUNT
+} wifi_sm_state_t;
+
+/**
+ * @brief Inputs of the state machine.
+ */
+typedef enum
+{
+    WIFI_SM_EV_CONNECT,    // Start connecting; arg nonzero keeps retrying after failures
+    WIFI_SM_EV_DISCONNECT, // Stop connecting or drop the link, and stay offline
+    WIFI_SM_EV_SCAN_START, // A scan was started
+    WIFI_SM_EV_SCAN_DONE,  // The scan finished
+    WIFI_SM_EV_ASSOCIATED, // The AP accepted us
+    WIFI_SM_EV_GOT_IP,     // DHCP finished
+    WIFI_SM_EV_LINK_LOST,  // Association failed or the link was lost; arg is the reason
+    WIFI_SM_EV_TIMEOUT,    // The timer requested with set_timer() expired
+    WIFI_SM_EV_RETRY,      // Cut a backoff short and start the next attempt now
+} wifi_sm_event_t;
+
+/**
+ * @brief Actions the state machine asks its owner to perform.
+ */
+typedef struct
+{
+    // Starts an association attempt; false if the driver refused
+    bool (*connect)(void *ctx);
+    // Drops the link or the attempt in progress
+    void (*disconnect)(void *ctx);
+    // Arms the one-shot timer, replacing any armed one; 0 cancels it
+    void (*set_timer)(void *ctx, uint32_t ms);
+    // Returns a random number for the backoff jitter
+    uint32_t (*random)(void *ctx);
+    // Called after every state change; reason is set when a failure caused it
+    void (*on_transition)(void *ctx, wifi_sm_state_t from, wifi_sm_state_t to, int reason);
+} wifi_sm_ops_t;
+
+/**
+ * @brief Timing of one phase.
+ */
+typedef struct
+{
+    uint32_t count;    // Times the phase was entered
+    uint32_t total_ms; // Time spent in it, including the current stay
+    uint32_t last_ms;  // Duration of the last completed stay
+} wifi_sm_phase_stats_t;
+
+/**
+ * @brief Counters and timings, see wifi_sm_get_stats().
+ */
+typedef struct
+{
+    wifi_sm_state_t state;
+    uint32_t in_state_ms;      // Time in the current state
+    wifi_sm_phase_stats_t phases[WIFI_SM_STATE_COUNT];
+    uint32_t attempts;         // Association attempts started
+    uint32_t failures;         // Attempts and links that failed
+    uint32_t retry;            // Consecutive failures since the last success
+    uint32_t backoff_ms;       // Delay chosen for the current or last backoff
+    uint32_t reconnects;       // Links restored after a loss
+    uint32_t last_reconnect_ms; // From link loss to address, last time
+    uint32_t mean_reconnect_ms;
+    int last_reason;           // Reason of the last failure
+} wifi_sm_stats_t;
+
+/**
+ * @brief State machine instance; treat as opaque.
+ */
+typedef struct
+{
+    const wifi_sm_ops_t *ops;
+    void *ctx;
+    wifi_sm_state_t state;
+    uint32_t entered_ms; // When the current state was entered
+    bool want_link;      // A connection was asked for and not cancelled
+    bool keep_trying;    // Retry after failures
+    bool lost_link;      // Reconnecting after losing a working link
+    uint32_t lost_ms;    // When the link was lost
+    uint64_t reconnect_total_ms;
+    wifi_sm_stats_t stats;
+} wifi_sm_t;
+
+/**
+ * @brief Initializes a state machine in the idle state.
+ */
+void wifi_sm_init(wifi_sm_t *sm, const wifi_sm_ops_t *ops, void *ctx, uint32_t now_ms);
+
+/**
+ * @brief Feeds an event to the state machine.
+ *
+ * @param event The event.
+ * @param arg Event argument, see wifi_sm_event_t; 0 if unused.
+ * @param now_ms The current time in milliseconds, may wrap.
+ */
+void wifi_sm_handle(wifi_sm_t *sm, wifi_sm_event_t event, int arg, uint32_t now_ms);
+
+/**
+ * @brief Gets the counters and timings.
+ *
+ * @param[out] stats The statistics, with the current stay accounted for.
+ */
+void wifi_sm_get_stats(const wifi_sm_t *sm, wifi_sm_stats_t *stats, uint32_t now_ms);
+
+/**
+ * @brief Gets the name of a state, as reported by the wifi() command.
+ */
+const char *wifi_sm_state_name(wifi_sm_state_t state);
+
+#endif // WIFI_SM_H